@@ -0,0 +1,152 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Throughput benchmark: runs the trace program (IPU only) for every combination
+// of the swept options and collects the JSON reports that it writes (see the
+// trace program's --report-json option) into one JSON array.
+
+#include <app_utils.hpp>
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include <sys/wait.h>
+
+namespace {
+
+// Split a comma separated list of option values:
+std::vector<std::string> splitList(const std::string& list) {
+  std::vector<std::string> items;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+// Scenes that are not built into the trace program are imported from file:
+bool isBuiltInScene(const std::string& scene) {
+  return scene == "box-simple" || scene == "box" || scene == "spheres";
+}
+
+std::string jsonString(const std::string& v) {
+  std::string s = "\"";
+  for (const auto c : v) {
+    if (c == '"' || c == '\\') { s += '\\'; }
+    s += c;
+  }
+  return s + "\"";
+}
+
+struct BenchConfig {
+  std::string scene;
+  std::string renderMode;
+  std::string raysPerWorker;
+  std::string ipus;
+  std::string nif; // "none" or the path of a NIF model
+
+  std::string traceArgs() const {
+    std::string args = isBuiltInScene(scene) ? " --scene " + scene : " --mesh-file " + scene;
+    args += " --render-mode " + renderMode + " --rays-per-worker " + raysPerWorker + " --ipus " + ipus;
+    if (nif != "none") {
+      args += " --nif-hdri " + nif;
+    }
+    return args;
+  }
+};
+
+} // end anonymous namespace
+
+int main(int argc, char** argv) {
+  namespace po = boost::program_options;
+  po::options_description desc;
+  desc.add_options()
+  ("help", "Show command help.")
+  ("trace", po::value<std::string>()->default_value("./trace"), "Path of the trace program to benchmark.")
+  ("scenes", po::value<std::string>()->default_value("box-simple,box,spheres"),
+    "Comma separated list of scenes to sweep (built in scene names or mesh files to import).")
+  ("render-modes", po::value<std::string>()->default_value("path-trace,shadow-trace"), "Comma separated list of render modes to sweep.")
+  ("rays-per-worker", po::value<std::string>()->default_value("1,2"), "Comma separated list of rays-per-worker values to sweep.")
+  ("ipus", po::value<std::string>()->default_value("1,4"), "Comma separated list of IPU counts to sweep.")
+  ("nif-hdri", po::value<std::string>()->default_value("none"),
+    "Comma separated list of NIF models to sweep ('none' renders without an environment light).")
+  ("trace-args", po::value<std::string>()->default_value("--width 768 --height 432 --samples 64"),
+    "Further arguments passed to every run of the trace program (e.g. NIF settings or '--wavefront'). "
+    "These must not repeat the swept options.")
+  ("output", po::value<std::string>()->default_value("bench.json"), "File in which to write the array of reports.")
+  ("work-dir", po::value<std::string>()->default_value("bench_work"), "Directory for the images and reports of each run.")
+  ("log-level", po::value<std::string>()->default_value("info"),
+  "Set the log level to one of the following: 'trace', 'debug', 'info', 'warn', 'err', 'critical', 'off'.");
+
+  po::variables_map args;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), args);
+    if (args.count("help")) {
+      std::cout << desc << "\n";
+      return EXIT_FAILURE;
+    }
+    po::notify(args);
+    setupLogging(args);
+  } catch (const std::exception& e) {
+    ipu_utils::logger()->error("Exiting after: {}.", e.what());
+    return EXIT_FAILURE;
+  }
+
+  std::vector<BenchConfig> configs;
+  for (const auto& scene : splitList(args.at("scenes").as<std::string>())) {
+    for (const auto& mode : splitList(args.at("render-modes").as<std::string>())) {
+      for (const auto& rpw : splitList(args.at("rays-per-worker").as<std::string>())) {
+        for (const auto& ipus : splitList(args.at("ipus").as<std::string>())) {
+          for (const auto& nif : splitList(args.at("nif-hdri").as<std::string>())) {
+            configs.push_back(BenchConfig{scene, mode, rpw, ipus, nif});
+          }
+        }
+      }
+    }
+  }
+
+  const auto workDir = std::filesystem::path(args.at("work-dir").as<std::string>());
+  std::filesystem::create_directories(workDir);
+  const auto outputFile = args.at("output").as<std::string>();
+  std::ofstream output(outputFile);
+  if (!output) {
+    ipu_utils::logger()->error("Could not open output file: '{}'", outputFile);
+    return EXIT_FAILURE;
+  }
+
+  // Each configuration's report is copied into the array. Failed runs (e.g. configurations
+  // that do not fit in tile memory) are recorded with their command and do not stop the sweep:
+  std::size_t failures = 0;
+  output << "[\n";
+  for (auto c = 0u; c < configs.size(); ++c) {
+    const auto reportFile = workDir / ("report_" + std::to_string(c) + ".json");
+    std::filesystem::remove(reportFile);
+    const auto command = args.at("trace").as<std::string>() + " --ipu-only" + configs[c].traceArgs() +
+                         " --outprefix " + (workDir / ("run_" + std::to_string(c))).string() +
+                         " --report-json " + reportFile.string() + " " + args.at("trace-args").as<std::string>();
+    ipu_utils::logger()->info("Benchmark {}/{}: {}", c + 1, configs.size(), command);
+
+    const auto status = std::system(command.c_str());
+    const auto exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : status;
+    std::ifstream report(reportFile);
+    if (exitCode == 0 && report) {
+      output << report.rdbuf();
+    } else {
+      ipu_utils::logger()->warn("Benchmark run failed (exit code {})", exitCode);
+      output << "{\n  \"command\": " << jsonString(command) << ",\n  \"exit_code\": " << exitCode << "\n}\n";
+      failures += 1;
+    }
+    if (c + 1 < configs.size()) {
+      output << ",\n";
+    }
+    output.flush();
+  }
+  output << "]\n";
+
+  ipu_utils::logger()->info("Wrote {} benchmark reports ({} failed) to '{}'", configs.size(), failures, outputFile);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
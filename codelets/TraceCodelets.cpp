@@ -17,6 +17,12 @@
 #include <Material.hpp>
 #include <Render.hpp>
 #include <BxDF.hpp>
+#include <SlimRay.hpp>
+#include <AdaptiveSampling.hpp>
+#include <EnvMap.hpp>
+#include <NifMlp.hpp>
+#include <RaySort.hpp>
+#include <SobolSampler.hpp>
 #include <embree_utils/geometry.hpp>
 
 #include <serialisation/Deserialiser.hpp>
@@ -33,9 +39,13 @@ using namespace embree_utils;
 // because we have been lazy by recording the BVH traversal on the
 // worker stacks. TODO: connect a tensor so graph construction
 // guarantees space for the BVH traversal (we know the max depth
-// of the tree at compute graph construction/compile time):
-DEF_STACK_USAGE(960, __runCodelet_PathTrace);
-DEF_STACK_USAGE(960, __runCodelet_ShadowTrace);
+// of the tree at compute graph construction/compile time). The
+// PathTrace variants are listed where they are instantiated:
+DEF_STACK_USAGE(1024, __runCodelet_ShadowTrace___false);
+DEF_STACK_USAGE(1024, __runCodelet_ShadowTrace___true);
+DEF_STACK_USAGE(1024, __runCodelet_ShardIntersect);
+DEF_STACK_USAGE(1024, __runCodelet_OccludeShadowRays);
+DEF_STACK_USAGE(1024, __runCodelet_WavefrontExtend);
 
 // Utility to get a uniform sample between 0 and 1
 // from the IPU's hardware RNG:
@@ -43,6 +53,24 @@ inline float hw_uniform_0_1() {
   return __builtin_ipu_urand_f32() + .5f;
 }
 
+// Path sampling is templated on the sampler so that paths can use either the
+// hardware RNG or a low discrepancy sequence (see SobolSampler.hpp):
+struct HwSampler {
+  float uniform_0_1() { return hw_uniform_0_1(); }
+};
+
+// Pair of standard normal samples (for anti-aliasing):
+inline float2 sampleGaussian(HwSampler&) {
+  return __builtin_ipu_f32v2grand();
+}
+
+inline float2 sampleGaussian(SobolSampler& sampler) {
+  const float u1 = sampler.uniform_0_1();
+  const float u2 = sampler.uniform_0_1();
+  const auto [g1, g2] = sampleGaussian2d(u1, u2);
+  return float2{g1, g2};
+}
+
 // Global data (per-tile) that stores scene data.
 // This is a workaround for Poplar not supporting
 // connection of arbitrary structured data to vertices.
@@ -52,21 +80,30 @@ SceneRef tileLocalScene;
 ArrayRef<Sphere> wrappedSpheres;
 ArrayRef<Disc> wrappedDiscs;
 ArrayRef<CompiledTriangleMesh> wrappedMeshes;
+ArrayRef<SceneInstance> wrappedInstances;
+
+// When the scene is sharded these convert the shard local
+// primIDs back to scene primIDs (indexed by geomID):
+ArrayRef<std::uint32_t> tileShardPrimIDOffsets;
 
 /// Some objects have been transferred direct from CPU to IPU but
 /// will contain incomptible pointer data but compatible plain old data.
-/// This vertex re-allocates these objects/structures for the IPU.
-/// Note: this is very questionable but it simplifies things considerably.
-/// At some point this will vanish anyway as the scene description will be
-/// organised into opaque binary chunks so that we can page chunks in and
-/// out of SRAM:
+/// Primitives are only ever called through TilePrimLookup (which knows their
+/// concrete types) so their vtable pointers are never used. Spheres and discs
+/// are therefore used in place and this vertex only has to rebuild the meshes
+/// and instances (whose array references point into the scene data on tile).
+/// The spheres, discs, and serialised scene are all parts of the tile's copy of
+/// one upload. This is the only vertex that decodes the scene: it runs once
+/// per upload and every other vertex uses the tile-global state it leaves:
 class BuildDataStructures : public Vertex {
 public:
   // Scene description:
   InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Sphere)>> spheres;
   InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Disc)>> discs;
   InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(CompiledTriangleMesh)>> meshes;
+  InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(SceneInstance)>> instances;
   Input<Vector<unsigned char, poplar::VectorLayout::SPAN, 16>> serialisedScene;
+  bool shardedScene;
 
   bool compute() {
     // De-serialise the scene ref data. This is stored in a tile-global object.
@@ -74,105 +111,371 @@ public:
     // `serialisedScene` byte tensor live:
     Deserialiser<16> d(&serialisedScene[0], serialisedScene.size());
     d >> tileLocalScene;
+    if (shardedScene) {
+      tileShardPrimIDOffsets = deserialiseArrayRef<std::uint32_t>(d);
+    }
 
     // For each primitive copy its position to a tensor:
     wrappedSpheres = ArrayRef<Sphere>::reinterpret(&spheres[0], spheres.size());
     wrappedDiscs   = ArrayRef<Disc>::reinterpret(&discs[0], discs.size());
     wrappedMeshes  = ArrayRef<CompiledTriangleMesh>::reinterpret(&meshes[0], meshes.size());
+    wrappedInstances = ArrayRef<SceneInstance>::reinterpret(&instances[0], instances.size());
 
-    // Need to re-new anything that inherits from Primitive i.e. reconstruct in place
-    // using placement-new! Any struct with pointers (e.g. vtable) will not be
-    // compatible between IPU and host.
-    //
-    // There are some assumptions that make this work:
+    // Meshes and instances contain pointers so are reconstructed in place
+    // using placement-new. There are some assumptions that make this work:
     // 1. Host pointers are larger than IPU pointers so everything has been over allocated.
     // 2. V-tables come at the end so other data has same layout.
     // 3. Tensors are not moved on IPU between this vertex and the trace vertex running
     //    (we are storing pointers for reuse between different vertices!)
-    // Basically this is all very dubious but works for now...
 
     // Mesh objects are constructed from the mesh info data:
     auto meshIdx = 0u;
     for (const auto& info : tileLocalScene.meshInfo) {
       auto firstNormalIndex = 0u;
       auto numNormals = 0u;
-      if (tileLocalScene.meshNormals.size()) {
+      if (tileLocalScene.meshNormals.size() || tileLocalScene.meshPackedNormals.size()) {
         // If scene has normals assume every mesh has normals:
         firstNormalIndex = info.firstVertex;
         numNormals = info.numVertices;
       }
+      auto firstPrecomputed = 0u;
+      auto numPrecomputed = 0u;
+      if (tileLocalScene.meshPrecomputed.size()) {
+        firstPrecomputed = info.firstIndex;
+        numPrecomputed = info.numTriangles;
+      }
+      // Compact vertices replace the full precision arrays (which are then empty):
+      const bool packed = tileLocalScene.meshPackedVerts.size();
+      const auto quantisation = packed ? tileLocalScene.meshQuantisation[meshIdx] : VertexQuantisation();
       new ((void*)&wrappedMeshes[meshIdx]) CompiledTriangleMesh(
         embree_utils::Bounds3d(),
         ArrayRef(&tileLocalScene.meshTris[info.firstIndex], info.numTriangles),
-        ArrayRef(&tileLocalScene.meshVerts[info.firstVertex], info.numVertices),
-        ArrayRef(&tileLocalScene.meshNormals[firstNormalIndex], numNormals)
+        ArrayRef(&tileLocalScene.meshVerts[info.firstVertex], packed ? 0u : info.numVertices),
+        ArrayRef(&tileLocalScene.meshNormals[firstNormalIndex], packed ? 0u : numNormals),
+        ArrayRef(&tileLocalScene.meshPrecomputed[firstPrecomputed], numPrecomputed),
+        quantisation,
+        ArrayRef(&tileLocalScene.meshPackedVerts[info.firstVertex], packed ? info.numVertices : 0u),
+        ArrayRef(&tileLocalScene.meshPackedNormals[firstNormalIndex], packed ? numNormals : 0u)
       );
       meshIdx += 1;
     }
 
-    // Other primitives are "re-newed" using their own data:
-    for (auto &s : wrappedSpheres) {
-      new ((void*)&s) Sphere(Vec3fa(s.x, s.y, s.z), s.radius);
-    }
-
-    for (auto &d : wrappedDiscs) {
-      new ((void*)&d) Disc(Vec3fa(d.nx, d.ny, d.nz), Vec3fa(d.cx, d.cy, d.cz), d.r);
+    // Instances reference one of the (re-newed) meshes and its bottom level BVH:
+    auto instanceIdx = 0u;
+    for (const auto& info : tileLocalScene.instances) {
+      new ((void*)&wrappedInstances[instanceIdx]) SceneInstance(
+        info, &wrappedMeshes[info.meshIndex], &tileLocalScene.blasNodes[info.firstNode]);
+      instanceIdx += 1;
     }
 
     return true;
   }
 };
 
-// Look up the underlying primitive from a geometry type and ID:
-const Primitive* primLookup(std::uint16_t geomID, std::uint32_t primID) {
-  const auto& geom = tileLocalScene.geometry[geomID];
-  switch (geom.type) {
-    case GeomType::Mesh:
-      return &wrappedMeshes[geom.index];
-    case GeomType::Sphere:
-      return &wrappedSpheres[geom.index];
-    case GeomType::Disc:
-      return &wrappedDiscs[geom.index];
-    case GeomType::NumTypes:
-    default:
-      return nullptr;
+// Scene contents that vertices can be specialised for (see SceneFeatures). The
+// code that intersects and shades features a scene does not have is compiled out
+// of the specialised vertex. The host picks the variant from the scene contents so
+// the missing features are never reached:
+template <bool Spheres, bool Discs, bool Instances, bool Refractive>
+struct FeatureSet {
+  static constexpr bool spheres = Spheres;
+  static constexpr bool discs = Discs;
+  static constexpr bool instances = Instances;
+  static constexpr bool refractive = Refractive;
+};
+
+using AllFeatures = FeatureSet<true, true, true, true>;
+
+// Look up the underlying primitive from a geometry type and ID. The primitive
+// is passed to the visitor as its concrete type so that traversal calls its
+// intersection and normal methods directly (i.e. not through the vtable):
+template <class Features = AllFeatures>
+struct TilePrimLookup {
+  template <class F>
+  void visit(std::uint16_t geomID, F&& f) const {
+    const auto& geom = tileLocalScene.geometry[geomID];
+    switch (geom.type) {
+      case GeomType::Mesh:
+        f(wrappedMeshes[geom.index]);
+        break;
+      case GeomType::Sphere:
+        if constexpr (Features::spheres) { f(wrappedSpheres[geom.index]); }
+        break;
+      case GeomType::Disc:
+        if constexpr (Features::discs) { f(wrappedDiscs[geom.index]); }
+        break;
+      case GeomType::Instance:
+        if constexpr (Features::instances) { f(wrappedInstances[geom.index]); }
+        break;
+      case GeomType::NumTypes:
+      default:
+        break;
+    }
   }
+};
+
+const TilePrimLookup<> primLookup{};
+
+// Return tan(fov/2) for use with pixelToRayDir():
+float fovTanTheta(float fovRadians) {
+  float s, c;
+  sincos(fovRadians / 2.f, s, c);
+  return s / c;
+}
+
+// The camera transform is streamed as the 12 floats of an AffineTransform:
+const AffineTransform& cameraTransform(const Input<Vector<float>>& camera) {
+  return *reinterpret_cast<const AffineTransform*>(&camera[0]);
+}
+
+// Generate a camera ray through a random point around the result's pixel. The
+// camera transform must be rigid (the direction is not renormalised):
+template <class Sampler>
+void sampleCameraRay(embree_utils::TraceResult& result,
+                     float imageWidth, float imageHeight,
+                     float2 antiAliasScale, float tanTheta,
+                     const AffineTransform& camera, Sampler& rng) {
+  // Sample around the pixel coord in the ray stream (anti-aliasing):
+  float2 g = sampleGaussian(rng);
+  float2 p = {result.p.u, result.p.v}; // row, col
+  p += antiAliasScale * g;
+  const auto rayDir = pixelToRayDir(p[1], p[0], imageWidth, imageHeight, tanTheta);
+  result.h = embree_utils::HitRecord(camera.point(embree_utils::Vec3fa(0.f, 0.f, 0.f)), camera.vector(rayDir));
 }
 
 void sampleCameraRays(int workerID,
                       float imageWidth, float imageHeight,
                       float2 antiAliasScale, float fovRadians,
+                      const AffineTransform& camera,
                       ArrayRef<embree_utils::TraceResult>& wrappedRays) {
   // Do trig outside of loop:
-  float s, c;
-  sincos(fovRadians / 2.f, s, c);
-  const auto fovTanTheta = s / c;
-  const auto rayOrigin = embree_utils::Vec3fa(0.f, 0.f, 0.f);
+  const auto tanTheta = fovTanTheta(fovRadians);
+  HwSampler rng;
 
   // Generate camera rays. Each worker starts processing offset by their worker IDs.
   // The external Poplar graph construction code ensures the number of rays to process on each
   // tile is a multiple of 6 (by padding or otherwise):
   for (auto r = workerID; r < wrappedRays.size(); r += poplar::MultiVertex::numWorkers()) {
-    auto& result = wrappedRays[r];
-    // Sample around the pixel coord in the ray stream (anti-aliasing):
-    float2 g = __builtin_ipu_f32v2grand();
-    float2 p = {result.p.u, result.p.v}; // row, col
-    p += antiAliasScale * g;
-    const auto rayDir = pixelToRayDir(p[1], p[0], imageWidth, imageHeight, fovTanTheta);
-    result.h = embree_utils::HitRecord(rayOrigin, rayDir);
+    sampleCameraRay(wrappedRays[r], imageWidth, imageHeight, antiAliasScale, tanTheta, camera, rng);
+  }
+}
+
+/// Spread angle of the camera rays used to choose texture mip levels (see surfaceAlbedo()):
+float tilePixelSpread() {
+  return pixelSpreadAngle(fovTanTheta(tileLocalScene.fovRadians), tileLocalScene.imageHeight);
+}
+
+/// Shade a path vertex: accumulate the hit material's emission (scaled by its MIS
+/// weight) into the path colour then sample the material's BxDF to get the direction
+/// of the next path segment. The albedo is the material's albedo at the hit (see
+/// surfaceAlbedo()):
+template <class Features = AllFeatures, class Sampler>
+void shadeHit(embree_utils::TraceResult& result, const Vec3fa& albedo, Vec3fa& color, Sampler& rng, float emissionWeight = 1.f) {
+  auto& hit = result.h;
+  const auto& material = tileLocalScene.materials[tileLocalScene.matIDs[hit.geomID]];
+
+  if (material.emissive) {
+    color += hit.throughput * material.emission * emissionWeight;
+  }
+
+  if (material.type == Material::Type::Diffuse) {
+    const float u1 = rng.uniform_0_1();
+    const float u2 = rng.uniform_0_1();
+    hit.r.direction = sampleDiffuse(hit.normal, u1, u2);
+    // Update throughput
+    //const float w = std::abs(wiWorld.dot(normal));
+    //const float pdf = cosineHemispherePdf(wiTangent);
+    // The terms w / (Pi * pdf) all cancel for diffuse throughput:
+    hit.throughput *= albedo; // * (w / (Pi * pdf)); // PDF terms cancel for cosine weighted samples
+    //throughput *= albedo * (wiTangent.z * 2.f); // Apply PDF for hemisphere samples (sampleDir is in tangent space so cos(theta) == z-coord).
+  } else if (material.type == Material::Type::Specular) {
+    hit.r.direction = reflect(hit.r.direction, hit.normal);
+    hit.throughput *= albedo;
+  } else if (Features::refractive && material.type == Material::Type::Refractive) {
+    const float u1 = rng.uniform_0_1();
+    const auto [dir, refracted] = dielectric(hit.r, hit.normal, material.ior, u1);
+    hit.r.direction = dir;
+    if (refracted) { hit.throughput *= albedo; }
+  } else {
+    // Mark an error:
+    result.rgb *= std::numeric_limits<float>::quiet_NaN();
+    hit.flags |= HitRecord::ERROR;
+  }
+}
+
+/// Intersect the next segment of a path with the scene. Returns false if the ray escaped:
+template <class Features = AllFeatures, class Bvh>
+bool extendPath(const Bvh& bvh, embree_utils::HitRecord& hit) {
+  offsetRay(hit.r, hit.normal); // offset rays to avoid self intersection.
+  // Reset ray limits for next bounce:
+  hit.r.tMin = 0.f;
+  hit.r.tMax = std::numeric_limits<float>::infinity();
+  const TilePrimLookup<Features> lookup;
+  auto intersected = bvh.intersect(hit.r, lookup);
+  if (intersected) {
+    updateHit(intersected, hit, lookup);
+    return true;
   }
+  hit.flags |= HitRecord::ESCAPED;
+  return false;
+}
+
+/// Texture baked from the NIF environment light (a zero width means there
+/// is no texture and escaped rays are either lit later by the NIF or not at all):
+using BakedEnvMap = EnvMap<half>;
+
+BakedEnvMap makeEnvMap(const Input<Vector<half>>& texels, unsigned width, const Input<float>& azimuthRotation) {
+  const auto height = width ? texels.size() / (3 * width) : 0u;
+  return BakedEnvMap{&texels[0], width, height, azimuthRotation};
+}
+
+/// Importance sampler for the baked environment light (a null cdf means the
+/// environment is only lit by rays that escape through BxDF sampling):
+EnvMapSampler makeEnvSampler(const Input<Vector<float>>& cdf, bool enabled, const BakedEnvMap& env) {
+  return EnvMapSampler{enabled ? &cdf[0] : nullptr, env.width, env.height, env.azimuthRotation};
+}
+
+/// Next event estimation of the environment light at a diffuse hit. A direction
+/// is sampled from the environment and a shadow ray is cast towards it. The light
+/// sample is weighted with MIS against BxDF sampling (the BxDF sample is weighted
+/// in the same way if it escapes). Must be called before the hit is shaded:
+template <class Features = AllFeatures, class Bvh, class Sampler>
+Vec3fa sampleEnvLight(const Bvh& bvh, const embree_utils::HitRecord& hit, const Vec3fa& albedo,
+                      const BakedEnvMap& env, const EnvMapSampler& sampler, Sampler& rng) {
+  const float u1 = rng.uniform_0_1();
+  const float u2 = rng.uniform_0_1();
+  float lightPdf;
+  const auto dir = sampler.sample(u1, u2, lightPdf);
+  const float cosTheta = hit.normal.dot(dir);
+  if (!(lightPdf > 0.f) || cosTheta <= 0.f) {
+    return Vec3fa(0.f, 0.f, 0.f);
+  }
+
+  auto shadowRay = hit.r;
+  shadowRay.direction = dir;
+  offsetRay(shadowRay, hit.normal);
+  shadowRay.tMin = 0.f;
+  shadowRay.tMax = std::numeric_limits<float>::infinity();
+  const TilePrimLookup<Features> lookup;
+  if (bvh.occluded(shadowRay, lookup)) {
+    return Vec3fa(0.f, 0.f, 0.f);
+  }
+
+  // The diffuse BxDF is albedo / Pi:
+  const float bxdfPdf = cosTheta * InvPi;
+  const float weight = powerHeuristic(lightPdf, bxdfPdf) * bxdfPdf / lightPdf;
+  return hit.throughput * albedo * env.lookup(dir) * weight;
+}
+
+/// Trace one path from the camera ray in the result's hit record. Returns the
+/// radiance carried by the path (and adds the first hit to the AOVs if there are any):
+template <class Features = AllFeatures, class Bvh, class Sampler>
+Vec3fa tracePath(const Bvh& bvh, embree_utils::TraceResult& result, const BakedEnvMap& env,
+                 const EnvMapSampler& sampler, Sampler& rng, DenoiseAovs* aovs = nullptr) {
+  auto& hit = result.h;
+  hit.throughput = Vec3fa(1.f, 1.f, 1.f);
+  Vec3fa color(0.f, 0.f, 0.f);
+  const TilePrimLookup<Features> lookup;
+  float bxdfPdf = 0.f; // Zero unless the last bounce was sampled from a diffuse BxDF
+  const float pixelSpread = tilePixelSpread();
+
+  for (auto i = 0u; i < tileLocalScene.maxPathLength; ++i) {
+    if (!extendPath<Features>(bvh, hit)) {
+      if (aovs && i == 0) {
+        aovs->addEscaped();
+      }
+      if (env.width) {
+        const float weight = sampler.cdf && bxdfPdf > 0.f ? powerHeuristic(bxdfPdf, sampler.pdf(hit.r.direction)) : 1.f;
+        color += hit.throughput * env.lookup(hit.r.direction) * weight;
+      }
+      break;
+    }
+
+    const auto& material = tileLocalScene.materials[tileLocalScene.matIDs[hit.geomID]];
+    const bool diffuse = material.type == Material::Type::Diffuse;
+    const auto albedo = surfaceAlbedo(tileLocalScene, material, hit, pixelSpread);
+    if (aovs && i == 0) {
+      aovs->addHit(albedo, hit);
+    }
+    if (sampler.cdf && diffuse) {
+      color += sampleEnvLight<Features>(bvh, hit, albedo, env, sampler, rng);
+    }
+    const float emissionWeight = emissionMisWeight(tileLocalScene.lights, material, hit, bxdfPdf);
+    if (tileLocalScene.lights.size() && diffuse) {
+      const float u1 = rng.uniform_0_1();
+      const float u2 = rng.uniform_0_1();
+      const float u3 = rng.uniform_0_1();
+      color += sampleAreaLights(bvh, tileLocalScene.lights, tileLocalScene.matIDs, tileLocalScene.materials,
+                                hit, albedo, u1, u2, u3, lookup);
+    }
+    shadeHit<Features>(result, albedo, color, rng, emissionWeight);
+    bxdfPdf = diffuse ? std::max(hit.normal.dot(hit.r.direction), 0.f) * InvPi : 0.f;
+
+    // Random stopping:
+    if (i > tileLocalScene.rouletteStartDepth) {
+      const float u1 = rng.uniform_0_1();
+      if (evaluateRoulette(u1, hit.throughput)) { break; }
+    }
+  } // end of path trace loop
+
+  return color;
+}
+
+/// Wraps a BVH to count the rays cast into it. The first cast of every path
+/// is its camera ray so the rest are secondary (bounce and shadow) rays. If
+/// RecordTraversal is set the traversal of every cast is also recorded:
+template <class Bvh, bool RecordTraversal = false>
+struct CastCountingBvh {
+  const Bvh& bvh;
+  mutable unsigned casts = 0;
+  mutable TraversalStats traversal;
+
+  template <class Lookup>
+  auto intersect(const embree_utils::Ray& ray, Lookup& lookup) const {
+    casts += 1;
+    if constexpr (RecordTraversal) {
+      traversal.bounces += 1;
+      const TraversalRecorder<Lookup> recorder{lookup, traversal};
+      return bvh.intersect(ray, recorder);
+    } else {
+      return bvh.intersect(ray, lookup);
+    }
+  }
+
+  template <class Lookup>
+  bool occluded(const embree_utils::Ray& ray, Lookup& lookup) const {
+    casts += 1;
+    if constexpr (RecordTraversal) {
+      const TraversalRecorder<Lookup> recorder{lookup, traversal};
+      return bvh.occluded(ray, recorder);
+    } else {
+      return bvh.occluded(ray, lookup);
+    }
+  }
+};
+
+// Lower 32 bits of the tile's cycle counter (differences are correct across one wrap):
+inline unsigned tileCycleCount() {
+  return __builtin_ipu_get_scount_l();
 }
 
 /// Simple uni-directional path trace vertex. Rays are path traced one by one
 /// alternating BVH intersection and BxDF sampling to produce the incoming ray
-/// direction. There is no light sampling so we rely on hitting light sources by
-/// chance.
+/// direction. The baked environment light and the scene's area lights can be
+/// sampled explicitly (next event estimation) at diffuse hits. The vertex is
+/// specialised for the kinds of primitive and material in the scene (meshes and
+/// diffuse and specular materials are always supported). The instrumented vertex
+/// stores each pixel's TraversalStats in its hit record instead of the hit:
+template <bool HasSpheres, bool HasDiscs, bool HasInstances, bool HasRefractive, bool Instrumented>
 class PathTrace : public MultiVertex {
+  using Features = FeatureSet<HasSpheres, HasDiscs, HasInstances, HasRefractive>;
+
 public:
   // Storage for sphere, disc, and mesh primitives:
   Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Sphere)>> spheres;
   Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Disc)>> discs;
   Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(CompiledTriangleMesh)>> meshes;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(SceneInstance)>> instances;
 
   // Scene description and BVH:
   Input<Vector<unsigned char, poplar::VectorLayout::SPAN, 16>> serialisedScene;
@@ -180,6 +483,28 @@ public:
   // Ray stream:
   InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> rays;
   Input<unsigned> vertexSampleCount; // Number of samples to take inside the vertex itself
+  Input<Vector<float>> camera; // Camera to world transform
+
+  // Baked environment light (not used if the width is zero):
+  Input<Vector<half>> envMap;
+  Input<float> azimuthRotation;
+  unsigned envMapWidth;
+  Input<Vector<float>> envCdf; // Importance sampling CDFs (only read if envSampling is set)
+  bool envSampling;
+
+  // Adaptive sampling (disabled if the threshold is zero):
+  float adaptiveThreshold;
+  unsigned adaptiveMinSamples;
+
+  // Sample paths with scrambled Sobol points instead of the hardware RNG:
+  bool lowDiscrepancy;
+
+  // Overwrite the hit records with the pixels' first hit AOVs (see DenoiseAovs):
+  bool denoiseAovs;
+
+  // Each worker's paths traced, secondary rays cast, and elapsed tile cycles (low and
+  // high words). These are accumulated over the executions of the vertex in a run:
+  InOut<Vector<unsigned>> workerCounters;
 
   bool compute(unsigned int workerID) {
     // Wrap all byte arrays with their correct types:
@@ -187,108 +512,289 @@ public:
 
     // Construct a BVH from all the wrapped arrays:
     CompactBvh bvh(tileLocalScene.bvhNodes, tileLocalScene.maxLeafDepth);
+    const auto env = makeEnvMap(envMap, envMapWidth, azimuthRotation);
+    const auto sampler = makeEnvSampler(envCdf, envSampling, env);
+
+    if (lowDiscrepancy) {
+      // Sample indices restart in every execution of the vertex so each
+      // execution scrambles the sequences with a new random seed:
+      const unsigned seed = __builtin_ipu_urand32();
+      const auto width = std::uint32_t(tileLocalScene.imageWidth);
+      tracePixels(workerID, wrappedRays, bvh, env, sampler, [&](const TraceResult& result, unsigned sample) {
+        const auto pixel = std::uint32_t(result.p.u) * width + std::uint32_t(result.p.v);
+        return SobolSampler(pixel, sample, seed);
+      });
+    } else {
+      tracePixels(workerID, wrappedRays, bvh, env, sampler, [](const TraceResult&, unsigned) {
+        return HwSampler();
+      });
+    }
+
+    return true;
+  }
+
+private:
+  /// Trace vertexSampleCount paths for every pixel. The sampler for each path
+  /// is made from the pixel's ray and the index of the sample:
+  template <class Bvh, class MakeSampler>
+  void tracePixels(unsigned workerID, ArrayRef<embree_utils::TraceResult>& wrappedRays, const Bvh& sceneBvh,
+                   const BakedEnvMap& env, const EnvMapSampler& sampler, MakeSampler&& makeSampler) {
+    const auto startCycles = tileCycleCount();
+    const CastCountingBvh<Bvh, Instrumented> bvh{sceneBvh};
+    unsigned paths = 0;
+    const auto tanTheta = fovTanTheta(tileLocalScene.fovRadians);
+    const float2 antiAliasScale{tileLocalScene.antiAliasScale, tileLocalScene.antiAliasScale};
+    const bool adaptive = adaptiveThreshold > 0.f;
+
+    // Each worker starts processing offset by their worker IDs. The external
+    // Poplar graph construction code ensures the number of rays to process on
+    // each tile is a multiple of 6 (by padding or otherwise):
+    for (auto r = workerID; r < wrappedRays.size(); r += numWorkers()) {
+      auto& result = wrappedRays[r];
+      const auto pixelStartCycles = Instrumented ? tileCycleCount() : 0u;
+      bvh.traversal = TraversalStats();
+      PixelSampleStats stats;
+      DenoiseAovs aovs;
+      Vec3fa sum(0.f, 0.f, 0.f);
+      while (stats.count < vertexSampleCount) {
+        auto rng = makeSampler(result, stats.count);
+        sampleCameraRay(result, tileLocalScene.imageWidth, tileLocalScene.imageHeight, antiAliasScale, tanTheta,
+                        cameraTransform(camera), rng);
+        const auto color = tracePath<Features>(bvh, result, env, sampler, rng, denoiseAovs ? &aovs : nullptr);
+        sum += color;
+        stats.add(color);
+        // With adaptive sampling each pixel is sampled until its estimate converges:
+        if (adaptive && stats.count >= adaptiveMinSamples && stats.converged(adaptiveThreshold)) {
+          break;
+        }
+      }
+
+      if (adaptive) {
+        // The result is scaled as if all vertexSampleCount samples had been taken so that
+        // the output is normalised in the same way as for uniform sampling:
+        result.rgb += sum * (float(vertexSampleCount) / float(stats.count));
+      } else {
+        result.rgb += sum;
+      }
+      if constexpr (Instrumented) {
+        bvh.traversal.cycles = tileCycleCount() - pixelStartCycles;
+        bvh.traversal.store(result.h, stats.count);
+      } else if (denoiseAovs) {
+        aovs.store(result.h, stats.count);
+      }
+      paths += stats.count;
+    } // end of loop over rays
+
+    auto counters = &workerCounters[4 * workerID];
+    counters[0] += paths;
+    counters[1] += bvh.casts - paths;
+    const unsigned cycles = tileCycleCount() - startCycles;
+    counters[2] += cycles;
+    counters[3] += counters[2] < cycles ? 1u : 0u; // Carry
+  }
+};
+
+#define INSTANTIATE_PATH_TRACE_VARIANT(S, D, I, R, T) \
+  template class PathTrace<S, D, I, R, T>; \
+  DEF_STACK_USAGE(1024, __runCodelet_PathTrace___##S##_##D##_##I##_##R##_##T);
+
+#define INSTANTIATE_PATH_TRACE(S, D, I, R) \
+  INSTANTIATE_PATH_TRACE_VARIANT(S, D, I, R, false) \
+  INSTANTIATE_PATH_TRACE_VARIANT(S, D, I, R, true)
+
+// Spheres, discs, instances, refractive materials (each with and without instrumentation):
+INSTANTIATE_PATH_TRACE(false, false, false, false)
+INSTANTIATE_PATH_TRACE(false, false, false, true)
+INSTANTIATE_PATH_TRACE(false, false, true, false)
+INSTANTIATE_PATH_TRACE(false, false, true, true)
+INSTANTIATE_PATH_TRACE(false, true, false, false)
+INSTANTIATE_PATH_TRACE(false, true, false, true)
+INSTANTIATE_PATH_TRACE(false, true, true, false)
+INSTANTIATE_PATH_TRACE(false, true, true, true)
+INSTANTIATE_PATH_TRACE(true, false, false, false)
+INSTANTIATE_PATH_TRACE(true, false, false, true)
+INSTANTIATE_PATH_TRACE(true, false, true, false)
+INSTANTIATE_PATH_TRACE(true, false, true, true)
+INSTANTIATE_PATH_TRACE(true, true, false, false)
+INSTANTIATE_PATH_TRACE(true, true, false, true)
+INSTANTIATE_PATH_TRACE(true, true, true, false)
+INSTANTIATE_PATH_TRACE(true, true, true, true)
+
+// The wavefront path tracer splits PathTrace into separate compute sets per
+// bounce. Each tile keeps a compacted list of the rays whose paths are still
+// live so later bounces only visit those rays. The escaped rays keep their
+// flag until the end of the sample so environment lighting is looked up once
+// for all of them (as for the megakernel).
+
+/// Generate camera rays for a new sample and mark all paths as live:
+class WavefrontGenerate : public MultiVertex {
+public:
+  InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> rays;
+  Output<Vector<unsigned>> liveRays;
+  Output<unsigned> numLiveRays;
+  Output<unsigned> pathDepth;
+  Input<Vector<float>> camera; // Camera to world transform
+
+  bool compute(unsigned workerID) {
+    auto wrappedRays = ArrayRef<embree_utils::TraceResult>::reinterpret(&rays[0], rays.size());
+    sampleCameraRays(workerID, tileLocalScene.imageWidth, tileLocalScene.imageHeight,
+                     float2{tileLocalScene.antiAliasScale, tileLocalScene.antiAliasScale},
+                     tileLocalScene.fovRadians, cameraTransform(camera), wrappedRays);
+
+    for (auto r = workerID; r < wrappedRays.size(); r += numWorkers()) {
+      wrappedRays[r].h.throughput = Vec3fa(1.f, 1.f, 1.f);
+      liveRays[r] = r;
+    }
+
+    if (workerID == 0) {
+      *numLiveRays = wrappedRays.size();
+      *pathDepth = 0;
+    }
+
+    return true;
+  }
+};
+
+/// Intersect the next segment of every live path with the scene:
+class WavefrontExtend : public MultiVertex {
+public:
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Sphere)>> spheres;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Disc)>> discs;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(CompiledTriangleMesh)>> meshes;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(SceneInstance)>> instances;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, 16>> serialisedScene;
+
+  InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> rays;
+  Input<Vector<unsigned>> liveRays;
+  Input<unsigned> numLiveRays;
+
+  bool compute(unsigned workerID) {
+    auto wrappedRays = ArrayRef<embree_utils::TraceResult>::reinterpret(&rays[0], rays.size());
+    CompactBvh bvh(tileLocalScene.bvhNodes, tileLocalScene.maxLeafDepth);
+    for (auto i = workerID; i < numLiveRays; i += numWorkers()) {
+      extendPath(bvh, wrappedRays[liveRays[i]].h);
+    }
+    return true;
+  }
+};
+
+/// Shade the live paths that hit something then apply Russian roulette:
+class WavefrontShade : public MultiVertex {
+public:
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, 16>> serialisedScene;
+
+  InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> rays;
+  Input<Vector<unsigned>> liveRays;
+  Input<unsigned> numLiveRays;
+  Input<unsigned> pathDepth;
+
+  // Baked environment light (not used if the width is zero):
+  Input<Vector<half>> envMap;
+  Input<float> azimuthRotation;
+  unsigned envMapWidth;
+
+  bool compute(unsigned workerID) {
+    auto wrappedRays = ArrayRef<embree_utils::TraceResult>::reinterpret(&rays[0], rays.size());
+    const auto env = makeEnvMap(envMap, envMapWidth, azimuthRotation);
+    const float pixelSpread = tilePixelSpread();
+    HwSampler rng;
+    for (auto i = workerID; i < numLiveRays; i += numWorkers()) {
+      auto& result = wrappedRays[liveRays[i]];
+      auto& hit = result.h;
+      if (hit.flags & HitRecord::ESCAPED) {
+        // Live rays that have escaped did so in this bounce:
+        if (env.width) {
+          result.rgb += hit.throughput * env.lookup(hit.r.direction);
+        }
+        continue;
+      }
+
+      const auto& material = tileLocalScene.materials[tileLocalScene.matIDs[hit.geomID]];
+      Vec3fa color(0.f, 0.f, 0.f);
+      shadeHit(result, surfaceAlbedo(tileLocalScene, material, hit, pixelSpread), color, rng);
+      result.rgb += color;
+
+      // Random stopping:
+      if (pathDepth > tileLocalScene.rouletteStartDepth) {
+        const float u1 = rng.uniform_0_1();
+        if (evaluateRoulette(u1, hit.throughput)) {
+          hit.flags |= HitRecord::TERMINATED;
+        }
+      }
+    }
+    return true;
+  }
+};
+
+/// Remove escaped and terminated paths from the live list (in place and in
+/// order so that consecutive live rays stay spread between the workers). The
+/// live list can also be grouped by the octant of the rays' next directions:
+class WavefrontCompact : public Vertex {
+public:
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> rays;
+  InOut<Vector<unsigned>> liveRays;
+  InOut<unsigned> numLiveRays;
+  InOut<unsigned> pathDepth;
+  unsigned octantSort;
+
+  bool compute() {
+    auto wrappedRays = ConstArrayRef<embree_utils::TraceResult>::reinterpret(&rays[0], rays.size());
+    constexpr auto finished = HitRecord::ESCAPED | HitRecord::TERMINATED;
+    unsigned count = 0;
+    for (auto i = 0u; i < numLiveRays; ++i) {
+      const auto r = liveRays[i];
+      if (!(wrappedRays[r].h.flags & finished)) {
+        liveRays[count] = r;
+        count += 1;
+      }
+    }
 
-    for (auto s = 0u; s < vertexSampleCount; ++s) {
-      // Generate ray samples:
-      sampleCameraRays(workerID, tileLocalScene.imageWidth, tileLocalScene.imageHeight,
-                      float2{tileLocalScene.antiAliasScale, tileLocalScene.antiAliasScale},
-                      tileLocalScene.fovRadians, wrappedRays);
-
-      // Intersect all rays against the BVH. Each worker starts processing offset by their worker IDs.
-      // The external Poplar graph construction code ensures the number of rays to process on each
-      // tile is a multiple of 6 (by padding or otherwise):
-      for (auto r = workerID; r < wrappedRays.size(); r += numWorkers()) {
-        auto& result = wrappedRays[r];
-        auto& hit = result.h;
-        hit.throughput = Vec3fa(1.f, 1.f, 1.f);
-        Vec3fa color(0.f, 0.f, 0.f);
-
-        for (auto i = 0u; i < tileLocalScene.maxPathLength; ++i) {
-          offsetRay(hit.r, hit.normal); // offset rays to avoid self intersection.
-          // Reset ray limits for next bounce:
-          hit.r.tMin = 0.f;
-          hit.r.tMax = std::numeric_limits<float>::infinity();
-          auto intersected = bvh.intersect(hit.r, primLookup);
-
-          if (intersected) {
-            updateHit(intersected, hit);
-            const auto& material = tileLocalScene.materials[tileLocalScene.matIDs[hit.geomID]];
-
-            if (material.emissive) {
-              color += hit.throughput * material.emission;
-            }
-
-            if (material.type == Material::Type::Diffuse) {
-              // Use HW random number generator for samples:
-              const float u1 = hw_uniform_0_1();
-              const float u2 = hw_uniform_0_1();
-              hit.r.direction = sampleDiffuse(hit.normal, u1, u2);
-              // Update throughput
-              //const float w = std::abs(wiWorld.dot(normal));
-              //const float pdf = cosineHemispherePdf(wiTangent);
-              // The terms w / (Pi * pdf) all cancel for diffuse throughput:
-              hit.throughput *= material.albedo; // * (w / (Pi * pdf)); // PDF terms cancel for cosine weighted samples
-              //throughput *= material.albedo * (wiTangent.z * 2.f); // Apply PDF for hemisphere samples (sampleDir is in tangent space so cos(theta) == z-coord).
-            } else if (material.type == Material::Type::Specular) {
-              hit.r.direction = reflect(hit.r.direction, hit.normal);
-              hit.throughput *= material.albedo;
-            } else if (material.type == Material::Type::Refractive) {
-              const float u1 = hw_uniform_0_1();
-              const auto [dir, refracted] = dielectric(hit.r, hit.normal, material.ior, u1);
-              hit.r.direction = dir;
-              if (refracted) { hit.throughput *= material.albedo; }
-            } else {
-              // Mark an error:
-              result.rgb *= std::numeric_limits<float>::quiet_NaN();
-              hit.flags |= HitRecord::ERROR;
-            }
-          } else {
-            hit.flags |= HitRecord::ESCAPED;
-            break;
-          }
-
-          // Random stopping:
-          if (i > tileLocalScene.rouletteStartDepth) {
-            const float u1 = hw_uniform_0_1();
-            if (evaluateRoulette(u1, hit.throughput)) { break; }
-          }
-        } // end of path trace loop
-
-        result.rgb += color;
-      } // end of loop over rays
-
-    } // end of sampling loop
+    if (octantSort) {
+      // Rays keep their slots in the ray array so the results stay with their
+      // pixels. The workers stride over the live list so the rays that they all
+      // trace at the same time (and each worker's run of rays) are neighbours in
+      // the sorted list and mostly share an octant:
+      sortByOctant(&liveRays[0], count, [&](unsigned r) {
+        return directionOctant(wrappedRays[r].h.r.direction);
+      });
+    }
 
+    *numLiveRays = count;
+    *pathDepth += 1;
     return true;
   }
 };
 
 /// Simple ray trace vertex primarily intended for testing and validation. The vertex intersects
-/// every ray with the BVH to get primary hits and then traces one shadow ray from each hit
-/// to a fixed point light source.
+/// every ray with the BVH to get primary hits and then queues one shadow ray from each hit
+/// to a fixed point light source. The queued shadow rays are tested in a batch by a separate
+/// compute set (see OccludeShadowRays and ShadeShadowRays) so that the any hit traversal
+/// does not share a superstep with the (more expensive) closest hit traversal.
+/// The instrumented vertex stores the TraversalStats of each primary ray in its
+/// hit record (the shadow rays are traced later by OccludeShadowRays):
+template <bool Instrumented>
 class ShadowTrace : public MultiVertex {
 public:
   // Storage for sphere, disc, and mesh primitives:
   Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Sphere)>> spheres;
   Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Disc)>> discs;
   Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(CompiledTriangleMesh)>> meshes;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(SceneInstance)>> instances;
 
   // Scene description and BVH:
   Input<Vector<unsigned char, poplar::VectorLayout::SPAN, 16>> serialisedScene;
 
   // Other scene parameters:
-  float ambientLightFactor;
   Input<Vector<float>> lightPos;
 
-  // Ray stream:
+  // Ray stream and the queue of shadow rays (one per ray):
   InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> rays;
+  Output<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Ray)>> shadowRays;
 
   bool compute(unsigned int workerID) {
-    // Unpack the scene data:
-    Deserialiser<16> d(&serialisedScene[0], serialisedScene.size());
-    d >> tileLocalScene;
-
+    // The scene was unpacked by BuildDataStructures (serialisedScene is only connected to keep it live):
     auto wrappedRays = ArrayRef<embree_utils::TraceResult>::reinterpret(&rays[0], rays.size());
+    auto wrappedShadowRays = ArrayRef<embree_utils::Ray>::reinterpret(&shadowRays[0], shadowRays.size());
 
     // Construct a BVH from all the wrapped arrays:
     CompactBvh bvh(tileLocalScene.bvhNodes, tileLocalScene.maxLeafDepth);
@@ -302,54 +808,86 @@ public:
     // The external Poplar graph construction code ensures the number of rays to process on each
     // tile is a multiple of 6 (by padding or otherwise):
     for (auto r = workerID; r < wrappedRays.size(); r += numWorkers()) {
-      auto& result = wrappedRays[r];
-
-      traceShadowRay(
-        bvh,
-        tileLocalScene.matIDs, tileLocalScene.materials,
-        ambientLightFactor,
-        result, primLookup, lp);
+      auto& hit = wrappedRays[r].h;
+      auto& shadowRay = wrappedShadowRays[r];
+      const auto startCycles = Instrumented ? tileCycleCount() : 0u;
+      const CastCountingBvh<decltype(bvh), Instrumented> countingBvh{bvh};
+      auto intersected = countingBvh.intersect(hit.r, primLookup);
+      if (intersected) {
+        updateHit(intersected, hit, primLookup);
+        shadowRay = makeShadowRay(hit, lp);
+      } else {
+        hit.flags |= HitRecord::ESCAPED;
+        shadowRay = hit.r;
+        shadowRay.tMax = -std::numeric_limits<float>::infinity();
+      }
+      if constexpr (Instrumented) {
+        countingBvh.traversal.cycles = tileCycleCount() - startCycles;
+        countingBvh.traversal.store(hit, 1);
+      }
     }
 
     return true;
   }
 };
 
-// Take ray results and calculate UV coords for all the escaped rays
-// in order to lookup lighting values from the HDRI environment map.
-// UVs are calculated using equirectangular projection.
+template class ShadowTrace<false>;
+template class ShadowTrace<true>;
+
+/// Make a list of the escaped rays so that the environment lighting only
+/// needs to be evaluated for a dense prefix of the NIF's input:
+class CompactEscapedRays : public Vertex {
+public:
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> results;
+  Output<Vector<unsigned>> escapedRays;
+  Output<unsigned> numEscapedRays;
+
+  bool compute() {
+    auto wrappedResults = ConstArrayRef<embree_utils::TraceResult>::reinterpret(&results[0], results.size());
+    unsigned count = 0;
+    for (auto r = 0u; r < wrappedResults.size(); ++r) {
+      if (wrappedResults[r].h.flags & HitRecord::ESCAPED) {
+        escapedRays[count] = r;
+        count += 1;
+      }
+    }
+    *numEscapedRays = count;
+    return true;
+  }
+};
+
+// Calculate UV coords for all the escaped rays in order to lookup lighting
+// values from the HDRI environment map. The UV of the i-th escaped ray is
+// written to position i. UVs are calculated using equirectangular projection.
+// T is the type of the NIF's input (float or half):
+template <typename T>
 class PreProcessEscapedRays : public MultiVertex {
 public:
-  InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> results;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> results;
+  Input<Vector<unsigned>> escapedRays;
+  Input<unsigned> numEscapedRays;
   Input<float> azimuthRotation;
-  Output<Vector<float>> u;
-  Output<Vector<float>> v;
+  Output<Vector<T>> u;
+  Output<Vector<T>> v;
 
   bool compute(unsigned workerId) {
     constexpr auto workerCount = numWorkers();
     auto wrappedResults = ConstArrayRef<embree_utils::TraceResult>::reinterpret(&results[0], results.size());
 
     // Parallelise over all workers (each worker starts at a different offset):
-    for (auto r = workerId; r < wrappedResults.size(); r += workerCount) {
-      auto& result = wrappedResults[r];
-      auto& hit = result.h;
-      if (hit.flags & HitRecord::ESCAPED) {
-        const auto& dir = hit.r.direction;
+    for (auto i = workerId; i < u.size(); i += workerCount) {
+      if (i < numEscapedRays) {
+        const auto& dir = wrappedResults[escapedRays[i]].h.r.direction;
         // Convert ray direction to UV coords using equirectangular projection.
         // Calc assumes ray-dir was already normalised (note: normalised in Ray constructor).
-        auto theta = acosf(dir.y);
-        auto phi = atan2(dir.z, dir.x) + azimuthRotation;
-        if (phi < 0.f) {
-          phi += TwoPi;
-        } else if (phi > TwoPi) {
-          phi -= TwoPi;
-        }
-        u[r] = theta * InvPi;
-        v[r] = phi * Inv2Pi;
+        float du, dv;
+        equirectUV(dir, azimuthRotation, du, dv);
+        u[i] = T(du);
+        v[i] = T(dv);
       } else {
-        // Avoid fp exceptions as these could otherwise remain uninitialised:
-        u[r] = 0.f;
-        v[r] = 0.f;
+        // Avoid fp exceptions as the padding could otherwise remain uninitialised:
+        u[i] = T(0.f);
+        v[i] = T(0.f);
       }
     }
 
@@ -357,24 +895,291 @@ public:
   }
 };
 
-// Update escaped rays with the result of env-map lighting lookup:
+template class PreProcessEscapedRays<float>;
+template class PreProcessEscapedRays<half>;
+
+// Update escaped rays with the result of env-map lighting lookup (scatters
+// the dense NIF results back to the rays). T is the type of the NIF's output:
+template <typename T>
 class PostProcessEscapedRays : public MultiVertex {
 public:
   InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> results;
-  Vector<Input<Vector<float>>> bgr;
+  Input<Vector<unsigned>> escapedRays;
+  Input<unsigned> numEscapedRays;
+  Vector<Input<Vector<T>>> bgr;
 
   bool compute(unsigned workerId) {
     constexpr auto workerCount = numWorkers();
     auto wrappedResults = ArrayRef<embree_utils::TraceResult>::reinterpret(&results[0], results.size());
 
     // Parallelise over all workers (each worker starts at a different offset):
-    for (auto r = workerId; r < wrappedResults.size(); r += workerCount) {
-      auto& result = wrappedResults[r];
-      auto& hit = result.h;
-      if (hit.flags & HitRecord::ESCAPED) {
-        auto v = bgr[r];
-        result.rgb += hit.throughput * Vec3fa(v[2], v[1], v[0]);
+    for (auto i = workerId; i < numEscapedRays; i += workerCount) {
+      auto& result = wrappedResults[escapedRays[i]];
+      auto v = bgr[i];
+      result.rgb += result.h.throughput * Vec3fa(float(v[2]), float(v[1]), float(v[0]));
+    }
+
+    return true;
+  }
+};
+
+template class PostProcessEscapedRays<float>;
+template class PostProcessEscapedRays<half>;
+
+// Light the escaped rays by evaluating the NIF on tile (instead of exchanging
+// UVs and results with NIF matmuls that are spread over all the tiles). The
+// weights are broadcast to every tile and each worker evaluates the MLP for
+// its share of the escaped rays using its own part of the scratch space:
+class NifEnvironmentLookup : public MultiVertex {
+public:
+  InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> results;
+  Input<Vector<unsigned>> escapedRays;
+  Input<unsigned> numEscapedRays;
+  Input<float> azimuthRotation;
+  Input<Vector<half>> weights;
+  InOut<Vector<float>> scratch;
+  unsigned embeddingDimension;
+  unsigned hiddenSize;
+  unsigned numLayers;
+  unsigned concatLayer;
+  float outputMax;
+  float meanB;
+  float meanG;
+  float meanR;
+  bool logToneMap;
+
+  bool compute(unsigned workerId) {
+    constexpr auto workerCount = numWorkers();
+    auto wrappedResults = ArrayRef<embree_utils::TraceResult>::reinterpret(&results[0], results.size());
+    const NifMlpShape shape{embeddingDimension, hiddenSize, numLayers, concatLayer};
+    const NifDecodeParams decode{outputMax, {meanB, meanG, meanR}, logToneMap};
+    float* workerScratch = &scratch[workerId * shape.scratchSize()];
+
+    for (auto i = workerId; i < numEscapedRays; i += workerCount) {
+      auto& result = wrappedResults[escapedRays[i]];
+      float u, v;
+      equirectUV(result.h.r.direction, azimuthRotation, u, v);
+      result.rgb += result.h.throughput * evaluateNif(shape, &weights[0], decode, u, v, workerScratch);
+    }
+
+    return true;
+  }
+};
+
+// Build the importance sampling CDFs of the baked environment light (runs once
+// after the NIF is baked):
+class BuildEnvMapSampler : public Vertex {
+public:
+  Input<Vector<half>> envMap;
+  Output<Vector<float>> cdf;
+  unsigned envMapWidth;
+
+  bool compute() {
+    const auto height = envMap.size() / (3 * envMapWidth);
+    EnvMapSampler::build(BakedEnvMap{&envMap[0], envMapWidth, height, 0.f}, &cdf[0]);
+    return true;
+  }
+};
+
+// Expand slim ray records streamed from DRAM into full trace results. Only the
+// pixel coordinate is needed because path tracing generates the camera rays:
+class UnpackSlimRays : public MultiVertex {
+public:
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(SlimRay)>> slimRays;
+  Output<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> rays;
+
+  bool compute(unsigned workerId) {
+    constexpr auto workerCount = numWorkers();
+    auto wrappedSlim = ConstArrayRef<SlimRay>::reinterpret(&slimRays[0], slimRays.size());
+    auto wrappedRays = ArrayRef<embree_utils::TraceResult>::reinterpret(&rays[0], rays.size());
+
+    for (auto r = workerId; r < wrappedRays.size(); r += workerCount) {
+      auto& result = wrappedRays[r];
+      result.p = PixelCoord(wrappedSlim[r].u, wrappedSlim[r].v);
+      result.rgb = Vec3fa(0.f, 0.f, 0.f);
+    }
+
+    return true;
+  }
+};
+
+// Generate the pixel coordinates of a batch on device (instead of streaming
+// them in) from the batch's position in the image's ray stream. Rays beyond the
+// end of the stream just pad the batch and their results are discarded:
+class GenerateSlimRays : public MultiVertex {
+public:
+  Input<unsigned> batchIndex;
+  Output<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(SlimRay)>> slimRays;
+  Output<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> rays;
+  Input<Vector<unsigned>> window; // Row, column, width, and number of rays of the render window
+  unsigned raysPerBatch;
+  unsigned firstRay; // Index of the tile's first ray within the batch
+
+  bool compute(unsigned workerId) {
+    constexpr auto workerCount = numWorkers();
+    const unsigned windowRow = window[0];
+    const unsigned windowCol = window[1];
+    const unsigned windowWidth = window[2];
+    const unsigned numRays = window[3];
+    auto wrappedSlim = ArrayRef<SlimRay>::reinterpret(&slimRays[0], slimRays.size());
+    auto wrappedRays = ArrayRef<embree_utils::TraceResult>::reinterpret(&rays[0], rays.size());
+    const unsigned batchStart = batchIndex * raysPerBatch + firstRay;
+
+    for (auto r = workerId; r < wrappedRays.size(); r += workerCount) {
+      const unsigned i = interleavedRayIndex(batchStart + r, raysPerBatch, wrappedRays.size(), numRays);
+      auto& slim = wrappedSlim[r];
+      slim.u = i < numRays ? windowRow + i / windowWidth : windowRow;
+      slim.v = i < numRays ? windowCol + i % windowWidth : windowCol;
+      slim.rgbe = 0u;
+      auto& result = wrappedRays[r];
+      result.p = PixelCoord(slim.u, slim.v);
+      result.rgb = Vec3fa(0.f, 0.f, 0.f);
+    }
+
+    return true;
+  }
+};
+
+// Pack the accumulated radiance of full trace results into slim records for
+// streaming back to DRAM (the pixel coordinate is left unchanged):
+class PackSlimRays : public MultiVertex {
+public:
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> rays;
+  InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(SlimRay)>> slimRays;
+
+  bool compute(unsigned workerId) {
+    constexpr auto workerCount = numWorkers();
+    auto wrappedRays = ConstArrayRef<embree_utils::TraceResult>::reinterpret(&rays[0], rays.size());
+    auto wrappedSlim = ArrayRef<SlimRay>::reinterpret(&slimRays[0], slimRays.size());
+
+    for (auto r = workerId; r < wrappedRays.size(); r += workerCount) {
+      wrappedSlim[r].rgbe = encodeRgbe(wrappedRays[r].rgb);
+    }
+
+    return true;
+  }
+};
+
+/// First phase of a shadow trace for a sharded scene. Intersects rays with the tile's
+/// shard of the scene and only replaces the hit if it is closer than any found in the
+/// shards the ray has already visited. The ray origin is not advanced (unlike updateHit())
+/// so that every shard tests the same ray.
+class ShardIntersect : public MultiVertex {
+public:
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Sphere)>> spheres;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Disc)>> discs;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(CompiledTriangleMesh)>> meshes;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(SceneInstance)>> instances;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, 16>> serialisedScene;
+  InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> rays;
+
+  bool compute(unsigned int workerID) {
+    auto wrappedRays = ArrayRef<embree_utils::TraceResult>::reinterpret(&rays[0], rays.size());
+    CompactBvh bvh(tileLocalScene.bvhNodes, tileLocalScene.maxLeafDepth);
+
+    for (auto r = workerID; r < wrappedRays.size(); r += numWorkers()) {
+      auto& hit = wrappedRays[r].h;
+      // The ray's tMax is the distance to the closest hit found so far:
+      auto intersected = bvh.intersect(hit.r, primLookup);
+      if (intersected) {
+        // Normal must be calculated while the primID is still local to the shard:
+        visitPrimitive(primLookup, intersected.geomID, intersected.primID, [&](const auto& prim) {
+          hit.normal = primitiveNormal(prim, intersected, hit.r.origin + hit.r.direction * intersected.t);
+        });
+        hit.geomID = intersected.geomID;
+        hit.primID = intersected.primID + tileShardPrimIDOffsets[intersected.geomID];
+        hit.r.tMax = intersected.t;
+      }
+    }
+
+    return true;
+  }
+};
+
+/// Second phase of a sharded shadow trace. Once rays have visited every shard their
+/// closest hits are final so the hit records can be completed and shadow rays cast.
+/// Rays that need no occlusion test are marked with tMax = -inf.
+class ShardShadowSetup : public MultiVertex {
+public:
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, 16>> serialisedScene;
+  Input<Vector<float>> lightPos;
+  InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> rays;
+  Output<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Ray)>> shadowRays;
+
+  bool compute(unsigned int workerID) {
+    auto wrappedRays = ArrayRef<embree_utils::TraceResult>::reinterpret(&rays[0], rays.size());
+    auto wrappedShadowRays = ArrayRef<embree_utils::Ray>::reinterpret(&shadowRays[0], shadowRays.size());
+    Vec3fa lp(lightPos[0], lightPos[1], lightPos[2]);
+
+    for (auto r = workerID; r < wrappedRays.size(); r += numWorkers()) {
+      auto& hit = wrappedRays[r].h;
+      auto& shadowRay = wrappedShadowRays[r];
+      if (hit.geomID != HitRecord::InvalidGeomID) {
+        hit.r.origin += hit.r.direction * hit.r.tMax; // Update ray origin with the hit point
+        shadowRay = makeShadowRay(hit, lp);
+      } else {
+        hit.flags |= HitRecord::ESCAPED;
+        shadowRay = hit.r;
+        shadowRay.tMax = -std::numeric_limits<float>::infinity();
+      }
+    }
+
+    return true;
+  }
+};
+
+/// Any hit occlusion test of a queue of shadow rays against the tile's BVH (this is
+/// the second phase of a shadow trace and the third of a sharded one where the BVH
+/// is the tile's shard). Occluded rays are marked with tMax = -inf (the same as
+/// Embree) so that no other shard needs to test them again.
+class OccludeShadowRays : public MultiVertex {
+public:
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Sphere)>> spheres;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Disc)>> discs;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(CompiledTriangleMesh)>> meshes;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(SceneInstance)>> instances;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, 16>> serialisedScene;
+  InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Ray)>> shadowRays;
+
+  bool compute(unsigned int workerID) {
+    auto wrappedShadowRays = ArrayRef<embree_utils::Ray>::reinterpret(&shadowRays[0], shadowRays.size());
+    CompactBvh bvh(tileLocalScene.bvhNodes, tileLocalScene.maxLeafDepth);
+
+    for (auto r = workerID; r < wrappedShadowRays.size(); r += numWorkers()) {
+      auto& shadowRay = wrappedShadowRays[r];
+      if (shadowRay.tMax >= 0.f && bvh.occluded(shadowRay, primLookup)) {
+        shadowRay.tMax = -std::numeric_limits<float>::infinity();
+      }
+    }
+
+    return true;
+  }
+};
+
+/// Final phase of a (sharded or unsharded) shadow trace: shade the hits using the
+/// result of the occlusion tests (this matches the shading in traceShadowRay()).
+class ShadeShadowRays : public MultiVertex {
+public:
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, 16>> serialisedScene;
+  float ambientLightFactor;
+  InOut<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(TraceResult)>> rays;
+  Input<Vector<unsigned char, poplar::VectorLayout::SPAN, alignof(Ray)>> shadowRays;
+
+  bool compute(unsigned int workerID) {
+    auto wrappedRays = ArrayRef<embree_utils::TraceResult>::reinterpret(&rays[0], rays.size());
+    auto wrappedShadowRays = ConstArrayRef<embree_utils::Ray>::reinterpret(&shadowRays[0], shadowRays.size());
+
+    for (auto r = workerID; r < wrappedRays.size(); r += numWorkers()) {
+      auto& result = wrappedRays[r];
+      const auto& hit = result.h;
+      if (hit.geomID == HitRecord::InvalidGeomID) { continue; }
+      const auto& shadowRay = wrappedShadowRays[r];
+      const auto& material = tileLocalScene.materials[tileLocalScene.matIDs[hit.geomID]];
+      auto color = material.albedo * ambientLightFactor;
+      if (shadowRay.tMax != -std::numeric_limits<float>::infinity()) {
+        color += material.albedo * shadowRay.direction.dot(hit.normal); // lambertian
       }
+      result.rgb = color;
     }
 
     return true;
@@ -0,0 +1,39 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Running statistics of the samples taken for one pixel. These are used to
+// stop sampling a pixel once the estimate of its brightness has converged.
+
+#pragma once
+
+#include <embree_utils/geometry.hpp>
+
+#include <algorithm>
+#include <cstdint>
+
+struct PixelSampleStats {
+  float sum = 0.f;
+  float sumSq = 0.f;
+  std::uint32_t count = 0;
+
+  /// Record the luminance of one sample:
+  void add(const embree_utils::Vec3fa& c) {
+    const float l = 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+    sum += l;
+    sumSq += l * l;
+    count += 1;
+  }
+
+  /// Return true if the standard error of the mean luminance is less than
+  /// threshold times the mean. Pixels darker than minLuminance are treated as
+  /// if they had that luminance (so black pixels converge):
+  bool converged(float threshold, float minLuminance = 1e-3f) const {
+    if (count < 2) {
+      return false;
+    }
+    const float n = count;
+    const float mean = sum / n;
+    const float variance = std::max(sumSq - sum * mean, 0.f) / (n - 1.f);
+    const float tolerance = threshold * std::max(mean, minLuminance);
+    return variance / n <= tolerance * tolerance;
+  }
+};
@@ -0,0 +1,23 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Camera paths for rendering animations (e.g. turntables and fly-throughs) in
+// one render session. A camera path file has one frame per line with the eye
+// position and the point it looks at: "ex ey ez tx ty tz" optionally followed
+// by an up vector "ux uy uz" (the default is +y). Blank lines and lines that
+// start with '#' are ignored. Coordinates are in the space of the scene as it
+// is rendered (the identity camera is at the origin looking down -z).
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Instance.hpp"
+
+/// Return the (rigid) camera to world transform of a camera at eye that looks at target:
+AffineTransform lookAtTransform(const embree_utils::Vec3fa& eye,
+                                const embree_utils::Vec3fa& target,
+                                const embree_utils::Vec3fa& up = embree_utils::Vec3fa(0.f, 1.f, 0.f));
+
+/// Load a camera path file (see above) and return a camera transform for every frame:
+std::vector<AffineTransform> loadCameraPath(const std::string& fileName);
@@ -49,16 +49,34 @@ bool intersectRaySlab(float componentInvDir, float componentOrigin, float slabMi
   return true;
 }
 
+// Leaves reference a contiguous run of primitives within one geometry. The
+// run length is packed into the top bits of the leaf's stored primitive ID:
+static constexpr std::uint32_t LeafCountShift = 28;
+static constexpr std::uint32_t LeafPrimMask = (1u << LeafCountShift) - 1u;
+static constexpr std::uint32_t MaxLeafPrims = 1u << (32 - LeafCountShift);
+
+inline
+std::uint32_t packLeafPrims(std::uint32_t firstPrim, std::uint32_t count) {
+  return ((count - 1u) << LeafCountShift) | firstPrim;
+}
+
+inline
+std::uint32_t leafFirstPrim(std::uint32_t packed) { return packed & LeafPrimMask; }
+
+inline
+std::uint32_t leafPrimCount(std::uint32_t packed) { return (packed >> LeafCountShift) + 1u; }
+
 struct
 __attribute__ ((aligned (8)))
 CompactBVH2Node {
+  static constexpr std::uint32_t Width = 2;
   static constexpr auto InvalidGeomID = std::numeric_limits<std::uint16_t>::max();
   static constexpr auto InvalidPrimID = std::numeric_limits<std::uint32_t>::max();
 
   // Explicitly list the bounds element by element to get a compact structure:
   float min_x, min_y, min_z;
 
-  // If this is a leaf we store the primitive IDs, otherwise we store
+  // If this is a leaf we store the (packed) primitive IDs, otherwise we store
   // the index of the second child node. (The first child node is always
   // the next node in the array).
   union {
@@ -0,0 +1,81 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// This file contains a compact 4-wide BVH node representation. Each node
+// stores the bounds of all its children so a single node fetch tests four
+// boxes. Leaves are stored inline in the child slots of their parent.
+
+#pragma once
+
+#ifdef __IPU__
+#include <ipu_vector_math>
+#endif
+
+#include "CompactBVH2Node.hpp"
+
+#ifdef __IPU__
+/// Slab test for two boxes at once using float2 arithmetic. All
+/// arguments must be expressed relative to the same origin.
+inline
+void intersectRaySlab2(float componentInvDir, float componentOrigin, float2 slabMin, float2 slabMax, float2& t0, float2& t1) {
+  const float2 o = {componentOrigin, componentOrigin};
+  const float2 i = {componentInvDir, componentInvDir};
+  float2 tNear = (slabMin - o) * i;
+  float2 tFar = (slabMax - o) * i;
+  float2 tmin = ipu::fmin(tNear, tFar);
+  float2 tmax = ipu::fmax(tNear, tFar);
+
+  // Make sure we never miss a potential hit due to rounding error:
+  tmax *= 1 + 2 * gamma(3);
+
+  t0 = ipu::fmax(tmin, t0);
+  t1 = ipu::fmin(tmax, t1);
+}
+#endif
+
+struct
+__attribute__ ((aligned (8)))
+CompactBVH4Node {
+  static constexpr std::uint32_t Width = 4;
+  static constexpr auto InvalidGeomID = std::numeric_limits<std::uint16_t>::max();
+
+  // All child bounds are stored relative to this origin (the min corner of the node):
+  float min_x, min_y, min_z;
+
+  // Number of valid child slots. Slots [0, childCount) are always the valid ones:
+  std::uint32_t childCount;
+
+  // Child box extents relative to the node origin at half precision. Lower
+  // bounds are rounded down and upper bounds rounded up so that the stored
+  // boxes always contain the original fp32 boxes:
+  half lo_x[Width], lo_y[Width], lo_z[Width];
+  half hi_x[Width], hi_y[Width], hi_z[Width];
+
+  // If a child is a leaf we store its packed primitive run (see packLeafPrims()),
+  // otherwise we store the index of the child node in the node array:
+  std::uint32_t child[Width];
+
+  // If geomID[c] == InvalidGeomID then child c is an inner node:
+  std::uint16_t geomID[Width];
+
+  bool isLeaf(std::uint32_t c) const { return geomID[c] != InvalidGeomID; }
+
+  /// Test a ray against all child boxes at once. Returns a bit mask with
+  /// bit c set if child c is hit within the range [tMin, tMax]. The entry
+  /// distance of every hit child is written to tEntry[c]:
+  std::uint32_t intersect(const embree_utils::Vec3fa& o, const embree_utils::Vec3fa& invDir, float tMin, float tMax, float (&tEntry)[Width]) const;
+
+  embree_utils::Bounds3d childBounds(std::uint32_t c) const {
+    return embree_utils::Bounds3d(
+      embree_utils::Vec3fa(min_x + (float)lo_x[c], min_y + (float)lo_y[c], min_z + (float)lo_z[c]),
+      embree_utils::Vec3fa(min_x + (float)hi_x[c], min_y + (float)hi_y[c], min_z + (float)hi_z[c])
+    );
+  }
+
+  embree_utils::Bounds3d toBounds() const {
+    embree_utils::Bounds3d b;
+    for (auto c = 0u; c < childCount; ++c) {
+      b += childBounds(c);
+    }
+    return b;
+  }
+};
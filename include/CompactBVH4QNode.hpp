@@ -0,0 +1,68 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// This file contains a quantised 4-wide BVH node representation. Child
+// bounds are stored as 8-bit offsets on a per-axis power of two grid that
+// spans the node's box. This is more compact than CompactBVH4Node and has
+// no limit on the size of the scene's extents.
+
+#pragma once
+
+#include "CompactBVH4Node.hpp"
+
+struct
+__attribute__ ((aligned (8)))
+CompactBVH4QNode {
+  static constexpr std::uint32_t Width = 4;
+  static constexpr auto InvalidGeomID = std::numeric_limits<std::uint16_t>::max();
+
+  // Lowest and highest grid exponents. These keep the grid scale and the
+  // ray origin expressed in grid units within normal fp32 range:
+  static constexpr std::int32_t MinExponent = -64;
+  static constexpr std::int32_t MaxExponent = 126;
+
+  // Origin of the quantisation grid (the min corner of the node):
+  float min_x, min_y, min_z;
+
+  // Grid spacing along each axis is 2^exp:
+  std::int8_t exp_x, exp_y, exp_z;
+
+  // Number of valid child slots. Slots [0, childCount) are always the valid ones:
+  std::uint8_t childCount;
+
+  // Quantised child bounds in grid units. Lower bounds are rounded down and
+  // upper bounds rounded up so that the boxes always contain the originals:
+  std::uint8_t lo_x[Width], lo_y[Width], lo_z[Width];
+  std::uint8_t hi_x[Width], hi_y[Width], hi_z[Width];
+
+  // If a child is a leaf we store its packed primitive run (see packLeafPrims()),
+  // otherwise we store the index of the child node in the node array:
+  std::uint32_t child[Width];
+
+  // If geomID[c] == InvalidGeomID then child c is an inner node:
+  std::uint16_t geomID[Width];
+
+  bool isLeaf(std::uint32_t c) const { return geomID[c] != InvalidGeomID; }
+
+  /// Test a ray against all child boxes at once. Returns a bit mask with
+  /// bit c set if child c is hit within the range [tMin, tMax]. The entry
+  /// distance of every hit child is written to tEntry[c]:
+  std::uint32_t intersect(const embree_utils::Vec3fa& o, const embree_utils::Vec3fa& invDir, float tMin, float tMax, float (&tEntry)[Width]) const;
+
+  embree_utils::Bounds3d childBounds(std::uint32_t c) const {
+    const float sx = exp2i(exp_x);
+    const float sy = exp2i(exp_y);
+    const float sz = exp2i(exp_z);
+    return embree_utils::Bounds3d(
+      embree_utils::Vec3fa(min_x + lo_x[c] * sx, min_y + lo_y[c] * sy, min_z + lo_z[c] * sz),
+      embree_utils::Vec3fa(min_x + hi_x[c] * sx, min_y + hi_y[c] * sy, min_z + hi_z[c] * sz)
+    );
+  }
+
+  embree_utils::Bounds3d toBounds() const {
+    embree_utils::Bounds3d b;
+    for (auto c = 0u; c < childCount; ++c) {
+      b += childBounds(c);
+    }
+    return b;
+  }
+};
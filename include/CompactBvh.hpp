@@ -5,31 +5,60 @@
 // BVH structure for use on IPU. Similar structures are typically common even
 // in non-IPU implementations as they are memory efficient and can be moved around
 // (e.g. paged) as they do not contain any absolute indices or pointers.
+//
+// The BVH is templated on its node type: CompactBVH2Node gives a binary tree
+// where every node is tested when popped from the stack, CompactBVH4Node
+// and CompactBVH4QNode give 4-wide trees where all children are tested together
+// at their parent.
 
 #pragma once
 
 #include "embree_utils/geometry.hpp"
 #include "CompactBVH2Node.hpp"
+#include "CompactBVH4Node.hpp"
+#include "CompactBVH4QNode.hpp"
 #include "Intersection.hpp"
+#include "Primitives.hpp"
 #include "Arrays.hpp"
+#include "TraversalStats.hpp"
 
+#include <type_traits>
+
+/// Call f with the primitive that a lookup finds for a geomID. A lookup is either
+/// a callable that returns a pointer to the primitive for a geomID and primID or
+/// an object with a visit(geomID, f) method that calls f with the primitive as
+/// its concrete type. The latter lets traversal intersect primitives without
+/// any virtual calls:
+template <class Lookup, class F>
+void visitPrimitive(Lookup& primLookup, std::uint16_t geomID, std::uint32_t primID, F&& f) {
+  if constexpr (std::is_invocable_v<Lookup&, std::uint16_t, std::uint32_t>) {
+    f(*primLookup(geomID, primID));
+  } else {
+    primLookup.visit(geomID, f);
+  }
+}
+
+template <class Node>
 struct CompactBvh {
+  static constexpr bool isWide = Node::Width > 2;
 
   embree_utils::Bounds3d getBoundingBox() const {
     return nodes.front().toBounds();
   }
 
-  const ArrayRef<CompactBVH2Node>& getNodes() const { return nodes; }
+  const ArrayRef<Node>& getNodes() const { return nodes; }
   const std::uint32_t getMaxDepth() const { return stackSize; }
 
-  CompactBvh(ArrayRef<CompactBVH2Node> nodesRef,
+  CompactBvh(ArrayRef<Node> nodesRef,
              std::uint32_t maxTraversalDepth)
   : nodes(nodesRef), stackSize(maxTraversalDepth) {}
 
   // Return true if the ray intersects any primitive in the BVH. For occlusion
   // tests this is more efficient than calling interesect because it can return early if any
-  // primitive intersection is found. This shares the traversal stack with intersect() so can
-  // not be called in a parallel thread to other intersection tests.
+  // primitive intersection is found. The traversal is tuned for any hit: the leaves of a
+  // node are tested before any of its inner children are visited (so shallow leaves can end
+  // the traversal early), primitives use their cheapest any hit test (see occludesPrimitives()),
+  // and the stack only records node indices.
   template <class Lookup>
   bool occluded(const embree_utils::Ray& ray,
                 Lookup& primLookup,
@@ -48,28 +77,67 @@ struct CompactBvh {
       1.f / ray.direction.z
     );
 
-    while (!toVisit.empty()) {
-      auto currentIndex = toVisit.back();
-      toVisit.pop_back();
-      const CompactBVH2Node& node = nodes[currentIndex];
-
-      // check if ray hits bounds by testing against each axis aligned slab:
-      float t0 = ray.tMin;
-      float t1 = ray.tMax;
-
-      if (node.intersect(ray.origin, invRayDir, t0, t1)) {
-        if (node.geomID != CompactBVH2Node::InvalidGeomID) {
-          // Node is a leaf so we must intersect the geometry:
-          auto* prim = primLookup(node.geomID, node.primID);
-          auto intersection = prim->intersect(node.primID, ray);
-          if (intersection.t > ray.tMin && intersection.t < ray.tMax) {
+    if constexpr (isWide) {
+      while (!toVisit.empty()) {
+        auto currentIndex = toVisit.back();
+        toVisit.pop_back();
+        const Node& node = nodes[currentIndex];
+        recordNodeVisit(primLookup);
+
+        // Test all the child boxes at once:
+        float tEntry[Node::Width];
+        auto hitMask = node.intersect(ray.origin, invRayDir, ray.tMin, ray.tMax, tEntry);
+        for (auto c = 0u; c < Node::Width; ++c) {
+          if ((hitMask & (1u << c)) && node.isLeaf(c) &&
+              occludedLeaf(node.geomID[c], node.child[c], ray, primLookup)) {
             return true; // Early exit on first hit
           }
-        } else {
-          // Node is interior so push the two children onto the
-          // stack (First child is always next in the array):
-          toVisit.push_back(node.secondChildIndex);
-          toVisit.push_back(currentIndex + 1);
+        }
+
+        // Push the inner children so that the nearest is visited first (an
+        // occluder near the ray's origin ends the traversal soonest):
+        std::uint32_t inner[Node::Width];
+        float innerEntry[Node::Width];
+        std::uint32_t innerCount = 0;
+        for (auto c = 0u; c < Node::Width; ++c) {
+          if ((hitMask & (1u << c)) && !node.isLeaf(c)) {
+            auto i = innerCount;
+            for (; i > 0 && innerEntry[i - 1] < tEntry[c]; --i) {
+              inner[i] = inner[i - 1];
+              innerEntry[i] = innerEntry[i - 1];
+            }
+            inner[i] = node.child[c];
+            innerEntry[i] = tEntry[c];
+            innerCount += 1;
+          }
+        }
+        for (auto i = 0u; i < innerCount; ++i) {
+          toVisit.push_back(inner[i]);
+        }
+      }
+    } else {
+      while (!toVisit.empty()) {
+        auto currentIndex = toVisit.back();
+        toVisit.pop_back();
+        const Node& node = nodes[currentIndex];
+        recordNodeVisit(primLookup);
+
+        // check if ray hits bounds by testing against each axis aligned slab:
+        float t0 = ray.tMin;
+        float t1 = ray.tMax;
+
+        if (node.intersect(ray.origin, invRayDir, t0, t1)) {
+          if (node.geomID != Node::InvalidGeomID) {
+            // Node is a leaf so we must intersect the geometry:
+            if (occludedLeaf(node.geomID, node.primID, ray, primLookup)) {
+              return true; // Early exit on first hit
+            }
+          } else {
+            // Node is interior so push the two children onto the
+            // stack (First child is always next in the array):
+            toVisit.push_back(node.secondChildIndex);
+            toVisit.push_back(currentIndex + 1);
+          }
         }
       }
     }
@@ -82,11 +150,12 @@ struct CompactBvh {
     const embree_utils::Ray& ray,
     Lookup& primLookup
   ) const {
-    // Push root node onto stack:
-    std::uint32_t stack[stackSize];
+    // Stack entries record the entry distance of their node so that
+    // nodes further than the closest hit found so far can be skipped:
+    StackEntry stack[stackSize];
     auto ref = ArrayRef(stack, stackSize);
-    WrappedArray<std::uint32_t> toVisit(ref);
-    toVisit.push_back(0);
+    WrappedArray<StackEntry> toVisit(ref);
+    toVisit.push_back(StackEntry{0, ray.tMin}); // Push root node onto stack
 
     // Setup intersection test:
     const embree_utils::Vec3fa invRayDir(
@@ -97,40 +166,75 @@ struct CompactBvh {
 
     auto closestIntersection = Intersection(ray.tMax, nullptr);
 
-    while (!toVisit.empty()) {
-      auto currentIndex = toVisit.back();
-      toVisit.pop_back();
-      const CompactBVH2Node& node = nodes[currentIndex];
-
-      // check if ray hits bounds by testing against each axis aligned slab:
-      float t0 = ray.tMin;
-      float t1 = closestIntersection.t;
-
-      if (node.intersect(ray.origin, invRayDir, t0, t1)) {
-        if (node.geomID != CompactBVH2Node::InvalidGeomID) {
-          // Debug: visualise Bounds of leaf nodes:
-          // if (t0 < closestIntersection.t) {
-          //   closestIntersection.t = t0;
-          //   closestIntersection.geomID = node.geomID;
-          //   closestIntersection.primID = node.primID;
-          // }
-
-          // Node is a leaf so intersect the geometry:
-          const Primitive* prim = primLookup(node.geomID, node.primID);
-          auto intersection = prim->intersect(node.primID, ray);
-          intersection.prim = prim;
-
-          // If this is closest intersection so far save it:
-          if (intersection.t > ray.tMin && intersection.t < closestIntersection.t) {
-            intersection.geomID = node.geomID;
-            // intersection.primID is set by the intersect method.
-            closestIntersection = intersection;
+    if constexpr (isWide) {
+      while (!toVisit.empty()) {
+        const auto entry = toVisit.back();
+        toVisit.pop_back();
+        if (entry.tEntry > closestIntersection.t) { continue; }
+        const Node& node = nodes[entry.index];
+        recordNodeVisit(primLookup);
+
+        // Test all the child boxes at once (leaves are inline so
+        // are intersected here rather than pushed onto the stack):
+        float tEntry[Node::Width];
+        auto hitMask = node.intersect(ray.origin, invRayDir, ray.tMin, closestIntersection.t, tEntry);
+
+        // Intersect leaves first as they can shorten the ray and cull inner children:
+        for (auto c = 0u; c < Node::Width; ++c) {
+          if ((hitMask & (1u << c)) && node.isLeaf(c)) {
+            intersectLeaf(node.geomID[c], node.child[c], ray, primLookup, closestIntersection);
+          }
+        }
+
+        // Sort the inner children that were hit by decreasing entry distance
+        // then push them so that the nearest child is visited first:
+        StackEntry inner[Node::Width];
+        std::uint32_t innerCount = 0;
+        for (auto c = 0u; c < Node::Width; ++c) {
+          if ((hitMask & (1u << c)) && !node.isLeaf(c) && tEntry[c] <= closestIntersection.t) {
+            auto i = innerCount;
+            for (; i > 0 && inner[i - 1].tEntry < tEntry[c]; --i) {
+              inner[i] = inner[i - 1];
+            }
+            inner[i] = StackEntry{node.child[c], tEntry[c]};
+            innerCount += 1;
+          }
+        }
+        for (auto i = 0u; i < innerCount; ++i) {
+          toVisit.push_back(inner[i]);
+        }
+      }
+    } else {
+      while (!toVisit.empty()) {
+        const auto entry = toVisit.back();
+        toVisit.pop_back();
+        if (entry.tEntry > closestIntersection.t) { continue; }
+        const auto currentIndex = entry.index;
+        const Node& node = nodes[currentIndex];
+        recordNodeVisit(primLookup);
+
+        // check if ray hits bounds by testing against each axis aligned slab:
+        float t0 = ray.tMin;
+        float t1 = closestIntersection.t;
+
+        if (node.intersect(ray.origin, invRayDir, t0, t1)) {
+          if (node.geomID != Node::InvalidGeomID) {
+            // Debug: visualise Bounds of leaf nodes:
+            // if (t0 < closestIntersection.t) {
+            //   closestIntersection.t = t0;
+            //   closestIntersection.geomID = node.geomID;
+            //   closestIntersection.primID = node.primID;
+            // }
+
+            // Node is a leaf so intersect the geometry:
+            intersectLeaf(node.geomID, node.primID, ray, primLookup, closestIntersection);
+          } else {
+            // Node is interior so push the two children onto the stack (First
+            // child is always next in the array). Binary nodes do not store
+            // child bounds so the parent's entry distance is used for both:
+            toVisit.push_back(StackEntry{node.secondChildIndex, t0});
+            toVisit.push_back(StackEntry{currentIndex + 1, t0});
           }
-        } else {
-          // Node is interior so push the two children onto the
-          // stack (First child is always next in the array):
-          toVisit.push_back(node.secondChildIndex);
-          toVisit.push_back(currentIndex + 1);
         }
       }
     }
@@ -139,6 +243,48 @@ struct CompactBvh {
   }
 
 private:
-  const ArrayRef<CompactBVH2Node> nodes;
+  struct StackEntry {
+    std::uint32_t index;
+    float tEntry;
+  };
+
+  // Intersect the run of primitives referenced by a leaf and
+  // update the closest intersection if any are nearer:
+  template <class Lookup>
+  static void intersectLeaf(std::uint16_t geomID, std::uint32_t packedPrims,
+                            const embree_utils::Ray& ray, Lookup& primLookup,
+                            Intersection& closestIntersection) {
+    const auto first = leafFirstPrim(packedPrims);
+    const auto end = first + leafPrimCount(packedPrims);
+    recordPrimTests(primLookup, end - first);
+    visitPrimitive(primLookup, geomID, first, [&](const auto& prim) {
+      for (auto p = first; p < end; ++p) {
+        auto intersection = intersectPrimitive(prim, p, ray);
+        intersection.prim = &prim;
+
+        // If this is closest intersection so far save it:
+        if (intersection.t > ray.tMin && intersection.t < closestIntersection.t) {
+          intersection.geomID = geomID;
+          // intersection.primID is set by the intersect method.
+          closestIntersection = intersection;
+        }
+      }
+    });
+  }
+
+  template <class Lookup>
+  static bool occludedLeaf(std::uint16_t geomID, std::uint32_t packedPrims,
+                           const embree_utils::Ray& ray, Lookup& primLookup) {
+    const auto first = leafFirstPrim(packedPrims);
+    const auto end = first + leafPrimCount(packedPrims);
+    recordPrimTests(primLookup, end - first);
+    bool occluded = false;
+    visitPrimitive(primLookup, geomID, first, [&](const auto& prim) {
+      occluded = occludesPrimitives(prim, first, end, ray);
+    });
+    return occluded;
+  }
+
+  const ArrayRef<Node> nodes;
   const std::uint32_t stackSize;
 };
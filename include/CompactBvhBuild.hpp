@@ -1,26 +1,38 @@
 // Copyright (c) 2022 Graphcore Ltd. All rights reserved.
 
-// Functionality to convert from custom BVH built with Embree
+// Functionality to convert from the native BVH build
 // into a more compact and efficient data structure.
 
-#include "embree_utils/node.hpp"
+#pragma once
+
+#include "SahBvhBuilder.hpp"
 #include "CompactBVH2Node.hpp"
+#include "CompactBVH4Node.hpp"
+#include "CompactBVH4QNode.hpp"
+
+/// Convert a native BVH build into an array of compact binary nodes. The build
+/// is already in depth first order so the conversion is a single pass over it.
+std::vector<CompactBVH2Node> buildCompactBvh(const BvhBuild& bvh);
 
-/// Recursively traverse a BVH2 sub-tree and flatten it into an array of compact nodes.
-std::uint32_t flattenBVH2Tree(const embree_utils::Node* node, std::vector<CompactBVH2Node>& compactTree, std::uint32_t depth, std::uint32_t& index, std::uint32_t& maxDepth);
+/// Recursively collapse a binary sub-tree into 4-wide nodes and append them to the array.
+/// Returns the index of the node that was created for the sub-tree's root. The argument
+/// pending is the number of stack entries that can be left by the node's ancestors.
+/// Instantiated for CompactBVH4Node and CompactBVH4QNode.
+template <class WideNode>
+std::uint32_t flattenBVH4Tree(const std::vector<BuildNode>& tree, std::uint32_t node, std::vector<WideNode>& compactTree, std::uint32_t pending, std::uint32_t& maxStackSize);
 
-// Convert a custom BVH built using Embree as a backend
-// into a compact array of nodes giving a more efficient data structure.
-// The returned array can be wrapped into a CompactBvh to instansiate an
-// efficient BVH object.
-static std::vector<CompactBVH2Node> buildCompactBvh(
-    const embree_utils::Node* startNode,
-    std::uint32_t maxNodes,
-    std::uint32_t& maxDepth)
+// Convert the sub-tree of a native binary BVH build rooted at startNode into a
+// compact array of 4-wide nodes. On return maxStackSize holds the size of traversal
+// stack required which is the value that should be passed to CompactBvh.
+template <class WideNode>
+static std::vector<WideNode> buildCompactBvh4(
+    const std::vector<BuildNode>& tree,
+    std::uint32_t startNode,
+    std::uint32_t& maxStackSize)
 {
-  std::vector<CompactBVH2Node> nodes(maxNodes);  
-  std::uint32_t indexTracker = 0;
-  maxDepth = 0;
-  flattenBVH2Tree(startNode, nodes, 1, indexTracker, maxDepth);
+  std::vector<WideNode> nodes;
+  nodes.reserve(tree[startNode].primCount / 2 + 1); // Roughly one wide node per pair of leaves at worst
+  maxStackSize = 1; // Root is always pushed
+  flattenBVH4Tree(tree, startNode, nodes, 0, maxStackSize);
   return nodes;
 }
@@ -0,0 +1,26 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Host denoiser for path traced images. This is an edge avoiding A-Trous
+// wavelet filter ("Edge-Avoiding A-Trous Wavelet Transform for fast Global
+// Illumination Filtering", Dammertz et al. 2010) guided by the first hit
+// albedo and normal AOVs (see DenoiseAovs). The image is divided by the
+// albedo before filtering so that texture and material detail is kept and
+// only the noisy illumination is blurred.
+
+#pragma once
+
+#include <cstdint>
+
+struct DenoiseSettings {
+  std::uint32_t iterations = 5; // The filter's footprint is 4 * 2^iterations + 1 pixels wide
+  float colourSigma = .5f; // Relative difference in illumination that stops the filter
+  float normalSigma = .3f;
+  float albedoSigma = .1f;
+};
+
+/// Denoise an image of width * height pixels. All images are interleaved 3
+/// channel float arrays and the channels of the albedo must be in the same
+/// order as those of the image. The output must not alias any of the inputs:
+void denoiseImage(const float* rgb, const float* albedo, const float* normal,
+                  std::uint32_t width, std::uint32_t height, float* output,
+                  const DenoiseSettings& settings = DenoiseSettings());
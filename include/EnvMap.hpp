@@ -0,0 +1,177 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Environment lighting stored as a texture in equirectangular projection.
+// This is used when the NIF environment light is baked into a texture once
+// (instead of evaluating the network for every escaped ray). The texture uses
+// the same UV convention as the NIF: u is the polar angle and v the azimuth
+// (both scaled to [0, 1]) and texel (r, c) is at UV (r / height, c / width).
+// The texture can also be importance sampled for next event estimation.
+
+#pragma once
+
+#include <embree_utils/geometry.hpp>
+#include <math/sincos.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+/// Return the equirectangular UV coords of a normalised direction:
+inline void equirectUV(const embree_utils::Vec3fa& dir, float azimuthRotation, float& u, float& v) {
+  auto theta = std::acos(std::min(std::max(dir.y, -1.f), 1.f));
+  auto phi = std::atan2(dir.z, dir.x) + azimuthRotation;
+  if (phi < 0.f) {
+    phi += embree_utils::TwoPi;
+  } else if (phi > embree_utils::TwoPi) {
+    phi -= embree_utils::TwoPi;
+  }
+  u = theta * embree_utils::InvPi;
+  v = phi * embree_utils::Inv2Pi;
+}
+
+/// Texture of BGR texels stored row by row. T is the texel
+/// component type (half on the IPU, float for testing):
+template <typename T>
+struct EnvMap {
+  const T* texels;
+  unsigned width;
+  unsigned height;
+  float azimuthRotation;
+
+  /// Bilinear lookup of the radiance arriving from a direction. The
+  /// texture wraps around in azimuth and is clamped at the poles:
+  embree_utils::Vec3fa lookup(const embree_utils::Vec3fa& dir) const {
+    float u, v;
+    equirectUV(dir, azimuthRotation, u, v);
+    const float x = v * width;
+    const float y = std::min(u * height, float(height - 1));
+    auto c0 = std::min(unsigned(x), width - 1);
+    auto r0 = unsigned(y);
+    const float fx = std::min(x - c0, 1.f);
+    const float fy = y - r0;
+    const auto c1 = c0 + 1 == width ? 0u : c0 + 1;
+    const auto r1 = std::min(r0 + 1, height - 1);
+    const auto top = texel(r0, c0) * (1.f - fx) + texel(r0, c1) * fx;
+    const auto bottom = texel(r1, c0) * (1.f - fx) + texel(r1, c1) * fx;
+    return top * (1.f - fy) + bottom * fy;
+  }
+
+  embree_utils::Vec3fa texel(unsigned r, unsigned c) const {
+    const auto* bgr = texels + 3 * (r * width + c);
+    return embree_utils::Vec3fa(float(bgr[2]), float(bgr[1]), float(bgr[0]));
+  }
+};
+
+/// Multiple importance sampling weight for a sample with pdf a (from a
+/// strategy that was sampled once) against a strategy with pdf b:
+inline float powerHeuristic(float a, float b) {
+  const float a2 = a * a;
+  const float b2 = b * b;
+  return a2 + b2 > 0.f ? a2 / (a2 + b2) : 0.f;
+}
+
+/// Importance sampling of an EnvMap in proportion to luminance. Cell (r, c)
+/// is the area that is interpolated between texels (r, c) and (r + 1, c + 1)
+/// and is weighted by the mean luminance of those texels and the solid angle
+/// of its row. The cdf holds the marginal CDF of the rows (height + 1 values)
+/// followed by the conditional CDF of the cells in each row (width + 1 values
+/// per row):
+struct EnvMapSampler {
+  const float* cdf;
+  unsigned width;
+  unsigned height;
+  float azimuthRotation;
+
+  static unsigned cdfSize(unsigned width, unsigned height) { return height + 1 + height * (width + 1); }
+
+  template <typename T>
+  static void build(const EnvMap<T>& env, float* cdf) {
+    float* marginal = cdf;
+    float* conditional = cdf + env.height + 1;
+    marginal[0] = 0.f;
+    for (auto r = 0u; r < env.height; ++r) {
+      float sinTheta, cosTheta;
+      sincos((r + .5f) * embree_utils::Pi / env.height, sinTheta, cosTheta);
+      const auto r1 = std::min(r + 1, env.height - 1);
+      float* row = conditional + r * (env.width + 1);
+      row[0] = 0.f;
+      for (auto c = 0u; c < env.width; ++c) {
+        const auto c1 = c + 1 == env.width ? 0u : c + 1;
+        const auto sum = env.texel(r, c) + env.texel(r, c1) + env.texel(r1, c) + env.texel(r1, c1);
+        row[c + 1] = row[c] + luminance(sum) * (.25f * sinTheta);
+      }
+      marginal[r + 1] = marginal[r] + row[env.width];
+      normalise(row, env.width);
+    }
+    normalise(marginal, env.height);
+  }
+
+  /// Sample a direction. The pdf (with respect to solid angle) is zero if
+  /// the sample is invalid:
+  embree_utils::Vec3fa sample(float u1, float u2, float& pdf) const {
+    const float* marginal = cdf;
+    const auto r = findInterval(marginal, height, u1);
+    const float* row = cdf + height + 1 + r * (width + 1);
+    const auto c = findInterval(row, width, u2);
+    const float dr = marginal[r + 1] - marginal[r];
+    const float dc = row[c + 1] - row[c];
+    const float fy = dr > 0.f ? std::min((u1 - marginal[r]) / dr, 1.f) : .5f;
+    const float fx = dc > 0.f ? std::min((u2 - row[c]) / dc, 1.f) : .5f;
+
+    // Invert the equirectangular projection:
+    float sinTheta, cosTheta, sinPhi, cosPhi;
+    sincos((r + fy) * embree_utils::Pi / height, sinTheta, cosTheta);
+    sincos((c + fx) * embree_utils::TwoPi / width - azimuthRotation, sinPhi, cosPhi);
+    // Get sin(theta) from the y-coord in the same way as pdf(dir) does:
+    pdf = cellPdf(dr * dc, std::sqrt(std::max(1.f - cosTheta * cosTheta, 0.f)));
+    return embree_utils::Vec3fa(sinTheta * cosPhi, cosTheta, sinTheta * sinPhi);
+  }
+
+  /// Pdf (with respect to solid angle) of sampling a normalised direction:
+  float pdf(const embree_utils::Vec3fa& dir) const {
+    float u, v;
+    equirectUV(dir, azimuthRotation, u, v);
+    const auto r = std::min(unsigned(u * height), height - 1);
+    const auto c = std::min(unsigned(v * width), width - 1);
+    const float* row = cdf + height + 1 + r * (width + 1);
+    const float sinTheta = std::sqrt(std::max(1.f - dir.y * dir.y, 0.f));
+    return cellPdf((cdf[r + 1] - cdf[r]) * (row[c + 1] - row[c]), sinTheta);
+  }
+
+private:
+  static float luminance(const embree_utils::Vec3fa& c) {
+    return .2126f * c.x + .7152f * c.y + .0722f * c.z;
+  }
+
+  // Normalise an (unnormalised) CDF of n intervals. If the
+  // total is zero the intervals are made uniform instead:
+  static void normalise(float* cdf, unsigned n) {
+    const float total = cdf[n];
+    for (auto i = 1u; i <= n; ++i) {
+      cdf[i] = total > 0.f ? cdf[i] / total : float(i) / n;
+    }
+  }
+
+  // Return the last of the n intervals of a CDF that starts at or before x:
+  static unsigned findInterval(const float* cdf, unsigned n, float x) {
+    unsigned lo = 0;
+    unsigned hi = n;
+    while (hi - lo > 1) {
+      const auto mid = (lo + hi) / 2;
+      if (cdf[mid] <= x) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  // Convert the probability of a cell to a pdf over directions (the cells
+  // are uniform in UV whose Jacobian to solid angle is 2 * Pi^2 * sin(theta)):
+  float cellPdf(float probability, float sinTheta) const {
+    if (sinTheta <= 0.f) {
+      return 0.f;
+    }
+    return probability * (width * height) / (2.f * embree_utils::Pi * embree_utils::Pi * sinTheta);
+  }
+};
@@ -0,0 +1,182 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// This file contains the primitive that makes a two level acceleration
+// structure: an Instance is a leaf primitive of the top level BVH that places
+// a shared (bottom level) mesh BVH in the scene using an affine transform.
+
+#pragma once
+
+#include "Primitives.hpp"
+#include "CompactBvh.hpp"
+
+#ifndef __IPU__
+#include <stdexcept>
+#endif
+
+/// Affine transform stored as the top three rows of a row major 4x4 matrix.
+struct AffineTransform {
+  float m[12];
+
+  static AffineTransform identity() {
+    return AffineTransform{{1.f, 0.f, 0.f, 0.f,
+                            0.f, 1.f, 0.f, 0.f,
+                            0.f, 0.f, 1.f, 0.f}};
+  }
+
+  embree_utils::Vec3fa point(const embree_utils::Vec3fa& p) const {
+    return embree_utils::Vec3fa(
+      m[0] * p.x + m[1] * p.y + m[2]  * p.z + m[3],
+      m[4] * p.x + m[5] * p.y + m[6]  * p.z + m[7],
+      m[8] * p.x + m[9] * p.y + m[10] * p.z + m[11]
+    );
+  }
+
+  /// Transform a direction (ignores the translation):
+  embree_utils::Vec3fa vector(const embree_utils::Vec3fa& v) const {
+    return embree_utils::Vec3fa(
+      m[0] * v.x + m[1] * v.y + m[2]  * v.z,
+      m[4] * v.x + m[5] * v.y + m[6]  * v.z,
+      m[8] * v.x + m[9] * v.y + m[10] * v.z
+    );
+  }
+
+  /// Transform a direction by the transpose of the linear part. Normals
+  /// must be transformed by the inverse transpose so applying this to the
+  /// inverse transform takes object space normals into world space:
+  embree_utils::Vec3fa transposedVector(const embree_utils::Vec3fa& v) const {
+    return embree_utils::Vec3fa(
+      m[0] * v.x + m[4] * v.y + m[8]  * v.z,
+      m[1] * v.x + m[5] * v.y + m[9]  * v.z,
+      m[2] * v.x + m[6] * v.y + m[10] * v.z
+    );
+  }
+
+  /// Determinant of the linear part (negative if the transform is a reflection):
+  float determinant() const {
+    return m[0] * (m[5] * m[10] - m[6] * m[9]) -
+           m[1] * (m[4] * m[10] - m[6] * m[8]) +
+           m[2] * (m[4] * m[9] - m[5] * m[8]);
+  }
+
+  /// Conservative bounds of a transformed box (transforms all eight corners):
+  embree_utils::Bounds3d bounds(const embree_utils::Bounds3d& b) const {
+    embree_utils::Bounds3d result;
+    for (auto c = 0u; c < 8; ++c) {
+      result += point(embree_utils::Vec3fa(c & 1 ? b.max.x : b.min.x,
+                                           c & 2 ? b.max.y : b.min.y,
+                                           c & 4 ? b.max.z : b.min.z));
+    }
+    return result;
+  }
+
+#ifndef __IPU__
+  AffineTransform inverse() const {
+    // Invert the linear part using cofactors (in double precision) then
+    // the inverse translation is the negated translation transformed by it:
+    const double a = m[0], b = m[1], c = m[2];
+    const double d = m[4], e = m[5], f = m[6];
+    const double g = m[8], h = m[9], i = m[10];
+    const double A = e * i - f * h, B = f * g - d * i, C = d * h - e * g;
+    const double det = a * A + b * B + c * C;
+    if (det == 0.0) {
+      throw std::runtime_error("Can not invert a singular transform.");
+    }
+    const double s = 1.0 / det;
+    const double inv[9] = {
+      A * s, (c * h - b * i) * s, (b * f - c * e) * s,
+      B * s, (a * i - c * g) * s, (c * d - a * f) * s,
+      C * s, (b * g - a * h) * s, (a * e - b * d) * s
+    };
+    AffineTransform result;
+    for (auto r = 0u; r < 3; ++r) {
+      result.m[4 * r + 0] = inv[3 * r + 0];
+      result.m[4 * r + 1] = inv[3 * r + 1];
+      result.m[4 * r + 2] = inv[3 * r + 2];
+      result.m[4 * r + 3] = -(inv[3 * r + 0] * m[3] + inv[3 * r + 1] * m[7] + inv[3 * r + 2] * m[11]);
+    }
+    return result;
+  }
+#endif
+};
+
+// POD description of an instance for transfer to the device. The instanced
+// mesh is stored in the scene's mesh arrays and its BVH is a range of the
+// bottom level node array:
+struct InstanceInfo {
+  AffineTransform objectToWorld;
+  AffineTransform worldToObject;
+  std::uint32_t meshIndex; // Index of the instanced mesh in the scene's MeshInfo array
+  std::uint32_t firstNode; // Offset of the mesh's BVH in the bottom level node array
+  std::uint32_t numNodes;
+  std::uint32_t stackSize; // Traversal stack size required by the mesh's BVH
+};
+
+/// The type of the instanced mesh is a template parameter so that the
+/// bottom level traversal calls the mesh's triangle tests directly:
+template <class Node, class Mesh>
+struct Instance : Primitive {
+  Instance(const InstanceInfo& info, const Mesh* _mesh, Node* _nodes)
+    : worldToObject(info.worldToObject),
+      mesh(_mesh),
+      nodes(_nodes),
+      numNodes(info.numNodes),
+      stackSize(info.stackSize),
+      normalSign(1.f)
+  {
+    bounds = info.objectToWorld.bounds(nodes[0].toBounds());
+
+    // Geometric normals come from the triangle winding which a reflection reverses
+    // (interpolated normals transform correctly by the inverse transpose alone):
+    if (!_mesh->hasNormals() && info.objectToWorld.determinant() < 0.f) {
+      normalSign = -1.f;
+    }
+  }
+
+  /// Intersect the instanced mesh. The ray is moved into object space and
+  /// traverses the mesh's own BVH. The transformed direction is not normalised
+  /// so ray distances are the same in object and world space:
+  Intersection intersect(std::uint32_t, const embree_utils::Ray& ray) const override {
+    embree_utils::Ray objectRay;
+    objectRay.origin = worldToObject.point(ray.origin);
+    objectRay.direction = worldToObject.vector(ray.direction);
+    objectRay.tMin = ray.tMin;
+    objectRay.tMax = ray.tMax;
+
+    // The bottom level BVH only ever references the one mesh:
+    auto lookup = [this](std::uint16_t, std::uint32_t) { return mesh; };
+    CompactBvh<Node> bvh(ArrayRef<Node>(nodes, numNodes), stackSize);
+    auto result = bvh.intersect(objectRay, lookup);
+    if (result) {
+      result.prim = this;
+      result.normal = worldToObject.transposedVector(result.normal).normalized() * normalSign;
+    }
+    return result;
+  }
+
+  /// Any hit test of the instanced mesh (the instance is a single primitive):
+  bool occludes(std::uint32_t, std::uint32_t, const embree_utils::Ray& ray) const {
+    embree_utils::Ray objectRay;
+    objectRay.origin = worldToObject.point(ray.origin);
+    objectRay.direction = worldToObject.vector(ray.direction);
+    objectRay.tMin = ray.tMin;
+    objectRay.tMax = ray.tMax;
+    auto lookup = [this](std::uint16_t, std::uint32_t) { return mesh; };
+    CompactBvh<Node> bvh(ArrayRef<Node>(nodes, numNodes), stackSize);
+    return bvh.occluded(objectRay, lookup);
+  }
+
+  embree_utils::Vec3fa normal(const Intersection& intersection, const embree_utils::Vec3fa&) const override {
+    // The world space normal was computed at intersection time:
+    return intersection.normal;
+  }
+
+  embree_utils::Bounds3d getBoundingBox() const override { return bounds; }
+
+  AffineTransform worldToObject;
+  embree_utils::Bounds3d bounds;
+  const Mesh* mesh;
+  Node* nodes;
+  std::uint32_t numNodes;
+  std::uint32_t stackSize;
+  float normalSign;
+};
@@ -8,13 +8,51 @@
 #include "ipu_utils.hpp"
 #include "Scene.hpp"
 #include "Primitives.hpp"
+#include "SlimRay.hpp"
+#include "NifMlp.hpp"
+#include "RayCallbackPool.hpp"
+#include "RayStream.hpp"
+#include "xoshiro.hpp"
 #include <serialisation/Serialiser.hpp>
 
 #include <poplin/MatMul.hpp>
 
 #include <functional>
+#include <optional>
+#include <span>
 
 class NifModel;
+class RayBatchQueue;
+
+/// Upper limits on the scene dependent sizes in the graph. A graph built with a
+/// capacity can render any scene and ray stream that fit within it so the compiled
+/// executable can be reused. Zero means use the size of the scene being rendered:
+struct GraphCapacity {
+  std::size_t maxSceneBytes = 0; // Size of the serialised scene
+  std::size_t maxSpheres = 0;
+  std::size_t maxDiscs = 0;
+  std::size_t maxMeshes = 0;
+  std::size_t maxInstances = 0;
+  std::size_t maxRays = 0; // Size of the ray stream
+};
+
+/// Throughput measurements of the last frame rendered by an IpuScene. Ray
+/// casts and cycles are only counted by the path trace vertex (not in wavefront mode):
+struct TraceStats {
+  double traceSecs = 0.0; // Runs of the trace program
+  double sceneUploadSecs = 0.0; // Runs of the init program (which uploads the scene)
+  double hostToDramSecs = 0.0;
+  double hostToDramBytes = 0.0;
+  double dramToHostSecs = 0.0; // Bulk reads of the results (zero if they are received in a callback)
+  double dramToHostBytes = 0.0;
+  bool castsCounted = false;
+  std::uint64_t paths = 0; // Each path casts one primary (camera) ray
+  std::uint64_t secondaryCasts = 0; // Bounce and shadow rays
+  std::vector<std::uint64_t> tileCycles; // Cycles of each replica's compute tiles in the path trace vertices
+
+  double hostToDramGBps() const { return 1e-9 * hostToDramBytes / hostToDramSecs; }
+  double dramToHostGBps() const { return 1e-9 * dramToHostBytes / dramToHostSecs; }
+};
 
 // IPU ray-tracing graph program builder. The program is designed to
 // be comaptible with an Embree/CPU based ray/path tracer for easy
@@ -28,12 +66,17 @@ class IpuScene : public ipu_utils::BuilderInterface {
   };
 
 public:
-  using RayCallbackFn = std::function<void(std::size_t, const std::vector<embree_utils::TraceResult>&)>;
+  using RayCallbackFn = std::function<void(std::size_t, std::span<const embree_utils::TraceResult>)>;
+
+  /// Called after each frame of a render session with the index of the frame that
+  /// finished (its results are in the ray stream). Return true to render another
+  /// frame. The camera, HDRI rotation, seed, and scene can be updated before returning:
+  using FrameCallbackFn = std::function<bool(std::size_t)>;
 
   IpuScene(const std::vector<Sphere>& _spheres,
            const std::vector<Disc>& _discs,
            SceneRef& sceneRef,
-           std::vector<embree_utils::TraceResult>& results,
+           RayStream& results,
            std::size_t raysPerWorker,
            RayCallbackFn* fn = nullptr);
 
@@ -41,39 +84,123 @@ public:
 
   std::size_t getRayStreamSize() const;
 
-  std::vector<std::vector<embree_utils::TraceResult>>& getRayBatches() { return rayBatches; }
+  /// Rays traced by each worker per batch (chosen when the graph is built if zero was passed to the constructor):
+  std::size_t getRaysPerWorker() const { return maxRaysPerWorker; }
+
+  /// Number of ray batches streamed to the device (including dummy batches added to feed every replica):
+  std::size_t getNumRayBatches() const { return numRayBatches; }
+
+  /// Index in the ray stream of the batch that the device processes at a (global)
+  /// batch index in the current run of the trace program (numStreamBatches for padding):
+  std::size_t streamBatchIndex(std::size_t deviceIndex) const {
+    return deviceIndex < numRunBatches ? firstRunBatch + deviceIndex : numStreamBatches;
+  }
+
+  /// The rays of the ray stream that belong to a batch (empty for dummy batches):
+  std::span<embree_utils::TraceResult> getRayBatch(std::size_t index);
+
+  /// Copy the results of a batch received from the device into the ray stream
+  /// (dropping any padding). Returns the updated part of the ray stream:
+  std::span<embree_utils::TraceResult> receiveRayBatch(std::size_t index, const void* src);
 
   bool loadNifModel(const std::string& assetPath);
-  NifResult buildNifHdri(poplar::Graph& g, std::unique_ptr<NifModel>& nif, poplar::Tensor uvs);
+  /// Build the NIF environment lookup for the UVs. The UVs of every tile must be
+  /// compacted so that only the first numEscapedRays (per tile) are valid:
+  NifResult buildNifHdri(poplar::Graph& g, std::unique_ptr<NifModel>& nif, poplar::Tensor uvs, poplar::Tensor numEscapedRays);
+  /// Build a program that bakes the NIF into a texture and copies it into every tile's env map:
+  NifResult buildNifBake(poplar::Graph& g, std::unique_ptr<NifModel>& nif, poplar::Tensor envMaps);
+  /// Build a program that uploads the NIF's weights and copies them to every tile (for on-tile evaluation):
+  NifResult buildNifOnTile(poplar::Graph& g, std::unique_ptr<NifModel>& nif, poplar::Tensor tileWeights);
   void setHdriRotation(float degrees);
   void setAvailableMemoryProportion(float proportion);
   void setMaxNifBatchSize(std::size_t raysPerBatch);
+  void setAutoRaysMemoryProportion(float proportion);
+  void setNifHalfPrecision(bool enable);
+  void setNifOnTile(bool enable);
+  void setEnvLightSampling(bool enable);
+  void setBakedHdriWidth(std::uint32_t width);
+  void autotuneNif(const std::string& planFile);
+  void setSceneShards(std::vector<SceneShardData>& shards);
+  void setSlimRayStream(bool enable);
+  void setDeviceRayGeneration(bool enable);
+  void setIoPipelineDepth(std::uint32_t depth);
+  /// Process the batches received by the ray callback on this many host threads
+  /// so that slow callbacks do not stall the device to host stream (0 processes
+  /// each batch on Poplar's stream callback thread):
+  void setRayCallbackThreads(std::size_t threads);
+  void setWavefront(bool enable);
+  void setOctantSort(bool enable);
+  void setCoherentRayOrder(bool enable);
+  void setAdaptiveSampling(float threshold, std::uint32_t minSamples);
+  void setLowDiscrepancySampling(bool enable);
+  void setDenoiseAovs(bool enable);
+  void setTraversalStats(bool enable);
+  void setGraphCapacity(const GraphCapacity& limits);
+  /// Share the frame's ray batches with other renderers: the IPU takes batches
+  /// from the front of the queue (which is started at the start of each frame):
+  void setRayBatchQueue(RayBatchQueue* queue);
+
+  // Render session: these can be called between frames (from the frame callback):
+  void setFrameCallback(FrameCallbackFn* fn);
+  void setCameraTransform(const AffineTransform& cameraToWorld);
+  void setRngSeed(std::uint64_t seed);
+  /// Render a different window of the image (the ray stream must be resized to match it):
+  void setRenderWindow(const CropWindow& window);
+  void updateScene(const SceneRef& scene);
+
+  /// Hash of the target, capacity, and options that the compiled graph depends on.
+  /// Everything else (including the scene) is streamed so an executable compiled for
+  /// a key can be loaded and run for any scene that fits its capacity:
+  std::uint64_t getGraphKey();
+
+  /// Bytes per ray in the DRAM and host ray streams:
+  std::size_t getRayRecordSize() const;
+
+  /// Stream an already serialised scene (e.g. one memory mapped from a SceneCache)
+  /// instead of serialising the SceneRef. The bytes must remain valid until execution ends:
+  void setSerialisedScene(const std::uint8_t* bytes, std::size_t size);
 
   void build(poplar::Graph& graph, const poplar::Target& target) override;
   void execute(poplar::Engine& engine, const poplar::Device& device) override;
 
-  double getTraceTimeSecs() const { return traceTimeSecs; }
+  /// Device time of the last frame (including the scene upload if there was one):
+  double getTraceTimeSecs() const { return stats.traceSecs + stats.sceneUploadSecs; }
+  const TraceStats& getTraceStats() const { return stats; }
   RayCallbackFn* getRayCallback() { return rayFunc; }
+  RayCallbackPool* getRayCallbackPool() { return callbackPool.get(); }
 
 private:
   Serialiser<16> serialiser;
   const std::vector<Sphere>& spheres;
   const std::vector<Disc>& discs;
   SceneRef data;
-  std::vector<embree_utils::TraceResult>& rayStream;
+  RayStream& rayStream;
 
   std::vector<std::uint64_t> seedValues;
   ipu_utils::StreamableTensor seedTensor;
   ipu_utils::StreamableTensor loopLimit;
   ipu_utils::StreamableTensor samplesPerPixel;
   ipu_utils::StreamableTensor azimuthRotation;
+  ipu_utils::StreamableTensor maxPathLength;
+  ipu_utils::StreamableTensor rayWindow;
+  ipu_utils::StreamableTensor cameraVar;
 
-  // Variables to hold the primitive data:
-  ipu_utils::StreamableTensor spheresVar;
-  ipu_utils::StreamableTensor discsVar;
-
-  // SceneRef data in serialised form:
+  // Primitives and the SceneRef data in serialised form are uploaded as a single
+  // byte stream (see getSceneLayout()):
   ipu_utils::StreamableTensor serialScene;
+  const std::uint8_t* serialisedScene;
+  std::size_t serialisedSceneSize;
+
+  // If the scene is sharded each shard is serialised separately (and padded
+  // to the same size) instead of uploading the full scene to every tile:
+  std::vector<std::uint8_t> serialShards;
+  std::size_t shardBytesPerTile;
+  std::uint32_t numShards;
+
+  // Streams for data that is smaller than the graph's capacity are padded:
+  GraphCapacity capacity;
+  std::optional<SceneFeatures> graphFeatures; // Features the path trace vertex is specialised for
+  std::vector<std::uint8_t> sceneUpload; // Packed by packSceneUpload()
 
   poplar::RemoteBuffer rayBuffer;
 
@@ -84,26 +211,87 @@ private:
   std::unique_ptr<NifModel> nif;
   poplin::matmul::PlanningCache cache;
 
-  std::vector<std::vector<embree_utils::TraceResult>> rayBatches;
+  // Ray batches reference the ray stream directly except for a partial last
+  // batch which is staged in a padded copy:
+  std::vector<embree_utils::TraceResult> paddedBatch;
+  std::vector<SlimRay> slimStream; // Used instead of the ray stream for slim batches
   RayCallbackFn* rayFunc;
+  FrameCallbackFn* frameFunc;
+  std::size_t rayCallbackThreads;
+  std::unique_ptr<RayCallbackPool> callbackPool; // Created on the first run if there are callback threads
+  bool sceneChanged; // The scene must be uploaded before the next frame is traced
 
-  // This is chosen so that the compute tiles can all
-  // be serviced by 32 I/O tiles:
-  std::uint32_t dramRayBatches;
-  double traceTimeSecs;
+  std::size_t dramRayBatches; // Capacity of the DRAM ray buffer (batches per replica)
+  TraceStats stats;
+  // Counters of each path trace worker: paths, secondary rays, and cycles (low and high words):
+  static constexpr std::size_t WorkerCounterCount = 4;
+  ipu_utils::StreamableTensor workerCounters;
+  std::vector<std::uint32_t> workerCounterData;
   std::size_t numComputeTiles;
   std::size_t maxRaysPerWorker;
+  bool autoRaysPerWorker; // Rays per worker are chosen from the tile memory in resolveRaysPerWorker()
+  float autoRaysMemoryProportion; // Proportion of tile memory that the automatic choice may fill
   std::size_t totalRayBufferSize;
+  std::size_t raysPerBatch;
+  std::size_t numStreamBatches; // Batches that contain rays from the ray stream
+  std::size_t numRayBatches;
+  std::size_t firstRunBatch; // First stream batch traced by the current run of the trace program
+  std::size_t numRunBatches; // Stream batches traced by the current run
+  std::uint32_t numBatchesPerReplica; // Loop limit streamed to the trace program
+  RayBatchQueue* batchQueue; // If set the IPU only renders the batches it takes from the queue
+  bool slimRayStream;
+  std::uint32_t ioPipelineDepth; // Requested depth
+  std::uint32_t pipelineDepth; // Depth of the pipeline that was built
+  bool deviceRayGeneration; // Pixels are derived from the batch index on device (no ray stream is uploaded)
+  bool wavefront; // Path trace one bounce per superstep with compaction of live paths
+  bool octantSort; // Wavefront compaction groups the live rays by direction octant
+  bool coherentRayOrder; // The ray stream is sorted in screen space (Morton) order before it is batched
+  float adaptiveThreshold;
+  std::uint32_t adaptiveMinSamples;
+  bool lowDiscrepancy; // Paths are sampled with scrambled Sobol points instead of the hardware RNG
+  bool denoiseAovs; // Path traced results return first hit AOVs in place of their hit records
+  bool traversalStats; // Results return each pixel's TraversalStats in place of their hit records
   float hdriRotationDegrees;
   float nifMemoryProportion;
   std::size_t nifMaxRaysPerBatch;
+  bool nifHalfPrecision; // Run the NIF (and exchange its inputs/outputs) at fp16
+  std::uint32_t bakedHdriWidth; // Width of the texture the NIF is baked into (0 evaluates the NIF per ray)
+  ipu_utils::StreamableTensor bakeUVs;
+  std::vector<float> bakeUVData;
+  bool nifOnTile; // Each tile evaluates the NIF for its own rays (with its own copy of the weights)
+  NifMlpShape nifShape;
+  ipu_utils::StreamableTensor nifTileWeights;
+  std::vector<std::uint8_t> nifTileWeightData;
+  bool envLightSampling; // Next event estimation against the baked environment light
+
+  const std::uint8_t* getSerialisedScene();
+  const SceneFeatures& getGraphFeatures();
+  poplar::Type nifType() const;
+  bool nifPerRay() const { return nif && bakedHdriWidth == 0; }
+  bool countCasts() const { return data.pathTrace && !wavefront; }
 
   poplar::program::Sequence fpSetupProg(poplar::Graph& graph) const;
 
-  std::size_t calcNumBatches(const poplar::Target& target, std::size_t numComputeTiles) const;
+  GraphCapacity resolveCapacity();
+
+  // Byte offsets of the parts of each tile's scene upload (the spheres are first):
+  struct SceneLayout {
+    std::size_t discsOffset;
+    std::size_t sceneOffset;
+    std::size_t bytesPerTile;
+  };
+  SceneLayout getSceneLayout(const GraphCapacity& cap) const;
+  void packSceneUpload(const GraphCapacity& cap);
+
+  void resolveRaysPerWorker(const poplar::Target& target, std::size_t computeTiles, std::size_t ioTiles);
+  void planRayBatches(const poplar::Target& target);
 
-  std::vector<std::vector<embree_utils::TraceResult>>
-  createRayBatches(const poplar::Device& device, std::size_t numComputeTiles) const;
+  void initRayBatches(const poplar::Device& device, std::size_t numComputeTiles);
+  void renderFrame(poplar::Engine& engine, const poplar::Device& device);
+  void traceBatches(poplar::Engine& engine, std::size_t numDeviceBatches, xoshiro::State& seedState, bool& uploadScene);
+  void* getRayBatchData(std::size_t index);
+  void sortRayStreamByScreenOrder();
+  std::uint32_t slimRayIndex(std::uint32_t i) const;
 
   void createComputeVars(poplar::Graph& ioGraph,
                          poplar::Graph& computeGraph,
@@ -0,0 +1,90 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Area lights for next event estimation. Every emissive triangle, sphere, and
+// disc in the scene is a light. Lights are chosen in proportion to their power
+// (emitted luminance times area) and points are sampled uniformly on the chosen
+// light's surface. Consequently the pdf (with respect to area) of a point on any
+// light is its emitted luminance divided by the total power of all the lights.
+
+#pragma once
+
+#include <embree_utils/geometry.hpp>
+#include <geometric_sampling.hpp>
+#include <Arrays.hpp>
+
+#include <cmath>
+#include <cstdint>
+
+struct AreaLight {
+  enum class Shape : std::uint32_t {
+    Triangle = 0,
+    Sphere,
+    Disc
+  };
+
+  embree_utils::Vec3fa p; // Triangle's first vertex or the centre of a sphere/disc
+  embree_utils::Vec3fa u; // Triangle's first edge or a disc tangent (scaled by the disc's radius)
+  embree_utils::Vec3fa v; // Triangle's second edge or the other disc tangent (scaled by the disc's radius)
+  float radius; // Sphere radius
+  float cdf; // Total power of this light and all lights before it
+  std::uint32_t geomID; // The light's emission is that of this geometry's material
+  Shape shape;
+
+  float area() const {
+    switch (shape) {
+      case Shape::Triangle:
+        return .5f * std::sqrt(u.cross(v).squaredNorm());
+      case Shape::Sphere:
+        return 2.f * embree_utils::TwoPi * radius * radius;
+      case Shape::Disc:
+      default:
+        return embree_utils::Pi * u.squaredNorm();
+    }
+  }
+
+  /// Uniformly sample a point (and the surface normal there) on the light:
+  void sample(float u1, float u2, embree_utils::Vec3fa& point, embree_utils::Vec3fa& normal) const {
+    if (shape == Shape::Triangle) {
+      const float s = std::sqrt(u1);
+      point = p + u * (s * (1.f - u2)) + v * (s * u2);
+      normal = u.cross(v).normalized();
+    } else if (shape == Shape::Sphere) {
+      const float z = 1.f - 2.f * u1;
+      const float r = std::sqrt(std::max(0.f, 1.f - z * z));
+      float s, c;
+      sincos(embree_utils::TwoPi * u2, s, c);
+      normal = embree_utils::Vec3fa(r * c, r * s, z);
+      point = p + normal * radius;
+    } else {
+      const auto [x, y] = sampleDiscConcentric(u1, u2);
+      point = p + u * x + v * y;
+      normal = u.cross(v).normalized();
+    }
+  }
+};
+
+/// Luminance used to weight the power of lights:
+inline float lightLuminance(const embree_utils::Vec3fa& rgb) {
+  return .2126f * rgb.x + .7152f * rgb.y + .0722f * rgb.z;
+}
+
+/// Choose a light in proportion to power (lights must not be empty):
+inline const AreaLight& chooseLight(const ArrayRef<AreaLight>& lights, float u) {
+  const float target = u * lights[lights.size() - 1].cdf;
+  unsigned lo = 0;
+  unsigned hi = lights.size() - 1;
+  while (lo < hi) {
+    const auto mid = (lo + hi) / 2;
+    if (lights[mid].cdf <= target) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lights[lo];
+}
+
+/// Pdf (with respect to area) of sampling a point on a light with the given emission:
+inline float lightAreaPdf(const ArrayRef<AreaLight>& lights, const embree_utils::Vec3fa& emission) {
+  return lightLuminance(emission) / lights[lights.size() - 1].cdf;
+}
@@ -4,25 +4,31 @@
 
 #include "embree_utils/geometry.hpp"
 
+#include <cstdint>
+
 // A very simple material description.
 struct Material {
   enum class Type {
     Diffuse, Specular, Refractive
   };
 
+  static constexpr std::uint32_t NoTexture = 0xffffffff;
+
   Material()
   :
     albedo(0.f, 0.f, 0.f),
     ior(1.52f),
     emission(0.f, 0.f, 0.f),
     type(Material::Type::Diffuse),
-    emissive(false) {}
+    emissive(false),
+    albedoTexture(NoTexture) {}
 
   Material(const embree_utils::Vec3fa& a,
            const embree_utils::Vec3fa& e, Material::Type t)
   :
     albedo(a), ior(1.52f), emission(e), type(t),
-    emissive(emission.isNonZero())
+    emissive(emission.isNonZero()),
+    albedoTexture(NoTexture)
   {}
 
   embree_utils::Vec3fa albedo;
@@ -30,4 +36,5 @@ struct Material {
   embree_utils::Vec3fa emission;
   Type type;
   bool emissive;
+  std::uint32_t albedoTexture; // Index of a texture in the scene that scales the albedo (or NoTexture)
 };
@@ -7,6 +7,7 @@
 #include "CompactBVH2Node.hpp"
 #include "Primitives.hpp"
 #include "Arrays.hpp"
+#include "Texture.hpp"
 
 #ifndef __IPU__
 #include <vector>
@@ -25,6 +26,70 @@ struct TriangleIntersection {
   float b0, b1, b2; // barycentric coords of hit-point
 };
 
+// Optional precomputed per-triangle data that trades memory (48 bytes per triangle on
+// top of the index and vertex buffers) for a cheaper intersection test. The rows are
+// an affine transform into a space where the triangle is the unit triangle
+// (0,0,0), (1,0,0), (0,1,0) (a Woop style test). The third row is the geometric normal
+// divided by its squared length. Unlike the default test this is not watertight:
+struct PrecomputedTriangle {
+  float m[12];
+};
+
+#ifndef __IPU__
+/// Compute the unit triangle transform for a triangle. Degenerate triangles get a
+/// zero transform which is never intersected.
+PrecomputedTriangle precomputeTriangle(const embree_utils::Vec3fa& p0,
+                                       const embree_utils::Vec3fa& p1,
+                                       const embree_utils::Vec3fa& p2);
+#endif
+
+// Compact vertex storage: positions are quantised to 16 bits per component against
+// the bounds of their mesh and unit normals are octahedral encoded as two 16-bit
+// values. A vertex with a normal takes 10 bytes instead of 32:
+struct __attribute__((packed, aligned(alignof(std::uint16_t))))
+QuantisedVertex {
+  std::uint16_t x, y, z;
+};
+
+struct OctahedralNormal {
+  std::int16_t u, v;
+};
+
+struct VertexQuantisation {
+  float origin[3];
+  float scale[3];
+
+  embree_utils::Vec3fa decode(const QuantisedVertex& q) const {
+    return embree_utils::Vec3fa(origin[0] + q.x * scale[0],
+                                origin[1] + q.y * scale[1],
+                                origin[2] + q.z * scale[2]);
+  }
+
+#ifndef __IPU__
+  /// Quantisation that covers the bounds using the full 16-bit range:
+  static VertexQuantisation fromBounds(const embree_utils::Bounds3d& bounds);
+  QuantisedVertex encode(const embree_utils::Vec3fa& v) const;
+#endif
+};
+
+inline embree_utils::Vec3fa decodeNormal(const OctahedralNormal& e) {
+  float x = e.u * (1.f / 32767.f);
+  float y = e.v * (1.f / 32767.f);
+  const float z = 1.f - std::abs(x) - std::abs(y);
+  if (z < 0.f) {
+    // Lower hemisphere is folded over the diagonals:
+    const float fx = (1.f - std::abs(y)) * (x >= 0.f ? 1.f : -1.f);
+    const float fy = (1.f - std::abs(x)) * (y >= 0.f ? 1.f : -1.f);
+    x = fx;
+    y = fy;
+  }
+  return embree_utils::Vec3fa(x, y, z).normalized();
+}
+
+#ifndef __IPU__
+OctahedralNormal encodeNormal(const embree_utils::Vec3fa& n);
+#endif
+
 // This triangle mesh class is templated on the storage type so that we can use dynamic
 // storage type (std::vector) on CPU and then easily convert to a static storage
 // type (ConstArrayRef) in IPU kernels whilst re-using the same implementation. 
@@ -33,16 +98,26 @@ struct TriangleMesh : Primitive {
 
   TriangleMesh() {}
 
-  /// Contruct from reference arrays and set bounds.
+  /// Contruct from reference arrays and set bounds. If packed vertices are
+  /// given they replace the full precision vertices and normals (which should
+  /// then be empty):
   TriangleMesh(
       const embree_utils::Bounds3d& _bounds,
       Storage<Triangle>&& externTriangles,
       Storage<embree_utils::Vec3fa>&& externVertices,
-      Storage<embree_utils::Vec3fa>&& externNormals)
+      Storage<embree_utils::Vec3fa>&& externNormals,
+      Storage<PrecomputedTriangle>&& externPrecomputed = Storage<PrecomputedTriangle>(),
+      const VertexQuantisation& _quantisation = VertexQuantisation(),
+      Storage<QuantisedVertex>&& externPackedVertices = Storage<QuantisedVertex>(),
+      Storage<OctahedralNormal>&& externPackedNormals = Storage<OctahedralNormal>())
     : bounds(_bounds),
       triangles(externTriangles),
       vertices(externVertices),
-      normals(externNormals)
+      normals(externNormals),
+      precomputed(externPrecomputed),
+      packedVertices(externPackedVertices),
+      packedNormals(externPackedNormals),
+      quantisation(_quantisation)
   {}
 
   embree_utils::Vec3fa normal(const Intersection& intersection, const embree_utils::Vec3fa&) const override {
@@ -50,11 +125,27 @@ struct TriangleMesh : Primitive {
     return intersection.normal;
   }
 
+  std::uint32_t numVertices() const {
+    return packedVertices.size() ? packedVertices.size() : vertices.size();
+  }
+
+  bool hasNormals() const {
+    return (packedVertices.size() ? packedNormals.size() : normals.size()) == numVertices();
+  }
+
+  embree_utils::Vec3fa getVertex(std::uint32_t i) const {
+    return packedVertices.size() ? quantisation.decode(packedVertices[i]) : vertices[i];
+  }
+
+  embree_utils::Vec3fa getNormal(std::uint32_t i) const {
+    return packedNormals.size() ? decodeNormal(packedNormals[i]) : normals[i];
+  }
+
   embree_utils::Bounds3d getTriangleBoundingBox(std::uint32_t primID) const {
     const auto& tri = triangles[primID];
-    const auto& p0 = vertices[tri.v0];
-    const auto& p1 = vertices[tri.v1];
-    const auto& p2 = vertices[tri.v2];
+    const auto p0 = getVertex(tri.v0);
+    const auto p1 = getVertex(tri.v1);
+    const auto p2 = getVertex(tri.v2);
     embree_utils::Bounds3d bounds;
     bounds += p0;
     bounds += p1;
@@ -68,7 +159,8 @@ struct TriangleMesh : Primitive {
     Intersection result(std::numeric_limits<float>::infinity(), nullptr);
     TriangleIntersection closestTri;
     for (auto primID = 0u; primID < triangles.size(); ++primID) {
-      const auto triIntersect = intersectTriangle(primID, transform, result.t);
+      const auto triIntersect = precomputed.size() ?
+        intersectPrecomputed(primID, ray, result.t) : intersectTriangle(primID, transform, result.t);
       if (triIntersect.t > 0.f && triIntersect.t < result.t) {
         result.primID = primID;
         result.t = triIntersect.t;
@@ -86,10 +178,11 @@ struct TriangleMesh : Primitive {
 
   /// Intersection test with the triangle specified by primID only:
   Intersection intersect(std::uint32_t primID, const embree_utils::Ray& ray) const override {
-    const RayShearParams transform(ray);
     Intersection result(std::numeric_limits<float>::infinity(), nullptr);
 
-    const auto triIntersect = intersectTriangle(primID, transform, result.t);
+    // The precomputed test does not need the ray's shear transform:
+    const auto triIntersect = precomputed.size() ?
+      intersectPrecomputed(primID, ray, result.t) : intersectTriangle(primID, RayShearParams(ray), result.t);
     if (triIntersect.t > 0.f && triIntersect.t < result.t) {
       result.primID = primID;
       result.t = triIntersect.t;
@@ -100,20 +193,44 @@ struct TriangleMesh : Primitive {
     return result;
   }
 
+  /// Any hit test of the triangles [first, end). Hits beyond the ray's tMax are rejected
+  /// inside the triangle test and no normals are computed:
+  bool occludes(std::uint32_t first, std::uint32_t end, const embree_utils::Ray& ray) const {
+    if (precomputed.size()) {
+      for (auto primID = first; primID < end; ++primID) {
+        const auto t = intersectPrecomputed(primID, ray, ray.tMax).t;
+        if (t > ray.tMin && t < ray.tMax) { return true; }
+      }
+      return false;
+    }
+    const RayShearParams transform(ray);
+    for (auto primID = first; primID < end; ++primID) {
+      const auto t = intersectTriangle(primID, transform, ray.tMax).t;
+      if (t > ray.tMin && t < ray.tMax) { return true; }
+    }
+    return false;
+  }
+
   // Compute normal by interpolation if the mesh has normals,
   // otherwise calculate the triangle's normal from its vertices
   // Intersection must contain a valid primID (check before calling):
   embree_utils::Vec3fa computeNormal(const TriangleIntersection& triIntersect, const Intersection& result) const {
+    if (!hasNormals() && precomputed.size()) {
+      // The transform's last row is parallel to the geometric normal:
+      const auto& m = precomputed[result.primID].m;
+      return embree_utils::Vec3fa(m[8], m[9], m[10]).normalized();
+    }
+
     const auto& tri = triangles[result.primID];
-    if (normals.size() != vertices.size()) {
-      const auto& p0 = vertices[tri.v0];
-      const auto& p1 = vertices[tri.v1];
-      const auto& p2 = vertices[tri.v2];
+    if (!hasNormals()) {
+      const auto p0 = getVertex(tri.v0);
+      const auto p1 = getVertex(tri.v1);
+      const auto p2 = getVertex(tri.v2);
       return (p1 - p0).cross(p2 - p0).normalized();
     } else {
-      const auto& n0 = normals[tri.v0];
-      const auto& n1 = normals[tri.v1];
-      const auto& n2 = normals[tri.v2];
+      const auto n0 = getNormal(tri.v0);
+      const auto n1 = getNormal(tri.v1);
+      const auto n2 = getNormal(tri.v2);
       return ((n0 * triIntersect.b0) +
               (n1 * triIntersect.b1) +
               (n2 * triIntersect.b2)).normalized();
@@ -126,21 +243,44 @@ struct TriangleMesh : Primitive {
 
   void updateBoundingBox() {
     bounds = embree_utils::Bounds3d();
-    for (const auto& v : vertices) {
-      bounds += v;
+    for (auto v = 0u; v < numVertices(); ++v) {
+      bounds += getVertex(v);
     }
   }
 
   TriangleIntersection intersectTriangle(std::uint32_t index, const RayShearParams& transform, const float tFar) const;
+  TriangleIntersection intersectPrecomputed(std::uint32_t index, const embree_utils::Ray& ray, const float tFar) const;
 
   embree_utils::Bounds3d bounds;
   Storage<Triangle> triangles;
   Storage<embree_utils::Vec3fa> vertices;
   Storage<embree_utils::Vec3fa> normals;
+  Storage<PrecomputedTriangle> precomputed; // Empty unless the precomputed leaf mode is enabled
+  Storage<QuantisedVertex> packedVertices; // If not empty these replace the vertices and normals
+  Storage<OctahedralNormal> packedNormals;
+  VertexQuantisation quantisation;
 };
 
 #ifndef __IPU__
 using HostTriangleMesh = TriangleMesh<std::vector>;
+
+// Triangle with full 32-bit vertex indices (as read from a file before conversion):
+struct WideTriangle {
+  std::uint32_t v0, v1, v2;
+};
+
+/// Split a mesh into meshes that each reference at most maxVertices vertices so that
+/// their triangles can be indexed with the Triangle index type. Triangles are divided
+/// by recursive median splits of their centroids along the widest axis so that each
+/// part stays spatially compact. A mesh that already fits is returned as a single part
+/// (without any vertices that no triangle references). Normals are optional (pass an empty vector if there are none).
+/// Texture coordinates are also optional: if given each part's are appended to partUVs.
+std::vector<HostTriangleMesh> splitMesh(const std::vector<WideTriangle>& triangles,
+                                        const std::vector<embree_utils::Vec3fa>& vertices,
+                                        const std::vector<embree_utils::Vec3fa>& normals,
+                                        std::size_t maxVertices = std::size_t(Triangle::MaxIndex) + 1,
+                                        const std::vector<TexCoord>& uvs = {},
+                                        std::vector<std::vector<TexCoord>>* partUVs = nullptr);
 #endif
 
 using CompiledTriangleMesh = TriangleMesh<ArrayRef>;
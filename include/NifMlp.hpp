@@ -0,0 +1,125 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Evaluation of a NIF (neural image field) MLP for a single UV coord. This
+// allows each tile to look up the NIF environment light for its own rays
+// (without any exchange) when the network is small enough for its weights
+// to be stored on every tile. The network is the same as that built by
+// NifModel: Fourier feature encoding, dense layers with ReLU activations
+// (the last layer is linear), an optional skip connection that concatenates
+// the features with the activations, and output decoding.
+
+#pragma once
+
+#include <embree_utils/geometry.hpp>
+#include <math/sincos.hpp>
+
+#include <cmath>
+#include <cstdint>
+
+/// Layer dimensions. The first layer's input is the Fourier features (4
+/// values per embedding dimension) and the input of the concat layer (if there
+/// is one) is the previous layer's activations followed by the features:
+struct NifMlpShape {
+  std::uint32_t embeddingDimension;
+  std::uint32_t hiddenSize;
+  std::uint32_t numLayers;
+  std::uint32_t concatLayer; // Zero if there is no skip connection
+
+  std::uint32_t numFeatures() const { return 4 * embeddingDimension; }
+
+  std::uint32_t layerInputs(std::uint32_t l) const {
+    if (l == 0) { return numFeatures(); }
+    return l == concatLayer ? hiddenSize + numFeatures() : hiddenSize;
+  }
+
+  std::uint32_t layerOutputs(std::uint32_t l) const {
+    return l + 1 == numLayers ? 3 : hiddenSize;
+  }
+
+  /// Number of weights (kernel then bias for every layer):
+  std::uint32_t numWeights() const {
+    std::uint32_t count = 0;
+    for (auto l = 0u; l < numLayers; ++l) {
+      count += (layerInputs(l) + 1) * layerOutputs(l);
+    }
+    return count;
+  }
+
+  /// Number of floats of scratch space needed for one evaluation:
+  std::uint32_t scratchSize() const { return 2 * hiddenSize + numFeatures(); }
+};
+
+/// Parameters that undo the output encoding applied during training:
+struct NifDecodeParams {
+  float max;
+  float mean[3]; // BGR
+  bool logToneMap;
+};
+
+/// Evaluate the NIF at a UV coord and return the decoded RGB radiance. T is
+/// the weight type (weights are converted to float as they are used):
+template <typename T>
+embree_utils::Vec3fa evaluateNif(const NifMlpShape& shape, const T* weights, const NifDecodeParams& decode,
+                                 float u, float v, float* scratch) {
+  const auto hidden = shape.hiddenSize;
+  const auto numFeatures = shape.numFeatures();
+  float* a = scratch;
+  float* features = scratch + hidden; // Directly after a so that concatenation is free
+  float* b = features + numFeatures;
+
+  // Fourier features of the normalised coords:
+  const float un = 2.f * (u - 1.f);
+  const float vn = 2.f * (v - 1.f);
+  const auto e = shape.embeddingDimension;
+  float coeff = 1.f;
+  for (auto i = 0u; i < e; ++i) {
+    sincos(un * coeff, features[i], features[2 * e + i]);
+    sincos(vn * coeff, features[e + i], features[3 * e + i]);
+    coeff *= 2.f;
+  }
+
+  const float* in = features;
+  float* out = a;
+  for (auto l = 0u; l < shape.numLayers; ++l) {
+    if (l == shape.concatLayer && l != 0) {
+      if (in != a) {
+        for (auto i = 0u; i < hidden; ++i) { a[i] = in[i]; }
+      }
+      in = a;
+      out = b;
+    }
+
+    const auto numIn = shape.layerInputs(l);
+    const auto numOut = shape.layerOutputs(l);
+    const T* kernel = weights;
+    const T* bias = weights + numIn * numOut;
+    for (auto j = 0u; j < numOut; ++j) {
+      out[j] = float(bias[j]);
+    }
+    for (auto i = 0u; i < numIn; ++i) {
+      const float x = in[i];
+      const T* row = kernel + i * numOut;
+      for (auto j = 0u; j < numOut; ++j) {
+        out[j] += x * float(row[j]);
+      }
+    }
+    if (l + 1 < shape.numLayers) {
+      for (auto j = 0u; j < numOut; ++j) {
+        out[j] = out[j] > 0.f ? out[j] : 0.f;
+      }
+    }
+
+    weights = bias + numOut;
+    in = out;
+    out = out == a ? b : a;
+  }
+
+  float bgr[3];
+  for (auto c = 0u; c < 3; ++c) {
+    bgr[c] = in[c] * decode.max + decode.mean[c];
+    if (decode.logToneMap) {
+      bgr[c] = std::exp(bgr[c]);
+    }
+  }
+  return embree_utils::Vec3fa(bgr[2], bgr[1], bgr[0]);
+}
@@ -6,6 +6,10 @@
 
 #include "Intersection.hpp"
 
+#include <limits>
+#include <type_traits>
+#include <utility>
+
 struct Primitive {
   virtual Intersection intersect(std::uint32_t primID, const embree_utils::Ray& ray) const {
     return Intersection::Failed();
@@ -18,10 +22,74 @@ struct Primitive {
   virtual embree_utils::Bounds3d getBoundingBox() const { return embree_utils::Bounds3d(); }
 };
 
-struct __attribute__((packed, aligned(alignof(std::uint16_t))))
+/// Intersect a primitive. If the concrete type of the primitive is known the
+/// call is qualified so it does not go through the vtable (the vtable pointers
+/// of primitives that were copied from the host are not valid on the IPU):
+template <class Prim>
+Intersection intersectPrimitive(const Prim& prim, std::uint32_t primID, const embree_utils::Ray& ray) {
+  if constexpr (std::is_same_v<Prim, Primitive>) {
+    return prim.intersect(primID, ray);
+  } else {
+    return prim.Prim::intersect(primID, ray);
+  }
+}
+
+/// Normal of a primitive at an intersection (dispatched in the same way as intersectPrimitive()):
+template <class Prim>
+embree_utils::Vec3fa primitiveNormal(const Prim& prim, const Intersection& result, const embree_utils::Vec3fa& hitPoint) {
+  if constexpr (std::is_same_v<Prim, Primitive>) {
+    return prim.normal(result, hitPoint);
+  } else {
+    return prim.Prim::normal(result, hitPoint);
+  }
+}
+
+/// Primitives can provide occludes(firstPrimID, endPrimID, ray) for a cheaper any hit
+/// test of a run of their primitives (e.g. one that skips the normal and barycentrics):
+template <class Prim, class = void>
+struct HasOccludes : std::false_type {};
+
+template <class Prim>
+struct HasOccludes<Prim, std::void_t<decltype(std::declval<const Prim&>().occludes(
+  std::uint32_t(), std::uint32_t(), std::declval<const embree_utils::Ray&>()))>> : std::true_type {};
+
+/// Return true if any of the primitives [first, end) intersects the ray between its
+/// tMin and tMax (dispatched in the same way as intersectPrimitive()):
+template <class Prim>
+bool occludesPrimitives(const Prim& prim, std::uint32_t first, std::uint32_t end, const embree_utils::Ray& ray) {
+  if constexpr (HasOccludes<Prim>::value) {
+    return prim.occludes(first, end, ray);
+  } else {
+    for (auto p = first; p < end; ++p) {
+      const auto intersection = intersectPrimitive(prim, p, ray);
+      if (intersection.t > ray.tMin && intersection.t < ray.tMax) {
+        return true;
+      }
+    }
+    return false;
+  }
+}
+
+// Triangles index the vertices of their mesh with 16 bits by default which keeps the
+// index buffers small on tile. Meshes with more vertices than this allows are split
+// on import. Build with WIDE_TRIANGLE_INDICES=1 to use 32-bit indices instead:
+#ifndef WIDE_TRIANGLE_INDICES
+#define WIDE_TRIANGLE_INDICES 0
+#endif
+
+#if WIDE_TRIANGLE_INDICES == 1
+using TriangleIndex = std::uint32_t;
+#else
+using TriangleIndex = std::uint16_t;
+#endif
+
+struct __attribute__((packed, aligned(alignof(TriangleIndex))))
 Triangle {
+  /// Largest vertex index a triangle can hold:
+  static constexpr std::uint32_t MaxIndex = std::numeric_limits<TriangleIndex>::max();
+
   Triangle(std::uint32_t a, std::uint32_t b, std::uint32_t c) : v0(a), v1(b), v2(c) {}
-  std::uint16_t v0, v1, v2;
+  TriangleIndex v0, v1, v2;
 };
 
 struct RayShearParams {
@@ -0,0 +1,48 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Accumulates ray tracing results into an HDR image as batches of results are
+// received from the IPU. The image is complete as soon as the last batch has
+// arrived (no passes over the ray stream are needed when the render ends) and
+// previews of the partial image can be saved while the render is in progress.
+
+#pragma once
+
+#include <embree_utils/geometry.hpp>
+
+#include <opencv2/core.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <span>
+#include <string>
+
+class ProgressiveImage {
+public:
+  /// Accumulate into image (which must be CV_32FC3 and is cleared to black).
+  /// Every result's colour is multiplied by weight (e.g. 1 / samples per pixel).
+  /// If previewIntervalSecs is positive a preview of the partial image is
+  /// written to previewPath at most once per interval:
+  ProgressiveImage(cv::Mat& image, float weight,
+                   const std::string& previewPath = "", double previewIntervalSecs = 0.0);
+
+  /// Add a batch of results to the image. This can be called concurrently from
+  /// multiple threads (e.g. the stream callbacks of different replicas):
+  void add(std::span<const embree_utils::TraceResult> batch);
+
+  /// Write the current state of the image to the preview path:
+  void savePreview();
+
+  std::size_t getRayCount() const { return rayCount; }
+
+private:
+  cv::Mat& image;
+  const float weight;
+  const std::string previewPath;
+  const std::chrono::duration<double> previewInterval;
+  std::chrono::steady_clock::time_point lastPreview; // Guarded by previewMutex
+  std::mutex previewMutex;
+  std::atomic<std::size_t> rayCount;
+
+  void writePreview();
+};
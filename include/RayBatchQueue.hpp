@@ -0,0 +1,88 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// A double ended queue of the ray batches of one frame. This lets the IPU and
+// the host CPU render the same frame together: the IPU takes batches from the
+// front of the queue while CPU threads take them from the back so the split of
+// work adapts to the speed of each device. Every batch is handed out once.
+// (The methods are virtual so that batches can also be shared with other
+// processes: see FarmBatchQueue).
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+
+class RayBatchQueue {
+public:
+  /// Consecutive batches [first, first + count):
+  struct Range {
+    std::size_t first;
+    std::size_t count;
+  };
+
+  RayBatchQueue() : front(0), back(0), raysPerBatch(0), started(false), closed(false) {}
+  virtual ~RayBatchQueue() {}
+
+  /// Fill the queue with the batches of a frame and wake threads waiting in takeBack():
+  virtual void start(std::size_t numBatches, std::size_t batchSize) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      front = 0;
+      back = numBatches;
+      raysPerBatch = batchSize;
+      started = true;
+    }
+    startedCondition.notify_all();
+  }
+
+  /// Stop handing out batches. Threads waiting in takeBack() return (e.g.
+  /// when the frame could not be started):
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    startedCondition.notify_all();
+  }
+
+  /// Take up to count batches from the front. The range is empty if there are none left:
+  virtual Range takeFront(std::size_t count) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (closed) {
+      return Range{front, 0};
+    }
+    const auto first = front;
+    front = std::min(front + count, back);
+    return Range{first, front - first};
+  }
+
+  /// Take one batch from the back. Waits until the frame has started and
+  /// returns nothing once there are no batches left or the queue is closed:
+  virtual std::optional<std::size_t> takeBack() {
+    std::unique_lock<std::mutex> lock(mutex);
+    startedCondition.wait(lock, [&]() { return started || closed; });
+    if (closed || back == front) {
+      return std::nullopt;
+    }
+    back -= 1;
+    return back;
+  }
+
+  /// Number of rays in each batch (only valid after start()):
+  std::size_t getRaysPerBatch() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return raysPerBatch;
+  }
+
+private:
+  mutable std::mutex mutex;
+  std::condition_variable startedCondition;
+  std::size_t front;
+  std::size_t back;
+  std::size_t raysPerBatch;
+  bool started;
+  bool closed;
+};
@@ -0,0 +1,82 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Choice of the number of rays each worker traces per batch. Larger batches
+// amortise the per-batch syncs and exchanges but the ray buffers of a batch
+// have to fit in the tile memory that the scene and other data leave free on
+// both the compute tiles and the I/O tiles.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+/// Tile memory available for ray buffers and the bytes that the buffers need
+/// per unit of rays-per-worker (all in bytes per tile):
+struct RayMemoryBudget {
+  std::size_t bytesPerTile = 0; // Memory that may be used on each tile
+  std::size_t computeFixedBytes = 0; // Scene and other data on each compute tile
+  std::size_t computeBytesPerRay = 0; // Buffers on a compute tile for each ray per worker
+  std::size_t ioFixedBytes = 0; // Scene and other data on each I/O tile
+  std::size_t ioBytesPerRay = 0; // Buffers on an I/O tile for each ray per worker
+};
+
+/// Largest rays-per-worker whose buffers fit in the budget on both kinds of tile
+/// (zero if not even one ray per worker fits):
+inline std::size_t fitRaysPerWorker(const RayMemoryBudget& budget) {
+  auto fit = [&](std::size_t fixed, std::size_t perRay) {
+    if (fixed >= budget.bytesPerTile) {
+      return std::size_t(0);
+    }
+    const auto free = budget.bytesPerTile - fixed;
+    return perRay ? free / perRay : free;
+  };
+  return std::min(fit(budget.computeFixedBytes, budget.computeBytesPerRay),
+                  fit(budget.ioFixedBytes, budget.ioBytesPerRay));
+}
+
+/// Largest rays-per-worker that still splits the rays into at least the given
+/// number of batches (so that they can fill the I/O pipeline):
+inline std::size_t raysPerWorkerForBatches(std::size_t numRays, std::size_t workersPerBatch, std::size_t numBatches) {
+  return std::max<std::size_t>(1, numRays / (numBatches * workersPerBatch));
+}
+
+/// Depth of the I/O pipeline for a DRAM ray buffer with the given number of
+/// batches per replica. Overlapping I/O needs enough batches to fill the
+/// pipeline otherwise the pipeline processes one batch at a time:
+inline std::size_t pipelineDepthForBatches(std::size_t dramBatches, std::size_t depth) {
+  return dramBatches < depth ? 1 : depth;
+}
+
+/// Batches each replica's DRAM buffer must hold for the largest stream of maxRays:
+/// the stream is split into batches (the last one padded) and the batches are
+/// shared evenly between the replicas (some get a dummy batch if they don't divide):
+inline std::size_t dramRayBatchCapacity(std::size_t maxRays, std::size_t raysPerBatch, std::size_t numReplicas) {
+  const auto numBatches = (maxRays + raysPerBatch - 1) / raysPerBatch;
+  return (numBatches + numReplicas - 1) / numReplicas;
+}
+
+/// How a ray stream is split into batches for the device:
+struct RayBatchCounts {
+  std::size_t streamBatches; // Batches that hold rays of the stream
+  std::size_t deviceBatches; // Including dummy batches that feed every replica and fill the pipeline
+  std::size_t paddingRays; // Dud rays that fill the last stream batch
+};
+
+/// Count the batches for a stream of numRays. Every replica processes the same
+/// number of batches (and at least pipelineDepth). Throws if the batches of a
+/// replica do not fit in a DRAM buffer of dramBatches:
+inline RayBatchCounts countRayBatches(std::size_t numRays, std::size_t raysPerBatch, std::size_t numReplicas,
+                                      std::size_t pipelineDepth, std::size_t dramBatches) {
+  RayBatchCounts counts;
+  counts.streamBatches = (numRays + raysPerBatch - 1) / raysPerBatch;
+  counts.paddingRays = counts.streamBatches * raysPerBatch - numRays;
+  counts.deviceBatches = (counts.streamBatches + numReplicas - 1) / numReplicas * numReplicas;
+  counts.deviceBatches = std::max(counts.deviceBatches, pipelineDepth * numReplicas);
+  if (counts.deviceBatches / numReplicas > dramBatches) {
+    throw std::runtime_error("Ray stream needs " + std::to_string(counts.deviceBatches / numReplicas) +
+                             " batches per replica but the graph's DRAM buffer holds " + std::to_string(dramBatches));
+  }
+  return counts;
+}
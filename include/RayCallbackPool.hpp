@@ -0,0 +1,208 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Lets the stream callbacks that receive ray batches from the IPU return
+// quickly: a callback only copies the batch into a pooled buffer and hands it
+// to a pool of host worker threads which decode the batch and run the user's
+// callback. Every (callback, worker) pair is connected by two lock-free single
+// producer single consumer queues: one passes full buffers to the worker and
+// the other returns them to the callback once they are processed. All buffers
+// are allocated up front so nothing allocates while rendering.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Fixed capacity lock-free queue for one producer thread and one consumer thread:
+template <class T>
+class SpscQueue {
+public:
+  explicit SpscQueue(std::size_t capacity) : slots(capacity + 1), head(0), tail(0) {}
+
+  /// Returns false if the queue is full (only call from the producer):
+  bool push(const T& value) {
+    const auto t = tail.load(std::memory_order_relaxed);
+    const auto next = (t + 1) % slots.size();
+    if (next == head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    slots[t] = value;
+    tail.store(next, std::memory_order_release);
+    return true;
+  }
+
+  /// Returns false if the queue is empty (only call from the consumer):
+  bool pop(T& value) {
+    const auto h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = slots[h];
+    head.store((h + 1) % slots.size(), std::memory_order_release);
+    return true;
+  }
+
+private:
+  std::vector<T> slots; // One slot is always empty to tell a full queue from an empty one
+  alignas(64) std::atomic<std::size_t> head;
+  alignas(64) std::atomic<std::size_t> tail;
+};
+
+class RayCallbackPool {
+public:
+  /// Process the data of one batch (called from the worker threads):
+  using ProcessFn = std::function<void(std::size_t batchIndex, const void* data)>;
+
+  /// Start the workers. Each of the numProducers callbacks has buffersPerWorker
+  /// buffers of bufferBytes for each worker:
+  RayCallbackPool(std::size_t numProducers, std::size_t numWorkers, std::size_t buffersPerWorker,
+                  std::size_t bufferBytes, ProcessFn fn)
+    : process(std::move(fn)),
+      bytes(bufferBytes),
+      workers(numWorkers),
+      inFlight(0),
+      stalls(0),
+      stopping(false)
+  {
+    for (auto p = 0u; p < numProducers; ++p) {
+      producers.emplace_back(new Producer{});
+      for (auto w = 0u; w < numWorkers; ++w) {
+        auto& channel = producers.back()->channels.emplace_back(new Channel(buffersPerWorker));
+        for (auto b = 0u; b < buffersPerWorker; ++b) {
+          channel->storage.emplace_back(new std::uint8_t[bytes]);
+          channel->free.push(Buffer{0, channel->storage.back().get()});
+        }
+      }
+    }
+    for (auto w = 0u; w < numWorkers; ++w) {
+      workers[w].pending = 0;
+      workers[w].thread = std::thread([this, w]() { workerLoop(w); });
+    }
+  }
+
+  ~RayCallbackPool() {
+    stopping = true;
+    for (auto& w : workers) {
+      w.pending += 1;
+      w.pending.notify_one();
+    }
+    for (auto& w : workers) {
+      w.thread.join();
+    }
+  }
+
+  /// Copy a batch into a free buffer and queue it for the workers. Only one
+  /// thread may submit for each producer index. If every buffer of the producer
+  /// is busy this waits for one to be returned:
+  void submit(std::size_t producer, std::size_t batchIndex, const void* data) {
+    auto& p = *producers[producer];
+    Buffer buffer;
+    bool stalled = false;
+    for (;;) {
+      for (auto i = 0u; i < workers.size(); ++i) {
+        const auto w = (p.nextWorker + i) % workers.size();
+        if (p.channels[w]->free.pop(buffer)) {
+          buffer.batchIndex = batchIndex;
+          std::memcpy(buffer.data, data, bytes);
+          inFlight += 1;
+          workers[w].pending += 1;
+          p.channels[w]->full.push(buffer); // Can not fail: the queues hold every buffer of the channel
+          workers[w].pending.notify_one();
+          p.nextWorker = w + 1;
+          stalls += stalled;
+          return;
+        }
+      }
+      stalled = true;
+      std::this_thread::yield();
+    }
+  }
+
+  /// Wait until every submitted batch has been processed. Rethrows the first
+  /// exception thrown by the process function:
+  void drain() {
+    for (auto n = inFlight.load(); n != 0; n = inFlight.load()) {
+      inFlight.wait(n);
+    }
+    std::exception_ptr e;
+    {
+      std::lock_guard<std::mutex> lock(errorMutex);
+      std::swap(e, error);
+    }
+    if (e) {
+      std::rethrow_exception(e);
+    }
+  }
+
+  /// Number of submissions that had to wait for a free buffer:
+  std::size_t getStalls() const { return stalls; }
+
+private:
+  struct Buffer {
+    std::size_t batchIndex;
+    std::uint8_t* data;
+  };
+
+  struct Channel {
+    Channel(std::size_t n) : full(n), free(n) {}
+    SpscQueue<Buffer> full; // Callback to worker
+    SpscQueue<Buffer> free; // Worker to callback
+    std::vector<std::unique_ptr<std::uint8_t[]>> storage;
+  };
+
+  struct Producer {
+    std::vector<std::unique_ptr<Channel>> channels; // One per worker
+    std::size_t nextWorker = 0; // Batches are shared out round robin
+  };
+
+  struct Worker {
+    std::thread thread;
+    std::atomic<std::size_t> pending; // Buffers queued for the worker (waited on when zero)
+  };
+
+  void workerLoop(std::size_t w) {
+    for (;;) {
+      workers[w].pending.wait(0);
+      if (stopping) {
+        return;
+      }
+      for (auto& p : producers) {
+        auto& channel = *p->channels[w];
+        Buffer buffer;
+        while (channel.full.pop(buffer)) {
+          try {
+            process(buffer.batchIndex, buffer.data);
+          } catch (...) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error) {
+              error = std::current_exception();
+            }
+          }
+          channel.free.push(buffer);
+          workers[w].pending -= 1;
+          if (inFlight.fetch_sub(1) == 1) {
+            inFlight.notify_all();
+          }
+        }
+      }
+    }
+  }
+
+  const ProcessFn process;
+  const std::size_t bytes;
+  std::vector<std::unique_ptr<Producer>> producers;
+  std::vector<Worker> workers;
+  std::atomic<std::size_t> inFlight;
+  std::atomic<std::size_t> stalls;
+  std::atomic<bool> stopping;
+  std::mutex errorMutex; // Only taken when a batch fails
+  std::exception_ptr error;
+};
@@ -0,0 +1,384 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Ray packet traversal of a CompactBvh for the CPU renderer. A packet of
+// coherent rays (e.g. the camera rays of a small screen tile) traverses the
+// BVH together: each node is loaded once for the whole packet and its boxes
+// are tested against every ray at once. Triangle mesh leaves are tested with
+// a packet version of the watertight triangle test. Lanes are GCC vector
+// extensions so the same code compiles to AVX-512, AVX2 or SSE instructions
+// depending on the host architecture flags (see HOST_ARCH_FLAGS in CMake).
+//
+// The tests mirror the scalar ones operation for operation (the nodes' slab
+// tests and TriangleMesh::intersectTriangle) so packets find the same hits as
+// CompactBvh::intersect. Vectors are only ever passed by reference to keep the
+// ABI independent of the enabled instruction set.
+
+#pragma once
+
+#include "CompactBvh.hpp"
+#include "Mesh.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#if defined(__AVX512F__)
+static constexpr std::size_t PacketWidth = 16;
+#else
+static constexpr std::size_t PacketWidth = 8;
+#endif
+
+/// Lane types for each supported packet width:
+template <std::size_t N>
+struct PacketLanes;
+
+template <>
+struct PacketLanes<8> {
+  typedef float Float __attribute__((vector_size(8 * sizeof(float))));
+  typedef std::int32_t Mask __attribute__((vector_size(8 * sizeof(std::int32_t))));
+};
+
+template <>
+struct PacketLanes<16> {
+  typedef float Float __attribute__((vector_size(16 * sizeof(float))));
+  typedef std::int32_t Mask __attribute__((vector_size(16 * sizeof(std::int32_t))));
+};
+
+template <std::size_t N>
+struct RayPacket {
+  using Float = typename PacketLanes<N>::Float;
+  using Mask = typename PacketLanes<N>::Mask;
+
+  /// Per lane results of a triangle test (only valid in the hit lanes):
+  struct TriangleHits {
+    Float t, b0, b1, b2;
+    Mask hit;
+  };
+
+  /// Load up to N rays. Lanes past the count are inactive:
+  RayPacket(const embree_utils::Ray* source, std::uint32_t count) : size(count) {
+    for (auto l = 0u; l < N; ++l) {
+      // Unused lanes repeat the first ray so that they never produce NaNs:
+      const auto& r = source[l < count ? l : 0];
+      rays[l] = r;
+      ox[l] = r.origin.x;
+      oy[l] = r.origin.y;
+      oz[l] = r.origin.z;
+      invX[l] = 1.f / r.direction.x;
+      invY[l] = 1.f / r.direction.y;
+      invZ[l] = 1.f / r.direction.z;
+      tMin[l] = r.tMin;
+      tMax[l] = r.tMax;
+      active[l] = l < count ? -1 : 0;
+
+      const RayShearParams shear(r);
+      kx[l] = shear.ix;
+      ky[l] = shear.iy;
+      kz[l] = shear.iz;
+      sx[l] = shear.sx;
+      sy[l] = shear.sy;
+      sz[l] = shear.sz;
+    }
+  }
+
+  static bool any(const Mask& m) {
+    for (auto l = 0u; l < N; ++l) {
+      if (m[l]) { return true; }
+    }
+    return false;
+  }
+
+  /// Packet version of intersectRaySlab():
+  static void intersectSlab(const Float& invDir, const Float& origin, float slabMin, float slabMax, Float& t0, Float& t1) {
+    const Float tNear = (slabMin - origin) * invDir;
+    const Float tFar = (slabMax - origin) * invDir;
+    const Mask swap = tNear > tFar;
+    const Float tmin = swap ? tFar : tNear;
+    Float tmax = swap ? tNear : tFar;
+
+    // Make sure we never miss a potential hit due to rounding error:
+    tmax *= 1 + 2 * gamma(3);
+
+    t0 = tmin > t0 ? tmin : t0;
+    t1 = tmax < t1 ? tmax : t1;
+  }
+
+  /// Return the mask of active lanes that hit the node's bounds before tFar:
+  void intersect(const CompactBVH2Node& node, const Float& tFar, Mask& hit) const {
+    Float t0 = tMin;
+    Float t1 = tFar;
+    intersectSlab(invX, ox, node.min_x, node.min_x + (float)node.dx, t0, t1);
+    intersectSlab(invY, oy, node.min_y, node.min_y + (float)node.dy, t0, t1);
+    intersectSlab(invZ, oz, node.min_z, node.min_z + (float)node.dz, t0, t1);
+    hit = active & (t0 <= t1);
+  }
+
+  /// Test every child box of a wide node (in the same way as the node's own
+  /// intersect()). hit[c] is the mask of active lanes that hit child c before
+  /// tFar and tEntry[c] holds their entry distances:
+  void intersect(const CompactBVH4Node& node, const Float& tFar,
+                 Mask (&hit)[CompactBVH4Node::Width], Float (&tEntry)[CompactBVH4Node::Width]) const {
+    const Float nx = ox - node.min_x;
+    const Float ny = oy - node.min_y;
+    const Float nz = oz - node.min_z;
+    for (auto c = 0u; c < CompactBVH4Node::Width; ++c) {
+      Float t0 = tMin;
+      Float t1 = tFar;
+      intersectSlab(invX, nx, (float)node.lo_x[c], (float)node.hi_x[c], t0, t1);
+      intersectSlab(invY, ny, (float)node.lo_y[c], (float)node.hi_y[c], t0, t1);
+      intersectSlab(invZ, nz, (float)node.lo_z[c], (float)node.hi_z[c], t0, t1);
+      hit[c] = c < node.childCount ? active & (t0 <= t1) : Mask{};
+      tEntry[c] = t0;
+    }
+  }
+
+  void intersect(const CompactBVH4QNode& node, const Float& tFar,
+                 Mask (&hit)[CompactBVH4QNode::Width], Float (&tEntry)[CompactBVH4QNode::Width]) const {
+    // Test in grid units as the scalar test does:
+    const Float gx = (ox - node.min_x) * exp2i(-node.exp_x);
+    const Float gy = (oy - node.min_y) * exp2i(-node.exp_y);
+    const Float gz = (oz - node.min_z) * exp2i(-node.exp_z);
+    const Float ix = invX * exp2i(node.exp_x);
+    const Float iy = invY * exp2i(node.exp_y);
+    const Float iz = invZ * exp2i(node.exp_z);
+    for (auto c = 0u; c < CompactBVH4QNode::Width; ++c) {
+      Float t0 = tMin;
+      Float t1 = tFar;
+      intersectSlab(ix, gx, node.lo_x[c], node.hi_x[c], t0, t1);
+      intersectSlab(iy, gy, node.lo_y[c], node.hi_y[c], t0, t1);
+      intersectSlab(iz, gz, node.lo_z[c], node.hi_z[c], t0, t1);
+      hit[c] = c < node.childCount ? active & (t0 <= t1) : Mask{};
+      tEntry[c] = t0;
+    }
+  }
+
+  /// Packet version of TriangleMesh::intersectTriangle() for the given lanes:
+  template <class Mesh>
+  void intersectTriangle(const Mesh& mesh, std::uint32_t index, const Mask& lanes, const Float& tFar,
+                         TriangleHits& result) const {
+    const auto& tri = mesh.triangles[index];
+    const auto p0 = mesh.getVertex(tri.v0);
+    const auto p1 = mesh.getVertex(tri.v1);
+    const auto p2 = mesh.getVertex(tri.v2);
+
+    // Translate vertices into ray coordinate system, permute so that the
+    // largest ray direction component is z, then shear z onto the ray:
+    Float p0x, p0y, p0z, p1x, p1y, p1z, p2x, p2y, p2z;
+    toRaySpace(p0, p0x, p0y, p0z);
+    toRaySpace(p1, p1x, p1y, p1z);
+    toRaySpace(p2, p2x, p2y, p2z);
+
+    // Edge coefficients and the edge and determinant tests:
+    const Float e0 = p1x * p2y - p1y * p2x;
+    const Float e1 = p2x * p0y - p2y * p0x;
+    const Float e2 = p0x * p1y - p0y * p1x;
+    Mask miss = ((e0 < 0) | (e1 < 0) | (e2 < 0)) & ((e0 > 0) | (e1 > 0) | (e2 > 0));
+    const Float det = e0 + e1 + e2;
+    miss |= det == 0;
+
+    // Scaled hit distance and test against the ray's t range:
+    p0z *= sz;
+    p1z *= sz;
+    p2z *= sz;
+    const Float tScaled = e0 * p0z + e1 * p1z + e2 * p2z;
+    const Float tFarScaled = tFar * det;
+    miss |= (det < 0) & ((tScaled >= 0) | (tScaled < tFarScaled));
+    miss |= (det > 0) & ((tScaled <= 0) | (tScaled > tFarScaled));
+
+    const Float invDet = 1.f / det;
+    result.b0 = e0 * invDet;
+    result.b1 = e1 * invDet;
+    result.b2 = e2 * invDet;
+    result.t = tScaled * invDet;
+
+    // Conservative bound on the error in t (see the scalar test):
+    Float maxZt, maxXt, maxYt, maxE;
+    maxAbs(p0z, p1z, p2z, maxZt);
+    maxAbs(p0x, p1x, p2x, maxXt);
+    maxAbs(p0y, p1y, p2y, maxYt);
+    maxAbs(e0, e1, e2, maxE);
+    const Float deltaZ = gamma(3) * maxZt;
+    const Float deltaX = gamma(5) * (maxXt + maxZt);
+    const Float deltaY = gamma(5) * (maxYt + maxZt);
+    const Float deltaE = 2 * (gamma(2) * maxXt * maxYt + deltaY * maxXt + deltaX * maxYt);
+    const Float absInvDet = invDet < 0 ? -invDet : invDet;
+    const Float deltaT = 3 * (gamma(3) * maxE * maxZt + deltaE * maxZt + deltaZ * maxE) * absInvDet;
+    miss |= result.t <= deltaT;
+
+    result.hit = lanes & ~miss;
+  }
+
+  embree_utils::Ray rays[N];
+  Float ox, oy, oz;
+  Float invX, invY, invZ;
+  Float tMin, tMax;
+  Mask active;
+  // Per lane RayShearParams:
+  Mask kx, ky, kz;
+  Float sx, sy, sz;
+  std::uint32_t size;
+
+private:
+  static void select(const Mask& k, const Float& x, const Float& y, const Float& z, Float& out) {
+    out = k == 0 ? x : (k == 1 ? y : z);
+  }
+
+  static void maxAbs(const Float& a, const Float& b, const Float& c, Float& out) {
+    const Float aa = a < 0 ? -a : a;
+    const Float ab = b < 0 ? -b : b;
+    const Float ac = c < 0 ? -c : c;
+    out = aa > ab ? aa : ab;
+    out = ac > out ? ac : out;
+  }
+
+  void toRaySpace(const embree_utils::Vec3fa& p, Float& x, Float& y, Float& z) const {
+    const Float tx = p.x - ox;
+    const Float ty = p.y - oy;
+    const Float tz = p.z - oz;
+    select(kx, tx, ty, tz, x);
+    select(ky, tx, ty, tz, y);
+    select(kz, tx, ty, tz, z);
+    x += sx * z;
+    y += sy * z;
+  }
+};
+
+/// Find the closest hit for every ray in a packet. The result for each ray is
+/// the same as from bvh.intersect(ray, primLookup) and results must have room for
+/// N entries. meshLookup returns a pointer to the triangle mesh for a geomID (or
+/// nullptr if the geometry is not a mesh) so that mesh leaves can use the packet
+/// triangle test. Other geometry (and meshes with precomputed triangles) is
+/// intersected one ray at a time. Nodes are only tested once for the whole packet
+/// so the traversal is fastest when the rays are coherent:
+template <class Node, std::size_t N, class Lookup, class MeshLookup>
+void intersectPacket(const CompactBvh<Node>& bvh,
+                     const RayPacket<N>& packet,
+                     Lookup& primLookup,
+                     MeshLookup& meshLookup,
+                     Intersection* results) {
+  using Packet = RayPacket<N>;
+  using Mask = typename Packet::Mask;
+  using Mesh = std::remove_cv_t<std::remove_pointer_t<decltype(meshLookup(std::uint16_t(0)))>>;
+  const auto& nodes = bvh.getNodes();
+
+  // Packets push no more entries than a single ray so they use the same stack size:
+  const auto stackSize = bvh.getMaxDepth();
+  std::uint32_t stack[stackSize];
+  auto ref = ArrayRef(stack, stackSize);
+  WrappedArray<std::uint32_t> toVisit(ref);
+  toVisit.push_back(0);
+
+  typename Packet::Float closest = packet.tMax;
+  for (auto l = 0u; l < N; ++l) {
+    results[l] = Intersection(packet.tMax[l], nullptr);
+  }
+
+  // Normals of triangle hits are only computed for the closest hit of each ray:
+  const Mesh* hitMesh[N] = {};
+  TriangleIntersection hitTri[N];
+
+  // Intersect the primitives of a leaf with the lanes that hit its bounds:
+  auto intersectLeaf = [&](std::uint16_t geomID, std::uint32_t packedPrims, const Mask& hit) {
+    const auto first = leafFirstPrim(packedPrims);
+    const auto end = first + leafPrimCount(packedPrims);
+    const Mesh* mesh = meshLookup(geomID);
+#if ALLOW_DOUBLE_FALLBACK == 1
+    mesh = nullptr; // The packet test has no double precision fallback
+#endif
+    if (mesh && mesh->precomputed.size() == 0) {
+      for (auto p = first; p < end; ++p) {
+        typename Packet::TriangleHits tri;
+        packet.intersectTriangle(*mesh, p, hit, closest, tri);
+        const Mask closer = tri.hit & (tri.t > 0.f) & (tri.t > packet.tMin) & (tri.t < closest);
+        if (!Packet::any(closer)) { continue; }
+        closest = closer ? tri.t : closest;
+        for (auto l = 0u; l < N; ++l) {
+          if (closer[l]) {
+            results[l] = Intersection(geomID, p, tri.t[l]);
+            results[l].prim = mesh;
+            hitMesh[l] = mesh;
+            hitTri[l] = TriangleIntersection{tri.t[l], tri.b0[l], tri.b1[l], tri.b2[l]};
+          }
+        }
+      }
+    } else {
+      visitPrimitive(primLookup, geomID, first, [&](const auto& prim) {
+        for (auto l = 0u; l < N; ++l) {
+          if (!hit[l]) { continue; }
+          for (auto p = first; p < end; ++p) {
+            auto intersection = intersectPrimitive(prim, p, packet.rays[l]);
+            if (intersection.t > packet.tMin[l] && intersection.t < closest[l]) {
+              intersection.prim = &prim;
+              intersection.geomID = geomID;
+              results[l] = intersection;
+              hitMesh[l] = nullptr;
+              closest[l] = intersection.t;
+            }
+          }
+        }
+      });
+    }
+  };
+
+  while (!toVisit.empty()) {
+    const auto currentIndex = toVisit.back();
+    toVisit.pop_back();
+    const Node& node = nodes[currentIndex];
+
+    if constexpr (CompactBvh<Node>::isWide) {
+      Mask hit[Node::Width];
+      typename Packet::Float tEntry[Node::Width];
+      packet.intersect(node, closest, hit, tEntry);
+
+      // Leaves first as they can shorten the rays:
+      for (auto c = 0u; c < Node::Width; ++c) {
+        if (node.isLeaf(c) && Packet::any(hit[c])) {
+          intersectLeaf(node.geomID[c], node.child[c], hit[c]);
+        }
+      }
+
+      // Push the inner children that were hit so that the one with the
+      // nearest entry (over the packet) is visited first:
+      float nearest[Node::Width];
+      std::uint32_t inner[Node::Width];
+      std::uint32_t innerCount = 0;
+      for (auto c = 0u; c < Node::Width; ++c) {
+        const Mask live = hit[c] & (tEntry[c] <= closest);
+        if (node.isLeaf(c) || !Packet::any(live)) { continue; }
+        float entry = std::numeric_limits<float>::infinity();
+        for (auto l = 0u; l < N; ++l) {
+          if (live[l] && tEntry[c][l] < entry) { entry = tEntry[c][l]; }
+        }
+        auto i = innerCount;
+        for (; i > 0 && nearest[i - 1] < entry; --i) {
+          nearest[i] = nearest[i - 1];
+          inner[i] = inner[i - 1];
+        }
+        nearest[i] = entry;
+        inner[i] = node.child[c];
+        innerCount += 1;
+      }
+      for (auto i = 0u; i < innerCount; ++i) {
+        toVisit.push_back(inner[i]);
+      }
+    } else {
+      Mask hit;
+      packet.intersect(node, closest, hit);
+      if (!Packet::any(hit)) { continue; }
+
+      if (node.geomID != Node::InvalidGeomID) {
+        intersectLeaf(node.geomID, node.primID, hit);
+      } else {
+        toVisit.push_back(node.secondChildIndex);
+        toVisit.push_back(currentIndex + 1);
+      }
+    }
+  }
+
+  for (auto l = 0u; l < packet.size; ++l) {
+    if (hitMesh[l]) {
+      results[l].normal = hitMesh[l]->computeNormal(hitTri[l], results[l]);
+    }
+  }
+}
@@ -0,0 +1,46 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Reordering of ray lists by direction. Rays that point into the same octant
+// visit the children of BVH nodes in the same order so tracing them one after
+// another (on the same worker) takes similar paths through the BVH.
+
+#pragma once
+
+#include <embree_utils/geometry.hpp>
+
+/// Octant of a direction (bit i is set if component i is negative):
+inline unsigned directionOctant(const embree_utils::Vec3fa& d) {
+  return unsigned(d.x < 0.f) | (unsigned(d.y < 0.f) << 1) | (unsigned(d.z < 0.f) << 2);
+}
+
+/// Sort a list of ray indices by octant in place (an 8-way radix sort which is
+/// not stable). The octant function returns the octant of the ray at an index:
+template <class Octant>
+void sortByOctant(unsigned* list, unsigned count, Octant&& octant) {
+  unsigned next[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  for (auto i = 0u; i < count; ++i) {
+    next[octant(list[i])] += 1;
+  }
+  unsigned end[8];
+  unsigned start = 0;
+  for (auto b = 0u; b < 8; ++b) {
+    const auto size = next[b];
+    next[b] = start;
+    start += size;
+    end[b] = start;
+  }
+  for (auto b = 0u; b < 8; ++b) {
+    while (next[b] < end[b]) {
+      const auto r = list[next[b]];
+      const auto o = octant(r);
+      if (o == b) {
+        next[b] += 1;
+      } else {
+        // Move the ray to its bucket and look at the ray it displaced next:
+        list[next[b]] = list[next[o]];
+        list[next[o]] = r;
+        next[o] += 1;
+      }
+    }
+  }
+}
@@ -0,0 +1,74 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Host storage for ray streams (one TraceResult per pixel of the render window
+// and any other per-pixel streams of the same size). By default streams are
+// ordinary heap memory. On hosts that are short of memory they can instead be
+// mapped from a file: the pages are then backed by the file rather than by
+// swap so the kernel can write back and drop finished parts of a large frame
+// at any time and only the batches in flight need to stay resident. Streams
+// can also be placed in huge pages to cut the TLB misses of streaming whole
+// frames to and from the device. The allocator itself is stateless (it reads a
+// process wide setting) so streams can be swapped, moved, and copied freely.
+
+#pragma once
+
+#include <embree_utils/geometry.hpp>
+
+#include <cstddef>
+#include <new>
+#include <span>
+#include <string>
+#include <vector>
+
+enum class RayStreamStorage {
+  Heap,
+  MappedFile, // Pages of an (unlinked) file in the ray stream directory
+  HugePages
+};
+
+/// Choose where ray streams that are allocated from now on are stored (streams
+/// that already exist stay where they are). A directory must be given for
+/// MappedFile storage. Allocations smaller than rayStreamMinMappedBytes always
+/// come from the heap:
+void setRayStreamStorage(RayStreamStorage storage, const std::string& directory = "");
+RayStreamStorage getRayStreamStorage();
+
+constexpr std::size_t rayStreamMinMappedBytes = 1u << 20;
+
+void* allocateRayStorage(std::size_t bytes);
+void freeRayStorage(void* p, std::size_t bytes);
+
+/// Hint that part of a stream is finished with for now: if it is mapped from a
+/// file its pages are written back and dropped from memory (they are read from
+/// the file again if they are accessed). Does nothing for other storage:
+void writeBackRayStorage(const void* p, std::size_t bytes);
+
+template <class T>
+struct RayStreamAllocator {
+  using value_type = T;
+
+  RayStreamAllocator() = default;
+  template <class U>
+  RayStreamAllocator(const RayStreamAllocator<U>&) {}
+
+  T* allocate(std::size_t n) {
+    if (n > std::size_t(-1) / sizeof(T)) {
+      throw std::bad_array_new_length();
+    }
+    return static_cast<T*>(allocateRayStorage(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, std::size_t n) { freeRayStorage(p, n * sizeof(T)); }
+
+  template <class U>
+  bool operator==(const RayStreamAllocator<U>&) const { return true; }
+  template <class U>
+  bool operator!=(const RayStreamAllocator<U>&) const { return false; }
+};
+
+using RayStream = std::vector<embree_utils::TraceResult, RayStreamAllocator<embree_utils::TraceResult>>;
+
+template <class T>
+void writeBackRays(std::span<T> rays) {
+  writeBackRayStorage(rays.data(), rays.size_bytes());
+}
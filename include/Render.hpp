@@ -8,18 +8,24 @@
 #include <Primitives.hpp>
 #include <CompactBvh.hpp>
 #include <Material.hpp>
-#include <Render.hpp>
+#include <Lights.hpp>
+#include <EnvMap.hpp>
+#include <Scene.hpp>
+#include <Texture.hpp>
 
 /// Update the hit record with intersection info, advance ray to hit
-/// point, and return a pointer to the primitive that was hit.
-inline
-void updateHit(const Intersection& i, embree_utils::HitRecord& hit) {
+/// point, and compute the normal of the primitive that was hit (found
+/// through the same lookup that was used to intersect it).
+template <class T>
+void updateHit(const Intersection& i, embree_utils::HitRecord& hit, T& primLookupFunc) {
   // Mark a geometry hit the same way embree does:
   hit.geomID = i.geomID;
   hit.primID = i.primID;
   hit.r.tMax = i.t;
   hit.r.origin += hit.r.direction * i.t; // Update ray origin with the hit point
-  hit.normal = i.prim->normal(i, hit.r.origin);
+  visitPrimitive(primLookupFunc, i.geomID, i.primID, [&](const auto& prim) {
+    hit.normal = primitiveNormal(prim, i, hit.r.origin);
+  });
 }
 
 // Calculate a new position to spawn a ray from. The new position is offset
@@ -32,32 +38,193 @@ void offsetRay(embree_utils::Ray& r, const embree_utils::Vec3fa& n) {
   r.origin += (n * m);
 }
 
-/// Templated on the callback that can lookup a Primitive
-/// from its geom and prim IDs.
-template <class T>
-void traceShadowRay(const CompactBvh& bvh,
+/// Next event estimation of the scene's area lights at a diffuse hit. A point is
+/// sampled on a light and a shadow ray is cast towards it. The light sample is
+/// weighted with MIS against BxDF sampling (see emissionMisWeight()). Must be
+/// called before the hit is shaded:
+template <class Bvh, class T>
+embree_utils::Vec3fa sampleAreaLights(const Bvh& bvh,
+                                      const ArrayRef<AreaLight>& lights,
+                                      const ArrayRef<std::uint32_t>& matIDs,
+                                      const ArrayRef<Material>& materials,
+                                      const embree_utils::HitRecord& hit,
+                                      const embree_utils::Vec3fa& albedo,
+                                      float u1, float u2, float u3,
+                                      T& primLookupFunc) {
+  using namespace embree_utils;
+  const auto& light = chooseLight(lights, u1);
+  Vec3fa lightPoint, lightNormal;
+  light.sample(u2, u3, lightPoint, lightNormal);
+
+  auto shadowRay = hit.r;
+  shadowRay.direction = lightPoint - hit.r.origin;
+  offsetRay(shadowRay, hit.normal);
+  const auto toLight = lightPoint - shadowRay.origin;
+  const float distSq = toLight.squaredNorm();
+  if (!(distSq > 0.f)) {
+    return Vec3fa(0.f, 0.f, 0.f);
+  }
+  const float dist = std::sqrt(distSq);
+  shadowRay.direction = toLight * (1.f / dist);
+  const float cosTheta = hit.normal.dot(shadowRay.direction);
+  const float cosLight = std::abs(lightNormal.dot(shadowRay.direction));
+  if (cosTheta <= 0.f || cosLight <= 0.f) {
+    return Vec3fa(0.f, 0.f, 0.f);
+  }
+
+  // Stop short of the light's own surface by the same margin that offsetRay() uses:
+  shadowRay.tMin = 0.f;
+  shadowRay.tMax = dist - (1.f + lightPoint.abs().maxc()) * rayEpsilon;
+  if (bvh.occluded(shadowRay, primLookupFunc)) {
+    return Vec3fa(0.f, 0.f, 0.f);
+  }
+
+  // Convert the light's area pdf to solid angle. The diffuse BxDF is albedo / Pi:
+  const auto& emission = materials[matIDs[light.geomID]].emission;
+  const float lightPdf = lightAreaPdf(lights, emission) * distSq / cosLight;
+  const float bxdfPdf = cosTheta * InvPi;
+  const float weight = powerHeuristic(lightPdf, bxdfPdf) * bxdfPdf / lightPdf;
+  return hit.throughput * albedo * emission * weight;
+}
+
+/// MIS weight for the emission that a path picks up when it hits a light. The
+/// hit record must be updated for the hit (but not yet shaded) and bxdfPdf is the
+/// solid angle pdf of the direction sampled at the previous path vertex (zero if
+/// the lights were not sampled there i.e. the previous vertex was not diffuse):
+inline float emissionMisWeight(const ArrayRef<AreaLight>& lights, const Material& material,
+                               const embree_utils::HitRecord& hit, float bxdfPdf) {
+  if (!material.emissive || bxdfPdf <= 0.f || lights.size() == 0) {
+    return 1.f;
+  }
+  const float cosLight = std::abs(hit.normal.dot(hit.r.direction));
+  if (cosLight <= 0.f) {
+    return 1.f;
+  }
+  const float lightPdf = lightAreaPdf(lights, material.emission) * hit.r.tMax * hit.r.tMax / cosLight;
+  return powerHeuristic(bxdfPdf, lightPdf);
+}
+
+/// First hit outputs (AOVs) that guide denoising summed over a pixel's samples.
+/// Paths that escape without hitting anything have a white albedo and a zero normal:
+struct DenoiseAovs {
+  embree_utils::Vec3fa albedo = embree_utils::Vec3fa(0.f, 0.f, 0.f);
+  embree_utils::Vec3fa normal = embree_utils::Vec3fa(0.f, 0.f, 0.f);
+
+  void addHit(const embree_utils::Vec3fa& surfaceAlbedo, const embree_utils::HitRecord& hit) {
+    albedo += surfaceAlbedo;
+    normal += hit.normal;
+  }
+
+  void addEscaped() {
+    albedo += embree_utils::Vec3fa(1.f, 1.f, 1.f);
+  }
+
+  /// Store the mean of count samples in the hit record: the albedo replaces the
+  /// throughput and the normal the normal (once a pixel's paths are finished the
+  /// rest of the record is no longer needed):
+  void store(embree_utils::HitRecord& hit, std::uint32_t count) const {
+    const float scale = count ? 1.f / float(count) : 0.f;
+    hit.throughput = albedo * scale;
+    hit.normal = normal * scale;
+  }
+};
+
+/// Return the spread angle of the rays through neighbouring pixels (used to choose
+/// texture mip levels). tanTheta is tan(fov/2) (see pixelToRayDir()):
+inline float pixelSpreadAngle(float tanTheta, float imageHeight) {
+  return 2.f * tanTheta / imageHeight;
+}
+
+/// Return the albedo of the surface at a hit: the material's albedo scaled by its
+/// texture at the hit (if it has a texture and the surface texture coordinates).
+/// The mip level is chosen with a ray cone of the given spread angle over the
+/// ray's last segment (for secondary rays this ignores the spread of the earlier
+/// bounces so their texture lookups are sharper than they need to be). The hit
+/// record must already be updated for the hit (see updateHit()):
+inline
+embree_utils::Vec3fa surfaceAlbedo(const SceneRef& scene, const Material& material,
+                                   const embree_utils::HitRecord& hit, float pixelSpread) {
+  if (material.albedoTexture == Material::NoTexture || scene.meshUVs.size() == 0) {
+    return material.albedo;
+  }
+  const auto& geom = scene.geometry[hit.geomID];
+  if (geom.type != GeomType::Mesh) {
+    return material.albedo;
+  }
+  const auto& info = scene.meshInfo[geom.index];
+  const auto& tri = scene.meshTris[info.firstIndex + hit.primID];
+  auto vertex = [&](std::uint32_t v) {
+    return scene.meshPackedVerts.size() ?
+      scene.meshQuantisation[geom.index].decode(scene.meshPackedVerts[info.firstVertex + v]) :
+      scene.meshVerts[info.firstVertex + v];
+  };
+
+  // Barycentric coordinates of the hit point:
+  const auto p0 = vertex(tri.v0);
+  const auto e1 = vertex(tri.v1) - p0;
+  const auto e2 = vertex(tri.v2) - p0;
+  const auto d = hit.r.origin - p0;
+  const float d11 = e1.dot(e1);
+  const float d12 = e1.dot(e2);
+  const float d22 = e2.dot(e2);
+  const float det = d11 * d22 - d12 * d12; // Squared length of e1 x e2
+  if (!(det > 0.f)) {
+    return material.albedo; // Degenerate triangle
+  }
+  const float d1 = d.dot(e1);
+  const float d2 = d.dot(e2);
+  const float b1 = (d22 * d1 - d12 * d2) / det;
+  const float b2 = (d11 * d2 - d12 * d1) / det;
+  const float b0 = 1.f - b1 - b2;
+  const auto& t0 = scene.meshUVs[info.firstVertex + tri.v0];
+  const auto& t1 = scene.meshUVs[info.firstVertex + tri.v1];
+  const auto& t2 = scene.meshUVs[info.firstVertex + tri.v2];
+  const TexCoord uv{b0 * t0.u + b1 * t1.u + b2 * t2.u, b0 * t0.v + b1 * t1.v + b2 * t2.v};
+
+  // The cone's footprint grows as the surface tilts away from the ray:
+  const auto& texture = scene.textures[material.albedoTexture];
+  const float uvArea = std::abs((t1.u - t0.u) * (t2.v - t0.v) - (t2.u - t0.u) * (t1.v - t0.v));
+  const float texelsPerArea = uvArea * texture.width * texture.height / std::sqrt(det);
+  const float width = hit.r.tMax * pixelSpread;
+  const float cosine = std::max(std::abs(hit.normal.dot(hit.r.direction)), .1f);
+  const auto level = textureLevel(texture, width * width / cosine, texelsPerArea);
+  return material.albedo * sampleTexture(texture, scene.texels, uv, level);
+}
+
+/// Make the shadow ray from a hit point to a point light. The hit record must
+/// already be updated for the hit (see updateHit()):
+inline
+embree_utils::Ray makeShadowRay(const embree_utils::HitRecord& hit, const embree_utils::Vec3fa& lightWorldPos) {
+  auto shadowRay = hit.r;
+  auto lightOffset = lightWorldPos - shadowRay.origin;
+  shadowRay.direction = lightOffset.normalized();
+
+  offsetRay(shadowRay, hit.normal); // offset rays to avoid self intersection.
+  // Reset ray limits for shadow bounce:
+  shadowRay.tMin = 0.f;
+  shadowRay.tMax = std::sqrt(lightOffset.squaredNorm());
+  return shadowRay;
+}
+
+/// Shade the result of a primary ray intersection (that was found by the
+/// caller) by casting a shadow ray. See traceShadowRay():
+template <class Bvh, class T>
+void shadeShadowRay(const Bvh& bvh,
                     const ArrayRef<std::uint32_t>& matIDs,
                     const ArrayRef<Material>& materials,
                     float ambient,
+                    const Intersection& intersected,
                     embree_utils::TraceResult& result,
                     T& primLookupFunc,
                     const embree_utils::Vec3fa& lightWorldPos) {
   auto& hit = result.h;
-  auto intersected = bvh.intersect(hit.r, primLookupFunc);
   if (intersected) {
-    updateHit(intersected, hit);
+    updateHit(intersected, hit, primLookupFunc);
     const auto& material = materials[matIDs[hit.geomID]];
 
     // For rays that hit cast a shadow ray to an arbitrary point
     // to test BVH occlusion function:
-    auto shadowRay = hit.r;
-    auto lightOffset = lightWorldPos - shadowRay.origin;
-    shadowRay.direction = lightOffset.normalized();
-
-    offsetRay(shadowRay, hit.normal); // offset rays to avoid self intersection.
-    // Reset ray limits for shadow bounce:
-    shadowRay.tMin = 0.f;
-    shadowRay.tMax = std::sqrt(lightOffset.squaredNorm());
+    const auto shadowRay = makeShadowRay(hit, lightWorldPos);
 
     auto matRgb = material.albedo;
     auto color = matRgb * ambient;
@@ -71,6 +238,20 @@ void traceShadowRay(const CompactBvh& bvh,
   }
 }
 
+/// Templated on the BVH type and the callback that can lookup
+/// a Primitive from its geom and prim IDs.
+template <class Bvh, class T>
+void traceShadowRay(const Bvh& bvh,
+                    const ArrayRef<std::uint32_t>& matIDs,
+                    const ArrayRef<Material>& materials,
+                    float ambient,
+                    embree_utils::TraceResult& result,
+                    T& primLookupFunc,
+                    const embree_utils::Vec3fa& lightWorldPos) {
+  auto intersected = bvh.intersect(result.h.r, primLookupFunc);
+  shadeShadowRay(bvh, matIDs, materials, ambient, intersected, result, primLookupFunc, lightWorldPos);
+}
+
 inline
 embree_utils::Vec3fa pixelToRayDir(float x, float y,
                                    float w, float h,
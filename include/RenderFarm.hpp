@@ -0,0 +1,74 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Lets several host processes (e.g. one per IPU-POD partition on different
+// hosts) render the same frame. The processes only coordinate through a
+// directory that every host mounts: the frame's ray batches are divided into
+// chunks (one run of the IPU pipeline each) and a process claims a chunk by
+// exclusively creating its claim file. Every process starts on its own
+// contiguous share of the chunks and then steals chunks from the backs of the
+// other shares so faster partitions render more of the frame. The results of
+// each chunk are written to the directory and the output process (rank 0)
+// gathers them into its own ray stream.
+
+#pragma once
+
+#include <RayBatchQueue.hpp>
+#include <RayStream.hpp>
+#include <embree_utils/geometry.hpp>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+class FarmBatchQueue : public RayBatchQueue {
+public:
+  /// Every process of the farm must use the same directory (one per frame)
+  /// and render the same ray stream with the same batch size:
+  FarmBatchQueue(const std::string& directory, std::uint32_t rank, std::uint32_t numProcesses,
+                 RayStream& rayStream);
+
+  void start(std::size_t numBatches, std::size_t batchSize) override;
+
+  /// Writes the results of the previous chunk then claims the next one. Every
+  /// call must ask for the same number of batches (the chunk size):
+  Range takeFront(std::size_t count) override;
+
+  /// Batches are not shared with host threads of the same process:
+  std::optional<std::size_t> takeBack() override { return std::nullopt; }
+
+  /// Write the results of the last chunk claimed (call once the frame is rendered):
+  void finish();
+
+  /// Wait for the results of every chunk and copy the ones that other processes
+  /// rendered into the ray stream (only valid for the output process):
+  void gather(double pollSecs = .1);
+
+  bool isOutputProcess() const { return rank == 0; }
+  std::size_t getChunksRendered() const { return rendered.size(); }
+  std::size_t getChunksStolen() const { return stolen; }
+  std::size_t getNumChunks() const { return numChunks; }
+
+private:
+  std::string chunkPath(std::size_t chunk, const char* suffix) const;
+  std::size_t shareBegin(std::uint32_t r) const { return r * numChunks / numProcesses; }
+  std::pair<std::size_t, std::size_t> chunkRays(std::size_t chunk) const;
+  void checkManifest();
+  bool tryClaim(std::size_t chunk);
+  std::optional<std::size_t> claimNext();
+  void publish(std::size_t chunk);
+
+  const std::string directory;
+  const std::uint32_t rank;
+  const std::uint32_t numProcesses;
+  RayStream& rayStream; // (Referenced as the IPU may reorder it before it starts)
+  std::size_t numBatches;
+  std::size_t raysPerBatch;
+  std::size_t chunkBatches; // Set by the first takeFront()
+  std::size_t numChunks;
+  std::size_t ownNext; // Next chunk of this process's share
+  std::vector<std::size_t> stealEnd; // End of the chunks not yet tried in each share
+  std::vector<std::size_t> rendered;
+  std::optional<std::size_t> unpublished;
+  std::size_t stolen;
+};
@@ -0,0 +1,53 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Native binned SAH BVH builder. The build writes a flat binary tree in depth
+// first order directly (there is no intermediate pointer based tree) so it can be
+// converted into any of the compact node formats with a simple index walk.
+
+#pragma once
+
+#include "embree_utils/geometry.hpp"
+
+#include <vector>
+#include <limits>
+
+// Bounds and IDs of one primitive passed to the build:
+struct BuildPrimitive {
+  embree_utils::Bounds3d bounds;
+  std::uint32_t geomID;
+  std::uint32_t primID;
+};
+
+// Binary BVH node produced by the build. Nodes are stored in depth first order
+// so the first child of an inner node is always the next node in the array.
+// Every node covers a contiguous range of the build's (reordered) primitives:
+struct BuildNode {
+  static constexpr auto InvalidGeomID = std::numeric_limits<std::uint32_t>::max();
+
+  embree_utils::Bounds3d bounds;
+  std::uint32_t firstPrim; // First primitive of the node's range in BvhBuild::prims
+  std::uint32_t primCount; // Number of primitives in the sub-tree
+  std::uint32_t secondChild; // Index of the second child (inner nodes only)
+  std::uint32_t geomID; // == InvalidGeomID for inner nodes. Leaves never mix geometries.
+  std::uint32_t geomFirst; // Leaves only: position of the leaf's first primitive among those of its geometry
+
+  bool isLeaf() const { return geomID != InvalidGeomID; }
+};
+
+struct BvhBuild {
+  std::vector<BuildNode> nodes; // nodes[0] is the root
+  std::vector<BuildPrimitive> prims; // Primitives reordered so that leaves reference contiguous runs
+  std::uint32_t maxDepth; // Depth of the deepest leaf (the root has depth 1)
+};
+
+struct SahBuildSettings {
+  std::uint32_t maxLeafPrims = 8;
+  std::uint32_t numBins = 16;
+  float traversalCost = 1.f;
+  float intersectionCost = 2.f;
+  std::uint32_t parallelThreshold = 4096; // Sub-trees with more primitives than this are built as separate tasks
+};
+
+/// Build a BVH over the primitives. Leaf sizes are chosen by the SAH up to
+/// maxLeafPrims. Throws if the primitive array is empty.
+BvhBuild buildSahBvh(std::vector<BuildPrimitive>&& prims, const SahBuildSettings& settings = SahBuildSettings());
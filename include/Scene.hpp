@@ -7,16 +7,32 @@
 
 #include "Primitives.hpp"
 #include "Mesh.hpp"
+#include "CompactBVH4QNode.hpp"
+#include "Instance.hpp"
 #include "Arrays.hpp"
 #include "Material.hpp"
+#include "Lights.hpp"
+#include "Texture.hpp"
 
 enum class GeomType : uint8_t {
   Mesh = 0,
   Sphere,
   Disc,
+  Instance,
   NumTypes
 };
 
+// Node format used for the scene BVH on CPU and IPU:
+using SceneBvhNode = CompactBVH4QNode;
+
+// Instances reference bottom level BVHs built with the same node format:
+using SceneInstance = Instance<SceneBvhNode, CompiledTriangleMesh>;
+
+#ifndef __IPU__
+// Instances of the host side meshes (e.g. for building and testing):
+using HostSceneInstance = Instance<SceneBvhNode, HostTriangleMesh>;
+#endif
+
 struct CropWindow {
   std::int32_t w;
   std::int32_t h;
@@ -33,16 +49,45 @@ struct GeomRef {
 
 #ifndef __IPU__
 
+// The part of a scene that is resident on one group of IPU tiles when the scene
+// is sharded. A shard holds one sub-tree of the scene BVH and only the triangles
+// and vertices referenced by that sub-tree. Meshes with no triangles in the shard
+// have empty ranges in meshInfo. Leaf primIDs are local to the shard so the
+// per geometry offsets are needed to recover primIDs in the full scene:
+struct SceneShardData {
+  std::vector<MeshInfo> meshInfo;
+  std::vector<Triangle> meshTris;
+  std::vector<embree_utils::Vec3fa> meshVerts;
+  std::vector<embree_utils::Vec3fa> meshNormals;
+  std::vector<PrecomputedTriangle> meshPrecomputed;
+  std::vector<QuantisedVertex> meshPackedVerts; // Quantised with the full scene's meshQuantisation
+  std::vector<OctahedralNormal> meshPackedNormals;
+  std::vector<std::uint32_t> primIDOffsets; // Indexed by geomID
+  std::vector<SceneBvhNode> bvhNodes;
+  std::uint32_t bvhMaxDepth;
+};
+
 struct SceneData {
   std::vector<GeomRef> geometry; // Geometric primitive array
   std::vector<MeshInfo> meshInfo; // Stores offsets for each mesh in the unified index and vertex buffers
   std::vector<Triangle> meshTris;
   std::vector<embree_utils::Vec3fa> meshVerts;
   std::vector<embree_utils::Vec3fa> meshNormals;
+  std::vector<PrecomputedTriangle> meshPrecomputed; // Empty or one per triangle (indexed like meshTris)
+  std::vector<VertexQuantisation> meshQuantisation; // Empty or one per mesh (indexed like meshInfo)
+  std::vector<QuantisedVertex> meshPackedVerts; // If not empty these replace meshVerts and meshNormals
+  std::vector<OctahedralNormal> meshPackedNormals;
   std::vector<std::uint32_t> matIDs;  // Material index corresponding to each primitive
   std::vector<Material> materials;   // Materials
-  std::vector<CompactBVH2Node> bvhNodes; // BVH Nodes
+  std::vector<SceneBvhNode> bvhNodes; // BVH Nodes
   std::uint32_t bvhMaxDepth;
+  std::vector<InstanceInfo> instances; // Instance transforms and the mesh/BVH each one references
+  std::vector<SceneBvhNode> blasNodes; // Bottom level BVH nodes for all instanced meshes
+  std::vector<AreaLight> lights; // Emissive primitives (empty if the scene has none)
+  std::vector<SceneShardData> shards; // Only populated if the scene was sharded
+  std::vector<TexCoord> meshUVs; // Empty or one per vertex (indexed like meshVerts)
+  std::vector<TextureInfo> textures;
+  std::vector<Bc1Block> texels; // The blocks of every texture's mip levels
 };
 
 #endif // ifndef __IPU__
@@ -53,10 +98,23 @@ struct SceneRef {
   ArrayRef<Triangle> meshTris;
   ArrayRef<embree_utils::Vec3fa> meshVerts;
   ArrayRef<embree_utils::Vec3fa> meshNormals;
+  ArrayRef<PrecomputedTriangle> meshPrecomputed;
+  ArrayRef<VertexQuantisation> meshQuantisation;
+  ArrayRef<QuantisedVertex> meshPackedVerts;
+  ArrayRef<OctahedralNormal> meshPackedNormals;
   ArrayRef<std::uint32_t> matIDs;
   ArrayRef<Material> materials;
-  ArrayRef<CompactBVH2Node> bvhNodes;
-  std::uint32_t maxLeafDepth; // Max depth of BVH tree: i.e. size of stack required for traversal.
+  ArrayRef<SceneBvhNode> bvhNodes;
+  ArrayRef<InstanceInfo> instances;
+  ArrayRef<SceneBvhNode> blasNodes;
+  ArrayRef<AreaLight> lights; // Next event estimation is used in path tracing if this is not empty
+  std::uint32_t maxLeafDepth; // Size of stack required for BVH traversal.
+
+  // Textures (see Texture.hpp). Only surfaces of meshes that are not instanced
+  // have texture coordinates:
+  ArrayRef<TexCoord> meshUVs;
+  ArrayRef<TextureInfo> textures;
+  ArrayRef<Bc1Block> texels;
 
   // Params used in path-trace kernel:
   float imageWidth;
@@ -70,7 +128,41 @@ struct SceneRef {
   std::uint32_t samplesPerPixel;
   std::uint64_t rngSeed;
   CropWindow window;
+  AffineTransform camera; // Camera to world (must be rigid): the identity views the scene from the origin
   bool pathTrace;
 };
 
+#ifndef __IPU__
+
+/// The kinds of primitive and material that the IPU path tracer is specialised
+/// for (triangle meshes and diffuse and specular materials are always supported):
+struct SceneFeatures {
+  bool spheres = false;
+  bool discs = false;
+  bool instances = false;
+  bool refractive = false;
+
+  /// Return true if a renderer specialised for these features can render a scene with the other's:
+  bool supports(const SceneFeatures& other) const {
+    return (spheres || !other.spheres) && (discs || !other.discs) &&
+           (instances || !other.instances) && (refractive || !other.refractive);
+  }
+};
+
+inline SceneFeatures getSceneFeatures(const SceneRef& scene) {
+  SceneFeatures features;
+  for (auto i = 0u; i < scene.geometry.size(); ++i) {
+    const auto type = scene.geometry[i].type;
+    features.spheres |= type == GeomType::Sphere;
+    features.discs |= type == GeomType::Disc;
+    features.instances |= type == GeomType::Instance;
+  }
+  for (auto i = 0u; i < scene.materials.size(); ++i) {
+    features.refractive |= scene.materials[i].type == Material::Type::Refractive;
+  }
+  return features;
+}
+
+#endif // ifndef __IPU__
+
 class Intersector {};
@@ -0,0 +1,63 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Analysis of a scene before it is rendered: the quality of its compact BVH
+// and the exact bytes it occupies on every tile. These let a scene that will
+// not fit on tile (or that will trace slowly) be rejected before the graph is
+// compiled.
+
+#pragma once
+
+#include "Scene.hpp"
+#include "SahBvhBuilder.hpp"
+
+#include <functional>
+#include <span>
+#include <string>
+#include <vector>
+
+/// Quality measures of a compact wide BVH (see analyseBvh()):
+struct BvhQuality {
+  std::size_t nodes = 0;
+  std::size_t leaves = 0; // Leaf children
+  std::size_t prims = 0; // Primitives referenced by the leaves
+  double sahCost = 0.0; // Expected cost of a ray that hits the root's bounds
+  double meanOverlap = 0.0; // Mean over nodes of the pairwise overlap of child boxes relative to the node's area
+  double meanBoundsError = 0.0; // Relative surface area that compression adds to the child boxes
+  double maxBoundsError = 0.0;
+  std::vector<std::size_t> leafSizes; // leafSizes[n] counts the leaves of n primitives
+  std::vector<std::size_t> leafDepths; // leafDepths[d] counts the leaves of nodes at depth d (the root has depth 1)
+  std::vector<std::size_t> childCounts; // childCounts[n] counts the nodes with n children
+};
+
+/// Return the exact bounds of a leaf's run of primitives:
+using LeafBoundsFn = std::function<embree_utils::Bounds3d(std::uint32_t geomID, std::uint32_t firstPrim, std::uint32_t primCount)>;
+
+/// Analyse a compact wide BVH. The bounds error compares the boxes stored in the
+/// nodes with the exact bounds of the primitives they contain and the SAH cost uses
+/// the build settings' traversal and intersection costs. Instantiated for
+/// CompactBVH4Node and CompactBVH4QNode.
+template <class WideNode>
+BvhQuality analyseBvh(std::span<const WideNode> nodes, const LeafBoundsFn& leafBounds,
+                      const SahBuildSettings& costs = SahBuildSettings());
+
+/// Bytes of one component of the scene as it is stored on every tile:
+struct TileMemoryItem {
+  std::string name;
+  std::size_t bytes;
+};
+
+/// Offsets in each tile's copy of the scene upload: the spheres and discs padded
+/// to the graph's capacity (and aligned) come first, then the serialised scene:
+struct SceneUploadLayout {
+  std::size_t discsOffset;
+  std::size_t sceneOffset;
+};
+SceneUploadLayout sceneUploadLayout(std::size_t maxSpheres, std::size_t maxDiscs);
+
+/// Return the exact bytes of each component of the serialised scene (including the
+/// padding that aligns it) followed by the sphere and disc arrays as they are uploaded
+/// (padded to the graph's capacity of maxSpheres and maxDiscs). If maxSceneBytes is
+/// larger than the serialised scene the padding up to it is included too. Together
+/// they are the scene's memory on every tile (a sharded scene only stores its shard on each tile):
+std::vector<TileMemoryItem> sceneTileMemory(const SceneRef& scene, std::size_t maxSpheres, std::size_t maxDiscs,
+                                            std::size_t maxSceneBytes = 0);
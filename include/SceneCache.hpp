@@ -0,0 +1,71 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Persistent on-disk cache of a scene that has been imported, built, and
+// serialised for the IPU. The file holds the Serialiser byte stream of the
+// SceneRef followed by the sphere and disc arrays. Everything is aligned in
+// the file so that it can be memory mapped and streamed to the device (and
+// referenced on the host) without any deserialisation copies.
+
+#pragma once
+
+#include "Scene.hpp"
+#include "Primitives.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// 64-bit FNV-1a hash. Pass a previous result as the seed to combine hashes:
+std::uint64_t hashBytes(const void* data, std::size_t size, std::uint64_t seed = 0xcbf29ce484222325ull);
+
+/// Hash the contents of a file. Throws if the file can not be read.
+std::uint64_t hashFile(const std::string& path, std::uint64_t seed = 0xcbf29ce484222325ull);
+
+class SceneCache {
+public:
+  /// Serialise the scene and its primitives to a new cache file. The file is
+  /// written to a temporary path first then renamed so a partially written
+  /// cache is never loaded. Throws if the file can not be written.
+  static void save(const std::string& path, std::uint64_t key,
+                   const SceneRef& scene, float horizontalFov,
+                   const std::vector<Sphere>& spheres,
+                   const std::vector<Disc>& discs);
+
+  /// Memory map a cache file. Returns nullptr if the file does not exist or
+  /// if it was written by a different version or for a different key.
+  static std::unique_ptr<SceneCache> load(const std::string& path, std::uint64_t key);
+
+  SceneCache(const SceneCache&) = delete;
+  SceneCache& operator = (const SceneCache&) = delete;
+  ~SceneCache();
+
+  /// Scene whose arrays reference the mapped file. The render parameters
+  /// are those that were used when the cache was written:
+  SceneRef& getSceneRef() { return scene; }
+  float getHorizontalFov() const { return horizontalFov; }
+  const std::vector<Sphere>& getSpheres() const { return spheres; }
+  const std::vector<Disc>& getDiscs() const { return discs; }
+
+  /// Overwrite the render parameters in the mapped byte stream with those of
+  /// the given scene. The mapping is private so this never modifies the file
+  /// (only the page holding the parameters is copied):
+  void setRenderParams(const SceneRef& params);
+
+  /// The serialised scene ready to be streamed to the device:
+  const std::uint8_t* getSerialisedScene() const { return bytes + sceneOffset; }
+  std::size_t getSerialisedSceneSize() const { return sceneSize; }
+
+private:
+  SceneCache() = default;
+
+  std::uint8_t* bytes = nullptr;
+  std::size_t mappedSize = 0;
+  std::size_t sceneOffset = 0;
+  std::size_t sceneSize = 0;
+  std::size_t paramsOffset = 0;
+  SceneRef scene;
+  float horizontalFov = 0.f;
+  std::vector<Sphere> spheres;
+  std::vector<Disc> discs;
+};
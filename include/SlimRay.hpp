@@ -0,0 +1,86 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Compact ray record for streaming path-trace ray batches between the host,
+// DRAM, and the compute tiles. Camera rays are generated on the compute tiles
+// from the pixel coordinate so the only data that needs to go in is the pixel
+// and the only data that comes out is the radiance. The full TraceResult only
+// ever exists in tile memory.
+
+#pragma once
+
+#include <embree_utils/geometry.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#ifndef __IPU__
+#include <cmath>
+#endif
+
+struct SlimRay {
+  std::uint16_t u; // Pixel row
+  std::uint16_t v; // Pixel column
+  std::uint32_t rgbe; // Radiance in shared exponent (Ward's RGBE) format
+};
+
+/// Encode a non-negative colour with an 8-bit mantissa per channel and a shared
+/// 8-bit exponent. Values smaller than 2^-120 encode as black:
+inline std::uint32_t encodeRgbe(const embree_utils::Vec3fa& c) {
+  const float m = std::max(std::max(c.x, c.y), std::max(c.z, 0.f));
+  if (!(m >= 0x1p-120f)) {
+    return 0u; // Black (also catches NaNs)
+  }
+
+  // Exponent e such that m = f * 2^e with f in [0.5, 1):
+  std::uint32_t bits;
+  std::memcpy(&bits, &m, sizeof(bits));
+  std::int32_t e = std::int32_t((bits >> 23) & 0xff) - 126;
+  e = std::min(e, 127);
+
+  // Scale so that mantissas are in [0, 256):
+  const std::uint32_t scaleBits = std::uint32_t(127 + 8 - e) << 23;
+  float scale;
+  std::memcpy(&scale, &scaleBits, sizeof(scale));
+  auto mantissa = [&](float x) {
+    return (std::uint32_t)std::min(std::max(x * scale, 0.f), 255.f);
+  };
+  return mantissa(c.x) | (mantissa(c.y) << 8) | (mantissa(c.z) << 16) | (std::uint32_t(e + 128) << 24);
+}
+
+/// Return the index in the ray stream of the ray that is at position i of a slim
+/// ray stream. Within each full batch the tiles are dealt consecutive rays in turn
+/// so every tile traces pixels spread over the whole region of the image covered
+/// by the batch (rather than one contiguous run of pixels). Compute sets wait for
+/// the slowest tile so this balances the work when some pixels have much longer
+/// paths than others (e.g. sky versus interior). A partial last batch (which has
+/// padding) is left in order. The mapping only permutes rays within a batch:
+inline std::uint32_t interleavedRayIndex(std::uint32_t i, std::uint32_t raysPerBatch,
+                                         std::uint32_t raysPerTile, std::uint32_t numRays) {
+  const auto batch = i / raysPerBatch;
+  const auto first = batch * raysPerBatch;
+  if (numRays - first < raysPerBatch) {
+    return i;
+  }
+  const auto numTiles = raysPerBatch / raysPerTile;
+  const auto tile = (i - first) / raysPerTile;
+  const auto j = (i - first) % raysPerTile;
+  return first + j * numTiles + tile;
+}
+
+#ifndef __IPU__
+/// Decode a colour encoded by encodeRgbe(). Non-zero mantissas are
+/// reconstructed at the centre of their quantisation interval:
+inline embree_utils::Vec3fa decodeRgbe(std::uint32_t rgbe) {
+  const auto e = rgbe >> 24;
+  if (e == 0) {
+    return embree_utils::Vec3fa(0.f, 0.f, 0.f);
+  }
+  const float f = std::ldexp(1.f, int(e) - (128 + 8));
+  auto channel = [&](std::uint32_t shift) {
+    const auto m = (rgbe >> shift) & 0xff;
+    return m ? (m + .5f) * f : 0.f;
+  };
+  return embree_utils::Vec3fa(channel(0), channel(8), channel(16));
+}
+#endif
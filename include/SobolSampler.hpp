@@ -0,0 +1,95 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Low discrepancy sampling with Owen scrambled Sobol points following
+// "Practical Hash-based Owen Scrambling" (Burley 2020). Only the first two
+// dimensions of the Sobol sequence are used (these have closed form generator
+// matrices so no tables are needed on tile) and they are reused for every
+// pair of dimensions: each pair shuffles the sample index and scrambles the
+// points with its own seed so that the pairs are decorrelated. Every pixel
+// has its own seed so the remaining error looks like noise rather than
+// structured artefacts. The same code runs on the IPU and the CPU.
+
+#pragma once
+
+#include <cstdint>
+
+namespace sobol {
+
+inline std::uint32_t reverseBits(std::uint32_t x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+/// Integer hash (lowbias32) used to derive seeds:
+inline std::uint32_t hash(std::uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+inline std::uint32_t hashCombine(std::uint32_t seed, std::uint32_t v) {
+  return seed ^ (hash(v) + (seed << 6) + (seed >> 2));
+}
+
+/// Owen scramble the bits of x (most significant bit first):
+inline std::uint32_t nestedUniformScramble(std::uint32_t x, std::uint32_t seed) {
+  // Laine-Karras style permutation of the reversed bits:
+  x = reverseBits(x);
+  x ^= x * 0x3d20adeau;
+  x += seed;
+  x *= (seed >> 16) | 1u;
+  x ^= x * 0x05526c56u;
+  x ^= x * 0x53a22864u;
+  return reverseBits(x);
+}
+
+/// First dimension of the Sobol sequence (the van der Corput sequence):
+inline std::uint32_t sobol0(std::uint32_t index) {
+  return reverseBits(index);
+}
+
+/// Second dimension of the Sobol sequence:
+inline std::uint32_t sobol1(std::uint32_t index) {
+  std::uint32_t result = 0;
+  for (std::uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+    if (index & 1u) {
+      result ^= v;
+    }
+  }
+  return result;
+}
+
+} // end namespace sobol
+
+/// Sampler for one sample of one pixel. Each call to uniform_0_1() returns
+/// the next dimension of the sample's scrambled Sobol point so that two
+/// consecutive calls give a stratified 2D sample. The sample index should
+/// count the samples of the pixel from zero:
+class SobolSampler {
+public:
+  SobolSampler() : SobolSampler(0u, 0u, 0u) {}
+
+  SobolSampler(std::uint32_t pixelIndex, std::uint32_t sampleIndex, std::uint32_t seed)
+    : pixelSeed(sobol::hashCombine(sobol::hash(seed), pixelIndex)), index(sampleIndex), dimension(0) {}
+
+  float uniform_0_1() {
+    const auto pairSeed = sobol::hashCombine(pixelSeed, dimension >> 1);
+    const auto shuffled = sobol::nestedUniformScramble(index, pairSeed);
+    const bool second = dimension & 1u;
+    const auto x = second ? sobol::sobol1(shuffled) : sobol::sobol0(shuffled);
+    dimension += 1;
+    // Keep 24 bits so that the result is exactly representable and less than one:
+    return float(sobol::nestedUniformScramble(x, sobol::hashCombine(pairSeed, second + 1u)) >> 8) * 0x1p-24f;
+  }
+
+private:
+  std::uint32_t pixelSeed;
+  std::uint32_t index;
+  std::uint32_t dimension;
+};
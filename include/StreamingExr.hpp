@@ -0,0 +1,83 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Writes an OpenEXR file incrementally while ray batches are received. The
+// image is stored in tiles and each tile is written to the file as soon as all
+// of the render window's pixels in it have arrived so there is little left to
+// write when the render ends. Every AOV is a separate RGB part of one
+// (multi-part) file and pixels are stored as half or single precision floats.
+
+#pragma once
+
+#include <Scene.hpp>
+#include <embree_utils/geometry.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+
+class StreamingExr {
+public:
+  // Values match the OpenEXR pixel type enumeration:
+  enum class PixelType : std::int32_t {
+    HALF = 1,
+    FLOAT = 2
+  };
+
+  /// Each part of the file takes its RGB value from the results:
+  using AovFn = std::function<embree_utils::Vec3fa(const embree_utils::TraceResult&)>;
+  struct Part {
+    std::string name;
+    AovFn value;
+  };
+
+  /// Create the file and write its headers. Pixels outside the window are
+  /// never received and stay black:
+  StreamingExr(const std::string& path, std::uint32_t width, std::uint32_t height, const CropWindow& window,
+               std::vector<Part> parts, PixelType type, std::uint32_t tileSize = 64);
+
+  /// Calls finish() if it has not been called (errors are only logged):
+  ~StreamingExr();
+
+  /// Add a batch of results and write any tiles they complete. This can be
+  /// called concurrently from multiple threads (e.g. the stream callbacks of
+  /// different replicas). A pixel received again replaces its earlier value:
+  void add(std::span<const embree_utils::TraceResult> batch);
+
+  /// Write all tiles that are incomplete or changed since they were written and
+  /// then the tile offsets. Throws if the file could not be written:
+  void finish();
+
+  std::size_t getNumTiles() const { return tilesX * tilesY; }
+  std::size_t getTilesStreamed() const { return tilesStreamed; }
+
+private:
+  const std::string path;
+  const std::uint32_t width;
+  const std::uint32_t height;
+  const std::vector<Part> parts;
+  const PixelType type;
+  const std::uint32_t tileSize;
+  const std::uint32_t tilesX;
+  const std::uint32_t tilesY;
+
+  std::vector<std::vector<float>> pixels; // RGB per pixel for each part
+  std::vector<std::uint32_t> tileExpected; // Window pixels in each tile
+  std::vector<std::atomic<std::uint32_t>> tileReceived;
+  std::vector<std::atomic<bool>> tileWritten;
+  std::vector<std::atomic<bool>> tileDirty; // Received pixels after being written
+
+  std::mutex fileMutex; // Guards everything below
+  std::ofstream file;
+  std::uint64_t offsetTablePos;
+  std::uint64_t fileEnd;
+  std::vector<std::vector<std::uint64_t>> tileOffsets; // For each part
+  std::atomic<std::size_t> tilesStreamed;
+  bool finished;
+
+  void writeTile(std::size_t tile);
+};
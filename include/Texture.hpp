@@ -0,0 +1,112 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Block compressed textures that are sampled in the same way on IPU and CPU.
+// Texels are stored as BC1 (DXT1) blocks: each 4x4 block of texels is two
+// RGB565 end point colours and a 2-bit index per texel that selects one of
+// four colours on the line between them. That is 4 bits per texel (an eighth
+// of 8-bit RGBA) so textures can be replicated on every tile along with the
+// rest of the scene. Each texture has a full chain of mip levels (down to
+// 1x1) and a lookup reads the level whose texels best match the footprint of
+// the ray. Texture coordinates wrap and v points up the image (the convention
+// of the texture coordinates that assimp returns).
+
+#pragma once
+
+#include <embree_utils/geometry.hpp>
+#include <Arrays.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#ifndef __IPU__
+#include <vector>
+#endif
+
+struct TexCoord {
+  float u, v;
+};
+
+struct Bc1Block {
+  std::uint16_t c0, c1; // RGB565 end points (c0 > c1 selects four colours, otherwise three and black)
+  std::uint32_t indices; // Two bits per texel in row major order starting from the least significant
+};
+
+struct TextureInfo {
+  std::uint32_t width; // Size of level 0
+  std::uint32_t height;
+  std::uint32_t numLevels;
+  std::uint32_t firstBlock; // Index of level 0's first block in the scene's blocks (the other levels follow it)
+};
+
+inline std::uint32_t mipSize(std::uint32_t size, std::uint32_t level) {
+  return std::max(size >> level, 1u);
+}
+
+inline std::uint32_t blocksAcross(std::uint32_t size) {
+  return (size + 3) / 4;
+}
+
+inline embree_utils::Vec3fa decodeRgb565(std::uint16_t c) {
+  return embree_utils::Vec3fa(((c >> 11) & 31u) * (1.f / 31.f),
+                              ((c >> 5) & 63u) * (1.f / 63.f),
+                              (c & 31u) * (1.f / 31.f));
+}
+
+/// Decode the texel at (x, y) (both in [0, 4)) of a block:
+inline embree_utils::Vec3fa decodeBc1Texel(const Bc1Block& block, std::uint32_t x, std::uint32_t y) {
+  const auto index = (block.indices >> (2 * (4 * y + x))) & 3u;
+  const auto c0 = decodeRgb565(block.c0);
+  const auto c1 = decodeRgb565(block.c1);
+  if (index == 0) { return c0; }
+  if (index == 1) { return c1; }
+  if (block.c0 > block.c1) {
+    return index == 2 ? c0 * (2.f / 3.f) + c1 * (1.f / 3.f) : c0 * (1.f / 3.f) + c1 * (2.f / 3.f);
+  }
+  return index == 2 ? (c0 + c1) * .5f : embree_utils::Vec3fa(0.f, 0.f, 0.f);
+}
+
+/// Choose the mip level with about one texel per ray footprint. The footprint is
+/// the world space area that the ray covers at the surface and texelsPerArea the
+/// density of level 0's texels on the surface. Each level has a quarter of the
+/// texels of the one above it so the level is log4 of the texels covered (rounded):
+inline std::uint32_t textureLevel(const TextureInfo& texture, float footprint, float texelsPerArea) {
+  const float texels = footprint * texelsPerArea;
+  std::uint32_t level = 0;
+  for (float limit = 2.f; level + 1 < texture.numLevels && texels > limit; limit *= 4.f) {
+    level += 1;
+  }
+  return level;
+}
+
+/// Nearest texel lookup in one level of a texture:
+template <class Blocks>
+embree_utils::Vec3fa sampleTexture(const TextureInfo& texture, const Blocks& blocks, const TexCoord& uv, std::uint32_t level) {
+  auto block = texture.firstBlock;
+  for (auto l = 0u; l < level; ++l) {
+    block += blocksAcross(mipSize(texture.width, l)) * blocksAcross(mipSize(texture.height, l));
+  }
+  const auto w = mipSize(texture.width, level);
+  const auto h = mipSize(texture.height, level);
+  const float u = uv.u - std::floor(uv.u);
+  const float v = 1.f - (uv.v - std::floor(uv.v));
+  const auto x = std::min(std::uint32_t(u * w), w - 1);
+  const auto y = std::min(std::uint32_t(v * h), h - 1);
+  block += (y / 4) * blocksAcross(w) + x / 4;
+  return decodeBc1Texel(blocks[block], x % 4, y % 4);
+}
+
+#ifndef __IPU__
+
+/// Encode 16 texels (row major, components in [0, 1]) as a BC1 block. The end
+/// points are the extremes of the texels along the diagonal of their bounding box:
+Bc1Block encodeBc1Block(const embree_utils::Vec3fa (&texels)[16]);
+
+/// Compress a linear RGB image (3 floats per texel stored row by row from the
+/// top) to BC1 with a full mip chain. The blocks are appended to the array and
+/// the texture's info returned. If maxSize is not zero levels that are wider or
+/// taller than it are dropped (so that large textures fit in tile memory):
+TextureInfo compressTexture(const std::vector<float>& rgb, std::uint32_t width, std::uint32_t height,
+                            std::vector<Bc1Block>& blocks, std::uint32_t maxSize = 0);
+
+#endif
@@ -0,0 +1,57 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Orderings of the screen tiles of an image. Visiting tiles along a space
+// filling curve keeps consecutive tiles close together on screen, so the rays
+// of tiles that are traced close together in time tend to traverse the same
+// parts of the BVH.
+
+#pragma once
+
+#include <Scene.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+/// Interleave the bits of x and y (x in the even bits):
+inline std::uint32_t mortonCode2d(std::uint16_t x, std::uint16_t y) {
+  auto spread = [](std::uint32_t v) {
+    v = (v | (v << 8)) & 0x00ff00ffu;
+    v = (v | (v << 4)) & 0x0f0f0f0fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+  };
+  return spread(x) | (spread(y) << 1);
+}
+
+/// Return the (row major) indices of a grid of tiles in Morton order. Grids
+/// that are not a power of two in size skip the curve's missing cells:
+inline std::vector<std::uint32_t> mortonTileOrder(std::uint32_t tilesX, std::uint32_t tilesY) {
+  std::vector<std::uint32_t> order(tilesX * tilesY);
+  std::iota(order.begin(), order.end(), 0u);
+  std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) {
+    return mortonCode2d(a % tilesX, a / tilesX) < mortonCode2d(b % tilesX, b / tilesX);
+  });
+  return order;
+}
+
+/// Split a render window into buckets of at most size x size pixels (buckets at
+/// the right and bottom edges are cropped to the window). The buckets are in
+/// Morton order so the first one is always the largest:
+inline std::vector<CropWindow> bucketWindows(const CropWindow& window, std::uint32_t size) {
+  const std::uint32_t bucketsX = (window.w + size - 1) / size;
+  const std::uint32_t bucketsY = (window.h + size - 1) / size;
+  std::vector<CropWindow> buckets;
+  buckets.reserve(bucketsX * bucketsY);
+  for (auto b : mortonTileOrder(bucketsX, bucketsY)) {
+    const std::int32_t c = (b % bucketsX) * size;
+    const std::int32_t r = (b / bucketsX) * size;
+    buckets.push_back(CropWindow{
+      std::min<std::int32_t>(size, window.w - c), std::min<std::int32_t>(size, window.h - r),
+      window.c + c, window.r + r
+    });
+  }
+  return buckets;
+}
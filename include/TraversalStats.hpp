@@ -0,0 +1,66 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Instrumentation of BVH traversal. A TraversalRecorder wraps a primitive
+// lookup so that CompactBvh records the nodes and primitives it visits while
+// tracing with it (plain lookups record nothing and cost nothing).
+
+#pragma once
+
+#include "embree_utils/geometry.hpp"
+
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+/// Work done to trace a pixel's rays (summed over its samples):
+struct TraversalStats {
+  std::uint32_t nodes = 0; // BVH nodes visited
+  std::uint32_t prims = 0; // Primitives tested
+  std::uint32_t bounces = 0; // Closest hit rays cast (path segments)
+  std::uint32_t cycles = 0; // Tile cycles spent on the pixel
+
+  /// Store the mean per sample in the hit record (once a pixel is finished the
+  /// rest of the record is no longer needed): the throughput holds the nodes,
+  /// primitives, and bounces and the ray's tMin holds the cycles:
+  void store(embree_utils::HitRecord& hit, std::uint32_t count) const {
+    const float scale = count ? 1.f / float(count) : 0.f;
+    hit.throughput = embree_utils::Vec3fa(float(nodes), float(prims), float(bounces)) * scale;
+    hit.r.tMin = float(cycles) * scale;
+  }
+};
+
+/// Primitive lookup that forwards to another lookup and records traversal statistics:
+template <class Lookup>
+struct TraversalRecorder {
+  Lookup& lookup;
+  TraversalStats& stats;
+
+  // Forward whichever kind of lookup is wrapped (see visitPrimitive()):
+  template <class L = Lookup>
+  auto operator()(std::uint16_t geomID, std::uint32_t primID) const -> decltype(std::declval<L&>()(geomID, primID)) {
+    return lookup(geomID, primID);
+  }
+
+  template <class F>
+  void visit(std::uint16_t geomID, F&& f) const { lookup.visit(geomID, std::forward<F>(f)); }
+
+  void recordNode() const { stats.nodes += 1; }
+  void recordPrims(std::uint32_t count) const { stats.prims += count; }
+};
+
+/// True for lookups that record traversal statistics:
+template <class Lookup, class = void>
+struct RecordsTraversal : std::false_type {};
+
+template <class Lookup>
+struct RecordsTraversal<Lookup, std::void_t<decltype(std::declval<Lookup&>().recordNode())>> : std::true_type {};
+
+template <class Lookup>
+void recordNodeVisit(Lookup& primLookup) {
+  if constexpr (RecordsTraversal<Lookup>::value) { primLookup.recordNode(); }
+}
+
+template <class Lookup>
+void recordPrimTests(Lookup& primLookup, std::uint32_t count) {
+  if constexpr (RecordsTraversal<Lookup>::value) { primLookup.recordPrims(count); }
+}
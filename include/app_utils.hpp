@@ -14,12 +14,14 @@
 
 #include <math/sincos.hpp>
 #include <IpuScene.hpp>
+#include <RayStream.hpp>
 #include <CompactBvhBuild.hpp>
 #include <CompactBvh.hpp>
+#include <SceneAnalysis.hpp>
 #include <BxDF.hpp>
 #include <Render.hpp>
+#include <SobolSampler.hpp>
 #include <scene_utils.hpp>
-#include <embree_utils/bvh.hpp>
 #include <embree_utils/EmbreeScene.hpp>
 #include <embree_utils/geometry.hpp>
 
@@ -29,28 +31,63 @@ enum VisualiseMode {
   NORMAL,
   RAY_TFAR,
   MAT_COLOR,
-  HIT_POINT
+  HIT_POINT,
+  // Heat maps of the traversal statistics (see IpuScene::setTraversalStats()):
+  BVH_NODES,
+  PRIM_TESTS,
+  BOUNCES,
+  CYCLES
 };
 
+inline bool isTraversalStatsMode(VisualiseMode mode) { return mode >= BVH_NODES; }
+
 enum RenderMode {
   SHADOW_TRACE,
   PATH_TRACE
 };
 
-void initPerspectiveRayStream(std::vector<embree_utils::TraceResult>& rayStream,
+void initPerspectiveRayStream(RayStream& rayStream,
                               const cv::Mat& image,
                               const SceneRef& data,
                               xoshiro::Generator* gen = nullptr);
 
-void zeroRgb(std::vector<embree_utils::TraceResult>& rayStream);
+// Initialise only the camera rays at the given ray stream indices (e.g. the rays of
+// one screen tile). If indices is null the first count rays are initialised:
+void initPerspectiveRays(RayStream& rayStream,
+                         const std::uint32_t* indices, std::size_t count,
+                         const cv::Mat& image,
+                         const SceneRef& data,
+                         xoshiro::Generator* gen = nullptr);
+
+// As above but each ray gets its own low discrepancy sampler (written to samplers[i]
+// for the i-th ray) which has already been used to jitter the camera ray:
+void initPerspectiveRays(RayStream& rayStream,
+                         const std::uint32_t* indices, std::size_t count,
+                         const cv::Mat& image,
+                         const SceneRef& data,
+                         std::uint32_t sampleIndex, std::uint32_t seed,
+                         SobolSampler* samplers);
+
+void zeroRgb(RayStream& rayStream);
 
-void scaleRgb(std::vector<embree_utils::TraceResult>& rayStream, float scale);
+void scaleRgb(RayStream& rayStream, float scale);
 
-unsigned visualiseHits(const std::vector<embree_utils::TraceResult>& rayStream,
+unsigned visualiseHits(const RayStream& rayStream,
                        const SceneRef& data, cv::Mat& image, VisualiseMode mode);
 
+// Denoise a path traced image (CV_32FC3) using the first hit AOVs that the IPU
+// returns in the ray stream's hit records (see IpuScene::setDenoiseAovs()):
+cv::Mat denoiseImage(const cv::Mat& image, const RayStream& rayStream);
+
+// Write an image file (the format is chosen by the file's extension):
+void saveImage(const std::string& fileName, const cv::Mat& image);
+
 const Primitive* getPrimitive(GeomRef geom, const SceneDescription& scene);
 
+// Return a function that gives the exact bounds of the runs of primitives in the leaves of
+// the scene's BVH (for analyseBvh()). The scene must be the one its SceneData was built from:
+LeafBoundsFn makeLeafBoundsFn(const SceneData& data, const SceneDescription& scene);
+
 void setupLogging(const boost::program_options::variables_map& args);
 
 std::optional<CropWindow> parseCropString(const std::string& cropFmt);
@@ -63,6 +100,32 @@ std::unique_ptr<PathTraceSettings> makePathTraceSettings(const boost::program_op
 // mirror the file import format).
 SceneDescription buildSceneDescription(const boost::program_options::variables_map& args);
 
+// Path of the scene cache file for the scene and build options selected by args. The
+// file name is a hash of the mesh file's contents and every option that affects the
+// scene data. Returns an empty string if the 'scene-cache' option is not set.
+std::string sceneCachePath(const boost::program_options::variables_map& args, std::uint64_t& key);
+
+// Reorder the triangles of every mesh (in both scene data and description) to match
+// the primitive order of the BVH build so that each leaf references a contiguous run.
+void reorderMeshTriangles(const BvhBuild& bvh, SceneData& data, SceneDescription& scene);
+
+// Split the scene into shards that each own one sub-tree of the BVH and the
+// geometry it references. Must be called after reorderMeshTriangles().
+std::vector<SceneShardData> buildSceneShards(const BvhBuild& bvh, const SceneData& data, std::uint32_t numShards);
+
+// Compute the precomputed triangle data of every mesh (in both scene data and
+// description). Must be called after reorderMeshTriangles().
+void precomputeMeshTriangles(SceneData& data, SceneDescription& scene);
+
+// Snap the vertices and normals of every mesh in the scene description to the
+// values they take in compact storage and record each mesh's quantisation.
+void quantiseMeshVertices(SceneData& data, SceneDescription& scene);
+
+// Make the list of area lights for next event estimation: one light for every
+// triangle, sphere, and disc whose material is emissive. The geometry and
+// instances must already be recorded in the scene data.
+std::vector<AreaLight> buildAreaLights(const SceneData& data, const SceneDescription& scene);
+
 // Build efficient scene representations for both Embree and our custom CPU/IPU renderers/
 //
 // The scene description needs to be converted into a compact representation
@@ -72,4 +135,11 @@ SceneDescription buildSceneDescription(const boost::program_options::variables_m
 // Note: creation order is important in all cases because geomIDs
 // (Embree concept) are used to retrieve primitives during BVH traversal)
 // Mapping between materials and primitives also depends on a consistent order.
-std::pair<SceneData, embree_utils::EmbreeScene> buildSceneData(const SceneDescription& scene);
+// Mesh triangles in the scene description are reordered to match the BVH leaves.
+// If numShards is non-zero the scene is also split into that many shards.
+// If precomputeTriangles is set every mesh also stores precomputed triangle data.
+// If compactVertices is set the scene data holds quantised vertices and octahedral
+// normals instead of full precision ones.
+std::pair<SceneData, embree_utils::EmbreeScene> buildSceneData(SceneDescription& scene, std::uint32_t numShards = 0,
+                                                               bool precomputeTriangles = false,
+                                                               bool compactVertices = false);
@@ -7,6 +7,8 @@
 #include "geometry.hpp"
 #include "shapes.hpp"
 
+#include <span>
+
 namespace {
 
 RTCRayHit convertHitRecord(const embree_utils::HitRecord& hit) {
@@ -77,7 +79,7 @@ public:
     rtcCommitScene(scene);
   }
 
-  void intersect(std::vector<RTCRayHit>& hitStream, std::size_t numParallelJobs) {
+  void intersect(std::span<RTCRayHit> hitStream, std::size_t numParallelJobs) {
     RTCIntersectContext context;
     rtcInitIntersectContext(&context);
 
@@ -95,7 +97,7 @@ public:
     }
   }
 
-  void occluded(std::vector<RTCRayHit>& hitStream, std::size_t numParallelJobs) {
+  void occluded(std::span<RTCRayHit> hitStream, std::size_t numParallelJobs) {
     RTCIntersectContext context;
     rtcInitIntersectContext(&context);
 
@@ -117,7 +119,8 @@ public:
     embree_utils::addSphere(device, scene, pos, radius);
   }
 
-  void addTriMesh(ConstArrayRef<embree_utils::Vec3fa> vertices, ConstArrayRef<std::uint16_t> triIndices) {
+  template <class Index>
+  void addTriMesh(ConstArrayRef<embree_utils::Vec3fa> vertices, ConstArrayRef<Index> triIndices) {
     embree_utils::addTriMesh(device, scene, vertices, triIndices);
   }
 
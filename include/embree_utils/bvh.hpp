@@ -6,6 +6,7 @@
 
 #include "node.hpp"
 
+#include <algorithm>
 #include <exception>
 #include <sstream>
 
@@ -50,10 +51,12 @@ struct BvhBuilder {
     args.maxBranchingFactor = 2;
     args.maxDepth = 64;
     args.sahBlockSize = 1;
+    // Embree terminates the build using the SAH so leaf sizes
+    // are chosen by cost up to the maximum we can store:
     args.minLeafSize = 1;
-    args.maxLeafSize = 1;
+    args.maxLeafSize = LeafNode::MaxPrimitives;
     args.traversalCost = 1.0f;
-    args.intersectionCost = 8.0f;
+    args.intersectionCost = 2.0f;
     args.bvh = bvh.bvh;
     args.primitives = buildPrimitives.data();
     args.primitiveCount = buildPrimitives.size();
@@ -84,7 +87,7 @@ struct BvhBuilder {
     return leafCount + innerCount;
   }
 
-  using TraversalFunction = std::function<void(const Node*)>;
+  using TraversalFunction = std::function<void(Node*)>;
 
   void depthFirstTraversal(Node* startNode, const TraversalFunction& visit) {
     std::vector<Node*> stack;
@@ -120,8 +123,48 @@ struct BvhBuilder {
   }
 
   static void* createLeaf(RTCThreadLocalAllocator alloc, const RTCBuildPrimitive* prims, size_t numPrims, void* userPtr) {
-    ((BvhBuilder*)userPtr)->leafCount += 1;
-    return LeafNode::create(alloc, prims, numPrims, userPtr);
+    auto* builder = (BvhBuilder*)userPtr;
+    if (numPrims > LeafNode::MaxPrimitives) { throw std::runtime_error("Too many primitives in leaf"); }
+
+    // Leaves can only reference one geometry so group primitives by geomID:
+    RTCBuildPrimitive sorted[LeafNode::MaxPrimitives];
+    std::copy(prims, prims + numPrims, sorted);
+    std::stable_sort(sorted, sorted + numPrims, [](const auto& a, const auto& b) { return a.geomID < b.geomID; });
+
+    Node* leaves[LeafNode::MaxPrimitives];
+    Bounds3d bounds[LeafNode::MaxPrimitives];
+    std::size_t leafCount = 0;
+    for (std::size_t start = 0; start < numPrims;) {
+      auto end = start + 1;
+      while (end < numPrims && sorted[end].geomID == sorted[start].geomID) { end += 1; }
+      auto* leaf = (LeafNode*)LeafNode::create(alloc, &sorted[start], end - start, nullptr);
+      bounds[leafCount] = leaf->bounds;
+      leaves[leafCount] = leaf;
+      leafCount += 1;
+      start = end;
+    }
+
+    builder->leafCount += leafCount;
+    Bounds3d unused;
+    return (void*)combineNodes(alloc, leaves, bounds, leafCount, builder, unused);
+  }
+
+  /// Join a small array of nodes into a balanced binary tree:
+  static Node* combineNodes(RTCThreadLocalAllocator alloc, Node** nodes, const Bounds3d* bounds, std::size_t count, BvhBuilder* builder, Bounds3d& combinedBounds) {
+    if (count == 1) {
+      combinedBounds = bounds[0];
+      return nodes[0];
+    }
+    builder->innerCount += 1;
+    auto* inner = (InnerNode*)InnerNode::create(alloc, 2, nullptr);
+    const auto split = count / 2;
+    Bounds3d childBounds[2];
+    inner->children[0] = combineNodes(alloc, nodes, bounds, split, builder, childBounds[0]);
+    inner->children[1] = combineNodes(alloc, nodes + split, bounds + split, count - split, builder, childBounds[1]);
+    inner->bounds += childBounds[0];
+    inner->bounds += childBounds[1];
+    combinedBounds = inner->bounds;
+    return inner;
   }
 };
 
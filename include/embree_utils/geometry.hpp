@@ -8,6 +8,7 @@
 #include <cstdint>
 #include <cmath>
 #include <algorithm>
+#include <tuple>
 
 namespace embree_utils {
 
@@ -175,6 +176,11 @@ struct Bounds3d {
     return (max + min) * .5f;
   }
 
+  float surfaceArea() const {
+    const auto d = max - min;
+    return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+
   void operator += (const Bounds3d& other) {
     min.x = std::min(min.x, other.min.x);
     min.y = std::min(min.y, other.min.y);
@@ -231,6 +237,7 @@ struct HitRecord {
   // Bitmasks for the hit flag:
   static constexpr std::uint16_t ERROR = 1;
   static constexpr std::uint16_t ESCAPED = 2;
+  static constexpr std::uint16_t TERMINATED = 4; // Path ended by Russian roulette
 
   HitRecord() {}
   HitRecord(const Vec3fa& origin, const Vec3fa& dir)
@@ -67,27 +67,41 @@ struct InnerNode : public Node {
   }
 };
 
+// A leaf holds a small run of primitives that all belong to the same geometry.
 struct LeafNode : public Node {
+  static constexpr unsigned MaxPrimitives = 8;
+
   Bounds3d bounds;
-  unsigned primID;
+  unsigned primID; // First primitive of the run (only valid once primitives are reordered)
   unsigned geomID;
+  unsigned primCount;
+  unsigned primIDs[MaxPrimitives]; // Primitive IDs as they were passed to the build
 
-  LeafNode (const Bounds3d& bounds, unsigned pId, unsigned gId)
-    : primID(pId), geomID(gId), bounds(bounds) {}
+  LeafNode (const Bounds3d& bounds, const RTCBuildPrimitive* prims, size_t numPrims)
+    : bounds(bounds), primID(prims[0].primID), geomID(prims[0].geomID), primCount(numPrims) {
+    for (auto i = 0u; i < numPrims; ++i) {
+      primIDs[i] = prims[i].primID;
+    }
+  }
 
   float sah() override {
     throw std::runtime_error("Does this get called?");
     return 1.0f;
   }
 
+  /// All primitives passed in must have the same geomID.
   static void* create(RTCThreadLocalAllocator alloc, const RTCBuildPrimitive* prims, size_t numPrims, void* userPtr) {
-    if (numPrims != 1) { throw std::runtime_error("Expected exactly 1 primitive"); }
-    Bounds3d bounds(
-      Vec3fa(prims[0].lower_x, prims[0].lower_y, prims[0].lower_z),
-      Vec3fa(prims[0].upper_x, prims[0].upper_y, prims[0].upper_z)
-    );
+    if (numPrims == 0 || numPrims > MaxPrimitives) { throw std::runtime_error("Unsupported number of leaf primitives"); }
+    Bounds3d bounds;
+    for (auto i = 0u; i < numPrims; ++i) {
+      if (prims[i].geomID != prims[0].geomID) { throw std::runtime_error("Leaf primitives must share geomID"); }
+      bounds += Bounds3d(
+        Vec3fa(prims[i].lower_x, prims[i].lower_y, prims[i].lower_z),
+        Vec3fa(prims[i].upper_x, prims[i].upper_y, prims[i].upper_z)
+      );
+    }
     void* ptr = rtcThreadLocalAlloc(alloc, sizeof(LeafNode), 16);
-    return (void*) new (ptr) LeafNode(bounds, prims[0].primID, prims[0].geomID);
+    return (void*) new (ptr) LeafNode(bounds, prims, numPrims);
   }
 };
 
@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <embree3/rtcore.h>
+
 #include "geometry.hpp"
 #include "Arrays.hpp"
 
@@ -18,9 +20,12 @@ struct Tri { std::uint32_t v0, v1, v2; };
 
 namespace embree_utils {
 
+/// Indices can be any unsigned type (e.g. the 16 or 32-bit indices of the
+/// custom meshes): Embree's index buffer always holds 32-bit indices.
+template <class Index>
 unsigned int addTriMesh(RTCDevice device, RTCScene scene,
                         ConstArrayRef<embree_utils::Vec3fa> vertices,
-                        ConstArrayRef<std::uint16_t> triIndices) {
+                        ConstArrayRef<Index> triIndices) {
   // create a triangulated cube with 12 triangles and 8 vertices
   RTCGeometry mesh = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
 
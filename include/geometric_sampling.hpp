@@ -2,6 +2,8 @@
 
 // This file contains fundamental geometric sampling routines.
 
+#pragma once
+
 #include <math/sincos.hpp>
 
 // Given a uniform sample on the unit square return a uniform sample on the unit disc.
@@ -28,6 +30,15 @@ inline std::pair<float, float> sampleDiscConcentric(float u1, float u2) {
   return {r * c, r * s};
 }
 
+// Given a uniform sample on the unit square return two independent samples from
+// the standard normal distribution (Box-Muller transform).
+inline std::pair<float, float> sampleGaussian2d(float u1, float u2) {
+  const float r = std::sqrt(-2.f * std::log(1.f - u1)); // 1 - u1 is never zero
+  float s, c;
+  sincos(embree_utils::TwoPi * u2, s, c);
+  return {r * c, r * s};
+}
+
 // Given a uniform sample on the unit square return a uniform sample on the unit hemisphere.
 inline embree_utils::Vec3fa sampleHemisphere(float u1, float u2) {
   const float r = std::sqrt(1.f - u1 * u1);
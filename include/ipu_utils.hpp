@@ -12,6 +12,7 @@
 #include <fstream>
 #include <string>
 #include <functional>
+#include <chrono>
 
 #include <poplar/Graph.hpp>
 #include <poplar/Engine.hpp>
@@ -48,6 +49,31 @@ inline std::shared_ptr<spdlog::logger> logger() {
   return spdlog::get("ipu_trace_logger");
 }
 
+/// Return the PopVision System Analyser channel for the application's host phases.
+/// Trace points are only recorded when PVTI is enabled (e.g. PVTI_OPTIONS='{"enable":"true"}'),
+/// in which case they appear on the same timeline as the Poplar libraries' own.
+inline pvti::TraceChannel* traceChannel() {
+  static pvti::TraceChannel channel = {"ipu_ray_lib"};
+  return &channel;
+}
+
+/// Record a trace point that spans the lifetime of this object:
+class TraceScope {
+public:
+  TraceScope(const std::string& name, pvti::TraceChannel* channel = traceChannel())
+    : label(name), channel(channel) {
+    pvti::Tracepoint::begin(channel, label);
+  }
+  ~TraceScope() { pvti::Tracepoint::end(channel, label); }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+  const std::string label;
+  pvti::TraceChannel* channel;
+};
+
 inline std::string makeExeFileName(const std::string& name) {
     return name + ".poplar.exe";
 }
@@ -372,6 +398,11 @@ struct StreamableTensor {
     e.connectStream(getReadHandle(), data);
   }
 
+  // Connect the read stream of a single replica:
+  void connectReadStream(poplar::Engine& e, unsigned replica, void* data) const {
+    e.connectStream(getReadHandle(), replica, data);
+  }
+
   template <class T, class Alloc>
   void connectWriteStream(poplar::Engine& e, std::vector<T, Alloc>& v) const {
     connectStream(e, getWriteHandle(), v);
@@ -520,18 +551,28 @@ private:
 /// Class that manages graph creation, engine creation and execution, and provides a consistent interface
 /// for saving and loading graph executables. In effect it manages all the host side and runtime activity
 /// of a Poplar program.
+/// Wall clock times of the stages of GraphManager::run() (stages that
+/// did not run take zero time):
+struct GraphTimings {
+  double buildSecs = 0.0;
+  double compileSecs = 0.0;
+  double loadExeSecs = 0.0; // Loading a saved executable (instead of building and compiling)
+  double engineLoadSecs = 0.0; // Creating the engine, attaching to the device, and loading the engine
+  double executeSecs = 0.0;
+};
+
 class GraphManager {
 public:
   GraphManager() {}
 
+  const GraphTimings& getTimings() const { return timings; }
+
   /// Run the graph (i.e. build, then compile (or load) and execute the graph.
   /// Takes a reference to an object that implements the builder interface. The
   /// builder object completely describes the Poplar program to build and run.
   /// Returns the exit code for the host program.
   int run(BuilderInterface& builder, const poplar::OptionFlags& opts = {}) {
     try {
-      pvti::TraceChannel traceChannel = {"ipu_utils::GraphManager"};
-
       logger()->info("Poplar version: {}", poplar::versionString());
       auto config = builder.getRuntimeConfig();
       auto device = builder.getDevice();
@@ -541,6 +582,7 @@ public:
       if (config.loadExe) {
         // When loading, we simply load-construct the executable and run it:
         pvti::Tracepoint::begin(&traceChannel, "loading_graph");
+        auto startTime = std::chrono::steady_clock::now();
         poplar::Executable exe = loadExe(config.exeName);
         // Need to load a ProgramManager also:
         auto progsFileName = makeProgramsFileName(config.exeName);
@@ -551,13 +593,16 @@ public:
           logger()->error("Error: failed to load program list from '{}'", progsFileName);
           throw;
         }
+        timings.loadExeSecs = secondsSince(startTime);
         pvti::Tracepoint::end(&traceChannel, "loading_graph");
         executeGraphProgram(exe, *device, builder, opts);
       } else {
         // Otherwise we must build and compile the graph:
         logger()->info("Graph construction started");
         pvti::Tracepoint::begin(&traceChannel, "constructing_graph");
+        auto startTime = std::chrono::steady_clock::now();
         builder.build(graph, device->getTarget());
+        timings.buildSecs = secondsSince(startTime);
         pvti::Tracepoint::end(&traceChannel, "constructing_graph");
         logger()->info("Graph construction finished");
 
@@ -566,8 +611,10 @@ public:
         CallbackFilter progress([] (int done, int todo) {
           logger()->debug("Compilation step {}/{}", done, todo);
         });
+        startTime = std::chrono::steady_clock::now();
         poplar::Executable exe = poplar::compileGraph(graph, builder.getPrograms().getList(), {},
                                                       progress.getFilteredCallback(), "ipu_utils_engine");
+        timings.compileSecs = secondsSince(startTime);
         pvti::Tracepoint::end(&traceChannel, "compiling_graph");
         logger()->info("Graph compilation finished");
 
@@ -596,16 +643,35 @@ public:
   }
 
 private:
+  GraphTimings timings;
+  pvti::TraceChannel traceChannel = {"ipu_utils::GraphManager"};
+
+  static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
   void executeGraphProgram(poplar::Executable& exe,
                            DeviceInterface& device,
                            BuilderInterface& builder,
                            const poplar::OptionFlags& opts) {
     // Prepare the execution engine and connect
     // data streams to/from IPU:
+    auto startTime = std::chrono::steady_clock::now();
+    pvti::Tracepoint::begin(&traceChannel, "creating_engine");
     poplar::Engine engine(std::move(exe), opts);
+    pvti::Tracepoint::end(&traceChannel, "creating_engine");
+    pvti::Tracepoint::begin(&traceChannel, "attaching_device");
     device.attach();
+    pvti::Tracepoint::end(&traceChannel, "attaching_device");
+    pvti::Tracepoint::begin(&traceChannel, "loading_engine");
     engine.load(device.getPoplarDevice());
+    pvti::Tracepoint::end(&traceChannel, "loading_engine");
+    timings.engineLoadSecs = secondsSince(startTime);
+    startTime = std::chrono::steady_clock::now();
+    pvti::Tracepoint::begin(&traceChannel, "executing_graph");
     builder.execute(engine, device.getPoplarDevice());
+    pvti::Tracepoint::end(&traceChannel, "executing_graph");
+    timings.executeSecs = secondsSince(startTime);
   }
 };
 
@@ -6,6 +6,7 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <limits>
 #include <memory>
 
@@ -45,3 +46,39 @@ half roundToHalfNotSmaller(float f) {
   }
   return h;
 }
+
+inline
+half nextHalfDown(half h) {
+  std::uint16_t bits;
+  std::memcpy(&bits, &h, sizeof(bits));
+  if (bits == 0) {
+    bits = 0x8001; // +0 steps to the smallest negative denormal
+  } else if (bits & 0x8000) {
+    bits += 1;
+  } else {
+    bits -= 1;
+  }
+  half result;
+  std::memcpy(&result, &bits, sizeof(bits));
+  return result;
+}
+
+inline
+half roundToHalfNotLarger(float f) {
+  half h = (half)f;
+  float ff = (float)h;
+  if (ff > f) {
+    h = nextHalfDown(h);
+  }
+  return h;
+}
+
+/// Construct the float 2^e directly from its bit pattern.
+/// The exponent must be in the normal range (i.e. [-126, 127]).
+inline
+float exp2i(std::int32_t e) {
+  std::uint32_t bits = std::uint32_t(e + 127) << 23;
+  float result;
+  std::memcpy(&result, &bits, sizeof(bits));
+  return result;
+}
@@ -9,6 +9,7 @@
 
 #include "Primitives.hpp"
 #include "Mesh.hpp"
+#include "Scene.hpp"
 #include "Material.hpp"
 #include "xoshiro.hpp"
 
@@ -17,6 +18,7 @@ struct PathTraceSettings {
   std::uint32_t samplesPerPixel;
   std::uint32_t maxPathLength;
   std::uint32_t roulletteStartDepth;
+  bool lowDiscrepancy; // The CPU path tracer samples with scrambled Sobol points instead of the sampler
 };
 
 struct Camera {
@@ -25,6 +27,12 @@ struct Camera {
   std::vector<float> matrix;
 };
 
+// An instance places one of the scene's prototype meshes in the world:
+struct InstanceDescription {
+  std::uint32_t prototype; // Index into SceneDescription::prototypes
+  AffineTransform objectToWorld;
+};
+
 struct SceneDescription {
   // Primitives:
   std::vector<HostTriangleMesh> meshes;
@@ -32,11 +40,27 @@ struct SceneDescription {
   std::vector<Disc> discs;
   std::vector<Material> materials;
 
+  // Texture coordinates of the meshes above (a mesh has none if its vector is
+  // empty or there is no vector for it) and the textures that materials reference:
+  std::vector<std::vector<TexCoord>> meshUVs;
+  std::vector<TextureInfo> textures;
+  std::vector<Bc1Block> texels;
+
+  // Meshes that are only rendered through instances. Each prototype gets its
+  // own bottom level BVH that is shared by all of its instances:
+  std::vector<HostTriangleMesh> prototypes;
+  std::vector<InstanceDescription> instances;
+
   // Material assignment:
   // ids index the materials above, correspondence with primitives
-  // is defined by the order of primitives above.
+  // is defined by the order of primitives above (meshes, spheres,
+  // discs, then instances).
   std::vector<std::uint32_t> matIDs;
 
+  // Primitives used to intersect the instances on the CPU. These are
+  // created by buildSceneData() and reference the SceneData it returns:
+  std::vector<HostSceneInstance> instancePrims;
+
   Camera camera;
   std::unique_ptr<PathTraceSettings> pathTrace;
 };
@@ -55,4 +79,16 @@ HostTriangleMesh makeCornellTallBlock();
 SceneDescription makeCornellBoxScene(std::string& meshFile, bool boxOnly);
 SceneDescription makePrimitiveScene();
 
-SceneDescription importScene(std::string& filename, bool loadNormals);
+/// Import a scene file. Diffuse textures are compressed and any mip levels
+/// larger than maxTextureSize (if not zero) are dropped:
+SceneDescription importScene(std::string& filename, bool loadNormals, std::uint32_t maxTextureSize = 0);
+
+/// Replace meshes that are transformed copies of other meshes in the scene with
+/// instances of a single prototype mesh. Vertices must match to within tolerance
+/// (relative to the mesh's size). Returns the number of meshes that became instances:
+std::size_t instanceDuplicateMeshes(SceneDescription& scene, float tolerance = 1e-4f);
+
+/// Concatenate the triangles, vertices, normals, and texture coordinates of the
+/// scene's meshes (followed by its instanced prototypes) into the unified arrays of
+/// data and record each mesh's offsets in them in data.meshInfo:
+void unifyMeshes(const SceneDescription& scene, SceneData& data);
@@ -45,9 +45,19 @@ void deserialise(Deserialiser<BaseAlign>& d, SceneRef& s) {
   s.meshTris = deserialiseArrayRef<Triangle>(d);
   s.meshVerts = deserialiseArrayRef<embree_utils::Vec3fa>(d);
   s.meshNormals = deserialiseArrayRef<embree_utils::Vec3fa>(d);
+  s.meshPrecomputed = deserialiseArrayRef<PrecomputedTriangle>(d);
+  s.meshQuantisation = deserialiseArrayRef<VertexQuantisation>(d);
+  s.meshPackedVerts = deserialiseArrayRef<QuantisedVertex>(d);
+  s.meshPackedNormals = deserialiseArrayRef<OctahedralNormal>(d);
   s.matIDs = deserialiseArrayRef<std::uint32_t>(d);
   s.materials = deserialiseArrayRef<Material>(d);
-  s.bvhNodes = deserialiseArrayRef<CompactBVH2Node>(d);
+  s.bvhNodes = deserialiseArrayRef<SceneBvhNode>(d);
+  s.instances = deserialiseArrayRef<InstanceInfo>(d);
+  s.blasNodes = deserialiseArrayRef<SceneBvhNode>(d);
+  s.lights = deserialiseArrayRef<AreaLight>(d);
+  s.meshUVs = deserialiseArrayRef<TexCoord>(d);
+  s.textures = deserialiseArrayRef<TextureInfo>(d);
+  s.texels = deserialiseArrayRef<Bc1Block>(d);
   d >> s.maxLeafDepth;
   d >> s.imageWidth;
   d >> s.imageHeight;
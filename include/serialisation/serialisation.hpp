@@ -31,17 +31,34 @@ void serialise(Serialiser<BaseAlign>& s, const ArrayRef<T>& arr) {
   s.write(arr.cbegin(), size);
 }
 
+// The scene's arrays are serialised first and the render parameters last so
+// that the parameters of a previously serialised scene can be rewritten in place
+// (see SceneCache):
 template <std::uint32_t BaseAlign>
-void serialise(Serialiser<BaseAlign>& ss, const SceneRef& s) {
+void serialiseSceneData(Serialiser<BaseAlign>& ss, const SceneRef& s) {
   ss << s.geometry;
   ss << s.meshInfo;
   ss << s.meshTris;
   ss << s.meshVerts;
   ss << s.meshNormals;
+  ss << s.meshPrecomputed;
+  ss << s.meshQuantisation;
+  ss << s.meshPackedVerts;
+  ss << s.meshPackedNormals;
   ss << s.matIDs;
   ss << s.materials;
   ss << s.bvhNodes;
+  ss << s.instances;
+  ss << s.blasNodes;
+  ss << s.lights;
+  ss << s.meshUVs;
+  ss << s.textures;
+  ss << s.texels;
   ss << s.maxLeafDepth;
+}
+
+template <std::uint32_t BaseAlign>
+void serialiseRenderParams(Serialiser<BaseAlign>& ss, const SceneRef& s) {
   ss << s.imageWidth;
   ss << s.imageHeight;
   ss << s.fovRadians;
@@ -51,6 +68,12 @@ void serialise(Serialiser<BaseAlign>& ss, const SceneRef& s) {
   ss << s.samplesPerPixel;
 }
 
+template <std::uint32_t BaseAlign>
+void serialise(Serialiser<BaseAlign>& ss, const SceneRef& s) {
+  serialiseSceneData(ss, s);
+  serialiseRenderParams(ss, s);
+}
+
 // Specialisation for primitives and arrays of primitives
 // (so that we only serialise data not vtable etc):
 template <std::uint32_t BaseAlign>
@@ -62,7 +85,7 @@ template <std::uint32_t BaseAlign>
 void serialise(Serialiser<BaseAlign>& ss, const Disc& d) {
   ss << d.cx << d.cy << d.cz
      << d.r
-     << d.nx << d.nz << d.nz;
+     << d.nx << d.ny << d.nz;
 }
 
 template <std::uint32_t BaseAlign>
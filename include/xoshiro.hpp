@@ -107,6 +107,11 @@ struct Generator {
     return xoshiro::uniform_neg1_1(state);
   }
 
+  // Advance by 2^64 numbers (see xoshiro::jump()):
+  void jump() {
+    xoshiro::jump(state);
+  }
+
 private:
   State state;
 };
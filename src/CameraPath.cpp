@@ -0,0 +1,57 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+#include <CameraPath.hpp>
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+AffineTransform lookAtTransform(const embree_utils::Vec3fa& eye,
+                                const embree_utils::Vec3fa& target,
+                                const embree_utils::Vec3fa& up) {
+  const auto forward = target - eye;
+  const auto right = forward.cross(up);
+  if (forward.squaredNorm() == 0.f || right.squaredNorm() == 0.f) {
+    throw std::runtime_error("Camera look at direction is degenerate.");
+  }
+  // Cameras look down their -z axis with +y up:
+  const auto z = -forward.normalized();
+  const auto x = right.normalized();
+  const auto y = z.cross(x);
+  return AffineTransform{{x.x, y.x, z.x, eye.x,
+                          x.y, y.y, z.y, eye.y,
+                          x.z, y.z, z.z, eye.z}};
+}
+
+std::vector<AffineTransform> loadCameraPath(const std::string& fileName) {
+  std::ifstream file(fileName);
+  if (!file) {
+    throw std::runtime_error("Could not open camera path file '" + fileName + "'.");
+  }
+
+  std::vector<AffineTransform> path;
+  std::string line;
+  for (std::size_t lineNumber = 1; std::getline(file, line); ++lineNumber) {
+    std::istringstream fields(line);
+    std::string first;
+    if (!(fields >> first) || first[0] == '#') {
+      continue;
+    }
+    // Eye and target are followed by an optional up vector:
+    std::istringstream values(line);
+    std::vector<float> v;
+    for (float f; values >> f;) {
+      v.push_back(f);
+    }
+    if (!values.eof() || (v.size() != 6 && v.size() != 9)) {
+      throw std::runtime_error("Could not parse camera at line " + std::to_string(lineNumber) + " of '" + fileName + "'.");
+    }
+    const embree_utils::Vec3fa up = v.size() == 9 ? embree_utils::Vec3fa(v[6], v[7], v[8]) : embree_utils::Vec3fa(0.f, 1.f, 0.f);
+    path.push_back(lookAtTransform(embree_utils::Vec3fa(v[0], v[1], v[2]), embree_utils::Vec3fa(v[3], v[4], v[5]), up));
+  }
+
+  if (path.empty()) {
+    throw std::runtime_error("Camera path file '" + fileName + "' has no cameras.");
+  }
+  return path;
+}
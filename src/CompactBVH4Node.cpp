@@ -0,0 +1,42 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+#include <CompactBVH4Node.hpp>
+
+std::uint32_t CompactBVH4Node::intersect(const embree_utils::Vec3fa& o, const embree_utils::Vec3fa& i, float tMin, float tMax, float (&tEntry)[Width]) const {
+  // Express the ray origin relative to the node origin so
+  // the child extents can be used without reconstruction:
+  const float ox = o.x - min_x;
+  const float oy = o.y - min_y;
+  const float oz = o.z - min_z;
+
+  std::uint32_t hitMask = 0;
+
+#ifdef __IPU__
+  // Test children two at a time using the float2 intrinsics:
+  for (auto c = 0u; c < Width; c += 2) {
+    float2 t0 = {tMin, tMin};
+    float2 t1 = {tMax, tMax};
+    intersectRaySlab2(i.x, ox, float2{(float)lo_x[c], (float)lo_x[c + 1]}, float2{(float)hi_x[c], (float)hi_x[c + 1]}, t0, t1);
+    intersectRaySlab2(i.y, oy, float2{(float)lo_y[c], (float)lo_y[c + 1]}, float2{(float)hi_y[c], (float)hi_y[c + 1]}, t0, t1);
+    intersectRaySlab2(i.z, oz, float2{(float)lo_z[c], (float)lo_z[c + 1]}, float2{(float)hi_z[c], (float)hi_z[c + 1]}, t0, t1);
+    hitMask |= (t0[0] <= t1[0]) << c;
+    hitMask |= (t0[1] <= t1[1]) << (c + 1);
+    tEntry[c] = t0[0];
+    tEntry[c + 1] = t0[1];
+  }
+#else
+  for (auto c = 0u; c < Width; ++c) {
+    float t0 = tMin;
+    float t1 = tMax;
+    if (intersectRaySlab(i.x, ox, (float)lo_x[c], (float)hi_x[c], t0, t1) &&
+        intersectRaySlab(i.y, oy, (float)lo_y[c], (float)hi_y[c], t0, t1) &&
+        intersectRaySlab(i.z, oz, (float)lo_z[c], (float)hi_z[c], t0, t1)) {
+      hitMask |= 1u << c;
+    }
+    tEntry[c] = t0;
+  }
+#endif
+
+  // Mask off any unused slots:
+  return hitMask & ((1u << childCount) - 1u);
+}
@@ -0,0 +1,49 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+#include <CompactBVH4QNode.hpp>
+
+std::uint32_t CompactBVH4QNode::intersect(const embree_utils::Vec3fa& o, const embree_utils::Vec3fa& i, float tMin, float tMax, float (&tEntry)[Width]) const {
+  // Transform the ray into grid units so the quantised bounds can be used
+  // directly. Scaling by powers of two is exact so this introduces no more
+  // rounding error than decoding the bounds into world space:
+  const float sx = exp2i(exp_x);
+  const float sy = exp2i(exp_y);
+  const float sz = exp2i(exp_z);
+  const float ox = (o.x - min_x) * exp2i(-exp_x);
+  const float oy = (o.y - min_y) * exp2i(-exp_y);
+  const float oz = (o.z - min_z) * exp2i(-exp_z);
+  const float ix = i.x * sx;
+  const float iy = i.y * sy;
+  const float iz = i.z * sz;
+
+  std::uint32_t hitMask = 0;
+
+#ifdef __IPU__
+  // Test children two at a time using the float2 intrinsics:
+  for (auto c = 0u; c < Width; c += 2) {
+    float2 t0 = {tMin, tMin};
+    float2 t1 = {tMax, tMax};
+    intersectRaySlab2(ix, ox, float2{(float)lo_x[c], (float)lo_x[c + 1]}, float2{(float)hi_x[c], (float)hi_x[c + 1]}, t0, t1);
+    intersectRaySlab2(iy, oy, float2{(float)lo_y[c], (float)lo_y[c + 1]}, float2{(float)hi_y[c], (float)hi_y[c + 1]}, t0, t1);
+    intersectRaySlab2(iz, oz, float2{(float)lo_z[c], (float)lo_z[c + 1]}, float2{(float)hi_z[c], (float)hi_z[c + 1]}, t0, t1);
+    hitMask |= (t0[0] <= t1[0]) << c;
+    hitMask |= (t0[1] <= t1[1]) << (c + 1);
+    tEntry[c] = t0[0];
+    tEntry[c + 1] = t0[1];
+  }
+#else
+  for (auto c = 0u; c < Width; ++c) {
+    float t0 = tMin;
+    float t1 = tMax;
+    if (intersectRaySlab(ix, ox, lo_x[c], hi_x[c], t0, t1) &&
+        intersectRaySlab(iy, oy, lo_y[c], hi_y[c], t0, t1) &&
+        intersectRaySlab(iz, oz, lo_z[c], hi_z[c], t0, t1)) {
+      hitMask |= 1u << c;
+    }
+    tEntry[c] = t0;
+  }
+#endif
+
+  // Mask off any unused slots:
+  return hitMask & ((1u << childCount) - 1u);
+}
@@ -2,8 +2,14 @@
 
 #include <CompactBvhBuild.hpp>
 
-template <typename T>
-CompactBVH2Node toCompactNode(const T& node) {
+std::uint32_t packLeaf(const BuildNode& leaf) {
+  if (leaf.primCount > MaxLeafPrims || leaf.geomFirst > LeafPrimMask) {
+    throw std::runtime_error("Cannot pack leaf primitive range into compact node");
+  }
+  return packLeafPrims(leaf.geomFirst, leaf.primCount);
+}
+
+CompactBVH2Node toCompactNode(const BuildNode& node) {
   CompactBVH2Node compactNode;
   compactNode.min_x = node.bounds.min.x;
   compactNode.min_y = node.bounds.min.y;
@@ -21,36 +27,187 @@ CompactBVH2Node toCompactNode(const T& node) {
   compactNode.dy = roundToHalfNotSmaller(dy);
   compactNode.dz = roundToHalfNotSmaller(dz);
 
-  if constexpr (std::is_same_v<embree_utils::LeafNode, T>) {
+  if (node.isLeaf()) {
     compactNode.geomID = node.geomID;
-    compactNode.primID = node.primID;
+    compactNode.primID = packLeaf(node);
   } else {
     compactNode.geomID = CompactBVH2Node::InvalidGeomID;
-    compactNode.primID = 0;
+    compactNode.secondChildIndex = node.secondChild;
   }
   return compactNode;
 }
 
-std::uint32_t flattenBVH2Tree(const embree_utils::Node* node, std::vector<CompactBVH2Node>& compactTree, std::uint32_t depth, std::uint32_t& index, std::uint32_t& maxDepth) {
-  CompactBVH2Node& compactNode = compactTree[index];
-  auto myIndex = index;
-  index += 1;
+std::vector<CompactBVH2Node> buildCompactBvh(const BvhBuild& bvh) {
+  std::vector<CompactBVH2Node> nodes;
+  nodes.reserve(bvh.nodes.size());
+  for (const auto& node : bvh.nodes) {
+    nodes.push_back(toCompactNode(node));
+  }
+  return nodes;
+}
+
+void setOrigin(CompactBVH4Node& compactNode, const embree_utils::Bounds3d& nodeBounds) {
+  compactNode.min_x = nodeBounds.min.x;
+  compactNode.min_y = nodeBounds.min.y;
+  compactNode.min_z = nodeBounds.min.z;
+}
+
+void clearChild(CompactBVH4Node& compactNode, std::uint32_t c) {
+  compactNode.lo_x[c] = compactNode.lo_y[c] = compactNode.lo_z[c] = (half)0.f;
+  compactNode.hi_x[c] = compactNode.hi_y[c] = compactNode.hi_z[c] = (half)0.f;
+}
+
+void setChildBounds(CompactBVH4Node& compactNode, std::uint32_t c, const embree_utils::Bounds3d& bounds) {
+  const float lo[3] = {
+    bounds.min.x - compactNode.min_x, bounds.min.y - compactNode.min_y, bounds.min.z - compactNode.min_z
+  };
+  const float hi[3] = {
+    bounds.max.x - compactNode.min_x, bounds.max.y - compactNode.min_y, bounds.max.z - compactNode.min_z
+  };
+  constexpr float maxHalf = 65504.f;
+  if (hi[0] > maxHalf || hi[1] > maxHalf || hi[2] > maxHalf) {
+    throw std::runtime_error("Cannot compress BVH bounds into fp16 (half)");
+  }
+
+  compactNode.lo_x[c] = roundToHalfNotLarger(lo[0]);
+  compactNode.lo_y[c] = roundToHalfNotLarger(lo[1]);
+  compactNode.lo_z[c] = roundToHalfNotLarger(lo[2]);
+  compactNode.hi_x[c] = roundToHalfNotSmaller(hi[0]);
+  compactNode.hi_y[c] = roundToHalfNotSmaller(hi[1]);
+  compactNode.hi_z[c] = roundToHalfNotSmaller(hi[2]);
+}
+
+// Choose the finest power of two grid that spans the extent in 255 steps:
+std::int8_t chooseGridExponent(float minCoord, float maxCoord) {
+  const double extent = (double)maxCoord - (double)minCoord;
+  std::int32_t e = CompactBVH4QNode::MinExponent;
+  if (extent > 0.0) {
+    e = std::max(e, std::ilogb(extent / 255.0));
+  }
+  while (e < CompactBVH4QNode::MaxExponent && 255.0 * exp2i(e) < extent) {
+    e += 1;
+  }
+  return e;
+}
+
+// Quantisation is computed in double precision so that rounding is
+// conservative with respect to the exact fp32 bounds:
+std::uint8_t quantiseDown(float v, float origin, std::int8_t e) {
+  const double q = std::floor(((double)v - (double)origin) / exp2i(e));
+  return std::clamp(q, 0.0, 255.0);
+}
 
-  if (depth > maxDepth) {
-    maxDepth = depth;
+std::uint8_t quantiseUp(float v, float origin, std::int8_t e) {
+  const double q = std::ceil(((double)v - (double)origin) / exp2i(e));
+  if (q > 255.0) {
+    throw std::logic_error("Child bounds exceed quantisation grid.");
   }
+  return std::max(q, 0.0);
+}
+
+void setOrigin(CompactBVH4QNode& compactNode, const embree_utils::Bounds3d& nodeBounds) {
+  compactNode.min_x = nodeBounds.min.x;
+  compactNode.min_y = nodeBounds.min.y;
+  compactNode.min_z = nodeBounds.min.z;
+  compactNode.exp_x = chooseGridExponent(nodeBounds.min.x, nodeBounds.max.x);
+  compactNode.exp_y = chooseGridExponent(nodeBounds.min.y, nodeBounds.max.y);
+  compactNode.exp_z = chooseGridExponent(nodeBounds.min.z, nodeBounds.max.z);
+}
 
-  if (node == nullptr) {
-    throw std::runtime_error("Null node encountered during traversal");
-  } else if (auto* leaf = dynamic_cast<const embree_utils::LeafNode*>(node)) {
-    compactNode = toCompactNode(*leaf);
-  } else if (auto* inner = dynamic_cast<const embree_utils::InnerNode*>(node)) {
-    compactNode = toCompactNode(*inner);
-    flattenBVH2Tree(inner->children[0], compactTree, depth + 1, index, maxDepth);
-    compactNode.secondChildIndex = flattenBVH2Tree(inner->children[1], compactTree, depth + 1, index, maxDepth);
+void clearChild(CompactBVH4QNode& compactNode, std::uint32_t c) {
+  compactNode.lo_x[c] = compactNode.lo_y[c] = compactNode.lo_z[c] = 0;
+  compactNode.hi_x[c] = compactNode.hi_y[c] = compactNode.hi_z[c] = 0;
+}
+
+void setChildBounds(CompactBVH4QNode& compactNode, std::uint32_t c, const embree_utils::Bounds3d& bounds) {
+  compactNode.lo_x[c] = quantiseDown(bounds.min.x, compactNode.min_x, compactNode.exp_x);
+  compactNode.lo_y[c] = quantiseDown(bounds.min.y, compactNode.min_y, compactNode.exp_y);
+  compactNode.lo_z[c] = quantiseDown(bounds.min.z, compactNode.min_z, compactNode.exp_z);
+  compactNode.hi_x[c] = quantiseUp(bounds.max.x, compactNode.min_x, compactNode.exp_x);
+  compactNode.hi_y[c] = quantiseUp(bounds.max.y, compactNode.min_y, compactNode.exp_y);
+  compactNode.hi_z[c] = quantiseUp(bounds.max.z, compactNode.min_z, compactNode.exp_z);
+}
+
+template <class WideNode>
+std::uint32_t flattenBVH4Tree(const std::vector<BuildNode>& tree, std::uint32_t node, std::vector<WideNode>& compactTree, std::uint32_t pending, std::uint32_t& maxStackSize) {
+  // Gather up to Width children by repeatedly opening the inner child
+  // with the largest surface area (a leaf root gets a single child):
+  std::uint32_t children[WideNode::Width];
+  std::uint32_t childCount = 0;
+  if (!tree[node].isLeaf()) {
+    children[childCount++] = node + 1;
+    children[childCount++] = tree[node].secondChild;
   } else {
-    throw std::runtime_error("Unknown derived node encountered during traversal.");
+    children[childCount++] = node;
+  }
+
+  while (childCount < WideNode::Width) {
+    std::int32_t best = -1;
+    float bestArea = -1.f;
+    for (auto c = 0u; c < childCount; ++c) {
+      const auto& child = tree[children[c]];
+      if (!child.isLeaf()) {
+        const float area = child.bounds.surfaceArea();
+        if (area > bestArea) {
+          best = c;
+          bestArea = area;
+        }
+      }
+    }
+    if (best < 0) { break; } // All children are leaves
+
+    const auto opened = children[best];
+    children[best] = opened + 1;
+    children[childCount++] = tree[opened].secondChild;
+  }
+
+  // Child bounds are encoded relative to the union of the children:
+  embree_utils::Bounds3d nodeBounds;
+  for (auto c = 0u; c < childCount; ++c) {
+    nodeBounds += tree[children[c]].bounds;
+  }
+
+  const auto myIndex = compactTree.size();
+  WideNode compactNode;
+  setOrigin(compactNode, nodeBounds);
+  compactNode.childCount = childCount;
+  for (auto c = 0u; c < WideNode::Width; ++c) {
+    // Unused slots have empty extents and are never traversed:
+    clearChild(compactNode, c);
+    compactNode.child[c] = 0;
+    compactNode.geomID[c] = WideNode::InvalidGeomID;
+  }
+
+  for (auto c = 0u; c < childCount; ++c) {
+    const auto& child = tree[children[c]];
+    setChildBounds(compactNode, c, child.bounds);
+    if (child.isLeaf()) {
+      compactNode.geomID[c] = child.geomID;
+      compactNode.child[c] = packLeaf(child);
+    }
+  }
+  compactTree.push_back(compactNode);
+
+  // Only inner children go onto the traversal stack so track the worst case
+  // number of entries: those left by ancestors plus all our inner children:
+  std::uint32_t innerCount = 0;
+  for (auto c = 0u; c < childCount; ++c) {
+    innerCount += compactNode.isLeaf(c) ? 0 : 1;
+  }
+  maxStackSize = std::max(maxStackSize, pending + innerCount);
+
+  // Recurse into inner children (indices are fixed up after because
+  // the recursion can reallocate the array). When a child is popped
+  // its siblings can still be on the stack:
+  for (auto c = 0u; c < childCount; ++c) {
+    if (!compactNode.isLeaf(c)) {
+      const auto childIndex = flattenBVH4Tree(tree, children[c], compactTree, pending + innerCount - 1, maxStackSize);
+      compactTree[myIndex].child[c] = childIndex;
+    }
   }
 
   return myIndex;
 }
+
+template std::uint32_t flattenBVH4Tree(const std::vector<BuildNode>&, std::uint32_t, std::vector<CompactBVH4Node>&, std::uint32_t, std::uint32_t&);
+template std::uint32_t flattenBVH4Tree(const std::vector<BuildNode>&, std::uint32_t, std::vector<CompactBVH4QNode>&, std::uint32_t, std::uint32_t&);
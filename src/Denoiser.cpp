@@ -0,0 +1,87 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+#include <Denoiser.hpp>
+
+#include <cmath>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Dark albedos are not divided out (that would only amplify their noise):
+inline float demodulationFactor(float albedo) {
+  return albedo > 1e-3f ? albedo : 1.f;
+}
+
+inline float squaredDistance(const float* a, const float* b) {
+  const float dx = a[0] - b[0];
+  const float dy = a[1] - b[1];
+  const float dz = a[2] - b[2];
+  return dx * dx + dy * dy + dz * dz;
+}
+
+} // end anonymous namespace
+
+void denoiseImage(const float* rgb, const float* albedo, const float* normal,
+                  std::uint32_t width, std::uint32_t height, float* output,
+                  const DenoiseSettings& settings) {
+  const std::size_t numValues = 3 * std::size_t(width) * height;
+  std::vector<float> current(numValues);
+  std::vector<float> next(numValues);
+  for (std::size_t i = 0; i < numValues; ++i) {
+    current[i] = rgb[i] / demodulationFactor(albedo[i]);
+  }
+
+  // 1D weights of the 5 tap B3 spline kernel (indexed by distance from the centre):
+  const float kernel[3] = {3.f / 8.f, 1.f / 4.f, 1.f / 16.f};
+  const float invNormalSigmaSq = 1.f / (settings.normalSigma * settings.normalSigma);
+  const float invAlbedoSigmaSq = 1.f / (settings.albedoSigma * settings.albedoSigma);
+  const int w = width;
+  const int h = height;
+
+  for (auto it = 0u; it < settings.iterations; ++it) {
+    // The taps spread out and the colour weight becomes stricter every iteration:
+    const int step = 1 << it;
+    const float colourSigma = settings.colourSigma / float(step);
+    const float invColourSigmaSq = 1.f / (colourSigma * colourSigma);
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < h; ++y) {
+      for (int x = 0; x < w; ++x) {
+        const auto p = 3 * (std::size_t(y) * w + x);
+        const float* c = &current[p];
+        const float colourScale = invColourSigmaSq / (c[0] * c[0] + c[1] * c[1] + c[2] * c[2] + 1e-4f);
+        float sum[3] = {0.f, 0.f, 0.f};
+        float weightSum = 0.f;
+        for (int dy = -2; dy <= 2; ++dy) {
+          const int qy = y + dy * step;
+          if (qy < 0 || qy >= h) { continue; }
+          for (int dx = -2; dx <= 2; ++dx) {
+            const int qx = x + dx * step;
+            if (qx < 0 || qx >= w) { continue; }
+            const auto q = 3 * (std::size_t(qy) * w + qx);
+            const float* cq = &current[q];
+            const float weight = kernel[std::abs(dx)] * kernel[std::abs(dy)] *
+              std::exp(-squaredDistance(c, cq) * colourScale
+                       - squaredDistance(&normal[p], &normal[q]) * invNormalSigmaSq
+                       - squaredDistance(&albedo[p], &albedo[q]) * invAlbedoSigmaSq);
+            sum[0] += weight * cq[0];
+            sum[1] += weight * cq[1];
+            sum[2] += weight * cq[2];
+            weightSum += weight;
+          }
+        }
+        // The centre tap always has a non-zero weight:
+        next[p] = sum[0] / weightSum;
+        next[p + 1] = sum[1] / weightSum;
+        next[p + 2] = sum[2] / weightSum;
+      }
+    }
+    std::swap(current, next);
+  }
+
+  for (std::size_t i = 0; i < numValues; ++i) {
+    output[i] = current[i] * demodulationFactor(albedo[i]);
+  }
+}
@@ -2,21 +2,36 @@
 
 #include <IpuScene.hpp>
 #include <RayCallback.hpp>
+#include <SlimRay.hpp>
+#include <EnvMap.hpp>
+#include <SceneCache.hpp>
+#include <RayBatchQueue.hpp>
+#include <TileOrder.hpp>
+#include <RayBudget.hpp>
+#include <SceneAnalysis.hpp>
 #include <serialisation/serialisation.hpp>
 #include "neural_networks/NifModel.hpp"
+#include "neural_networks/NifAutotune.hpp"
 #include <xoshiro.hpp>
 #include <io_utils.hpp>
 
 #include <poplar/CSRFunctions.hpp>
+#include <poplar/DeviceManager.hpp>
 #include <popops/Loop.hpp>
 #include <popops/ElementWise.hpp>
+#include <popops/Reduce.hpp>
 #include <popops/codelets.hpp>
+#include <popops/Zero.hpp>
 #include <gcl/TileAllocation.hpp>
 #include <poputil/TileMapping.hpp>
+#include <poputil/VertexTemplates.hpp>
 #include <popops/Loop.hpp>
 #include <poprand/RandomGen.hpp>
 #include <poprand/codelets.hpp>
 
+#include <cstring>
+#include <set>
+#include <sstream>
 #include <vector>
 #include <random>
 #include <algorithm>
@@ -24,7 +39,7 @@
 IpuScene::IpuScene(const std::vector<Sphere>& _spheres,
           const std::vector<Disc>& _discs,
           SceneRef& sceneRef,
-          std::vector<embree_utils::TraceResult>& results,
+          RayStream& results,
           std::size_t raysPerWorker,
           RayCallbackFn* fn)
   :
@@ -37,31 +52,314 @@ IpuScene::IpuScene(const std::vector<Sphere>& _spheres,
     loopLimit("loop_limit"),
     samplesPerPixel("samples_per_pixel"),
     azimuthRotation("hdri_azimuth"),
-    spheresVar("sphere_data"),
-    discsVar("disc_data"),
+    maxPathLength("max_path_length"),
+    rayWindow("ray_window"),
+    cameraVar("camera_transform"),
     serialScene("serialScene"),
+    serialisedScene(nullptr), // The scene is serialised on first use unless setSerialisedScene() is called.
+    serialisedSceneSize(0u),
+    shardBytesPerTile(0u),
+    numShards(0u), // Scene is replicated on every tile unless setSceneShards() is called.
     rayFunc(fn), // If a callback is provided partial results will be streamed to the host.
+    frameFunc(nullptr), // Only one frame is rendered unless setFrameCallback() is called.
+    rayCallbackThreads(0u), // Batches are processed on the stream callback threads unless setRayCallbackThreads() is called.
+    sceneChanged(true),
+    dramRayBatches(0u), // Set with the other ray batch sizes in planRayBatches().
+    workerCounters("worker_counters"),
     numComputeTiles(0u), // This is set in build().
     maxRaysPerWorker(raysPerWorker),
+    autoRaysPerWorker(raysPerWorker == 0), // 0 interpretted as "auto"
+    autoRaysMemoryProportion(0.5),
     totalRayBufferSize(0u), // Needs to be set before device to host streams execute.
+    raysPerBatch(0u), // Ray batch sizes are set in execute().
+    numStreamBatches(0u),
+    numRayBatches(0u),
+    firstRunBatch(0u),
+    numRunBatches(0u),
+    numBatchesPerReplica(0u),
+    batchQueue(nullptr), // The IPU renders every batch unless setRayBatchQueue() is called.
+    slimRayStream(false), // Full trace results are streamed unless setSlimRayStream() is called.
+    ioPipelineDepth(2), // Overlap I/O with compute by default.
+    pipelineDepth(0), // Set in build() (may be less than requested for small renders).
+    deviceRayGeneration(false),
+    wavefront(false),
+    octantSort(false),
+    coherentRayOrder(false),
+    adaptiveThreshold(0.f),
+    adaptiveMinSamples(16),
+    lowDiscrepancy(false),
+    denoiseAovs(false),
+    traversalStats(false),
     hdriRotationDegrees(0.f),
     nifMemoryProportion(0.6),
-    nifMaxRaysPerBatch(0) // 0 interpretted as "auto"
-{
-  // Serialise the scene description for transfer to IPU:
-  serialiser << data;
-  ipu_utils::logger()->debug("Serialised scene size: {} KiB", serialiser.bytes.size() / 1024.f);
+    nifMaxRaysPerBatch(0), // 0 interpretted as "auto"
+    nifHalfPrecision(false),
+    bakedHdriWidth(0),
+    bakeUVs("hdri_bake_uvs"),
+    nifOnTile(false),
+    nifShape{0, 0, 0, 0},
+    nifTileWeights("nif_tile_weights"),
+    envLightSampling(false)
+{}
 
-  // Log individual component sizes at trace level:
-  ipu_utils::logger()->trace("Geometry info: {} bytes per tile", data.geometry.size() * sizeof(GeomRef));
-  ipu_utils::logger()->trace("Mesh info: {} bytes per tile", data.meshInfo.size() * sizeof(MeshInfo));
-  ipu_utils::logger()->trace("BVH nodes: {} bytes per tile", data.bvhNodes.size() * sizeof(CompactBVH2Node));
-  ipu_utils::logger()->trace("Index buffer: {} bytes per tile", data.meshTris.size() * sizeof(Triangle));
-  ipu_utils::logger()->trace("Vertex buffer: {} bytes per tile", data.meshVerts.size() * sizeof(embree_utils::Vec3fa));
-  ipu_utils::logger()->trace("Normal buffer: {} bytes per tile", data.meshNormals.size() * sizeof(embree_utils::Vec3fa));
+IpuScene::~IpuScene() {}
+
+/// Stream slim ray records (pixel in, RGBE radiance out) instead of full trace
+/// results. Only valid for path tracing because camera rays are generated on
+/// device. Only the rgb of the returned ray stream is updated:
+void IpuScene::setSlimRayStream(bool enable) {
+  slimRayStream = enable;
 }
 
-IpuScene::~IpuScene() {}
+/// Generate the pixel coordinates of every batch on device instead of uploading
+/// a ray stream. Implies a slim ray stream: only the results leave the chip and
+/// the host ray stream does not need to be initialised:
+void IpuScene::setDeviceRayGeneration(bool enable) {
+  deviceRayGeneration = enable;
+  if (enable) {
+    slimRayStream = true;
+  }
+}
+
+/// Path trace in wavefront mode: each bounce runs as separate extend, shade, and
+/// compaction compute sets instead of tracing whole paths in one vertex:
+void IpuScene::setWavefront(bool enable) {
+  wavefront = enable;
+}
+
+/// In wavefront mode reorder each tile's live rays by the octant of their direction
+/// between bounces so that each worker traces rays that take similar paths through the BVH:
+void IpuScene::setOctantSort(bool enable) {
+  octantSort = enable;
+}
+
+/// Sort the ray stream so that the rays of each tile's slice of a batch are close
+/// together on screen (the stream is reordered in place but every result keeps its
+/// pixel coords). Rays of a slim stream are then no longer interleaved between tiles:
+void IpuScene::setCoherentRayOrder(bool enable) {
+  coherentRayOrder = enable;
+}
+
+/// Stop sampling each pixel once the standard error of its mean luminance is below
+/// threshold times the mean (having taken at least minSamples). The number of
+/// samples per pixel becomes the maximum. A threshold of zero disables adaptive sampling:
+void IpuScene::setAdaptiveSampling(float threshold, std::uint32_t minSamples) {
+  if (threshold < 0.f || minSamples < 2) {
+    throw std::invalid_argument("Adaptive sampling needs a non-negative threshold and at least 2 samples per pixel.");
+  }
+  adaptiveThreshold = threshold;
+  adaptiveMinSamples = minSamples;
+}
+
+/// Sample paths with scrambled Sobol points (see SobolSampler.hpp) instead of
+/// the IPU's hardware random number generator:
+void IpuScene::setLowDiscrepancySampling(bool enable) {
+  lowDiscrepancy = enable;
+}
+
+/// Return the first hit albedo and normal AOVs of each pixel (for denoising) in
+/// the throughput and normal of the path traced results (see DenoiseAovs):
+void IpuScene::setDenoiseAovs(bool enable) {
+  denoiseAovs = enable;
+}
+
+/// Build the instrumented trace vertices: each pixel's result returns its
+/// TraversalStats (see TraversalStats.hpp) in place of its hit record:
+void IpuScene::setTraversalStats(bool enable) {
+  traversalStats = enable;
+}
+
+/// Set the number of stages of the I/O pipeline: 1 processes one batch at a
+/// time and 2 overlaps DRAM I/O with compute. If there are too few batches per
+/// replica to fill the pipeline the graph is built with depth 1 instead:
+void IpuScene::setIoPipelineDepth(std::uint32_t depth) {
+  if (depth < 1 || depth > 2) {
+    throw std::invalid_argument("I/O pipeline depth must be 1 or 2.");
+  }
+  ioPipelineDepth = depth;
+}
+
+void IpuScene::setRayCallbackThreads(std::size_t threads) {
+  rayCallbackThreads = threads;
+}
+
+void IpuScene::setRayBatchQueue(RayBatchQueue* queue) {
+  batchQueue = queue;
+}
+
+/// Keep rendering frames (with the device attached and the scene resident) for as
+/// long as the callback returns true:
+void IpuScene::setFrameCallback(FrameCallbackFn* fn) {
+  frameFunc = fn;
+}
+
+/// Transform camera rays generated on device (i.e. when path tracing). The scene is
+/// in camera space so the identity leaves the view unchanged. Must be rigid. The
+/// initial transform is the SceneRef's camera:
+void IpuScene::setCameraTransform(const AffineTransform& cameraToWorld) {
+  data.camera = cameraToWorld;
+}
+
+void IpuScene::setRngSeed(std::uint64_t seed) {
+  data.rngSeed = seed;
+}
+
+/// Used to render the image in buckets: each frame of the session renders a
+/// different window with the same graph and DRAM ray buffer, which must be large
+/// enough for the window's rays:
+void IpuScene::setRenderWindow(const CropWindow& window) {
+  data.window = window;
+}
+
+/// Replace the scene (and its render parameters). The sphere and disc arrays
+/// passed to the constructor can be modified in place before calling this. The
+/// new scene is uploaded and unpacked on tile before the next frame and it must
+/// fit within the graph's capacity:
+void IpuScene::updateScene(const SceneRef& scene) {
+  if (numShards) {
+    throw std::logic_error("A sharded scene can not be updated.");
+  }
+  if (data.pathTrace && !getGraphFeatures().supports(getSceneFeatures(scene))) {
+    throw std::logic_error("The new scene has primitive or material types that the graph was not built for.");
+  }
+  data = scene;
+  serialiser.bytes.clear();
+  serialisedScene = nullptr;
+  sceneChanged = true;
+}
+
+/// Build the graph for scenes up to the given sizes instead of the sizes of this
+/// scene. Must be set before the graph is built:
+void IpuScene::setGraphCapacity(const GraphCapacity& limits) {
+  capacity = limits;
+}
+
+/// Return the capacity with unset limits replaced by the sizes of the scene. Throws
+/// if the scene does not fit:
+GraphCapacity IpuScene::resolveCapacity() {
+  getSerialisedScene();
+  auto resolve = [](std::size_t limit, std::size_t size, const std::string& what) {
+    if (limit == 0) {
+      return size;
+    }
+    if (size > limit) {
+      throw std::runtime_error("Graph capacity exceeded: " + what + " (" + std::to_string(size) +
+                               " > " + std::to_string(limit) + ")");
+    }
+    return limit;
+  };
+  GraphCapacity result;
+  // A sharded scene is always sized to fit its shards exactly:
+  result.maxSceneBytes = numShards ? serialShards.size() : resolve(capacity.maxSceneBytes, serialisedSceneSize, "serialised scene bytes");
+  result.maxSpheres = resolve(capacity.maxSpheres, spheres.size(), "spheres");
+  result.maxDiscs = resolve(capacity.maxDiscs, discs.size(), "discs");
+  result.maxMeshes = resolve(capacity.maxMeshes, data.meshInfo.size(), "meshes");
+  result.maxInstances = resolve(capacity.maxInstances, data.instances.size(), "instances");
+  result.maxRays = resolve(capacity.maxRays, rayStream.size(), "rays");
+  return result;
+}
+
+/// Each tile receives the spheres and discs padded to the graph's capacity followed
+/// by the serialised scene (or its shard). The offsets only depend on the capacity so
+/// the vertices can be connected to each part of the tile's copy:
+IpuScene::SceneLayout IpuScene::getSceneLayout(const GraphCapacity& cap) const {
+  const auto upload = sceneUploadLayout(cap.maxSpheres, cap.maxDiscs);
+  SceneLayout layout;
+  layout.discsOffset = upload.discsOffset;
+  layout.sceneOffset = upload.sceneOffset;
+  layout.bytesPerTile = layout.sceneOffset + (numShards ? shardBytesPerTile : cap.maxSceneBytes);
+  return layout;
+}
+
+/// Pack the data for the scene upload stream (one copy of the layout per shard):
+void IpuScene::packSceneUpload(const GraphCapacity& cap) {
+  ipu_utils::TraceScope traceScope("pack_scene_upload");
+  // Log individual component sizes at trace level (measuring them serialises the scene):
+  if (ipu_utils::logger()->should_log(spdlog::level::trace)) {
+    for (const auto& item : sceneTileMemory(data, cap.maxSpheres, cap.maxDiscs, numShards ? 0 : cap.maxSceneBytes)) {
+      ipu_utils::logger()->trace("{}: {} bytes per tile", item.name, item.bytes);
+    }
+  }
+  const auto layout = getSceneLayout(cap);
+  const auto* sceneBytes = numShards ? serialShards.data() : getSerialisedScene();
+  const auto sceneSize = numShards ? shardBytesPerTile : serialisedSceneSize;
+  const auto* sphereBytes = reinterpret_cast<const std::uint8_t*>(spheres.data());
+  const auto* discBytes = reinterpret_cast<const std::uint8_t*>(discs.data());
+  sceneUpload.assign(std::max(numShards, 1u) * layout.bytesPerTile, 0u);
+  for (auto i = 0u; i < std::max(numShards, 1u); ++i) {
+    // Note: this copies host pointers into the on device data! We will
+    // overwrite by rebuilding the object before using it in the codelet:
+    auto dst = sceneUpload.begin() + i * layout.bytesPerTile;
+    std::copy(sphereBytes, sphereBytes + spheres.size() * sizeof(Sphere), dst);
+    std::copy(discBytes, discBytes + discs.size() * sizeof(Disc), dst + layout.discsOffset);
+    std::copy(sceneBytes + i * sceneSize, sceneBytes + (i + 1) * sceneSize, dst + layout.sceneOffset);
+  }
+}
+
+std::uint64_t IpuScene::getGraphKey() {
+  const auto& config = getRuntimeConfig();
+  std::string arch = "ipu_model";
+  if (!config.useIpuModel) {
+    // Devices are listed (not attached) just to find the architecture:
+    auto devices = poplar::DeviceManager::createDeviceManager().getDevices(poplar::TargetType::IPU, config.numIpus);
+    if (devices.empty()) {
+      throw std::runtime_error("No devices with " + std::to_string(config.numIpus) + " IPUs are available.");
+    }
+    arch = devices.front().getTarget().getTargetArchString();
+  }
+
+  // Increment this whenever the programs or streams of the graph change:
+  constexpr std::uint32_t graphVersion = 13;
+  const auto cap = resolveCapacity();
+  const auto& features = getGraphFeatures();
+  std::ostringstream desc;
+  desc << graphVersion << " " << poplar::versionString() << " " << arch << " " << config.numIpus << " " << config.numReplicas << " "
+       << cap.maxSceneBytes << " " << cap.maxSpheres << " " << cap.maxDiscs << " " << cap.maxMeshes << " "
+       << cap.maxInstances << " " << cap.maxRays << " " << (autoRaysPerWorker ? 0 : maxRaysPerWorker) << " " << (autoRaysPerWorker ? autoRaysMemoryProportion : 0.f) << " " << data.pathTrace << " "
+       << slimRayStream << " " << deviceRayGeneration << " " << wavefront << " " << octantSort << " " << adaptiveThreshold << " "
+       << adaptiveMinSamples << " " << lowDiscrepancy << " " << denoiseAovs << " " << traversalStats << " " << ioPipelineDepth << " " << numShards << " " << shardBytesPerTile << " "
+       << (nif != nullptr) << " " << nifHalfPrecision << " " << bakedHdriWidth << " " << nifOnTile << " " << envLightSampling << " "
+       << features.spheres << " " << features.discs << " " << features.instances << " " << features.refractive << " " << sizeof(embree_utils::TraceResult) << " " << sizeof(CompiledTriangleMesh) << " " << sizeof(Triangle);
+  const auto descStr = desc.str();
+  return hashBytes(descStr.data(), descStr.size(), hashFile("TraceCodelets.gp"));
+}
+
+std::size_t IpuScene::getRayRecordSize() const {
+  return slimRayStream ? sizeof(SlimRay) : sizeof(embree_utils::TraceResult);
+}
+
+void IpuScene::setSerialisedScene(const std::uint8_t* bytes, std::size_t size) {
+  serialisedScene = bytes;
+  serialisedSceneSize = size;
+  sceneChanged = true;
+  ipu_utils::logger()->debug("Using pre-serialised scene: {} KiB", serialisedSceneSize / 1024.f);
+}
+
+const std::uint8_t* IpuScene::getSerialisedScene() {
+  if (serialisedScene == nullptr) {
+    // Serialise the scene description for transfer to IPU:
+    ipu_utils::TraceScope traceScope("serialise_scene");
+    serialiser << data;
+    serialisedScene = serialiser.bytes.data();
+    serialisedSceneSize = serialiser.bytes.size();
+    ipu_utils::logger()->debug("Serialised scene size: {} KiB", serialisedSceneSize / 1024.f);
+  }
+  return serialisedScene;
+}
+
+/// Return the scene features that the graph's path trace vertex supports. These
+/// are fixed when first used: later scenes must only use the same features. Kinds
+/// of primitive with a non-zero graph capacity are always supported:
+const SceneFeatures& IpuScene::getGraphFeatures() {
+  if (!graphFeatures) {
+    auto features = getSceneFeatures(data);
+    features.spheres |= capacity.maxSpheres > 0;
+    features.discs |= capacity.maxDiscs > 0;
+    features.instances |= capacity.maxInstances > 0;
+    graphFeatures = features;
+  }
+  return *graphFeatures;
+}
 
 poplar::program::Sequence IpuScene::fpSetupProg(poplar::Graph& graph) const {
   poplar::program::Sequence prog;
@@ -75,107 +373,211 @@ poplar::program::Sequence IpuScene::fpSetupProg(poplar::Graph& graph) const {
   return prog;
 }
 
-std::size_t IpuScene::calcNumBatches(const poplar::Target& target, std::size_t numComputeTiles) const {
-  // The max size is a multiple of the number of workers by definition:
+/// If the constructor was given zero rays per worker choose the largest number
+/// whose ray buffers fit in the tile memory left by the scene and the other
+/// per-tile data (on both the compute and I/O tiles) but no more than leaves
+/// enough batches to fill the I/O pipeline. The choice only depends on the target,
+/// capacity, and options so an executable loaded from the cache gets the same value:
+void IpuScene::resolveRaysPerWorker(const poplar::Target& target, std::size_t computeTiles, std::size_t ioTiles) {
+  if (!autoRaysPerWorker) {
+    return;
+  }
+  const auto cap = resolveCapacity();
   const auto numWorkers = target.getNumWorkerContexts();
-  const auto maxRaysPerIteration = maxRaysPerWorker * numWorkers * numComputeTiles;
-  const auto numReplicas = getRuntimeConfig().numReplicas;
-  std::uint32_t numBatches = rayStream.size() / maxRaysPerIteration;
+  RayMemoryBudget budget;
+  budget.bytesPerTile = std::size_t(autoRaysMemoryProportion * target.getBytesPerTile());
+
+  // The scene (or its shard) is stored on every compute tile along with the env map and NIF:
+  budget.computeFixedBytes = getSceneLayout(cap).bytesPerTile +
+    cap.maxMeshes * sizeof(CompiledTriangleMesh) + cap.maxInstances * sizeof(SceneInstance);
+  if (data.pathTrace && nif && bakedHdriWidth) {
+    budget.computeFixedBytes += 3 * bakedHdriWidth * (bakedHdriWidth / 2) * sizeof(std::uint16_t);
+    if (envLightSampling) {
+      budget.computeFixedBytes += EnvMapSampler::cdfSize(bakedHdriWidth, bakedHdriWidth / 2) * sizeof(float);
+    }
+  }
 
-  // If batches does not divide max rays per itr then we need an
-  // extra batch to clean up the remainder:
-  if (rayStream.size() % maxRaysPerIteration) {
-    numBatches += 1;
+  // Buffers of each ray a worker traces:
+  std::size_t bytesPerRay = sizeof(embree_utils::TraceResult);
+  if (slimRayStream) { bytesPerRay += sizeof(SlimRay); }
+  if (wavefront) { bytesPerRay += sizeof(std::uint32_t); } // Live ray list
+  if (nifPerRay()) {
+    bytesPerRay += sizeof(std::uint32_t); // Escaped ray list
+    const auto shape = nif->getData()->getMlpShape();
+    if (nifOnTile) {
+      budget.computeFixedBytes += shape.numWeights() * sizeof(std::uint16_t) + numWorkers * shape.scratchSize() * sizeof(float);
+    } else {
+      bytesPerRay += 2 * target.getTypeSize(nifType()); // UV coords (exchanged to the NIF)
+    }
+  }
+  budget.computeBytesPerRay = numWorkers * bytesPerRay;
+  if (nifPerRay() && !nifOnTile && nifMaxRaysPerBatch == 0) {
+    // The NIF's batch (and so its activations, which are spread over all the tiles) grows with the rays per worker:
+    const auto shape = nif->getData()->getMlpShape();
+    budget.computeBytesPerRay += (1440 * 2 * shape.hiddenSize * target.getTypeSize(nifType())) / computeTiles;
   }
 
-  // If the number of batches doesn't divide the number of replicas we need
-  // extra dummy batches so that all replicas process the same amount of data:
-  auto batchCounter = numBatches + (numBatches % numReplicas) * (numReplicas - 1);
+  // The I/O tiles hold the load and save buffers of every compute tile and a copy of the scene:
+  const auto rayBuffers = deviceRayGeneration ? 1 : 2;
+  budget.ioBytesPerRay = (rayBuffers * computeTiles * numWorkers * getRayRecordSize() + ioTiles - 1) / ioTiles;
+  budget.ioFixedBytes = (cap.maxSceneBytes + sceneBytes + ioTiles - 1) / ioTiles;
 
-  std::uint32_t numBatchesPerReplica = batchCounter / numReplicas;
+  auto raysPerWorker = fitRaysPerWorker(budget);
+  if (raysPerWorker == 0) {
+    ipu_utils::logger()->warn("Ray buffers for one ray per worker exceed {}% of tile memory.", 100.f * autoRaysMemoryProportion);
+    raysPerWorker = 1;
+  }
+  const auto numReplicas = getRuntimeConfig().numReplicas;
+  const auto pipelineLimit = raysPerWorkerForBatches(cap.maxRays, computeTiles * numWorkers * numReplicas, ioPipelineDepth);
+  maxRaysPerWorker = std::min(raysPerWorker, pipelineLimit);
+  ipu_utils::logger()->info("Rays per worker: {} (tile memory allows {})", maxRaysPerWorker, raysPerWorker);
+}
 
-  ipu_utils::logger()->debug("Ray batches: {}", numBatches);
-  ipu_utils::logger()->debug("Ray batches per replica: {}", numBatchesPerReplica);
-  ipu_utils::logger()->debug("Loop iterations {} (pipeline loop iterations {})", numBatchesPerReplica, numBatchesPerReplica - 2u);
+/// Size the ray buffers for the graph's capacity. This is called when the graph
+/// is built and again before it executes because a graph loaded from an executable
+/// is never built:
+void IpuScene::planRayBatches(const poplar::Target& target) {
+  const auto cap = resolveCapacity();
+  totalRayBufferSize = numComputeTiles * maxRaysPerWorker * target.getNumWorkerContexts() * getRayRecordSize();
+  const auto maxRaysPerIteration = maxRaysPerWorker * target.getNumWorkerContexts() * numComputeTiles;
+  dramRayBatches = dramRayBatchCapacity(cap.maxRays, maxRaysPerIteration, getRuntimeConfig().numReplicas);
+  ipu_utils::logger()->debug("Ray batches per replica: {}", dramRayBatches);
+
+  // Overlapping I/O needs enough batches to fill the pipeline otherwise
+  // fall back to a pipeline that processes one batch at a time:
+  pipelineDepth = pipelineDepthForBatches(dramRayBatches, ioPipelineDepth);
+  if (pipelineDepth < ioPipelineDepth) {
+    ipu_utils::logger()->info("Only {} ray batches per replica: I/O will not be overlapped with compute.",
+                              dramRayBatches);
+  }
+  ipu_utils::logger()->debug("I/O pipeline depth: {}", pipelineDepth);
+}
 
-  // For overlapped I/O we need a pipeline with 2 stages:
-  if (numBatchesPerReplica < 2) {
-    throw std::runtime_error("Using for async I/O pipeline: number of batches per replica must be at least 2 "
-                              "to fill the pipeline.");
+/// Reorder the ray stream along a Morton curve through the pixels of the render
+/// window so that every contiguous run of rays covers a compact region of the screen:
+void IpuScene::sortRayStreamByScreenOrder() {
+  std::vector<std::pair<std::uint32_t, std::uint32_t>> keys(rayStream.size());
+  #pragma omp parallel for schedule(auto)
+  for (auto i = 0u; i < rayStream.size(); ++i) {
+    const auto& p = rayStream[i].p;
+    keys[i] = {mortonCode2d(std::uint16_t(p.v - data.window.c), std::uint16_t(p.u - data.window.r)), i};
   }
+  // The stream is already in order for later frames (unless it was regenerated):
+  if (std::is_sorted(keys.begin(), keys.end())) {
+    return;
+  }
+  std::sort(keys.begin(), keys.end());
+  RayStream sorted;
+  sorted.reserve(rayStream.size());
+  for (const auto& k : keys) {
+    sorted.push_back(rayStream[k.second]);
+  }
+  rayStream.swap(sorted);
+}
 
-  return batchCounter;
+/// Index in the ray stream of the ray at position i of the slim ray stream:
+std::uint32_t IpuScene::slimRayIndex(std::uint32_t i) const {
+  // Rays that are already coherent keep their order. Otherwise they are
+  // interleaved between the tiles to balance the work:
+  return coherentRayOrder ? i : interleavedRayIndex(i, raysPerBatch, raysPerBatch / numComputeTiles, rayStream.size());
 }
 
-std::vector<std::vector<embree_utils::TraceResult>>
-IpuScene::createRayBatches(const poplar::Device& device, std::size_t numComputeTiles) const {
+void IpuScene::initRayBatches(const poplar::Device& device, std::size_t numComputeTiles) {
+  if (coherentRayOrder && !deviceRayGeneration) {
+    sortRayStreamByScreenOrder();
+  }
+
   // The max size is a multiple of the number of workers by definition:
   const auto numWorkers = device.getTarget().getNumWorkerContexts();
-  const auto maxRaysPerIteration = maxRaysPerWorker * numWorkers * numComputeTiles;
+  raysPerBatch = maxRaysPerWorker * numWorkers * numComputeTiles;
   const auto numReplicas = getRuntimeConfig().numReplicas;
-  std::uint32_t numBatches = rayStream.size() / maxRaysPerIteration;
-  if (rayStream.size() % maxRaysPerIteration) {
-    numBatches += 1;
-  }
-
-  // Batch the rays using unecessary copying for now:
-  std::vector<std::vector<embree_utils::TraceResult>> rayBatches;
-  rayBatches.reserve(numBatches);
-  auto hitItr = rayStream.begin();
-
-  for (auto i = 0u; i < numBatches; ++i) {
-    rayBatches.push_back(std::vector<embree_utils::TraceResult>());
-    auto& batch = rayBatches.back();
-    batch.reserve(maxRaysPerIteration);
-    for (auto j = 0u; j < maxRaysPerIteration; ++j) {
-      batch.push_back(*hitItr);
-      hitItr += 1;
-      if (hitItr == rayStream.end()) {
-        break;
-      }
-    }
+  // Every replica processes the same number of batches (the same number of
+  // loop iterations in the middle of the pipeline) so dummy batches are added.
+  // A graph built for a larger capacity also needs enough batches to fill its pipeline:
+  const auto counts = countRayBatches(rayStream.size(), raysPerBatch, numReplicas, pipelineDepth, dramRayBatches);
+  numStreamBatches = counts.streamBatches;
+  numRayBatches = counts.deviceBatches;
+  if (numRayBatches > numStreamBatches) {
+    ipu_utils::logger()->debug("Padding with {} dummy batches to feed all replicas", numRayBatches - numStreamBatches);
   }
 
-  // Pad the last batch:
-  if (rayBatches.back().size() != maxRaysPerIteration) {
-    const auto padding = maxRaysPerIteration - rayBatches.back().size();
-    ipu_utils::logger()->debug("Last batch needs padding: {}", padding);
-    // Need to pad with dud rays:
-    for (auto i = 0u; i < padding; ++i) {
-      // Choose rays that will probably fail at first intersection:
-      rayBatches.back().push_back(
-        embree_utils::TraceResult(
-          embree_utils::HitRecord(embree_utils::Vec3fa(10000, 0, 0), embree_utils::Vec3fa(1, 0, 0)),
-          embree_utils::PixelCoord())
-      );
+  // Full batches are transferred directly to and from the ray stream. Only
+  // the last batch (if it is partial) is staged in a copy padded to full size:
+  paddedBatch.clear();
+  slimStream.clear();
+  const auto remainingRays = counts.paddingRays ? raysPerBatch - counts.paddingRays : 0;
+  if (slimRayStream) {
+    // Slim records are always staged (they are much smaller than the ray stream)
+    // unless they are generated on device and only received via the callback.
+    // Padding records just trace pixel (0, 0) and their results are discarded.
+    // Rays are interleaved between tiles to balance the work:
+    if (!deviceRayGeneration || rayFunc == nullptr) {
+      slimStream.resize(numStreamBatches * raysPerBatch, SlimRay{0, 0, 0u});
+    }
+    for (auto r = 0u; r < rayStream.size() && !deviceRayGeneration; ++r) {
+      const auto& p = rayStream[slimRayIndex(r)].p;
+      if (!(p.u >= 0.f && p.u < 65536.f && p.v >= 0.f && p.v < 65536.f)) {
+        throw std::runtime_error("Pixel coordinates are out of range for a slim ray stream.");
+      }
+      slimStream[r].u = p.u;
+      slimStream[r].v = p.v;
     }
-    ipu_utils::logger()->debug("Last chunk padded to size: {}", rayBatches.back().size());
+  } else if (remainingRays) {
+    ipu_utils::logger()->debug("Last batch needs padding: {}", counts.paddingRays);
+    paddedBatch.reserve(raysPerBatch);
+    paddedBatch.insert(paddedBatch.end(), rayStream.end() - remainingRays, rayStream.end());
+    // Need to pad with dud rays. Choose rays that will probably fail at first intersection:
+    paddedBatch.resize(raysPerBatch,
+      embree_utils::TraceResult(
+        embree_utils::HitRecord(embree_utils::Vec3fa(10000, 0, 0), embree_utils::Vec3fa(1, 0, 0)),
+        embree_utils::PixelCoord())
+    );
   }
+}
 
-  // We also need to pad the number of batches so that all replicas process the same
-  // number of batches (same number of loop iterations in the middle of the pipeline):
-  const auto remainder = rayBatches.size() % numReplicas;
-  if (remainder) {
-    auto dummyBatchesNeeded = remainder * (numReplicas - 1);
-    ipu_utils::logger()->debug("Padding with {} dummy batches to feed all replicas", dummyBatchesNeeded);
-    for (auto d = 0u; d < dummyBatchesNeeded; ++d) {
-      rayBatches.push_back(rayBatches.back()); // Just repeat the last batch
-    }
+void* IpuScene::getRayBatchData(std::size_t index) {
+  // Dummy batches only feed replicas so they just repeat the last batch of the run:
+  index = firstRunBatch + std::min(index, numRunBatches - 1);
+  if (slimRayStream) {
+    return slimStream.data() + index * raysPerBatch;
+  }
+  if (!paddedBatch.empty() && index == numStreamBatches - 1) {
+    return paddedBatch.data();
   }
+  return rayStream.data() + index * raysPerBatch;
+}
 
-  if (rayBatches.size() < 2) {
-    throw std::runtime_error("Using async I/O pipeline: number of batches per replica "
-                             "must be at least 2 to fill the pipeline.");
+std::span<embree_utils::TraceResult> IpuScene::getRayBatch(std::size_t index) {
+  if (index >= numStreamBatches) {
+    return std::span<embree_utils::TraceResult>();
   }
+  const auto first = index * raysPerBatch;
+  return std::span(rayStream).subspan(first, std::min(raysPerBatch, rayStream.size() - first));
+}
 
-  return rayBatches;
+std::span<embree_utils::TraceResult> IpuScene::receiveRayBatch(std::size_t index, const void* src) {
+  // Copy only the real rays (padding and dummy batches are discarded):
+  auto batch = getRayBatch(index);
+  if (slimRayStream) {
+    // Undo the interleaving of rays between tiles:
+    auto slim = static_cast<const SlimRay*>(src);
+    const auto first = index * raysPerBatch;
+    for (auto r = 0u; r < batch.size(); ++r) {
+      auto& result = batch[slimRayIndex(first + r) - first];
+      result.p = embree_utils::PixelCoord(slim[r].u, slim[r].v);
+      result.rgb = decodeRgbe(slim[r].rgbe);
+    }
+  } else {
+    std::memcpy(batch.data(), src, batch.size_bytes());
+  }
+  return batch;
 }
 
 bool IpuScene::loadNifModel(const std::string& assetPath) {
   try {
     const auto metaFile = assetPath + "/nif_metadata.txt";
     const auto h5File = assetPath + "/converted.hdf5";
-    auto nifData = std::make_shared<NifModel::Data>(h5File, metaFile);
+    auto nifData = NifModel::Data::load(h5File, metaFile);
     nif = std::make_unique<NifModel>(nifData, "hdri_nif");
     ipu_utils::logger()->info("Loaded NIF model from '{}'", assetPath);
     return true;
@@ -193,31 +595,33 @@ void IpuScene::createComputeVars(poplar::Graph& ioGraph,
                                  poplar::Graph& computeGraph,
                                  std::size_t numComputeTiles,
                                  std::size_t maxRaysPerIteration) {
-  // Add a variable to hold each primitive type:
-  spheresVar.buildTensor(ioGraph, poplar::UNSIGNED_CHAR, {spheres.size() * sizeof(Sphere)});
-  discsVar.buildTensor(ioGraph, poplar::UNSIGNED_CHAR, {discs.size() * sizeof(Disc)});
+  // Scene data is sized for the graph's capacity (the scene itself is streamed):
+  const auto cap = resolveCapacity();
 
-  // All scene data is serialised into a single byte stream:
-  serialScene.buildTensor(ioGraph, poplar::UNSIGNED_CHAR, {serialiser.bytes.size()});
+  // All scene data (including the primitives) is packed into a single byte
+  // stream. For a sharded scene the stream holds all the shards back to back:
+  const auto layout = getSceneLayout(cap);
+  serialScene.buildTensor(ioGraph, poplar::UNSIGNED_CHAR, {std::max(numShards, 1u) * layout.bytesPerTile});
 
   samplesPerPixel.buildTensor(ioGraph, poplar::UNSIGNED_INT, {1u});
   azimuthRotation.buildTensor(ioGraph, poplar::FLOAT, {});
+  cameraVar.buildTensor(ioGraph, poplar::FLOAT, {sizeof(AffineTransform) / sizeof(float)});
 
   // The scene data vars get uploaded once by the host and then broadcast to every
-  // tile so we store them in a separate map to keep track of that more easily.
-  // TODO: spheres and disc primitives should be stored in the serialised scene's
-  // monolithic byte array.
+  // tile so we store them in a separate map to keep track of that more easily:
   ioSceneVars = {
-    {"spheres", spheresVar.get()},
-    {"discs", discsVar.get()},
-    {"meshes", computeGraph.addVariable(poplar::UNSIGNED_CHAR,
-                                        {data.meshInfo.size() * sizeof(CompiledTriangleMesh)},
-                                        "tri_meshes")},
-    {"serialisedScene", serialScene.get()},
+    {"sceneData", serialScene.get()},
     {"samplesPerPixel", samplesPerPixel.get()},
-    {"azimuthRotation", azimuthRotation.get()}
+    {"azimuthRotation", azimuthRotation.get()},
+    {"camera", cameraVar.get()}
   };
 
+  if (deviceRayGeneration) {
+    // The render window is streamed so that one graph can render any window:
+    rayWindow.buildTensor(ioGraph, poplar::UNSIGNED_INT, {4u});
+    ioSceneVars["rayWindow"] = rayWindow.get();
+  }
+
   // Map the receive buffers for scene data linearly across the IO tiles. We must
   // specify large minimum chunk and grain sizes otherwise exchange code on the
   // compute tiles becomes prohibitively large:
@@ -230,21 +634,192 @@ void IpuScene::createComputeVars(poplar::Graph& ioGraph,
 
   // These tensors hold the scene data after it has been broadcast to every tile in the compute graph:
   for (const auto& p : ioSceneVars) {
+    auto elementsPerTile = p.second.numElements();
+    if (p.first == "sceneData") {
+      elementsPerTile = layout.bytesPerTile; // Tiles of a sharded scene only receive their own shard
+    }
     broadcastSceneVars.insert(std::make_pair(
       p.first,
-      computeGraph.addVariable(p.second.elementType(), {numComputeTiles, p.second.numElements()}, p.first + "_broadcast"))
+      computeGraph.addVariable(p.second.elementType(), {numComputeTiles, elementsPerTile}, p.first + "_broadcast"))
     );
   }
 
+  // The vertices are connected to the parts of the scene data in place:
+  const auto sceneData = broadcastSceneVars.at("sceneData");
+  broadcastSceneVars["spheres"] = sceneData.slice(0, cap.maxSpheres * sizeof(Sphere), 1);
+  broadcastSceneVars["discs"] = sceneData.slice(layout.discsOffset, layout.discsOffset + cap.maxDiscs * sizeof(Disc), 1);
+  broadcastSceneVars["serialisedScene"] = sceneData.slice(layout.sceneOffset, layout.bytesPerTile, 1);
+
+  // Meshes and instances are rebuilt on each tile from the scene so are never broadcast:
+  broadcastSceneVars["meshes"] = computeGraph.addVariable(
+    poplar::UNSIGNED_CHAR, {numComputeTiles, cap.maxMeshes * sizeof(CompiledTriangleMesh)}, "tri_meshes");
+  broadcastSceneVars["instances"] = computeGraph.addVariable(
+    poplar::UNSIGNED_CHAR, {numComputeTiles, cap.maxInstances * sizeof(SceneInstance)}, "instances");
+
   // Ray data is distributed across tiles:
   const auto perTileRayBufferSize = maxRaysPerIteration * sizeof(embree_utils::TraceResult);
   rayTraceVars = {
-    {"rays", computeGraph.addVariable(poplar::UNSIGNED_CHAR, {numComputeTiles, perTileRayBufferSize}, "sram_ray_buffer")},
-    {"uvs", computeGraph.addVariable(poplar::FLOAT, {numComputeTiles, 2, maxRaysPerIteration}, "uv_coords")}
+    {"rays", computeGraph.addVariable(poplar::UNSIGNED_CHAR, {numComputeTiles, perTileRayBufferSize}, "sram_ray_buffer")}
+  };
+
+  if (slimRayStream) {
+    // Slim records are exchanged with the I/O tiles and expanded on tile:
+    rayTraceVars["slimRays"] = computeGraph.addVariable(
+      poplar::UNSIGNED_CHAR, {numComputeTiles, maxRaysPerIteration * sizeof(SlimRay)}, "sram_slim_ray_buffer");
+  }
+  if (wavefront) {
+    // Per-tile list of the rays whose paths are still live:
+    rayTraceVars["liveRays"] = computeGraph.addVariable(poplar::UNSIGNED_INT, {numComputeTiles, maxRaysPerIteration}, "live_rays");
+    rayTraceVars["numLiveRays"] = computeGraph.addVariable(poplar::UNSIGNED_INT, {numComputeTiles, 1}, "num_live_rays");
+    rayTraceVars["pathDepth"] = computeGraph.addVariable(poplar::UNSIGNED_INT, {numComputeTiles, 1}, "path_depth");
+  }
+  if (data.pathTrace) {
+    // Path tracing vertices always take an environment map but it is only a
+    // placeholder (which is never read) unless the NIF is baked into a texture:
+    const std::size_t envMapSize = bakedHdriWidth && nif ? 3 * bakedHdriWidth * (bakedHdriWidth / 2) : 3;
+    rayTraceVars["envMap"] = computeGraph.addVariable(poplar::HALF, {numComputeTiles, envMapSize}, "env_map");
+    const std::size_t envCdfSize = envLightSampling ? EnvMapSampler::cdfSize(bakedHdriWidth, bakedHdriWidth / 2) : 1;
+    rayTraceVars["envCdf"] = computeGraph.addVariable(poplar::FLOAT, {numComputeTiles, envCdfSize}, "env_cdf");
+  }
+  if (nifPerRay() && nifOnTile) {
+    // Every tile gets its own copy of the weights and scratch space for each worker:
+    nifShape = nif->getData()->getMlpShape();
+    const auto numWorkers = computeGraph.getTarget().getNumWorkerContexts();
+    rayTraceVars["nifWeights"] = computeGraph.addVariable(poplar::HALF, {numComputeTiles, nifShape.numWeights()}, "nif_weights");
+    rayTraceVars["nifScratch"] = computeGraph.addVariable(poplar::FLOAT, {numComputeTiles, numWorkers * nifShape.scratchSize()}, "nif_scratch");
+    ipu_utils::logger()->info("On-tile NIF uses {} bytes per tile",
+                              nifShape.numWeights() * sizeof(std::uint16_t) + numWorkers * nifShape.scratchSize() * sizeof(float));
+  } else if (nifPerRay()) {
+    rayTraceVars["uvs"] = computeGraph.addVariable(nifType(), {numComputeTiles, 2, maxRaysPerIteration}, "uv_coords");
+  }
+  if (nifPerRay()) {
+    // Per-tile list of the escaped rays (the NIF only needs to process these):
+    rayTraceVars["escapedRays"] = computeGraph.addVariable(poplar::UNSIGNED_INT, {numComputeTiles, maxRaysPerIteration}, "escaped_rays");
+    rayTraceVars["numEscapedRays"] = computeGraph.addVariable(poplar::UNSIGNED_INT, {numComputeTiles, 1}, "num_escaped_rays");
+  }
+  if (deviceRayGeneration) {
+    rayTraceVars["batchIndex"] = computeGraph.addVariable(poplar::UNSIGNED_INT, {numComputeTiles}, "batch_index");
+  }
+
+  if (!data.pathTrace) {
+    // Shadow traces queue a shadow ray per ray between the intersect and occlude phases:
+    rayTraceVars["shadowRays"] = computeGraph.addVariable(
+      poplar::UNSIGNED_CHAR, {numComputeTiles, maxRaysPerIteration * sizeof(embree_utils::Ray)}, "shadow_rays");
+  }
+  if (countCasts()) {
+    // The path trace vertex counts the paths, secondary rays, and cycles of each of its workers:
+    const auto numWorkers = computeGraph.getTarget().getNumWorkerContexts();
+    workerCounters.buildTensor(computeGraph, poplar::UNSIGNED_INT, {numComputeTiles, WorkerCounterCount * numWorkers});
+    rayTraceVars["workerCounters"] = workerCounters.get();
+  }
+  if (numShards) {
+    // Sharded scenes also need a buffer to receive rays that are exchanged between tile groups:
+    rayTraceVars["rayExchange"] = computeGraph.addVariable(
+      poplar::UNSIGNED_CHAR, {numComputeTiles, perTileRayBufferSize}, "ray_exchange_buffer");
+  }
+}
+
+namespace {
+
+// Programs that move one ray batch through the I/O pipeline:
+struct IoPipelineStages {
+  poplar::program::Sequence load;    // DRAM to I/O tiles
+  poplar::program::Sequence copyIn;  // I/O tiles to compute tiles
+  poplar::program::Sequence compute;
+  poplar::program::Sequence copyOut; // Compute tiles to I/O tiles
+  poplar::program::Sequence save;    // I/O tiles to DRAM (and host)
+  poplar::program::Sequence incLoadIndex;
+  poplar::program::Sequence incSaveIndex;
+};
+
+/// Repeat a program the number of times held in a scalar tensor (a Repeat's
+/// count is fixed when the graph is compiled):
+poplar::program::Sequence repeatCount(poplar::Graph& graph, poplar::Tensor count,
+                                      const poplar::program::Program& body, const std::string& name) {
+  auto counter = graph.addVariable(poplar::UNSIGNED_INT, {}, name + "/counter");
+  graph.setTileMapping(counter, 0);
+  poplar::program::Sequence prog;
+  popops::zero(graph, counter, prog, name + "/zero");
+
+  poplar::program::Sequence cond;
+  poplar::Tensor pred = popops::sub(graph, count, counter, cond, name + "/condition");
+  cond.add(poplar::program::AssumeEqualAcrossReplicas(pred, name + "/pred_assume_equal"));
+  poplar::program::Sequence loopBody {body};
+  popops::addInPlace(graph, counter, 1u, loopBody, name + "/increment");
+  prog.add(poplar::program::RepeatWhileTrue(cond, pred, loopBody, name));
+  return prog;
+}
+
+/// Build the loop over a replica's ray batches. The loop condition must run
+/// while the save index is less than the loop limit (minus the pipeline depth).
+///
+/// With depth 1 each batch is loaded, traced, and saved in turn. With depth 2
+/// the I/O tiles save the previous batch and load the next one while the compute
+/// tiles trace the current batch. Every buffer holds one batch so the steady
+/// state has three batches in flight which is the most that can overlap in a
+/// bulk synchronous step: a deeper queue of loads would still wait for the step
+/// in which it was issued.
+poplar::program::Sequence buildIoPipeline(std::uint32_t depth, const IoPipelineStages& s,
+                                          const poplar::program::Sequence& cond, const poplar::Tensor& pred) {
+  if (depth == 1) {
+    poplar::program::Sequence body {
+      s.load, s.copyIn, s.compute, s.copyOut, s.save, s.incLoadIndex, s.incSaveIndex
+    };
+    return poplar::program::Sequence {
+      poplar::program::RepeatWhileTrue(cond, pred, body, "trace_loop")
+    };
+  }
+
+  if (depth != 2) {
+    throw std::logic_error("Unsupported I/O pipeline depth: " + std::to_string(depth));
+  }
+
+  // Main loop should read and write DRAM asynchronously with compute:
+  poplar::program::Sequence body {
+    s.save,
+    s.incSaveIndex,
+    s.incLoadIndex,
+    s.load,
+    s.compute,
+    s.copyOut,
+    s.copyIn
+  };
+
+  return poplar::program::Sequence {
+    // Prologue fills the pipeline:
+    s.load,
+    s.copyIn,
+    s.compute,
+    s.incLoadIndex,
+    s.load,
+    s.copyOut,
+    s.copyIn,
+    poplar::program::RepeatWhileTrue(cond, pred, body, "trace_loop"),
+    // Epilogue drains it:
+    s.save,
+    s.incSaveIndex,
+    s.compute,
+    s.copyOut,
+    s.save
   };
 }
 
-IpuScene::NifResult IpuScene::buildNifHdri(poplar::Graph& g, std::unique_ptr<NifModel>& model, poplar::Tensor input) {
+} // end anonymous namespace
+
+/// Make a program that moves the rows of a per-tile tensor to the same tile
+/// in the next shard's group of tiles (the last group wraps around to the first).
+/// The buffer receives the exchanged data and must have the same shape as the tensor.
+static poplar::program::Sequence rotateShards(poplar::Tensor t, poplar::Tensor buffer, std::size_t tilesPerShard) {
+  const auto numTiles = t.dim(0);
+  auto rotated = poplar::concat(buffer.slice(tilesPerShard, numTiles, 0), buffer.slice(0, tilesPerShard, 0));
+  return poplar::program::Sequence {
+    poplar::program::Copy(t, rotated),
+    poplar::program::Copy(buffer, t) // On tile copy
+  };
+}
+
+IpuScene::NifResult IpuScene::buildNifHdri(poplar::Graph& g, std::unique_ptr<NifModel>& model,
+                                           poplar::Tensor input, poplar::Tensor numEscapedRays) {
   if (!model) {
     throw std::runtime_error("Empty NIF model object.");
   }
@@ -252,29 +827,25 @@ IpuScene::NifResult IpuScene::buildNifHdri(poplar::Graph& g, std::unique_ptr<Nif
   IpuScene::NifResult result;
 
   bool optimiseStreamMemory = true;
-  auto propStr = std::to_string(nifMemoryProportion);
-  poplar::OptionFlags matmulOptions {
-    {"partialsType", "half"},
-    {"availableMemoryProportion", std::to_string(nifMemoryProportion)},
-    {"fullyConnectedPass", "INFERENCE_FWD"},
-    {"use128BitConvUnitLoad", "true"},
-    {"enableFastReduce", "true"}
-  };
-  ipu_utils::logger()->trace("NIF available memory proportion set to {}", propStr);
+  auto matmulOptions = NifModel::defaultMatmulOptions(nifMemoryProportion);
 
   // We need to serialise the input into smaller batches to save memory.  Keep this
   // part simple and find first divisor below the 'optimal' (empirically determined) batch size.
   // Eventually Poplar will automatically calculate batch serialisation plans so overcomplicating
-  // this would be a waste of time.
+  // this would be a waste of time. Batches are slices of the per-tile ray dimension
+  // (across all tiles) so that the escaped rays (which are compacted to the front of
+  // each tile's UVs) only occupy the first few batches:
   input = input.dimShuffle({1, 0, 2});
   ipu_utils::logger()->debug("NIF input shape: {}", input.shape());
+  const unsigned raysPerTile = input.dim(2);
   unsigned fullBatchSize = input.numElements() / 2;
   std::size_t optimalBatchSize;
   if (nifMaxRaysPerBatch == 0) {
-    // If option is 0 then we automatically set the batch size so that a single batch
-    // is fed to the network for each ray batch (often this will not be optimal but it
-    // gives users a comprehensible starting point for tuning the parameter themselves):
-    optimalBatchSize = 1440 * 6 * maxRaysPerWorker;
+    // If option is 0 then we automatically set the batch size so that each worker's
+    // share of the rays is one batch. This gives users a comprehensible starting point
+    // for tuning the parameter themselves while still allowing batches that contain no
+    // escaped rays to be skipped:
+    optimalBatchSize = 1440 * maxRaysPerWorker;
   } else {
     // Overide with user specified value:
     optimalBatchSize = nifMaxRaysPerBatch;
@@ -284,9 +855,10 @@ IpuScene::NifResult IpuScene::buildNifHdri(poplar::Graph& g, std::unique_ptr<Nif
   float optimalFactor = fullBatchSize / (float)optimalBatchSize;
   ipu_utils::logger()->trace("Optimal NIF serialisation-factor: {}", optimalFactor);
   unsigned closestFactor = std::ceil(optimalFactor);
-  while (fullBatchSize % closestFactor) {
+  while (raysPerTile % closestFactor) {
     closestFactor += 1;
   }
+  const auto raysPerSlice = raysPerTile / closestFactor;
   std::size_t batchSize = fullBatchSize / closestFactor;
   ipu_utils::logger()->debug("Batch-size serialisation full-size: {} serial-size: {} factor: {}", fullBatchSize, batchSize, closestFactor);
   if (batchSize > optimalBatchSize) {
@@ -298,7 +870,7 @@ IpuScene::NifResult IpuScene::buildNifHdri(poplar::Graph& g, std::unique_ptr<Nif
   ipu_utils::logger()->debug("Serialised input shape: {}", inputSlice.shape());
 
   auto nifGraphFunc = g.addFunction(
-      model->buildInference(g, matmulOptions, cache, optimiseStreamMemory, inputSlice));
+      model->buildInference(g, matmulOptions, cache, optimiseStreamMemory, inputSlice, nifType()));
 
   // Analyse the model for the full batch size per replica:
   model->analyseModel(model->getBatchSize() * closestFactor);
@@ -313,17 +885,34 @@ IpuScene::NifResult IpuScene::buildNifHdri(poplar::Graph& g, std::unique_ptr<Nif
   result.bgr = g.addVariable(nifResult.elementType(), outputShape, "result_rgb");
   ipu_utils::logger()->debug("NIF full result.bgr tensor shape: {}", result.bgr.shape());
 
-  // Now ready to construct the program. Since the number of serialisation steps will be small
-  // we construct the serialisation loop unrolled (slices can be static):
+  // A batch only needs to run if some tile has more escaped rays than come before the
+  // batch. The predicates for all batches are computed from the largest count:
   poplar::program::Sequence unrolledLoop;
-
+  namespace pe = popops::expr;
+  auto maxEscaped = popops::reduce(g, numEscapedRays.flatten(), poplar::UNSIGNED_INT, {0},
+                                   popops::Operation::MAX, unrolledLoop, "max_escaped_rays");
+  std::vector<unsigned> sliceStarts(closestFactor);
   for (auto s = 0u; s < closestFactor; ++s) {
-    auto uvSlice = input.reshape({2, fullBatchSize}).slice(s * batchSize, (s + 1) * batchSize, 1);
-    auto resultSlice = result.bgr.reshape({fullBatchSize, 3}).slice(s * batchSize, (s + 1) * batchSize, 0);
+    sliceStarts[s] = s * raysPerSlice;
+  }
+  auto starts = g.addConstant(poplar::UNSIGNED_INT, {closestFactor}, sliceStarts.data(), "nif_slice_starts");
+  g.setTileMapping(starts, g.getTileMapping(maxEscaped));
+  auto runSlice = popops::map(g, pe::Gt(pe::_1, pe::_2), {maxEscaped.expand({0}).broadcast(closestFactor, 0), starts},
+                              unrolledLoop, "nif_slice_predicates");
 
-    unrolledLoop.add(poplar::program::Copy(uvSlice, inputSlice));
-    unrolledLoop.add(poplar::program::Call(nifGraphFunc));
-    unrolledLoop.add(poplar::program::Copy(nifResultSlice, resultSlice));
+  // Now ready to construct the program. Since the number of serialisation steps will be small
+  // we construct the serialisation loop unrolled (slices can be static):
+  for (auto s = 0u; s < closestFactor; ++s) {
+    const auto begin = s * raysPerSlice;
+    const auto end = begin + raysPerSlice;
+    auto uvSlice = input.slice(begin, end, 2).reshape({2, batchSize});
+    auto resultSlice = result.bgr.slice(begin, end, 1).reshape({batchSize, 3});
+
+    unrolledLoop.add(poplar::program::If(runSlice[s], poplar::program::Sequence {
+      poplar::program::Copy(uvSlice, inputSlice),
+      poplar::program::Call(nifGraphFunc),
+      poplar::program::Copy(nifResultSlice, resultSlice)
+    }, poplar::program::Sequence()));
   }
 
   result.init = model->buildInit(g, optimiseStreamMemory);
@@ -331,6 +920,87 @@ IpuScene::NifResult IpuScene::buildNifHdri(poplar::Graph& g, std::unique_ptr<Nif
   return result;
 }
 
+/// Bake the NIF into an equirectangular texture of fp16 BGR texels. The network
+/// is evaluated once for every texel in the init program (so it runs again only
+/// if the scene changes) then the texture is copied to every compute tile where
+/// the path tracing vertices light escaped rays with a bilinear lookup:
+IpuScene::NifResult IpuScene::buildNifBake(poplar::Graph& g, std::unique_ptr<NifModel>& model, poplar::Tensor envMaps) {
+  if (!model) {
+    throw std::runtime_error("Empty NIF model object.");
+  }
+
+  IpuScene::NifResult result;
+  const std::size_t width = bakedHdriWidth;
+  const std::size_t height = width / 2;
+  const std::size_t numTexels = width * height;
+
+  // Serialise the texels into batches in the same way as for per-ray inference:
+  const std::size_t optimalBatchSize = nifMaxRaysPerBatch ? nifMaxRaysPerBatch : 1440 * maxRaysPerWorker;
+  unsigned factor = std::ceil(numTexels / (float)optimalBatchSize);
+  while (numTexels % factor) {
+    factor += 1;
+  }
+  const auto batchSize = numTexels / factor;
+  ipu_utils::logger()->debug("Baking NIF into {} x {} texture using {} batches of {}", width, height, factor, batchSize);
+
+  // UV coords of the texels are streamed from the host:
+  auto [u, v] = NifModel::makeGridCoordsUV(width, height);
+  bakeUVData = std::move(u);
+  bakeUVData.insert(bakeUVData.end(), v.begin(), v.end());
+  bakeUVs.buildTensor(g, poplar::FLOAT, {2, numTexels});
+  poputil::mapTensorLinearly(g, bakeUVs);
+
+  auto inputSlice = g.addVariable(poplar::FLOAT, {2, batchSize}, poplar::VariableMappingMethod::LINEAR, "bake_input_slice");
+  auto matmulOptions = NifModel::defaultMatmulOptions(nifMemoryProportion);
+  auto nifGraphFunc = g.addFunction(
+      model->buildInference(g, matmulOptions, cache, true, inputSlice, nifType()));
+  model->analyseModel(numTexels);
+
+  auto nifResult = model->getOutput();
+  auto nifResultSlice = nifResult.slice(0, batchSize, 0);
+  auto texture = g.addVariable(nifResult.elementType(), {numTexels, 3}, poplar::VariableMappingMethod::LINEAR, "baked_hdri");
+
+  poplar::program::Sequence bake;
+  bake.add(model->buildInit(g, true));
+  bake.add(bakeUVs.buildWrite(g, true));
+  for (auto s = 0u; s < factor; ++s) {
+    bake.add(poplar::program::Copy(bakeUVs.get().slice(s * batchSize, (s + 1) * batchSize, 1), inputSlice));
+    bake.add(poplar::program::Call(nifGraphFunc));
+    bake.add(poplar::program::Copy(nifResultSlice, texture.slice(s * batchSize, (s + 1) * batchSize, 0)));
+  }
+
+  if (texture.elementType() != poplar::HALF) {
+    // Saturate rather than overflow to inf (e.g. when the sun is in the HDRI):
+    popops::minInPlace(g, texture, 65504.f, bake, "saturate_baked_hdri");
+    texture = popops::cast(g, texture, poplar::HALF, bake, "baked_hdri_to_fp16");
+  }
+
+  // Replicate the texture on every tile:
+  bake.add(poplar::program::Copy(texture.flatten().expand({0}).broadcast(envMaps.dim(0), 0), envMaps));
+
+  result.bgr = texture;
+  result.init = bake;
+  return result;
+}
+
+/// Copy the NIF's weights (at fp16) to every tile once so that each tile can
+/// evaluate the network for its own escaped rays. This only suits small networks
+/// as the weights (and the scratch space for the activations of each worker) are
+/// replicated on every tile:
+IpuScene::NifResult IpuScene::buildNifOnTile(poplar::Graph& g, std::unique_ptr<NifModel>& model, poplar::Tensor tileWeights) {
+  if (!model) {
+    throw std::runtime_error("Empty NIF model object.");
+  }
+
+  IpuScene::NifResult result;
+  nifTileWeightData = model->getData()->packWeightsHalf(g.getTarget());
+  nifTileWeights.buildTensor(g, poplar::HALF, {tileWeights.dim(1)});
+  poputil::mapTensorLinearly(g, nifTileWeights);
+  result.init.add(nifTileWeights.buildWrite(g, true));
+  result.init.add(poplar::program::Copy(nifTileWeights.get().expand({0}).broadcast(tileWeights.dim(0), 0), tileWeights));
+  return result;
+}
+
 void IpuScene::setHdriRotation(float degrees) {
   hdriRotationDegrees = degrees;
 }
@@ -343,6 +1013,139 @@ void IpuScene::setMaxNifBatchSize(std::size_t raysPerBatch) {
   nifMaxRaysPerBatch = raysPerBatch;
 }
 
+/// Proportion of each tile's memory that the ray buffers and per-tile data may
+/// fill when the rays per worker are chosen automatically (the rest is left for
+/// code, vertex state, and exchange buffers):
+void IpuScene::setAutoRaysMemoryProportion(float proportion) {
+  if (proportion <= 0.f || proportion > 1.f) {
+    throw std::invalid_argument("Automatic rays-per-worker memory proportion must be in (0, 1].");
+  }
+  autoRaysMemoryProportion = proportion;
+}
+
+/// Run the NIF's input encoding, activations, and weights at fp16 and exchange
+/// its UV inputs and decoded outputs (which are saturated to the fp16 range) at
+/// fp16. Matmul partials are fp16 in either mode and the output decode is fp32.
+void IpuScene::setNifHalfPrecision(bool enable) {
+  nifHalfPrecision = enable;
+}
+
+/// Choose the NIF's batch size and matmul memory proportion by timing candidate
+/// plans on the device. The plan is loaded from the file if it was already tuned
+/// for the same device, ray batch size, and precision, otherwise it is tuned and
+/// saved there. Must be called after the NIF and runtime config are set:
+void IpuScene::autotuneNif(const std::string& planFile) {
+  if (!nif) {
+    throw std::logic_error("A NIF must be loaded before it can be autotuned.");
+  }
+
+  // Each replica runs its own NIF so tune for the IPUs of one replica:
+  const auto config = getRuntimeConfig();
+  NifAutotuneSettings settings;
+  settings.config = config;
+  settings.config.numIpus = config.numIpus / config.numReplicas;
+  settings.config.numReplicas = 1;
+  settings.config.deferredAttach = true;
+  settings.dtype = nifType();
+  settings.memoryProportions = {0.3f, 0.45f, 0.6f};
+
+  // Find the compute tiles and rays per tile in the same way as build():
+  auto device = ipu_utils::getDeviceFromConfig(settings.config);
+  const auto& target = device->getTarget();
+  poplar::Graph graph(target);
+  const auto numTilesForIO = gcl::getMinIoTiles(graph);
+  settings.numTiles = target.getNumTiles() - numTilesForIO;
+  resolveRaysPerWorker(target, settings.numTiles, numTilesForIO);
+  settings.raysPerTile = maxRaysPerWorker * target.getNumWorkerContexts();
+  device.reset();
+
+  auto plan = loadNifPlan(planFile, settings);
+  if (!plan) {
+    plan = ::autotuneNif(nif->getData(), settings);
+    saveNifPlan(planFile, settings, *plan);
+  }
+  nifMaxRaysPerBatch = plan->batchSize;
+  nifMemoryProportion = plan->availableMemoryProportion;
+}
+
+/// Bake the NIF into a texture of the given width (the height is half the width)
+/// instead of evaluating it for every escaped ray. The texture is replicated on
+/// every tile so this trades tile memory for a much cheaper lookup. Zero (the
+/// default) evaluates the NIF exactly for every ray:
+void IpuScene::setBakedHdriWidth(std::uint32_t width) {
+  if (width % 2) {
+    throw std::invalid_argument("The baked HDRI width must be even.");
+  }
+  bakedHdriWidth = width;
+}
+
+/// Evaluate the NIF inside a vertex on every tile (for each tile's own escaped
+/// rays) instead of with matmuls spread across all the tiles. This removes all
+/// of the exchange from the environment lookup but needs the whole network to
+/// fit on every tile. The weights are always fp16 and activations fp32:
+void IpuScene::setNifOnTile(bool enable) {
+  nifOnTile = enable;
+}
+
+/// Importance sample the baked NIF environment light at every diffuse hit (next
+/// event estimation with a shadow ray) and combine it with BxDF sampling using
+/// MIS. Sampling is in proportion to the luminance of the baked texture so it is
+/// most effective for outdoor environments with a small, bright sun:
+void IpuScene::setEnvLightSampling(bool enable) {
+  envLightSampling = enable;
+}
+
+poplar::Type IpuScene::nifType() const {
+  return nifHalfPrecision ? poplar::HALF : poplar::FLOAT;
+}
+
+/// Distribute the scene across groups of tiles instead of replicating it on every
+/// tile. The compute tiles are split into one group per shard and every ray batch
+/// visits each group in turn. Must be called before the graph is built.
+void IpuScene::setSceneShards(std::vector<SceneShardData>& shards) {
+  getSerialisedScene();
+  ipu_utils::TraceScope traceScope("serialise_scene_shards");
+  const auto fullSceneBytes = serialisedSceneSize;
+  std::vector<Serialiser<16>> shardSerialisers;
+  shardSerialisers.reserve(shards.size());
+  std::size_t maxShardBytes = 0;
+  for (auto& shard : shards) {
+    // Parts of the scene that are not sharded are taken from the full scene:
+    SceneRef shardRef = data;
+    shardRef.meshInfo = ArrayRef(shard.meshInfo);
+    shardRef.meshTris = ArrayRef(shard.meshTris);
+    shardRef.meshVerts = ArrayRef(shard.meshVerts);
+    shardRef.meshNormals = ArrayRef(shard.meshNormals);
+    shardRef.meshPrecomputed = ArrayRef(shard.meshPrecomputed);
+    shardRef.meshPackedVerts = ArrayRef(shard.meshPackedVerts);
+    shardRef.meshPackedNormals = ArrayRef(shard.meshPackedNormals);
+    shardRef.bvhNodes = ArrayRef(shard.bvhNodes);
+    shardRef.maxLeafDepth = shard.bvhMaxDepth;
+    shardRef.lights = ArrayRef<AreaLight>(); // A shard can not test the visibility of lights by itself
+    shardRef.meshUVs = ArrayRef<TexCoord>(); // Sharded scenes are only shadow traced (without textures)
+    shardRef.textures = ArrayRef<TextureInfo>();
+    shardRef.texels = ArrayRef<Bc1Block>();
+
+    shardSerialisers.emplace_back(fullSceneBytes / shards.size());
+    auto& s = shardSerialisers.back();
+    s << shardRef;
+    s << shard.primIDOffsets;
+    maxShardBytes = std::max(maxShardBytes, s.bytes.size());
+  }
+
+  // Every shard is padded to the same size (rounded up to keep each tile's copy aligned):
+  shardBytesPerTile = ((maxShardBytes + 15) / 16) * 16;
+  serialShards.assign(shards.size() * shardBytesPerTile, 0u);
+  for (auto i = 0u; i < shardSerialisers.size(); ++i) {
+    const auto& bytes = shardSerialisers[i].bytes;
+    std::copy(bytes.begin(), bytes.end(), serialShards.begin() + i * shardBytesPerTile);
+  }
+  numShards = shards.size();
+
+  ipu_utils::logger()->debug("Scene split into {} shards. Max shard size: {} KiB (full scene {} KiB)",
+                             numShards, shardBytesPerTile / 1024.f, fullSceneBytes / 1024.f);
+}
+
 void IpuScene::build(poplar::Graph& graph, const poplar::Target& target) {
   // Get two disjoint graphs: one set of tiles for compute and
   // another set of tiles for DRAM I/O:
@@ -357,8 +1160,54 @@ void IpuScene::build(poplar::Graph& graph, const poplar::Target& target) {
   // Ensure max ray count is a multiple of the number of workers and tiles by definition:
   numComputeTiles = computeGraph.getTarget().getNumTiles();
   const auto numWorkers = target.getNumWorkerContexts();
+
+  // A sharded scene is split across equal sized tile groups:
+  std::size_t tilesPerShard = numComputeTiles;
+  if (numShards) {
+    if (data.pathTrace) {
+      throw std::runtime_error("Sharded scenes are only supported in shadow-trace render mode.");
+    }
+    if (numComputeTiles % numShards) {
+      throw std::runtime_error("Number of compute tiles (" + std::to_string(numComputeTiles) +
+                               ") is not divisible by the number of scene shards (" + std::to_string(numShards) + ").");
+    }
+    tilesPerShard = numComputeTiles / numShards;
+    ipu_utils::logger()->debug("Tiles per scene shard: {}", tilesPerShard);
+  }
+  resolveRaysPerWorker(target, numComputeTiles, numTilesForIO);
   const auto maxRaysPerIteration = maxRaysPerWorker * numWorkers;
-  totalRayBufferSize = numComputeTiles * maxRaysPerIteration * sizeof(embree_utils::TraceResult);
+  if (slimRayStream && (!data.pathTrace || numShards)) {
+    throw std::logic_error("A slim ray stream can only be used for path tracing an unsharded scene.");
+  }
+  if (wavefront && !data.pathTrace) {
+    throw std::logic_error("Wavefront mode is only supported for path tracing.");
+  }
+  if (octantSort && !wavefront) {
+    throw std::logic_error("Octant sorting of rays is only supported in wavefront mode.");
+  }
+  if (adaptiveThreshold > 0.f && (nifPerRay() || wavefront)) {
+    // These modes take one sample of every pixel per compute set:
+    throw std::logic_error("Adaptive sampling is not supported with a NIF environment light or in wavefront mode.");
+  }
+  if (lowDiscrepancy && (nifPerRay() || wavefront || !data.pathTrace)) {
+    // Sample indices count the samples taken inside one execution of the path tracing vertex:
+    throw std::logic_error("Low discrepancy sampling is only supported for path tracing without wavefront mode or a NIF evaluated per ray.");
+  }
+  if (denoiseAovs && (slimRayStream || nifPerRay() || wavefront || !data.pathTrace)) {
+    // The AOVs are returned in the full trace results once all of a pixel's samples are taken:
+    throw std::logic_error("Denoising AOVs are only supported for path tracing with full trace results "
+                           "(not with a slim ray stream, in wavefront mode, or with a NIF evaluated per ray).");
+  }
+  if (traversalStats && (slimRayStream || nifPerRay() || wavefront || numShards || denoiseAovs)) {
+    // The stats replace the hit records of the results once a pixel is finished:
+    throw std::logic_error("Traversal statistics need full trace results and are not supported with a NIF evaluated "
+                           "per ray, in wavefront mode, for sharded scenes, or with denoising AOVs.");
+  }
+  if (envLightSampling && (!nif || !bakedHdriWidth || wavefront || !data.pathTrace)) {
+    // The light is sampled from the baked texture inside the path tracing vertex:
+    throw std::logic_error("Environment light sampling needs a baked NIF environment light and is not supported in wavefront mode.");
+  }
+  planRayBatches(target);
   ipu_utils::logger()->debug("Num compute tiles: {}", numComputeTiles);
   ipu_utils::logger()->debug("Trace result buffer total size: {}", totalRayBufferSize);
 
@@ -373,16 +1222,19 @@ void IpuScene::build(poplar::Graph& graph, const poplar::Target& target) {
   createComputeVars(ioGraph, computeGraph, numComputeTiles, maxRaysPerIteration);
 
   // Add remote buffer to store ray-batches:
-  auto rayBatchesPerReplica = calcNumBatches(target, numComputeTiles) / getRuntimeConfig().numReplicas;
-  ipu_utils::logger()->debug("Allocating buffer for {} ray batches in DRAM.", rayBatchesPerReplica);
-  ipu_utils::logger()->debug("DRAM Ray-buffer size: {} bytes", totalRayBufferSize * rayBatchesPerReplica);
+  ipu_utils::logger()->debug("Allocating buffer for {} ray batches in DRAM.", dramRayBatches);
+  ipu_utils::logger()->debug("DRAM Ray-buffer size: {} bytes", totalRayBufferSize * dramRayBatches);
   rayBuffer = computeGraph.addRemoteBuffer("dram_ray_buffer", poplar::UNSIGNED_CHAR,
-                                    totalRayBufferSize, rayBatchesPerReplica,
+                                    totalRayBufferSize, dramRayBatches,
                                     true, optimiseMemUse);
 
-  // Add a duplicate SRAM ray buffer distributed across all I/O tiles:
-  auto loadBuffer = ioGraph.addVariable(poplar::UNSIGNED_CHAR, {totalRayBufferSize},
-                                        poplar::VariableMappingMethod::LINEAR, "ray_load_buffer");
+  // Add a duplicate SRAM ray buffer distributed across all I/O tiles
+  // (there is nothing to load if rays are generated on device):
+  poplar::Tensor loadBuffer;
+  if (!deviceRayGeneration) {
+    loadBuffer = ioGraph.addVariable(poplar::UNSIGNED_CHAR, {totalRayBufferSize},
+                                     poplar::VariableMappingMethod::LINEAR, "ray_load_buffer");
+  }
   // We also need another tmp duplicate on the IO tiles:
   auto saveBuffer = ioGraph.addVariable(poplar::UNSIGNED_CHAR, {totalRayBufferSize},
                                         poplar::VariableMappingMethod::LINEAR, "ray_save_buffer");
@@ -396,9 +1248,35 @@ void IpuScene::build(poplar::Graph& graph, const poplar::Target& target) {
 
   // Reads/writes from DRAM to I/O tiles and
   // reads/writes from IO tiles to compute tiles:
-  auto loadRaysFromDRAM = poplar::program::Copy(rayBuffer, loadBuffer, loadIndex, "load_rays");
-  auto copyRaysIOToCompute = poplar::program::Copy(loadBuffer, rayTraceVars["rays"].flatten());
-  auto copyRaysComputeToIO = poplar::program::Copy(rayTraceVars["rays"].flatten(), saveBuffer);
+  poplar::program::Sequence loadRaysFromDRAM;
+  auto unpackRaysCs = computeGraph.addComputeSet("unpack_rays_cs");
+  auto packRaysCs = computeGraph.addComputeSet("pack_rays_cs");
+  poplar::program::Sequence copyRaysIOToCompute;
+  poplar::program::Sequence copyRaysComputeToIO;
+  if (deviceRayGeneration) {
+    // The global batch index (batches are dealt to the replicas in turn) is
+    // broadcast to the compute tiles which derive their rays' pixels from it:
+    namespace pe = popops::expr;
+    auto replica = ioGraph.addReplicationIndexConstant();
+    ioGraph.setTileMapping(replica, 0);
+    auto batchIndex = popops::map(ioGraph, pe::Add(pe::Mul(pe::_1, pe::Const((unsigned)getRuntimeConfig().numReplicas)), pe::_2),
+                                  {loadIndex, replica}, copyRaysIOToCompute, "global_batch_index");
+    copyRaysIOToCompute.add(poplar::program::Copy(batchIndex.reshape({1}).broadcast(numComputeTiles, 0),
+                                                  rayTraceVars["batchIndex"]));
+    copyRaysIOToCompute.add(poplar::program::Execute(unpackRaysCs));
+    copyRaysComputeToIO.add(poplar::program::Execute(packRaysCs));
+    copyRaysComputeToIO.add(poplar::program::Copy(rayTraceVars["slimRays"].flatten(), saveBuffer));
+  } else if (slimRayStream) {
+    loadRaysFromDRAM.add(poplar::program::Copy(rayBuffer, loadBuffer, loadIndex, "load_rays"));
+    copyRaysIOToCompute.add(poplar::program::Copy(loadBuffer, rayTraceVars["slimRays"].flatten()));
+    copyRaysIOToCompute.add(poplar::program::Execute(unpackRaysCs));
+    copyRaysComputeToIO.add(poplar::program::Execute(packRaysCs));
+    copyRaysComputeToIO.add(poplar::program::Copy(rayTraceVars["slimRays"].flatten(), saveBuffer));
+  } else {
+    loadRaysFromDRAM.add(poplar::program::Copy(rayBuffer, loadBuffer, loadIndex, "load_rays"));
+    copyRaysIOToCompute.add(poplar::program::Copy(loadBuffer, rayTraceVars["rays"].flatten()));
+    copyRaysComputeToIO.add(poplar::program::Copy(rayTraceVars["rays"].flatten(), saveBuffer));
+  }
   // Stream the save index back to the host so it can monitor progress:
   auto hostRayStream = ioGraph.addDeviceToHostFIFO("save_rays", saveBuffer.elementType(), saveBuffer.numElements());
   poplar::program::Sequence saveRays = {
@@ -411,53 +1289,187 @@ void IpuScene::build(poplar::Graph& graph, const poplar::Target& target) {
   // Compute sets:
   auto initCs = computeGraph.addComputeSet("init_data_cs");
   auto traceCs = computeGraph.addComputeSet("trace_cs");
+  auto wavefrontGenerateCs = computeGraph.addComputeSet("wavefront_generate_cs");
+  auto wavefrontExtendCs = computeGraph.addComputeSet("wavefront_extend_cs");
+  auto wavefrontShadeCs = computeGraph.addComputeSet("wavefront_shade_cs");
+  auto wavefrontCompactCs = computeGraph.addComputeSet("wavefront_compact_cs");
+  auto compactEscapedCs = computeGraph.addComputeSet("compact_escaped_cs");
   auto preProcessCs = computeGraph.addComputeSet("preproc_cs");
   auto postProcessCs = computeGraph.addComputeSet("postproc_cs");
+  auto nifLookupCs = computeGraph.addComputeSet("nif_lookup_cs");
+  auto shardIntersectCs = computeGraph.addComputeSet("shard_intersect_cs");
+  auto shardShadowSetupCs = computeGraph.addComputeSet("shard_shadow_setup_cs");
+  auto occludeCs = computeGraph.addComputeSet("occlude_cs");
+  auto shadeCs = computeGraph.addComputeSet("shade_cs");
+  embree_utils::Vec3fa lightPos(18, 257, -1060);
 
   for (auto t = 0u; t < numComputeTiles; ++t) {
     // This vertex unpacks the scene data on tile:
     auto initBuildVertex = computeGraph.addVertex(initCs, "BuildDataStructures");
     computeGraph.setTileMapping(initBuildVertex, t);
 
-    // Serialised scene buffer:
+    // Serialised scene buffer and the primitives uploaded with it:
     computeGraph.connect(initBuildVertex["serialisedScene"], broadcastSceneVars["serialisedScene"][t]);
-
-    // Extra scene data. Eventually these should be serialised with everything else:
     computeGraph.connect(initBuildVertex["spheres"], broadcastSceneVars["spheres"][t]);
     computeGraph.connect(initBuildVertex["discs"], broadcastSceneVars["discs"][t]);
     computeGraph.connect(initBuildVertex["meshes"], broadcastSceneVars["meshes"][t]);
+    computeGraph.connect(initBuildVertex["instances"], broadcastSceneVars["instances"][t]);
+    computeGraph.setInitialValue(initBuildVertex["shardedScene"], numShards != 0);
 
-    // Ray tracing:
-    // Choose between two ray trace modes at compile time.
-    poplar::VertexRef rayTraceVertex;
-    if (data.pathTrace) {
-      rayTraceVertex = computeGraph.addVertex(traceCs, "PathTrace");
-      poplar::Tensor vertexLoopCount;
-      if (nif) {
-        // We need to tell PathTrace vertex not to loop:
-        vertexLoopCount = computeGraph.addConstant(poplar::UNSIGNED_INT, {}, 1u);
-      } else {
-        // We need to tell PathTrace vertex to loop data.samplesPerPixel times:
-        vertexLoopCount = computeGraph.addConstant(poplar::UNSIGNED_INT, {}, data.samplesPerPixel);
-      }
-      computeGraph.connect(rayTraceVertex["vertexSampleCount"], vertexLoopCount);
-      computeGraph.setTileMapping(vertexLoopCount, t);
-    } else {
-      rayTraceVertex = computeGraph.addVertex(traceCs, "ShadowTrace");
-      computeGraph.setInitialValue(rayTraceVertex["ambientLightFactor"], .05f);
-      embree_utils::Vec3fa lightPos(18, 257, -1060);
+    if (numShards) {
+      // Sharded shadow trace: rays and then shadow rays are passed around the tile
+      // groups so the vertices for each phase only see the local shard of the scene:
       auto lp = computeGraph.addConstant(poplar::FLOAT, {3}, &lightPos.x);
       computeGraph.setTileMapping(lp, t);
-      computeGraph.connect(rayTraceVertex["lightPos"], lp);
+      auto intersectVertex = computeGraph.addVertex(shardIntersectCs, "ShardIntersect");
+      computeGraph.connect(intersectVertex["rays"], rayTraceVars["rays"][t]);
+      auto shadowSetupVertex = computeGraph.addVertex(shardShadowSetupCs, "ShardShadowSetup");
+      computeGraph.connect(shadowSetupVertex["rays"], rayTraceVars["rays"][t]);
+      computeGraph.connect(shadowSetupVertex["shadowRays"], rayTraceVars["shadowRays"][t]);
+      computeGraph.connect(shadowSetupVertex["lightPos"], lp);
+      auto occludeVertex = computeGraph.addVertex(occludeCs, "OccludeShadowRays");
+      computeGraph.connect(occludeVertex["shadowRays"], rayTraceVars["shadowRays"][t]);
+      auto shadeVertex = computeGraph.addVertex(shadeCs, "ShadeShadowRays");
+      computeGraph.connect(shadeVertex["rays"], rayTraceVars["rays"][t]);
+      computeGraph.connect(shadeVertex["shadowRays"], rayTraceVars["shadowRays"][t]);
+      computeGraph.setInitialValue(shadeVertex["ambientLightFactor"], .05f);
+
+      for (auto v : {intersectVertex, shadowSetupVertex, occludeVertex, shadeVertex}) {
+        computeGraph.setTileMapping(v, t);
+        computeGraph.connect(v["serialisedScene"], broadcastSceneVars["serialisedScene"][t]);
+      }
+      for (auto v : {intersectVertex, occludeVertex}) {
+        computeGraph.connect(v["spheres"], broadcastSceneVars["spheres"][t]);
+        computeGraph.connect(v["discs"], broadcastSceneVars["discs"][t]);
+        computeGraph.connect(v["meshes"], broadcastSceneVars["meshes"][t]);
+        computeGraph.connect(v["instances"], broadcastSceneVars["instances"][t]);
+      }
+
+      for (auto& p : broadcastSceneVars) {
+        computeGraph.setTileMapping(p.second[t], t);
+      }
+
+      for (auto& p : rayTraceVars) {
+        computeGraph.setTileMapping(p.second[t], t);
+      }
+      continue;
     }
 
-    computeGraph.connect(rayTraceVertex["rays"], rayTraceVars["rays"][t]);
+    if (wavefront) {
+      // Wavefront path tracing: separate vertices for each stage of a bounce:
+      auto generateVertex = computeGraph.addVertex(wavefrontGenerateCs, "WavefrontGenerate");
+      auto extendVertex = computeGraph.addVertex(wavefrontExtendCs, "WavefrontExtend");
+      auto shadeVertex = computeGraph.addVertex(wavefrontShadeCs, "WavefrontShade");
+      auto compactVertex = computeGraph.addVertex(wavefrontCompactCs, "WavefrontCompact");
+      for (auto v : {generateVertex, extendVertex, shadeVertex, compactVertex}) {
+        computeGraph.setTileMapping(v, t);
+        computeGraph.connect(v["rays"], rayTraceVars["rays"][t]);
+        computeGraph.connect(v["liveRays"], rayTraceVars["liveRays"][t]);
+        computeGraph.connect(v["numLiveRays"], rayTraceVars["numLiveRays"][t][0]);
+      }
+      for (auto v : {generateVertex, shadeVertex, compactVertex}) {
+        computeGraph.connect(v["pathDepth"], rayTraceVars["pathDepth"][t][0]);
+      }
+      computeGraph.connect(generateVertex["camera"], broadcastSceneVars["camera"][t]);
+      computeGraph.connect(extendVertex["spheres"], broadcastSceneVars["spheres"][t]);
+      computeGraph.connect(extendVertex["discs"], broadcastSceneVars["discs"][t]);
+      computeGraph.connect(extendVertex["meshes"], broadcastSceneVars["meshes"][t]);
+      computeGraph.connect(extendVertex["instances"], broadcastSceneVars["instances"][t]);
+      for (auto v : {extendVertex, shadeVertex}) {
+        computeGraph.connect(v["serialisedScene"], broadcastSceneVars["serialisedScene"][t]);
+      }
+      computeGraph.connect(shadeVertex["envMap"], rayTraceVars["envMap"][t]);
+      computeGraph.connect(shadeVertex["azimuthRotation"], broadcastSceneVars["azimuthRotation"][t][0]);
+      computeGraph.setInitialValue(shadeVertex["envMapWidth"], nif ? bakedHdriWidth : 0u);
+      computeGraph.setInitialValue(compactVertex["octantSort"], unsigned(octantSort));
+    } else {
+      // Ray tracing:
+      // Choose between two ray trace modes at compile time.
+      poplar::VertexRef rayTraceVertex;
+      if (data.pathTrace) {
+        // Only the scene's kinds of primitive and material are compiled into the vertex:
+        const auto& features = getGraphFeatures();
+        const auto pathTraceVertex = poputil::templateVertex("PathTrace", features.spheres, features.discs,
+                                                             features.instances, features.refractive, traversalStats);
+        if (t == 0) {
+          ipu_utils::logger()->debug("Path trace vertex: {}", pathTraceVertex);
+        }
+        rayTraceVertex = computeGraph.addVertex(traceCs, pathTraceVertex);
+        if (nifPerRay()) {
+          // We need to tell PathTrace vertex not to loop:
+          auto vertexLoopCount = computeGraph.addConstant(poplar::UNSIGNED_INT, {}, 1u);
+          computeGraph.connect(rayTraceVertex["vertexSampleCount"], vertexLoopCount);
+          computeGraph.setTileMapping(vertexLoopCount, t);
+        } else {
+          // We need to tell PathTrace vertex to loop over all the (streamed) samples per pixel:
+          computeGraph.connect(rayTraceVertex["vertexSampleCount"], broadcastSceneVars["samplesPerPixel"][t][0]);
+        }
+        computeGraph.connect(rayTraceVertex["camera"], broadcastSceneVars["camera"][t]);
+        computeGraph.connect(rayTraceVertex["envMap"], rayTraceVars["envMap"][t]);
+        computeGraph.connect(rayTraceVertex["azimuthRotation"], broadcastSceneVars["azimuthRotation"][t][0]);
+        computeGraph.setInitialValue(rayTraceVertex["envMapWidth"], nif ? bakedHdriWidth : 0u);
+        computeGraph.connect(rayTraceVertex["envCdf"], rayTraceVars["envCdf"][t]);
+        computeGraph.setInitialValue(rayTraceVertex["envSampling"], envLightSampling);
+        computeGraph.setInitialValue(rayTraceVertex["adaptiveThreshold"], adaptiveThreshold);
+        computeGraph.setInitialValue(rayTraceVertex["adaptiveMinSamples"], adaptiveMinSamples);
+        computeGraph.setInitialValue(rayTraceVertex["lowDiscrepancy"], lowDiscrepancy);
+        computeGraph.setInitialValue(rayTraceVertex["denoiseAovs"], denoiseAovs);
+        computeGraph.connect(rayTraceVertex["workerCounters"], rayTraceVars["workerCounters"][t]);
+      } else {
+        rayTraceVertex = computeGraph.addVertex(traceCs, poputil::templateVertex("ShadowTrace", traversalStats));
+        auto lp = computeGraph.addConstant(poplar::FLOAT, {3}, &lightPos.x);
+        computeGraph.setTileMapping(lp, t);
+        computeGraph.connect(rayTraceVertex["lightPos"], lp);
+        computeGraph.connect(rayTraceVertex["shadowRays"], rayTraceVars["shadowRays"][t]);
+
+        // The queued shadow rays are occlusion tested and shaded in their own compute sets:
+        auto occludeVertex = computeGraph.addVertex(occludeCs, "OccludeShadowRays");
+        computeGraph.connect(occludeVertex["shadowRays"], rayTraceVars["shadowRays"][t]);
+        computeGraph.connect(occludeVertex["spheres"], broadcastSceneVars["spheres"][t]);
+        computeGraph.connect(occludeVertex["discs"], broadcastSceneVars["discs"][t]);
+        computeGraph.connect(occludeVertex["meshes"], broadcastSceneVars["meshes"][t]);
+        computeGraph.connect(occludeVertex["instances"], broadcastSceneVars["instances"][t]);
+        auto shadeVertex = computeGraph.addVertex(shadeCs, "ShadeShadowRays");
+        computeGraph.connect(shadeVertex["rays"], rayTraceVars["rays"][t]);
+        computeGraph.connect(shadeVertex["shadowRays"], rayTraceVars["shadowRays"][t]);
+        computeGraph.setInitialValue(shadeVertex["ambientLightFactor"], .05f);
+        for (auto v : {occludeVertex, shadeVertex}) {
+          computeGraph.setTileMapping(v, t);
+          computeGraph.connect(v["serialisedScene"], broadcastSceneVars["serialisedScene"][t]);
+        }
+      }
 
-    computeGraph.setTileMapping(rayTraceVertex, t);
-    computeGraph.connect(rayTraceVertex["spheres"], broadcastSceneVars["spheres"][t]);
-    computeGraph.connect(rayTraceVertex["discs"], broadcastSceneVars["discs"][t]);
-    computeGraph.connect(rayTraceVertex["meshes"], broadcastSceneVars["meshes"][t]);
-    computeGraph.connect(rayTraceVertex["serialisedScene"], broadcastSceneVars["serialisedScene"][t]);
+      computeGraph.connect(rayTraceVertex["rays"], rayTraceVars["rays"][t]);
+
+      computeGraph.setTileMapping(rayTraceVertex, t);
+      computeGraph.connect(rayTraceVertex["spheres"], broadcastSceneVars["spheres"][t]);
+      computeGraph.connect(rayTraceVertex["discs"], broadcastSceneVars["discs"][t]);
+      computeGraph.connect(rayTraceVertex["meshes"], broadcastSceneVars["meshes"][t]);
+      computeGraph.connect(rayTraceVertex["instances"], broadcastSceneVars["instances"][t]);
+      computeGraph.connect(rayTraceVertex["serialisedScene"], broadcastSceneVars["serialisedScene"][t]);
+    }
+
+    if (deviceRayGeneration) {
+      auto generateVertex = computeGraph.addVertex(unpackRaysCs, "GenerateSlimRays");
+      computeGraph.connect(generateVertex["batchIndex"], rayTraceVars["batchIndex"][t]);
+      computeGraph.connect(generateVertex["slimRays"], rayTraceVars["slimRays"][t]);
+      computeGraph.connect(generateVertex["rays"], rayTraceVars["rays"][t]);
+      computeGraph.connect(generateVertex["window"], broadcastSceneVars["rayWindow"][t]);
+      computeGraph.setInitialValue(generateVertex["raysPerBatch"], unsigned(numComputeTiles * maxRaysPerIteration));
+      computeGraph.setInitialValue(generateVertex["firstRay"], unsigned(t * maxRaysPerIteration));
+      computeGraph.setTileMapping(generateVertex, t);
+    } else if (slimRayStream) {
+      auto unpackVertex = computeGraph.addVertex(unpackRaysCs, "UnpackSlimRays");
+      computeGraph.connect(unpackVertex["slimRays"], rayTraceVars["slimRays"][t]);
+      computeGraph.connect(unpackVertex["rays"], rayTraceVars["rays"][t]);
+      computeGraph.setTileMapping(unpackVertex, t);
+    }
+    if (slimRayStream) {
+      auto packVertex = computeGraph.addVertex(packRaysCs, "PackSlimRays");
+      computeGraph.connect(packVertex["rays"], rayTraceVars["rays"][t]);
+      computeGraph.connect(packVertex["slimRays"], rayTraceVars["slimRays"][t]);
+      computeGraph.setTileMapping(packVertex, t);
+    }
 
     // Set tile mappings:
     for (auto& p : broadcastSceneVars) {
@@ -473,76 +1485,201 @@ void IpuScene::build(poplar::Graph& graph, const poplar::Target& target) {
   std::map<std::string, poplar::Tensor> varReceivingSlices;
 
   ipu_utils::logger()->trace("Building scene broadcast");
+  // Parameters that can change between frames are broadcast at the start of every frame:
+  const std::set<std::string> frameVars = {"samplesPerPixel", "azimuthRotation", "camera", "rayWindow"};
   poplar::program::Sequence broadcastSceneData;
+  poplar::program::Sequence broadcastFrameData;
   for (auto& p : ioSceneVars) {
     auto src = p.second; // Data is received to this slice
     auto dst = broadcastSceneVars.at(p.first);
     auto numReceiving = dst.dim(0);
+    if (numShards && p.first == "sceneData") {
+      // Each shard is only broadcast to the tiles in its own group:
+      auto shards = src.reshape({numShards, dst.dim(1)});
+      std::vector<poplar::Tensor> views;
+      for (auto s = 0u; s < numShards; ++s) {
+        views.push_back(shards.slice(s, s + 1, 0).broadcast(tilesPerShard, 0));
+      }
+      broadcastSceneData.add(poplar::program::Copy(poplar::concat(views, 0), dst));
+      continue;
+    }
     auto srcBroadcast = src.reshape({1, src.numElements()}).broadcast(numReceiving, 0); // Create a broadcast view
-    broadcastSceneData.add(poplar::program::Copy(srcBroadcast, dst)); // Copy the broadcast view to the rest of the tiles
+    auto& broadcast = frameVars.count(p.first) ? broadcastFrameData : broadcastSceneData;
+    broadcast.add(poplar::program::Copy(srcBroadcast, dst)); // Copy the broadcast view to the rest of the tiles
   }
 
   // Free up the space used to stream the scene data from the host:
   for (auto& p : ioSceneVars) {
-    auto src = p.second; // Data is received to this slice
-    broadcastSceneData.add(poplar::program::WriteUndef(p.second, "undef_" + p.first)); // Copy the broadcast view to the rest of the tiles
+    if (!frameVars.count(p.first)) {
+      broadcastSceneData.add(poplar::program::WriteUndef(p.second, "undef_" + p.first));
+    }
   }
 
+  // The init program uploads the scene and unpacks it on tile. It only needs to run
+  // again if the scene changes so a render session can trace many frames per init:
   ipu_utils::logger()->trace("Building init sequence");
   poplar::program::Sequence init = {
     fpSetupProg(computeGraph),
-    spheresVar.buildWrite(computeGraph, optimiseMemUse),
-    discsVar.buildWrite(computeGraph, optimiseMemUse),
     serialScene.buildWrite(ioGraph, optimiseMemUse),
+    broadcastSceneData
+  };
+
+  // Every frame starts by receiving its own parameters:
+  poplar::program::Sequence frame = {
+    fpSetupProg(computeGraph),
     samplesPerPixel.buildWrite(computeGraph, optimiseMemUse),
     azimuthRotation.buildWrite(computeGraph, optimiseMemUse),
-    broadcastSceneData
+    cameraVar.buildWrite(ioGraph, optimiseMemUse)
   };
+  if (deviceRayGeneration) {
+    frame.add(rayWindow.buildWrite(ioGraph, optimiseMemUse));
+  }
+  frame.add(broadcastFrameData);
 
   poplar::program::Sequence rayTraceBody {
     poplar::program::Execute(traceCs)
   };
+  if (!data.pathTrace) {
+    rayTraceBody.add(poplar::program::Execute(occludeCs));
+    rayTraceBody.add(poplar::program::Execute(shadeCs));
+  }
+
+  if (numShards) {
+    // Each phase runs one superstep per shard with an exchange to the next tile group
+    // after each one. After numShards steps every ray has visited all the shards and
+    // is back on the tile it started on:
+    auto exchange = rayTraceVars["rayExchange"];
+    auto shadowExchange = exchange.slice(0, rayTraceVars["shadowRays"].dim(1), 1);
+    rayTraceBody = poplar::program::Sequence {
+      poplar::program::Repeat(numShards, poplar::program::Sequence {
+        poplar::program::Execute(shardIntersectCs),
+        rotateShards(rayTraceVars["rays"], exchange, tilesPerShard)
+      }),
+      poplar::program::Execute(shardShadowSetupCs),
+      poplar::program::Repeat(numShards, poplar::program::Sequence {
+        poplar::program::Execute(occludeCs),
+        rotateShards(rayTraceVars["shadowRays"], shadowExchange, tilesPerShard)
+      }),
+      poplar::program::Execute(shadeCs)
+    };
+  }
+
+  if (wavefront) {
+    // One superstep per stage of each bounce. Paths are compacted after every
+    // bounce so the later (mostly empty) bounces are cheap. The path length is
+    // streamed so it can change without recompiling:
+    maxPathLength.buildTensor(ioGraph, poplar::UNSIGNED_INT, {});
+    ioGraph.setTileMapping(maxPathLength, 0);
+    frame.add(maxPathLength.buildWrite(ioGraph, optimiseMemUse));
+    rayTraceBody = poplar::program::Sequence {
+      poplar::program::Execute(wavefrontGenerateCs),
+      repeatCount(ioGraph, maxPathLength, poplar::program::Sequence {
+        poplar::program::Execute(wavefrontExtendCs),
+        poplar::program::Execute(wavefrontShadeCs),
+        poplar::program::Execute(wavefrontCompactCs)
+      }, "bounce_loop")
+    };
+  }
 
   if (data.pathTrace) {
-    if (nif) {
-      // Build the NIF graph and tile map the result:
-      auto result = buildNifHdri(computeGraph, nif, rayTraceVars["uvs"]);
+    if (nif && bakedHdriWidth) {
+      // The NIF only runs once (at init) to bake the env-map texture:
+      init.add(buildNifBake(computeGraph, nif, rayTraceVars["envMap"]).init);
+      if (envLightSampling) {
+        // Every tile builds the sampling CDFs from its own copy of the texture:
+        auto envSamplerCs = computeGraph.addComputeSet("env_sampler_cs");
+        for (auto t = 0u; t < numComputeTiles; ++t) {
+          auto samplerVertex = computeGraph.addVertex(envSamplerCs, "BuildEnvMapSampler");
+          computeGraph.setTileMapping(samplerVertex, t);
+          computeGraph.connect(samplerVertex["envMap"], rayTraceVars["envMap"][t]);
+          computeGraph.connect(samplerVertex["cdf"], rayTraceVars["envCdf"][t]);
+          computeGraph.setInitialValue(samplerVertex["envMapWidth"], bakedHdriWidth);
+        }
+        init.add(poplar::program::Execute(envSamplerCs));
+      }
+    } else if (nif) {
+      // Build the NIF graph and tile map the result (or just distribute the
+      // weights if each tile evaluates the NIF itself):
+      auto result = nifOnTile ? buildNifOnTile(computeGraph, nif, rayTraceVars["nifWeights"])
+                              : buildNifHdri(computeGraph, nif, rayTraceVars["uvs"], rayTraceVars["numEscapedRays"]);
 
       for (auto t = 0u; t < numComputeTiles; ++t) {
+        // Add vertices to list the escaped rays:
+        auto compactVertex = computeGraph.addVertex(compactEscapedCs, "CompactEscapedRays");
+        computeGraph.setTileMapping(compactVertex, t);
+        computeGraph.connect(compactVertex["results"], rayTraceVars["rays"][t]);
+        computeGraph.connect(compactVertex["escapedRays"], rayTraceVars["escapedRays"][t]);
+        computeGraph.connect(compactVertex["numEscapedRays"], rayTraceVars["numEscapedRays"][t][0]);
+
+        if (nifOnTile) {
+          // Add vertices to evaluate the NIF for the escaped rays:
+          auto lookupVertex = computeGraph.addVertex(nifLookupCs, "NifEnvironmentLookup");
+          computeGraph.setTileMapping(lookupVertex, t);
+          computeGraph.connect(lookupVertex["results"], rayTraceVars["rays"][t]);
+          computeGraph.connect(lookupVertex["escapedRays"], rayTraceVars["escapedRays"][t]);
+          computeGraph.connect(lookupVertex["numEscapedRays"], rayTraceVars["numEscapedRays"][t][0]);
+          computeGraph.connect(lookupVertex["azimuthRotation"], broadcastSceneVars["azimuthRotation"][t][0]);
+          computeGraph.connect(lookupVertex["weights"], rayTraceVars["nifWeights"][t]);
+          computeGraph.connect(lookupVertex["scratch"], rayTraceVars["nifScratch"][t]);
+          const auto decode = nif->getData()->getDecodeParams();
+          computeGraph.setInitialValue(lookupVertex["embeddingDimension"], nifShape.embeddingDimension);
+          computeGraph.setInitialValue(lookupVertex["hiddenSize"], nifShape.hiddenSize);
+          computeGraph.setInitialValue(lookupVertex["numLayers"], nifShape.numLayers);
+          computeGraph.setInitialValue(lookupVertex["concatLayer"], nifShape.concatLayer);
+          computeGraph.setInitialValue(lookupVertex["outputMax"], decode.max);
+          computeGraph.setInitialValue(lookupVertex["meanB"], decode.mean[0]);
+          computeGraph.setInitialValue(lookupVertex["meanG"], decode.mean[1]);
+          computeGraph.setInitialValue(lookupVertex["meanR"], decode.mean[2]);
+          computeGraph.setInitialValue(lookupVertex["logToneMap"], decode.logToneMap);
+          continue;
+        }
+
         computeGraph.setTileMapping(result.bgr[t], t);
 
         // Add vertices to convert escaped rays to uv coordinates:
-        auto preProcVertex = computeGraph.addVertex(preProcessCs, "PreProcessEscapedRays");
+        auto preProcVertex = computeGraph.addVertex(preProcessCs, poputil::templateVertex("PreProcessEscapedRays", nifType()));
         computeGraph.setTileMapping(preProcVertex, t);
         computeGraph.connect(preProcVertex["results"], rayTraceVars["rays"][t]);
+        computeGraph.connect(preProcVertex["escapedRays"], rayTraceVars["escapedRays"][t]);
+        computeGraph.connect(preProcVertex["numEscapedRays"], rayTraceVars["numEscapedRays"][t][0]);
         computeGraph.connect(preProcVertex["u"], rayTraceVars["uvs"][t][0]);
         computeGraph.connect(preProcVertex["v"], rayTraceVars["uvs"][t][1]);
         computeGraph.connect(preProcVertex["azimuthRotation"], broadcastSceneVars["azimuthRotation"][t][0]);
 
-        // Add vertices to
-        auto postProcVertex = computeGraph.addVertex(postProcessCs, "PostProcessEscapedRays");
+        // Add vertices to scatter the lighting back to the escaped rays:
+        auto postProcVertex = computeGraph.addVertex(postProcessCs, poputil::templateVertex("PostProcessEscapedRays", nifType()));
         computeGraph.setTileMapping(postProcVertex, t);
         computeGraph.connect(postProcVertex["results"], rayTraceVars["rays"][t]);
+        computeGraph.connect(postProcVertex["escapedRays"], rayTraceVars["escapedRays"][t]);
+        computeGraph.connect(postProcVertex["numEscapedRays"], rayTraceVars["numEscapedRays"][t][0]);
         computeGraph.connect(postProcVertex["bgr"], result.bgr[t]);
       }
 
       // Add program for NIF inference:
-      rayTraceBody.add(poplar::program::Execute(preProcessCs));
-      rayTraceBody.add(result.exec);
-      rayTraceBody.add(poplar::program::Execute(postProcessCs));
+      rayTraceBody.add(poplar::program::Execute(compactEscapedCs));
+      if (nifOnTile) {
+        rayTraceBody.add(poplar::program::Execute(nifLookupCs));
+      } else {
+        rayTraceBody.add(poplar::program::Execute(preProcessCs));
+        rayTraceBody.add(result.exec);
+        rayTraceBody.add(poplar::program::Execute(postProcessCs));
+      }
 
       // Add program for initialising NIF weights:
       init.add(result.init);
     }
   }
 
-  // Add program to set HW RNG seed to the init sequence:
+  // Add program to set HW RNG seed to the frame sequence:
   seedTensor.buildTensor(computeGraph, poplar::UNSIGNED_INT, {2});
   computeGraph.setTileMapping(seedTensor, 0);
 
   // Do not broadcast the seed to all replicas: need a different seed per replica:
-  init.add(seedTensor.buildWrite(computeGraph, optimiseMemUse, false));
-  poprand::setSeed(computeGraph, seedTensor, 1u, init, "set_seed");
+  frame.add(seedTensor.buildWrite(computeGraph, optimiseMemUse, false));
+  poprand::setSeed(computeGraph, seedTensor, 1u, frame, "set_seed");
+  if (countCasts()) {
+    popops::zero(computeGraph, workerCounters.get(), frame, "zero_worker_counters");
+  }
 
   // Final part of initialisation is to run the init compute set:
   init.add(poplar::program::Execute({initCs}));
@@ -552,13 +1689,17 @@ void IpuScene::build(poplar::Graph& graph, const poplar::Target& target) {
     loopLimit.buildWrite(ioGraph, optimiseMemUse)
   };
 
-  // Adjust loop limit for async I/O pipeline:
-  popops::subInPlace(ioGraph, loopLimit, 2u, initLoopCounters, "loop_limit_init");
-  init.add(initLoopCounters);
+  // The loop only runs the steady state of the pipeline (the batches in
+  // flight when it starts and ends are processed outside of it):
+  if (pipelineDepth > 1) {
+    popops::subInPlace(ioGraph, loopLimit, pipelineDepth, initLoopCounters, "loop_limit_init");
+  }
 
-  // Make our own loop (instead of e.g. using countedForLoop) so we can ensure asynchronous I/O:
-  ioGraph.setInitialValue(saveIndex, 0u);
-  ioGraph.setInitialValue(loadIndex, 0u);
+  // Make our own loop (instead of e.g. using countedForLoop) so we can ensure asynchronous I/O.
+  // The indices are reset for every frame:
+  popops::zero(ioGraph, loadIndex, initLoopCounters, "load_index_init");
+  popops::zero(ioGraph, saveIndex, initLoopCounters, "save_index_init");
+  frame.add(initLoopCounters);
   poplar::program::Sequence incLoadIndex;
   popops::addInPlace(ioGraph, loadIndex, 1u, incLoadIndex, "increment_load_index");
   poplar::program::Sequence incSaveIndex;
@@ -569,10 +1710,10 @@ void IpuScene::build(poplar::Graph& graph, const poplar::Target& target) {
   cond.add(poplar::program::AssumeEqualAcrossReplicas(pred, "pred_assume_equal"));
 
   poplar::program::Sequence sampleLoop;
-  if (data.pathTrace && nif) {
-    // For path tracing with a NIF HDRI we need to make an additional inner loop
-    // around the path-trace and NIF programs.
-    sampleLoop.add(poplar::program::Repeat(data.samplesPerPixel, rayTraceBody));
+  if (data.pathTrace && (nifPerRay() || wavefront)) {
+    // For path tracing with a NIF HDRI (or in wavefront mode) we need to make an
+    // additional inner loop around the path-trace and NIF programs.
+    sampleLoop.add(repeatCount(ioGraph, samplesPerPixel.get()[0], rayTraceBody, "sample_loop"));
   } else {
     // For path-tracing with no NIF lookup we can lower the sample loop inside the vertex,
     // and for a single pass render there is no loop so in these cases we just
@@ -580,52 +1721,75 @@ void IpuScene::build(poplar::Graph& graph, const poplar::Target& target) {
     sampleLoop = rayTraceBody;
   }
 
-  // Main loop should read and write DRAM
-  // asynchronously with compute:
-  poplar::program::Sequence traceBody {
-    //poplar::program::PrintTensor("save idx: ", saveIndex),
-    saveRays,
-    incSaveIndex,
-    incLoadIndex,
-    //poplar::program::PrintTensor("load idx: ", loadIndex),
-    loadRaysFromDRAM,
-    sampleLoop,
-    copyRaysComputeToIO,
-    copyRaysIOToCompute
-  };
-
-  // This is the main loop over ray-batches:
-  auto traceLoop = poplar::program::RepeatWhileTrue(cond, pred, traceBody, "trace_loop");
-
-  poplar::program::Sequence pipeline {
-    //poplar::program::PrintTensor("load idx: ", loadIndex),
+  IoPipelineStages stages {
     loadRaysFromDRAM,
     copyRaysIOToCompute,
     sampleLoop,
-    incLoadIndex,
-    //poplar::program::PrintTensor("load idx: ", loadIndex),
-    loadRaysFromDRAM,
-    copyRaysComputeToIO,
-    copyRaysIOToCompute,
-    traceLoop,
-    //poplar::program::PrintTensor("save idx: ", saveIndex),
-    saveRays,
-    incSaveIndex,
-    sampleLoop,
     copyRaysComputeToIO,
-    //poplar::program::PrintTensor("save idx: ", saveIndex),
     saveRays,
+    incLoadIndex,
+    incSaveIndex
   };
+  auto pipeline = buildIoPipeline(pipelineDepth, stages, cond, pred);
 
   poplar::program::Sequence trace = {
-    init,
+    frame,
     pipeline
   };
+  if (countCasts()) {
+    // The counts of each run of the trace program are read back (and summed on the host):
+    trace.add(workerCounters.buildRead(computeGraph, optimiseMemUse));
+  }
 
+  getPrograms().add("init", init);
   getPrograms().add("trace", trace);
 }
 
 void IpuScene::execute(poplar::Engine& engine, const poplar::Device& device) {
+  const auto numReplicas = getRuntimeConfig().numReplicas;
+  if (numComputeTiles == 0) {
+    // The graph was loaded from an executable so build() was not called:
+    if (nif) {
+      throw std::logic_error("A NIF environment light can not be used with a precompiled executable.");
+    }
+    poplar::Graph graph(device.getTarget(), poplar::replication_factor(numReplicas));
+    const auto numTilesForIO = gcl::getMinIoTiles(graph);
+    numComputeTiles = device.getTarget().getNumTiles() / numReplicas - numTilesForIO;
+    resolveRaysPerWorker(device.getTarget(), numComputeTiles, numTilesForIO);
+    planRayBatches(device.getTarget());
+  }
+
+  // Connect stream for NIF weights:
+  if (nif && nifOnTile && !bakedHdriWidth) {
+    nifTileWeights.connectWriteStream(engine, nifTileWeightData);
+  } else if (nif) {
+    nif->connectStreams(engine);
+    if (bakedHdriWidth) {
+      bakeUVs.connectWriteStream(engine, bakeUVData);
+    }
+  }
+
+  // The engine stays attached (and the scene resident on tile) for as many
+  // frames as the frame callback asks for:
+  for (std::size_t frame = 0; ; ++frame) {
+    renderFrame(engine, device);
+    if (frameFunc == nullptr || !(*frameFunc)(frame)) {
+      break;
+    }
+    if (data.pathTrace && !slimRayStream) {
+      // Path traced radiance accumulates into the uploaded rays so clear the last frame's:
+      for (auto& r : rayStream) {
+        r.rgb = embree_utils::Vec3fa(0.f, 0.f, 0.f);
+      }
+    }
+  }
+}
+
+/// Trace one frame: upload the scene if it has changed then stream the ray
+/// batches and the frame's parameters and run the trace program. With a ray
+/// batch queue the program runs repeatedly over batches taken from the queue.
+void IpuScene::renderFrame(poplar::Engine& engine, const poplar::Device& device) {
+  ipu_utils::TraceScope traceScope("render_frame");
   // If ray list is larger than max size per iteration then we need to
   // serialise it into smaller chunks. We also need to make sure each chunk is
   // a multiple of the number of workers.
@@ -633,38 +1797,107 @@ void IpuScene::execute(poplar::Engine& engine, const poplar::Device& device) {
   // The max size is a multiple of the number of workers by definition:
   const auto numWorkers = device.getTarget().getNumWorkerContexts();
   const auto totalRaysPerIteration = numComputeTiles * maxRaysPerWorker * numWorkers;
-  totalRayBufferSize = totalRaysPerIteration * sizeof(embree_utils::TraceResult);
   const auto numReplicas = getRuntimeConfig().numReplicas;
   ipu_utils::logger()->debug("Rays per iteration: {} Total rays: {} ", totalRaysPerIteration, rayStream.size());
 
-  rayBatches = createRayBatches(device, numComputeTiles);
-  std::uint32_t numBatchesPerReplica = rayBatches.size() / numReplicas;
+  initRayBatches(device, numComputeTiles);
+  if (batchQueue && deviceRayGeneration) {
+    throw std::logic_error("A ray batch queue can not be used with device ray generation.");
+  }
   loopLimit.connectWriteStream(engine, &numBatchesPerReplica);
   samplesPerPixel.connectWriteStream(engine, &data.samplesPerPixel);
+  if (wavefront) {
+    maxPathLength.connectWriteStream(engine, &data.maxPathLength);
+  }
+  const std::uint32_t window[4] = {
+    std::uint32_t(data.window.r), std::uint32_t(data.window.c),
+    std::uint32_t(data.window.w), std::uint32_t(data.window.w * data.window.h)
+  };
+  if (deviceRayGeneration) {
+    rayWindow.connectWriteStream(engine, (void*)window);
+  }
+  cameraVar.connectWriteStream(engine, (void*)data.camera.m);
 
   float radians = (hdriRotationDegrees / 360.f) * (2.0 * M_PI);
   azimuthRotation.connectWriteStream(engine, &radians);
 
-  // Set a different RNG seed per-replica:
+  // Per-replica RNG seeds are drawn from this state for each run of the trace program:
   xoshiro::State s;
   xoshiro::seed(s, data.rngSeed);
+
+  bool uploadScene = sceneChanged;
+  if (uploadScene) {
+    packSceneUpload(resolveCapacity());
+    serialScene.connectWriteStream(engine, sceneUpload.data());
+    sceneChanged = false;
+  }
+
+  stats = TraceStats();
+  stats.castsCounted = countCasts();
+  if (countCasts()) {
+    const auto countsPerReplica = numComputeTiles * WorkerCounterCount * numWorkers;
+    workerCounterData.resize(numReplicas * countsPerReplica);
+    for (auto r = 0u; r < numReplicas; ++r) {
+      workerCounters.connectReadStream(engine, r, workerCounterData.data() + r * countsPerReplica);
+    }
+    stats.tileCycles.assign(numReplicas * numComputeTiles, 0u);
+  }
+
+  if (batchQueue == nullptr) {
+    firstRunBatch = 0;
+    numRunBatches = numStreamBatches;
+    traceBatches(engine, numRayBatches, s, uploadScene);
+    return;
+  }
+
+  // Take the smallest number of batches that fills the pipeline of every replica
+  // until the queue is empty. Each run is padded in the same way as a full frame:
+  batchQueue->start(numStreamBatches, raysPerBatch);
+  const auto batchesPerRun = pipelineDepth * numReplicas;
+  std::size_t ipuBatches = 0;
+  for (auto run = batchQueue->takeFront(batchesPerRun); run.count; run = batchQueue->takeFront(batchesPerRun)) {
+    firstRunBatch = run.first;
+    numRunBatches = run.count;
+    // Seeds come from the run's first batch so its samples do not depend on
+    // which runs came before it (or which process rendered it):
+    xoshiro::seed(s, data.rngSeed + run.first);
+    traceBatches(engine, batchesPerRun, s, uploadScene);
+    ipuBatches += run.count;
+  }
+  ipu_utils::logger()->info("IPU rendered {}/{} ray batches", ipuBatches, numStreamBatches);
+}
+
+/// Run the trace program once over the rays of the current run's stream
+/// batches (padded to numDeviceBatches with dummy batches).
+void IpuScene::traceBatches(poplar::Engine& engine, std::size_t numDeviceBatches,
+                            xoshiro::State& seedState, bool& uploadScene) {
+  const auto numReplicas = getRuntimeConfig().numReplicas;
+  numBatchesPerReplica = numDeviceBatches / numReplicas;
+
+  // Set a different RNG seed per-replica (and per run):
+  seedValues.clear();
   for (auto r = 0u; r < numReplicas; ++r) {
-    seedValues.push_back(xoshiro::next128ss(s));
+    seedValues.push_back(xoshiro::next128ss(seedState));
   }
   seedTensor.connectWriteStream(engine, seedValues);
 
-  // Connect stream for NIF weights:
-  if (nif) {
-    nif->connectStreams(engine);
+  // Each replica's callback can hand its batches to a pool of host threads. Two
+  // buffers per thread (for each replica) let a thread process one batch while
+  // the next is copied:
+  if (rayFunc && rayCallbackThreads && !callbackPool) {
+    callbackPool = std::make_unique<RayCallbackPool>(
+      numReplicas, rayCallbackThreads, 2, getRayStreamSize(),
+      [this](std::size_t batchIndex, const void* src) {
+        auto batch = receiveRayBatch(batchIndex, src);
+        if (!batch.empty()) {
+          (*rayFunc)(batchIndex, batch);
+          writeBackRays(batch);
+        }
+      });
+    ipu_utils::logger()->debug("Ray callback batches are processed on {} host threads", rayCallbackThreads);
   }
 
-  // Note: these copy host pointers into the on device data! We will
-  // overwrite by rebuilding the object before using it in the codelet:
-  spheresVar.connectWriteStream(engine, (void*)spheres.data());
-  discsVar.connectWriteStream(engine, (void*)discs.data());
-  serialScene.connectWriteStream(engine, (void*)serialiser.bytes.data());
-
-  // Connect callbacks:
+  // Connect callbacks (new ones each run so that their batch counts restart):
   for (auto i = 0u; i < numReplicas; ++i) {
     engine.connectStreamToCallback("save_rays", i, std::make_unique<RayCallback>(*this, i));
   }
@@ -672,64 +1905,89 @@ void IpuScene::execute(poplar::Engine& engine, const poplar::Device& device) {
   // We don't include sending initial rays to DRAM in timing (they
   // would stay there for the duration of a real render)
   auto startTime = std::chrono::steady_clock::now();
+  pvti::Tracepoint::begin(ipu_utils::traceChannel(), "host_to_dram_rays");
   std::size_t replicaIndices[numReplicas] = {0};
-  for (auto i = 0u; i < rayBatches.size(); ++i) {
-    auto& v = rayBatches[i];
-    if (v.size() != totalRaysPerIteration) {
-      throw std::runtime_error("The number of rays in each batch is not correct: " + std::to_string(v.size()));
-    }
+  for (auto i = 0u; i < numDeviceBatches && !deviceRayGeneration; ++i) {
     const auto replica = i % numReplicas; // Cycle through the replicas for each sequential batch index
-    engine.copyToRemoteBuffer(v.data(), "dram_ray_buffer", replicaIndices[replica], replica);
+    engine.copyToRemoteBuffer(getRayBatchData(i), "dram_ray_buffer", replicaIndices[replica], replica);
+    // The host copy is not needed again until the results arrive:
+    writeBackRays(getRayBatch(streamBatchIndex(i)));
     replicaIndices[replica] += 1;
   }
+  pvti::Tracepoint::end(ipu_utils::traceChannel(), "host_to_dram_rays");
   auto endTime = std::chrono::steady_clock::now();
   auto secs = std::chrono::duration<double>(endTime - startTime).count();
-  auto hostToDramBw = (1e-9 * rayBatches.size() * totalRaysPerIteration * sizeof(embree_utils::TraceResult) / secs);
+  auto hostToDramBw = deviceRayGeneration ? std::numeric_limits<double>::quiet_NaN()
+                                          : (1e-9 * numDeviceBatches * totalRayBufferSize / secs);
   ipu_utils::logger()->debug("Host to DRAM ray bandwidth: {} GB/sec", hostToDramBw);
+  if (!deviceRayGeneration) {
+    stats.hostToDramSecs += secs;
+    stats.hostToDramBytes += double(numDeviceBatches) * totalRayBufferSize;
+  }
 
   // Include initialisation (send BVH to device) in IPU timings:
   ipu_utils::logger()->info("IPU Rendering started.");
+  if (uploadScene) {
+    startTime = std::chrono::steady_clock::now();
+    pvti::Tracepoint::begin(ipu_utils::traceChannel(), "upload_scene");
+    getPrograms().run(engine, "init");
+    pvti::Tracepoint::end(ipu_utils::traceChannel(), "upload_scene");
+    endTime = std::chrono::steady_clock::now();
+    stats.sceneUploadSecs += std::chrono::duration<double>(endTime - startTime).count();
+    uploadScene = false;
+  }
   startTime = std::chrono::steady_clock::now();
+  pvti::Tracepoint::begin(ipu_utils::traceChannel(), "trace");
   getPrograms().run(engine, "trace");
+  pvti::Tracepoint::end(ipu_utils::traceChannel(), "trace");
   endTime = std::chrono::steady_clock::now();
-  traceTimeSecs = std::chrono::duration<double>(endTime - startTime).count();
+  stats.traceSecs += std::chrono::duration<double>(endTime - startTime).count();
   ipu_utils::logger()->info("IPU Rendering finished.");
+  if (callbackPool) {
+    // The results are not complete until the host threads have processed every batch:
+    ipu_utils::TraceScope traceScope("drain_ray_callbacks");
+    callbackPool->drain();
+    ipu_utils::logger()->debug("Ray callbacks waited for a free buffer {} times", callbackPool->getStalls());
+  }
+
+  // A tile takes as long as its slowest worker:
+  const auto countersPerTile = workerCounterData.size() / std::max<std::size_t>(stats.tileCycles.size(), 1u);
+  for (auto t = 0u; stats.castsCounted && t < stats.tileCycles.size(); ++t) {
+    std::uint64_t tileCycles = 0;
+    for (auto i = t * countersPerTile; i < (t + 1) * countersPerTile; i += WorkerCounterCount) {
+      stats.paths += workerCounterData[i];
+      stats.secondaryCasts += workerCounterData[i + 1];
+      tileCycles = std::max(tileCycles, workerCounterData[i + 2] + (std::uint64_t(workerCounterData[i + 3]) << 32));
+    }
+    stats.tileCycles[t] += tileCycles;
+  }
 
   auto dramToHostBw = std::numeric_limits<float>::quiet_NaN();
   if (rayFunc == nullptr) {
     // No callback was set so read rays back to host from DRAM in bulk:
+    ipu_utils::TraceScope traceScope("dram_to_host_rays");
     startTime = std::chrono::steady_clock::now();
+    // (results of dummy batches are never read):
     for (auto& i : replicaIndices) { i = 0; }
-    for (auto i = 0u; i < rayBatches.size(); i += 1) {
+    for (auto i = 0u; i < numRunBatches; i += 1) {
       const auto replica = i % numReplicas;
-      engine.copyFromRemoteBuffer("dram_ray_buffer", rayBatches[i].data(), replicaIndices[replica], replica);
+      auto dst = getRayBatchData(i);
+      engine.copyFromRemoteBuffer("dram_ray_buffer", dst, replicaIndices[replica], replica);
+      if (slimRayStream || dst == paddedBatch.data()) {
+        receiveRayBatch(streamBatchIndex(i), dst);
+      }
+      // (Finished results can leave host memory if the stream is mapped from a file):
+      writeBackRays(getRayBatch(streamBatchIndex(i)));
       replicaIndices[replica] += 1;
     }
     endTime = std::chrono::steady_clock::now();
     secs = std::chrono::duration<double>(endTime - startTime).count();
-    dramToHostBw = (1e-9 * rayBatches.size() * totalRaysPerIteration * sizeof(embree_utils::TraceResult) / secs);
+    dramToHostBw = (1e-9 * numRunBatches * totalRayBufferSize / secs);
+    stats.dramToHostSecs += secs;
+    stats.dramToHostBytes += double(numRunBatches) * totalRayBufferSize;
   }
 
   ipu_utils::logger()->debug("DRAM ray bandwidth (to/from): {} {} GB/sec", hostToDramBw, dramToHostBw);
-
-  // Copy result back into original stream:
-  auto hitItr = rayStream.begin();
-  auto index = 0u;
-  for (const auto& v : rayBatches) {
-    auto count = 0u;
-    for (auto& h : v) {
-      *hitItr = h;
-      hitItr += 1;
-      count += 1;
-      if (hitItr == rayStream.end()) {
-        break;
-      }
-    }
-    index += 1;
-    if (hitItr == rayStream.end()) {
-      break;
-    }
-  }
 }
 
 /// Return the per batch ray stream size for use when copying the ray stream
@@ -3,14 +3,20 @@
 
 #include <Mesh.hpp>
 
+#ifndef __IPU__
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#endif
+
 template <template<class T> class Storage>
 TriangleIntersection
 TriangleMesh<Storage>::intersectTriangle(std::uint32_t index, const RayShearParams& transform, const float tFar) const {
   // Get the triangles vertices:
   const auto& tri = triangles[index];
-  const auto& p0 = vertices[tri.v0];
-  const auto& p1 = vertices[tri.v1];
-  const auto& p2 = vertices[tri.v2];
+  const auto p0 = getVertex(tri.v0);
+  const auto p1 = getVertex(tri.v1);
+  const auto p2 = getVertex(tri.v2);
 
   // Translate vertices into ray coordinate system:
   auto p0t = p0 - transform.o;
@@ -103,6 +109,212 @@ TriangleMesh<Storage>::intersectTriangle(std::uint32_t index, const RayShearPara
   return TriangleIntersection{t, b0, b1, b2};
 }
 
+template <template<class T> class Storage>
+TriangleIntersection
+TriangleMesh<Storage>::intersectPrecomputed(std::uint32_t index, const embree_utils::Ray& ray, const float tFar) const {
+  const auto& m = precomputed[index].m;
+  const auto& o = ray.origin;
+  const auto& d = ray.direction;
+
+  // Distance to the triangle's plane (a zero transform gives NaN which fails the range test):
+  const float oz = m[8] * o.x + m[9] * o.y + m[10] * o.z + m[11];
+  const float dz = m[8] * d.x + m[9] * d.y + m[10] * d.z;
+  const float t = -oz / dz;
+  if (!(t > 0.f && t < tFar)) {
+    return TriangleIntersection{0.f, 0.f, 0.f, 0.f};
+  }
+
+  // Barycentric coordinates are the unit triangle coordinates of the hit point:
+  const auto p = o + d * t;
+  const float u = m[0] * p.x + m[1] * p.y + m[2] * p.z + m[3];
+  const float v = m[4] * p.x + m[5] * p.y + m[6] * p.z + m[7];
+  if (u < 0.f || v < 0.f || u + v > 1.f) {
+    return TriangleIntersection{0.f, 0.f, 0.f, 0.f};
+  }
+
+  return TriangleIntersection{t, 1.f - u - v, u, v};
+}
+
+#ifndef __IPU__
+PrecomputedTriangle precomputeTriangle(const embree_utils::Vec3fa& p0,
+                                       const embree_utils::Vec3fa& p1,
+                                       const embree_utils::Vec3fa& p2) {
+  // The transform is the inverse of the matrix with columns (e1, e2, n) where
+  // n = e1 x e2. Its rows are (e2 x n, n x e1, e1 x e2) / |n|^2 (computed in double):
+  const double o[3] = {p0.x, p0.y, p0.z};
+  const double e1[3] = {(double)p1.x - o[0], (double)p1.y - o[1], (double)p1.z - o[2]};
+  const double e2[3] = {(double)p2.x - o[0], (double)p2.y - o[1], (double)p2.z - o[2]};
+  auto cross = [](const double* a, const double* b, double* c) {
+    c[0] = a[1] * b[2] - a[2] * b[1];
+    c[1] = a[2] * b[0] - a[0] * b[2];
+    c[2] = a[0] * b[1] - a[1] * b[0];
+  };
+
+  double n[3];
+  cross(e1, e2, n);
+  const double det = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+  PrecomputedTriangle result;
+  if (det == 0.0) {
+    for (auto& v : result.m) { v = 0.f; }
+    return result;
+  }
+
+  double rows[3][3];
+  cross(e2, n, rows[0]);
+  cross(n, e1, rows[1]);
+  for (auto i = 0u; i < 3; ++i) { rows[2][i] = n[i]; }
+  for (auto r = 0u; r < 3; ++r) {
+    double w = 0.0;
+    for (auto c = 0u; c < 3; ++c) {
+      const double v = rows[r][c] / det;
+      result.m[4 * r + c] = v;
+      w -= v * o[c];
+    }
+    result.m[4 * r + 3] = w;
+  }
+  return result;
+}
+#endif
+
+#ifndef __IPU__
+VertexQuantisation VertexQuantisation::fromBounds(const embree_utils::Bounds3d& bounds) {
+  VertexQuantisation q;
+  for (auto i = 0u; i < 3; ++i) {
+    q.origin[i] = bounds.min[i];
+    q.scale[i] = (bounds.max[i] - bounds.min[i]) / 65535.f;
+  }
+  return q;
+}
+
+QuantisedVertex VertexQuantisation::encode(const embree_utils::Vec3fa& v) const {
+  std::uint16_t q[3];
+  for (auto i = 0u; i < 3; ++i) {
+    const float f = scale[i] > 0.f ? std::round((v[i] - origin[i]) / scale[i]) : 0.f;
+    q[i] = (std::uint16_t)std::clamp(f, 0.f, 65535.f);
+  }
+  return QuantisedVertex{q[0], q[1], q[2]};
+}
+
+OctahedralNormal encodeNormal(const embree_utils::Vec3fa& n) {
+  // Project onto the octahedron then fold the lower hemisphere over the diagonals:
+  const float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+  float x = n.x / l1;
+  float y = n.y / l1;
+  if (n.z < 0.f) {
+    const float fx = (1.f - std::abs(y)) * (x >= 0.f ? 1.f : -1.f);
+    const float fy = (1.f - std::abs(x)) * (y >= 0.f ? 1.f : -1.f);
+    x = fx;
+    y = fy;
+  }
+  return OctahedralNormal{
+    (std::int16_t)std::round(std::clamp(x, -1.f, 1.f) * 32767.f),
+    (std::int16_t)std::round(std::clamp(y, -1.f, 1.f) * 32767.f)
+  };
+}
+
+std::vector<HostTriangleMesh> splitMesh(const std::vector<WideTriangle>& triangles,
+                                        const std::vector<embree_utils::Vec3fa>& vertices,
+                                        const std::vector<embree_utils::Vec3fa>& normals,
+                                        std::size_t maxVertices,
+                                        const std::vector<TexCoord>& uvs,
+                                        std::vector<std::vector<TexCoord>>* partUVs) {
+  if (maxVertices < 3) {
+    throw std::invalid_argument("Mesh parts must be allowed at least 3 vertices.");
+  }
+  const bool hasNormals = !normals.empty();
+  if (hasNormals && normals.size() != vertices.size()) {
+    throw std::invalid_argument("Mesh must have one normal per vertex.");
+  }
+  const bool hasUVs = !uvs.empty() && partUVs != nullptr;
+  if (hasUVs && uvs.size() != vertices.size()) {
+    throw std::invalid_argument("Mesh must have one texture coordinate per vertex.");
+  }
+
+  std::vector<std::uint32_t> order(triangles.size());
+  std::vector<embree_utils::Vec3fa> centroids(triangles.size());
+  for (auto t = 0u; t < triangles.size(); ++t) {
+    const auto& tri = triangles[t];
+    order[t] = t;
+    centroids[t] = (vertices.at(tri.v0) + vertices.at(tri.v1) + vertices.at(tri.v2)) * (1.f / 3.f);
+  }
+
+  // Per vertex: the last part that counted it and its index in the part being built:
+  std::vector<std::uint32_t> lastSeen(vertices.size(), std::numeric_limits<std::uint32_t>::max());
+  std::vector<std::uint32_t> localIndex(vertices.size());
+  std::uint32_t pass = 0;
+  auto countVertices = [&](std::size_t begin, std::size_t end) {
+    pass += 1;
+    std::size_t count = 0;
+    for (auto i = begin; i < end; ++i) {
+      const auto& tri = triangles[order[i]];
+      for (auto v : {tri.v0, tri.v1, tri.v2}) {
+        if (lastSeen[v] != pass) {
+          lastSeen[v] = pass;
+          count += 1;
+        }
+      }
+    }
+    return count;
+  };
+
+  std::vector<HostTriangleMesh> parts;
+  auto emitPart = [&](std::size_t begin, std::size_t end) {
+    pass += 1;
+    HostTriangleMesh part;
+    part.triangles.reserve(end - begin);
+    std::vector<TexCoord> partUV;
+    auto local = [&](std::uint32_t v) {
+      if (lastSeen[v] != pass) {
+        lastSeen[v] = pass;
+        localIndex[v] = part.vertices.size();
+        part.vertices.push_back(vertices[v]);
+        if (hasNormals) {
+          part.normals.push_back(normals[v]);
+        }
+        if (hasUVs) {
+          partUV.push_back(uvs[v]);
+        }
+      }
+      return localIndex[v];
+    };
+    for (auto i = begin; i < end; ++i) {
+      const auto& tri = triangles[order[i]];
+      const auto a = local(tri.v0);
+      const auto b = local(tri.v1);
+      const auto c = local(tri.v2);
+      part.triangles.push_back(Triangle(a, b, c));
+    }
+    part.updateBoundingBox();
+    parts.push_back(std::move(part));
+    if (hasUVs) {
+      partUVs->push_back(std::move(partUV));
+    }
+  };
+
+  // Depth first so that neighbouring parts are adjacent in the output:
+  std::function<void(std::size_t, std::size_t)> split = [&](std::size_t begin, std::size_t end) {
+    if (countVertices(begin, end) <= maxVertices) {
+      emitPart(begin, end);
+      return;
+    }
+    embree_utils::Bounds3d bounds;
+    for (auto i = begin; i < end; ++i) {
+      bounds += centroids[order[i]];
+    }
+    const auto extent = bounds.max - bounds.min;
+    const auto axis = extent.x >= extent.y && extent.x >= extent.z ? 0u : (extent.y >= extent.z ? 1u : 2u);
+    const auto mid = begin + (end - begin) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+      [&](std::uint32_t a, std::uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+    split(begin, mid);
+    split(mid, end);
+  };
+
+  split(0, triangles.size());
+  return parts;
+}
+#endif
+
 template struct TriangleMesh<ArrayRef>;
 
 #ifndef __IPU__
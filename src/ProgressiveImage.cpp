@@ -0,0 +1,66 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+#include <ProgressiveImage.hpp>
+#include <ipu_utils.hpp>
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <stdexcept>
+
+ProgressiveImage::ProgressiveImage(cv::Mat& _image, float _weight,
+                                   const std::string& _previewPath, double previewIntervalSecs)
+  : image(_image),
+    weight(_weight),
+    previewPath(_previewPath),
+    previewInterval(previewIntervalSecs),
+    lastPreview(std::chrono::steady_clock::now()),
+    rayCount(0)
+{
+  if (image.type() != CV_32FC3 || !image.isContinuous()) {
+    throw std::logic_error("Progressive image must be a continuous CV_32FC3 image.");
+  }
+  image.setTo(cv::Scalar(0.f, 0.f, 0.f));
+}
+
+void ProgressiveImage::add(std::span<const embree_utils::TraceResult> batch) {
+  // Different batches normally cover different pixels but the adds are atomic
+  // so that pixels can safely be received more than once (and so that previews
+  // never read a partially written value):
+  for (const auto& r : batch) {
+    auto& pixel = image.at<cv::Vec3f>(r.p.u, r.p.v);
+    // Note: OpenCV is BGR:
+    std::atomic_ref<float>(pixel[0]).fetch_add(r.rgb.z * weight, std::memory_order_relaxed);
+    std::atomic_ref<float>(pixel[1]).fetch_add(r.rgb.y * weight, std::memory_order_relaxed);
+    std::atomic_ref<float>(pixel[2]).fetch_add(r.rgb.x * weight, std::memory_order_relaxed);
+  }
+  rayCount += batch.size();
+
+  // Only one thread writes a preview and others do not wait for it:
+  if (previewInterval.count() > 0.0) {
+    std::unique_lock<std::mutex> lock(previewMutex, std::try_to_lock);
+    if (lock && std::chrono::steady_clock::now() - lastPreview >= previewInterval) {
+      writePreview();
+    }
+  }
+}
+
+void ProgressiveImage::savePreview() {
+  std::lock_guard<std::mutex> lock(previewMutex);
+  writePreview();
+}
+
+// The caller must hold the preview mutex:
+void ProgressiveImage::writePreview() {
+  cv::Mat preview(image.rows, image.cols, CV_32FC3);
+  auto src = reinterpret_cast<float*>(image.data);
+  auto dst = reinterpret_cast<float*>(preview.data);
+  for (auto i = 0u; i < image.total() * 3; ++i) {
+    dst[i] = std::atomic_ref<float>(src[i]).load(std::memory_order_relaxed);
+  }
+  {
+    ipu_utils::TraceScope traceScope("write_preview");
+    cv::imwrite(previewPath, preview);
+  }
+  lastPreview = std::chrono::steady_clock::now();
+  ipu_utils::logger()->info("Saved preview '{}' ({} rays received)", previewPath, rayCount.load());
+}
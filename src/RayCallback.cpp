@@ -9,17 +9,28 @@ void RayCallback::fetch(void *p) {
   // Only copy data if a callback was registered. If there is no call
   // back rays can still be read from DRAM when the IPU is finished.
   if (scene.getRayCallback()) {
-    const auto batchIndex = receiveIndex + replica;
+    ipu_utils::TraceScope traceScope("ray_callback");
+    const auto batchIndex = scene.streamBatchIndex(receiveIndex + replica);
     ipu_utils::logger()->debug("Saving ray data from replica {} to index {}: {} bytes", replica, batchIndex, scene.getRayStreamSize());
-    auto& batch = scene.getRayBatches()[batchIndex];
-    std::memcpy(batch.data(), p, scene.getRayStreamSize());
-    (*scene.getRayCallback())(batchIndex, batch);
+    if (auto* pool = scene.getRayCallbackPool()) {
+      // Only copy the data so that the stream is released quickly (the pool's
+      // threads decode the batch and call the application's callback):
+      pool->submit(replica, batchIndex, p);
+    } else {
+      // Results go straight into the ray stream (dummy batches give an empty span):
+      auto batch = scene.receiveRayBatch(batchIndex, p);
+      if (!batch.empty()) {
+        (*scene.getRayCallback())(batchIndex, batch);
+        // Finished results can leave host memory (if the ray stream is mapped from a file):
+        writeBackRays(batch);
+      }
+    }
   }
   // Increment the index even if no data was copied so progress can be logged:
   receiveIndex += scene.getRuntimeConfig().numReplicas;
   // Only log progress on one replica to reduce output:
   if (replica == scene.getRuntimeConfig().numReplicas - 1) {
-    ipu_utils::logger()->debug("Ray-batches finished: {}/{}", receiveIndex, scene.getRayBatches().size());
+    ipu_utils::logger()->debug("Ray-batches finished: {}/{}", receiveIndex, scene.getNumRayBatches());
   }
 }
 
@@ -0,0 +1,168 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+#include <RayStream.hpp>
+#include <ipu_utils.hpp>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+namespace {
+
+constexpr std::size_t hugePageSize = 2u << 20;
+
+struct Mapping {
+  std::size_t length;
+  bool fileBacked;
+};
+
+struct StorageState {
+  std::mutex mutex;
+  RayStreamStorage storage = RayStreamStorage::Heap;
+  std::string directory;
+  std::map<std::uintptr_t, Mapping> mappings; // Keyed by start address
+  bool hugePageFallbackLogged = false;
+};
+
+StorageState& state() {
+  static StorageState s;
+  return s;
+}
+
+std::string errorString(const std::string& what) {
+  return what + ": " + std::strerror(errno);
+}
+
+void* mapFile(const std::string& directory, std::size_t length) {
+  auto path = directory + "/ipu_ray_stream_XXXXXX";
+  const auto fd = mkstemp(path.data());
+  if (fd < 0) {
+    throw std::runtime_error(errorString("Could not create ray stream file in '" + directory + "'"));
+  }
+  // The file is only reachable through the mapping (so it is removed when the stream is freed or the process exits):
+  unlink(path.c_str());
+  if (ftruncate(fd, length) != 0) {
+    close(fd);
+    throw std::runtime_error(errorString("Could not size ray stream file in '" + directory + "'"));
+  }
+  auto* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    throw std::runtime_error(errorString("Could not map ray stream file in '" + directory + "'"));
+  }
+  return p;
+}
+
+void* mapHugePages(std::size_t length, bool& fallbackLogged) {
+  auto* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    return p;
+  }
+  // No huge pages are reserved so ask for transparent huge pages instead:
+  if (!fallbackLogged) {
+    ipu_utils::logger()->warn("Could not map reserved huge pages for the ray stream ({}): using transparent huge pages",
+                              std::strerror(errno));
+    fallbackLogged = true;
+  }
+  p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  madvise(p, length, MADV_HUGEPAGE);
+  return p;
+}
+
+} // end anonymous namespace
+
+void setRayStreamStorage(RayStreamStorage storage, const std::string& directory) {
+  if (storage == RayStreamStorage::MappedFile && directory.empty()) {
+    throw std::invalid_argument("A directory is needed to map ray streams from files.");
+  }
+  auto& s = state();
+  std::lock_guard<std::mutex> lock(s.mutex);
+  s.storage = storage;
+  s.directory = directory;
+}
+
+RayStreamStorage getRayStreamStorage() {
+  auto& s = state();
+  std::lock_guard<std::mutex> lock(s.mutex);
+  return s.storage;
+}
+
+void* allocateRayStorage(std::size_t bytes) {
+  auto& s = state();
+  std::lock_guard<std::mutex> lock(s.mutex);
+  if (s.storage == RayStreamStorage::Heap || bytes < rayStreamMinMappedBytes) {
+    return ::operator new(bytes);
+  }
+
+  void* p = nullptr;
+  std::size_t length = 0;
+  const bool fileBacked = s.storage == RayStreamStorage::MappedFile;
+  if (fileBacked) {
+    const auto pageSize = std::size_t(sysconf(_SC_PAGESIZE));
+    length = (bytes + pageSize - 1) / pageSize * pageSize;
+    p = mapFile(s.directory, length);
+  } else {
+    length = (bytes + hugePageSize - 1) / hugePageSize * hugePageSize;
+    p = mapHugePages(length, s.hugePageFallbackLogged);
+  }
+  s.mappings[reinterpret_cast<std::uintptr_t>(p)] = Mapping{length, fileBacked};
+  return p;
+}
+
+void freeRayStorage(void* p, std::size_t bytes) {
+  if (p == nullptr) {
+    return;
+  }
+  // Streams go back to wherever they came from (the storage setting may have changed since):
+  auto& s = state();
+  std::lock_guard<std::mutex> lock(s.mutex);
+  auto itr = s.mappings.find(reinterpret_cast<std::uintptr_t>(p));
+  if (itr == s.mappings.end()) {
+    ::operator delete(p, bytes);
+    return;
+  }
+  munmap(p, itr->second.length);
+  s.mappings.erase(itr);
+}
+
+void writeBackRayStorage(const void* p, std::size_t bytes) {
+  if (p == nullptr || bytes == 0) {
+    return;
+  }
+  const auto start = reinterpret_cast<std::uintptr_t>(p);
+  auto& s = state();
+  std::lock_guard<std::mutex> lock(s.mutex);
+  auto itr = s.mappings.upper_bound(start);
+  if (itr == s.mappings.begin()) {
+    return;
+  }
+  --itr;
+  const auto mapStart = itr->first;
+  const auto mapEnd = mapStart + itr->second.length;
+  if (!itr->second.fileBacked || start >= mapEnd) {
+    return;
+  }
+
+  // Pages that are only partly covered are dropped too: their contents are
+  // safe in the file (it is just a hint so errors are ignored):
+  const auto pageSize = std::uintptr_t(sysconf(_SC_PAGESIZE));
+  const auto first = start / pageSize * pageSize;
+  const auto end = std::min(mapEnd, (start + bytes + pageSize - 1) / pageSize * pageSize);
+  auto* page = reinterpret_cast<void*>(first);
+#ifdef MADV_PAGEOUT
+  madvise(page, end - first, MADV_PAGEOUT);
+#else
+  msync(page, end - first, MS_ASYNC);
+  madvise(page, end - first, MADV_DONTNEED);
+#endif
+}
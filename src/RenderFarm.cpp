@@ -0,0 +1,220 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+#include <RenderFarm.hpp>
+#include <ipu_utils.hpp>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+FarmBatchQueue::FarmBatchQueue(const std::string& _directory, std::uint32_t _rank, std::uint32_t _numProcesses,
+                               RayStream& _rayStream)
+  : directory(_directory),
+    rank(_rank),
+    numProcesses(_numProcesses),
+    rayStream(_rayStream),
+    numBatches(0),
+    raysPerBatch(0),
+    chunkBatches(0),
+    numChunks(0),
+    ownNext(0),
+    stolen(0)
+{
+  if (numProcesses == 0 || rank >= numProcesses) {
+    throw std::invalid_argument("Farm rank must be less than the number of farm processes.");
+  }
+  std::filesystem::create_directories(directory);
+}
+
+void FarmBatchQueue::start(std::size_t _numBatches, std::size_t batchSize) {
+  if (chunkBatches) {
+    throw std::logic_error("A farm batch queue can only render one frame.");
+  }
+  numBatches = _numBatches;
+  raysPerBatch = batchSize;
+  RayBatchQueue::start(_numBatches, batchSize);
+}
+
+RayBatchQueue::Range FarmBatchQueue::takeFront(std::size_t count) {
+  if (chunkBatches == 0) {
+    chunkBatches = count;
+    numChunks = (numBatches + chunkBatches - 1) / chunkBatches;
+    checkManifest();
+    ownNext = shareBegin(rank);
+    stealEnd.resize(numProcesses);
+    for (auto r = 0u; r < numProcesses; ++r) {
+      stealEnd[r] = shareBegin(r + 1);
+    }
+  } else if (count != chunkBatches) {
+    throw std::logic_error("Every farm chunk must have the same number of batches.");
+  }
+
+  // The previous chunk's results are complete once the IPU asks for more:
+  finish();
+  const auto chunk = claimNext();
+  if (!chunk) {
+    return Range{numBatches, 0};
+  }
+  rendered.push_back(*chunk);
+  unpublished = chunk;
+  const auto first = *chunk * chunkBatches;
+  return Range{first, std::min(chunkBatches, numBatches - first)};
+}
+
+void FarmBatchQueue::finish() {
+  if (unpublished) {
+    publish(*unpublished);
+    unpublished.reset();
+  }
+}
+
+void FarmBatchQueue::gather(double pollSecs) {
+  if (!isOutputProcess()) {
+    throw std::logic_error("Only the output process gathers the farm's results.");
+  }
+  if (chunkBatches == 0) {
+    throw std::logic_error("The frame must be rendered before its results are gathered.");
+  }
+  finish();
+  ipu_utils::TraceScope traceScope("farm_gather");
+
+  std::vector<bool> local(numChunks, false);
+  for (auto c : rendered) {
+    local[c] = true;
+  }
+  std::vector<std::size_t> missing;
+  for (auto c = 0u; c < numChunks; ++c) {
+    if (!local[c]) {
+      missing.push_back(c);
+    }
+  }
+
+  auto lastReport = std::chrono::steady_clock::now();
+  while (!missing.empty()) {
+    std::vector<std::size_t> stillMissing;
+    for (auto c : missing) {
+      const auto path = chunkPath(c, ".rays");
+      std::ifstream in(path, std::ios::binary);
+      if (!in) {
+        stillMissing.push_back(c);
+        continue;
+      }
+      const auto [first, count] = chunkRays(c);
+      const auto bytes = count * sizeof(embree_utils::TraceResult);
+      in.read(reinterpret_cast<char*>(rayStream.data() + first), bytes);
+      if (std::size_t(in.gcount()) != bytes || in.peek() != std::ifstream::traits_type::eof()) {
+        throw std::runtime_error("Farm results '" + path + "' have the wrong size.");
+      }
+    }
+    missing.swap(stillMissing);
+    if (missing.empty()) {
+      break;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (std::chrono::duration<double>(now - lastReport).count() > 30.0) {
+      ipu_utils::logger()->info("Waiting for {} of {} chunks from the other farm processes", missing.size(), numChunks);
+      lastReport = now;
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(pollSecs));
+  }
+  ipu_utils::logger()->info("Gathered {} farm chunks ({} rendered by this process)", numChunks, rendered.size());
+}
+
+std::string FarmBatchQueue::chunkPath(std::size_t chunk, const char* suffix) const {
+  return directory + "/chunk_" + std::to_string(chunk) + suffix;
+}
+
+// First ray and number of rays in a chunk:
+std::pair<std::size_t, std::size_t> FarmBatchQueue::chunkRays(std::size_t chunk) const {
+  const auto first = chunk * chunkBatches * raysPerBatch;
+  return {first, std::min(chunkBatches * raysPerBatch, rayStream.size() - first)};
+}
+
+// The first process to start writes the frame's layout and the others check that they match it:
+void FarmBatchQueue::checkManifest() {
+  std::ostringstream manifest;
+  manifest << rayStream.size() << " " << numBatches << " " << raysPerBatch << " " << chunkBatches << " "
+           << numProcesses << " " << sizeof(embree_utils::TraceResult);
+  const auto path = directory + "/manifest";
+  const auto tmpPath = path + ".tmp." + std::to_string(rank);
+  {
+    std::ofstream out(tmpPath);
+    out << manifest.str();
+    if (!out) {
+      throw std::runtime_error("Could not write '" + tmpPath + "'.");
+    }
+  }
+  // A hard link is created atomically and fails if the manifest already exists:
+  std::error_code ec;
+  std::filesystem::create_hard_link(tmpPath, path, ec);
+  std::filesystem::remove(tmpPath);
+  if (ec) {
+    std::ifstream in(path);
+    std::string existing;
+    std::getline(in, existing);
+    if (existing != manifest.str()) {
+      throw std::runtime_error("Farm manifest '" + path + "' (" + existing + ") does not match this process (" +
+                               manifest.str() + "): every process must render the same frame with the same IPU configuration.");
+    }
+  }
+  ipu_utils::logger()->info("Render farm process {} of {}: {} chunks of {} ray batches", rank, numProcesses, numChunks, chunkBatches);
+}
+
+bool FarmBatchQueue::tryClaim(std::size_t chunk) {
+  const auto path = chunkPath(chunk, ".claim");
+  auto* file = std::fopen(path.c_str(), "wx"); // Exclusive create
+  if (file == nullptr) {
+    if (errno == EEXIST) {
+      return false;
+    }
+    throw std::runtime_error("Could not claim farm chunk '" + path + "': " + std::strerror(errno));
+  }
+  std::fprintf(file, "%u\n", rank);
+  std::fclose(file);
+  return true;
+}
+
+std::optional<std::size_t> FarmBatchQueue::claimNext() {
+  // Own share from the front:
+  while (ownNext < shareBegin(rank + 1)) {
+    const auto chunk = ownNext++;
+    if (tryClaim(chunk)) {
+      return chunk;
+    }
+  }
+  // Then steal from the back of the other shares (a chunk that was claimed
+  // stays claimed so every chunk is tried at most once):
+  for (auto i = 1u; i < numProcesses; ++i) {
+    const auto victim = (rank + i) % numProcesses;
+    while (stealEnd[victim] > shareBegin(victim)) {
+      const auto chunk = --stealEnd[victim];
+      if (tryClaim(chunk)) {
+        stolen += 1;
+        return chunk;
+      }
+    }
+  }
+  return std::nullopt;
+}
+
+void FarmBatchQueue::publish(std::size_t chunk) {
+  ipu_utils::TraceScope traceScope("farm_publish");
+  const auto [first, count] = chunkRays(chunk);
+  const auto path = chunkPath(chunk, ".rays");
+  const auto tmpPath = path + ".tmp." + std::to_string(rank);
+  {
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(rayStream.data() + first), count * sizeof(embree_utils::TraceResult));
+    if (!out) {
+      throw std::runtime_error("Could not write farm results '" + tmpPath + "'.");
+    }
+  }
+  // Renaming makes the results visible all at once:
+  std::filesystem::rename(tmpPath, path);
+}
@@ -0,0 +1,203 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+#include <SahBvhBuilder.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+struct Bin {
+  embree_utils::Bounds3d bounds;
+  std::uint32_t count = 0;
+};
+
+struct Split {
+  std::int32_t axis = -1;
+  std::uint32_t bin = 0; // Primitives in bins [0, bin] go left
+  float cost = std::numeric_limits<float>::infinity();
+};
+
+class SahBuilder {
+public:
+  SahBuilder(std::vector<BuildPrimitive>& primitives, const SahBuildSettings& buildSettings)
+    : prims(primitives), settings(buildSettings) {}
+
+  /// Build the sub-tree over prims[begin, end) and append its nodes
+  /// to the array in depth first order. Returns the sub-tree's depth:
+  std::uint32_t build(std::uint32_t begin, std::uint32_t end, std::vector<BuildNode>& nodes) {
+    BuildNode node;
+    node.firstPrim = begin;
+    node.primCount = end - begin;
+    node.secondChild = 0;
+    node.geomID = BuildNode::InvalidGeomID;
+    node.geomFirst = 0;
+
+    embree_utils::Bounds3d centroids;
+    bool sameGeom = true;
+    for (auto p = begin; p < end; ++p) {
+      node.bounds += prims[p].bounds;
+      centroids += prims[p].bounds.centroid();
+      sameGeom = sameGeom && prims[p].geomID == prims[begin].geomID;
+    }
+
+    const auto count = end - begin;
+    const bool canBeLeaf = sameGeom && count <= settings.maxLeafPrims;
+    const auto split = findSplit(begin, end, node.bounds, centroids);
+    const float leafCost = settings.intersectionCost * count;
+    const auto myIndex = nodes.size();
+    if (canBeLeaf && (split.axis < 0 || leafCost <= split.cost)) {
+      node.geomID = prims[begin].geomID;
+      nodes.push_back(node);
+      return 1;
+    }
+    nodes.push_back(node);
+
+    const auto mid = partition(begin, end, split, centroids, sameGeom);
+
+    std::uint32_t leftDepth = 0;
+    std::uint32_t rightDepth = 0;
+    if (count > settings.parallelThreshold) {
+      // Large sub-trees are built concurrently into their own arrays then
+      // appended (with indices offset) to keep the depth first order:
+      std::vector<BuildNode> left;
+      std::vector<BuildNode> right;
+      #pragma omp task shared(left, leftDepth)
+      leftDepth = build(begin, mid, left);
+      #pragma omp task shared(right, rightDepth)
+      rightDepth = build(mid, end, right);
+      #pragma omp taskwait
+      append(left, nodes);
+      nodes[myIndex].secondChild = nodes.size();
+      append(right, nodes);
+    } else {
+      leftDepth = build(begin, mid, nodes);
+      nodes[myIndex].secondChild = nodes.size();
+      rightDepth = build(mid, end, nodes);
+    }
+
+    return 1 + std::max(leftDepth, rightDepth);
+  }
+
+private:
+  std::vector<BuildPrimitive>& prims;
+  const SahBuildSettings& settings;
+
+  std::uint32_t binIndex(const BuildPrimitive& p, std::uint32_t axis, const embree_utils::Bounds3d& centroids) const {
+    const float lo = centroids.min[axis];
+    const float extent = centroids.max[axis] - lo;
+    const auto b = (std::uint32_t)(settings.numBins * ((p.bounds.centroid()[axis] - lo) / extent));
+    return std::min(b, settings.numBins - 1);
+  }
+
+  Split findSplit(std::uint32_t begin, std::uint32_t end,
+                  const embree_utils::Bounds3d& bounds, const embree_utils::Bounds3d& centroids) const {
+    Split best;
+    const float area = bounds.surfaceArea();
+    std::vector<Bin> bins(settings.numBins);
+    std::vector<float> rightArea(settings.numBins);
+    std::vector<std::uint32_t> rightCount(settings.numBins);
+    for (auto axis = 0u; axis < 3; ++axis) {
+      if (!(centroids.max[axis] > centroids.min[axis])) { continue; }
+
+      std::fill(bins.begin(), bins.end(), Bin());
+      for (auto p = begin; p < end; ++p) {
+        auto& bin = bins[binIndex(prims[p], axis, centroids)];
+        bin.bounds += prims[p].bounds;
+        bin.count += 1;
+      }
+
+      // Sweep from the right to get the cost of every right hand side:
+      embree_utils::Bounds3d acc;
+      std::uint32_t accCount = 0;
+      for (auto b = settings.numBins - 1; b > 0; --b) {
+        acc += bins[b].bounds;
+        accCount += bins[b].count;
+        rightArea[b] = acc.surfaceArea();
+        rightCount[b] = accCount;
+      }
+
+      // Then sweep from the left evaluating the SAH for each split plane:
+      acc = embree_utils::Bounds3d();
+      accCount = 0;
+      for (auto b = 0u; b + 1 < settings.numBins; ++b) {
+        acc += bins[b].bounds;
+        accCount += bins[b].count;
+        if (accCount == 0 || rightCount[b + 1] == 0) { continue; }
+        const float cost = settings.traversalCost + settings.intersectionCost *
+          (acc.surfaceArea() * accCount + rightArea[b + 1] * rightCount[b + 1]) / area;
+        if (cost < best.cost) {
+          best.axis = axis;
+          best.bin = b;
+          best.cost = cost;
+        }
+      }
+    }
+    return best;
+  }
+
+  std::uint32_t partition(std::uint32_t begin, std::uint32_t end, const Split& split,
+                          const embree_utils::Bounds3d& centroids, bool sameGeom) {
+    const auto first = prims.begin() + begin;
+    const auto last = prims.begin() + end;
+    std::vector<BuildPrimitive>::iterator mid;
+    if (split.axis >= 0) {
+      mid = std::partition(first, last, [&](const BuildPrimitive& p) {
+        return binIndex(p, split.axis, centroids) <= split.bin;
+      });
+    } else if (!sameGeom) {
+      // Centroids are all the same but leaves can not mix geometries:
+      const auto geomID = first->geomID;
+      mid = std::partition(first, last, [&](const BuildPrimitive& p) { return p.geomID == geomID; });
+    } else {
+      // Too many primitives at the same centroid so split the range in half:
+      mid = first + (end - begin) / 2;
+    }
+    return mid - prims.begin();
+  }
+
+  static void append(const std::vector<BuildNode>& subtree, std::vector<BuildNode>& nodes) {
+    const auto offset = nodes.size();
+    for (auto node : subtree) {
+      if (!node.isLeaf()) {
+        node.secondChild += offset;
+      }
+      nodes.push_back(node);
+    }
+  }
+};
+
+} // end anonymous namespace
+
+BvhBuild buildSahBvh(std::vector<BuildPrimitive>&& prims, const SahBuildSettings& settings) {
+  if (prims.empty()) {
+    throw std::runtime_error("Can not build a BVH with no primitives.");
+  }
+  if (settings.maxLeafPrims == 0 || settings.numBins < 2) {
+    throw std::logic_error("Invalid BVH build settings.");
+  }
+
+  BvhBuild result;
+  result.prims = std::move(prims);
+  result.nodes.reserve(2 * result.prims.size());
+
+  SahBuilder builder(result.prims, settings);
+  #pragma omp parallel
+  #pragma omp single
+  result.maxDepth = builder.build(0, result.prims.size(), result.nodes);
+
+  // Leaves are in the same order as their primitives so each leaf's position in
+  // its geometry follows from a running count of every geometry's primitives:
+  std::vector<std::uint32_t> geomCounts;
+  for (auto& node : result.nodes) {
+    if (node.isLeaf()) {
+      if (node.geomID >= geomCounts.size()) {
+        geomCounts.resize(node.geomID + 1, 0u);
+      }
+      node.geomFirst = geomCounts[node.geomID];
+      geomCounts[node.geomID] += node.primCount;
+    }
+  }
+
+  return result;
+}
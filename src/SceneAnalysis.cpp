@@ -0,0 +1,157 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+#include <SceneAnalysis.hpp>
+#include <CompactBVH4Node.hpp>
+#include <CompactBVH4QNode.hpp>
+#include <serialisation/serialisation.hpp>
+
+#include <algorithm>
+
+namespace {
+
+std::size_t& histogramBin(std::vector<std::size_t>& histogram, std::size_t bin) {
+  if (histogram.size() <= bin) {
+    histogram.resize(bin + 1, 0u);
+  }
+  return histogram[bin];
+}
+
+float overlapArea(const embree_utils::Bounds3d& a, const embree_utils::Bounds3d& b) {
+  const embree_utils::Bounds3d overlap(
+    embree_utils::Vec3fa(std::max(a.min.x, b.min.x), std::max(a.min.y, b.min.y), std::max(a.min.z, b.min.z)),
+    embree_utils::Vec3fa(std::min(a.max.x, b.max.x), std::min(a.max.y, b.max.y), std::min(a.max.z, b.max.z))
+  );
+  if (overlap.min.x > overlap.max.x || overlap.min.y > overlap.max.y || overlap.min.z > overlap.max.z) {
+    return 0.f;
+  }
+  return overlap.surfaceArea();
+}
+
+template <class WideNode>
+struct BvhAnalyser {
+  std::span<const WideNode> nodes;
+  const LeafBoundsFn& leafBounds;
+  const SahBuildSettings& costs;
+  double rootArea;
+  BvhQuality quality;
+  double overlapSum = 0.0;
+  double boundsErrorSum = 0.0;
+  std::size_t boundsCount = 0;
+
+  // Accumulate the measures of the sub-tree and return the exact bounds of its primitives:
+  embree_utils::Bounds3d visit(std::uint32_t index, std::uint32_t depth, double nodeArea) {
+    const auto& node = nodes[index];
+    quality.nodes += 1;
+    quality.sahCost += costs.traversalCost * nodeArea / rootArea;
+    histogramBin(quality.childCounts, node.childCount) += 1;
+
+    embree_utils::Bounds3d exact;
+    double overlap = 0.0;
+    for (auto c = 0u; c < node.childCount; ++c) {
+      const auto stored = node.childBounds(c);
+      embree_utils::Bounds3d childExact;
+      if (node.isLeaf(c)) {
+        const auto count = leafPrimCount(node.child[c]);
+        childExact = leafBounds(node.geomID[c], leafFirstPrim(node.child[c]), count);
+        quality.leaves += 1;
+        quality.prims += count;
+        histogramBin(quality.leafSizes, count) += 1;
+        histogramBin(quality.leafDepths, depth) += 1;
+        quality.sahCost += costs.intersectionCost * count * stored.surfaceArea() / rootArea;
+      } else {
+        childExact = visit(node.child[c], depth + 1, stored.surfaceArea());
+      }
+
+      const double exactArea = childExact.surfaceArea();
+      if (exactArea > 0.0) {
+        const auto error = std::max(stored.surfaceArea() / exactArea - 1.0, 0.0);
+        boundsErrorSum += error;
+        boundsCount += 1;
+        quality.maxBoundsError = std::max(quality.maxBoundsError, error);
+      }
+      for (auto d = 0u; d < c; ++d) {
+        overlap += overlapArea(stored, node.childBounds(d));
+      }
+      exact += childExact;
+    }
+    if (nodeArea > 0.0) {
+      overlapSum += overlap / nodeArea;
+    }
+    return exact;
+  }
+};
+
+} // end anonymous namespace
+
+template <class WideNode>
+BvhQuality analyseBvh(std::span<const WideNode> nodes, const LeafBoundsFn& leafBounds, const SahBuildSettings& costs) {
+  if (nodes.empty()) {
+    return BvhQuality();
+  }
+  const double rootArea = nodes[0].toBounds().surfaceArea();
+  BvhAnalyser<WideNode> analyser{nodes, leafBounds, costs, rootArea > 0.0 ? rootArea : 1.0};
+  analyser.visit(0, 1, rootArea);
+  auto quality = analyser.quality;
+  quality.meanOverlap = analyser.overlapSum / quality.nodes;
+  quality.meanBoundsError = analyser.boundsCount ? analyser.boundsErrorSum / analyser.boundsCount : 0.0;
+  return quality;
+}
+
+template BvhQuality analyseBvh<CompactBVH4Node>(std::span<const CompactBVH4Node>, const LeafBoundsFn&, const SahBuildSettings&);
+template BvhQuality analyseBvh<CompactBVH4QNode>(std::span<const CompactBVH4QNode>, const LeafBoundsFn&, const SahBuildSettings&);
+
+SceneUploadLayout sceneUploadLayout(std::size_t maxSpheres, std::size_t maxDiscs) {
+  auto alignUp = [](std::size_t n, std::size_t align) { return ((n + align - 1) / align) * align; };
+  SceneUploadLayout layout;
+  layout.discsOffset = alignUp(maxSpheres * sizeof(Sphere), alignof(Disc));
+  layout.sceneOffset = alignUp(layout.discsOffset + maxDiscs * sizeof(Disc), 16);
+  return layout;
+}
+
+std::vector<TileMemoryItem> sceneTileMemory(const SceneRef& scene, std::size_t maxSpheres, std::size_t maxDiscs,
+                                            std::size_t maxSceneBytes) {
+  // Serialise each component in turn so that the alignment padding in front of it is counted:
+  Serialiser<16> s(1024);
+  std::vector<TileMemoryItem> items;
+  auto add = [&](const std::string& name, auto write) {
+    const auto start = s.bytes.size();
+    write();
+    items.push_back(TileMemoryItem{name, s.bytes.size() - start});
+  };
+
+  // The order must match serialise(Serialiser&, const SceneRef&):
+  add("Geometry info", [&]() { s << scene.geometry; });
+  add("Mesh info", [&]() { s << scene.meshInfo; });
+  add("Index buffer", [&]() { s << scene.meshTris; });
+  add("Vertex buffer", [&]() { s << scene.meshVerts; });
+  add("Normal buffer", [&]() { s << scene.meshNormals; });
+  add("Precomputed triangles", [&]() { s << scene.meshPrecomputed; });
+  add("Vertex quantisation", [&]() { s << scene.meshQuantisation; });
+  add("Packed vertex buffer", [&]() { s << scene.meshPackedVerts; });
+  add("Packed normal buffer", [&]() { s << scene.meshPackedNormals; });
+  add("Material IDs", [&]() { s << scene.matIDs; });
+  add("Materials", [&]() { s << scene.materials; });
+  add("BVH nodes", [&]() { s << scene.bvhNodes; });
+  add("Instances", [&]() { s << scene.instances; });
+  add("Instance BVH nodes", [&]() { s << scene.blasNodes; });
+  add("Area lights", [&]() { s << scene.lights; });
+  add("Texture coordinates", [&]() { s << scene.meshUVs; });
+  add("Texture info", [&]() { s << scene.textures; });
+  add("Texture blocks", [&]() { s << scene.texels; });
+  // (The BVH's stack size is stored with the render parameters):
+  add("Render parameters", [&]() {
+    s << scene.maxLeafDepth;
+    serialiseRenderParams(s, scene);
+  });
+
+  // A graph built for a larger scene reserves its capacity on every tile:
+  if (maxSceneBytes > s.bytes.size()) {
+    items.push_back(TileMemoryItem{"Scene capacity padding", maxSceneBytes - s.bytes.size()});
+  }
+
+  // Spheres and discs are uploaded in front of the serialised scene (padded to the capacity):
+  const auto layout = sceneUploadLayout(maxSpheres, maxDiscs);
+  items.push_back(TileMemoryItem{"Spheres", layout.discsOffset});
+  items.push_back(TileMemoryItem{"Discs", layout.sceneOffset - layout.discsOffset});
+  return items;
+}
@@ -0,0 +1,241 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+#include <SceneCache.hpp>
+#include <serialisation/serialisation.hpp>
+#include <serialisation/deserialisation.hpp>
+#include <ipu_utils.hpp>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Increment this whenever the layout of the file or of any serialised type changes:
+constexpr std::uint32_t cacheVersion = 6;
+constexpr char cacheMagic[8] = {'I', 'P', 'U', 'S', 'C', 'N', 'C', '\0'};
+
+// Sections are aligned well beyond the serialiser's base alignment (the
+// mapping itself is page aligned):
+constexpr std::size_t sectionAlign = 64;
+
+struct CacheHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t headerSize;
+  std::uint32_t triangleSize; // Depends on the width of the triangle indices the program was built with
+  std::uint64_t key;
+  std::uint64_t sceneOffset;
+  std::uint64_t sceneSize;
+  std::uint64_t paramsOffset; // Offset of the render parameters in the scene stream
+  std::uint64_t primitivesOffset;
+  std::uint64_t primitivesSize;
+  float horizontalFov;
+};
+
+std::size_t alignUp(std::size_t offset) {
+  return ((offset + sectionAlign - 1) / sectionAlign) * sectionAlign;
+}
+
+template <std::uint32_t BaseAlign>
+void writeRenderParams(std::uint8_t* dst, std::size_t offset, std::size_t size, const SceneRef& params) {
+  // Pre-pad so the alignment matches that of the parameters in the original stream:
+  Serialiser<BaseAlign> s(64);
+  const auto pad = offset % BaseAlign;
+  s.bytes.resize(pad);
+  serialiseRenderParams(s, params);
+  if (s.bytes.size() - pad != size) {
+    throw std::logic_error("Serialised render parameters do not match the cached scene.");
+  }
+  std::memcpy(dst + offset, s.bytes.data() + pad, size);
+}
+
+} // end anonymous namespace
+
+std::uint64_t hashBytes(const void* data, std::size_t size, std::uint64_t seed) {
+  auto h = seed;
+  auto ptr = static_cast<const std::uint8_t*>(data);
+  for (auto i = 0u; i < size; ++i) {
+    h ^= ptr[i];
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+std::uint64_t hashFile(const std::string& path, std::uint64_t seed) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Could not open file for hashing: '" + path + "'");
+  }
+  std::vector<char> buffer(1 << 20);
+  auto h = seed;
+  while (file) {
+    file.read(buffer.data(), buffer.size());
+    h = hashBytes(buffer.data(), file.gcount(), h);
+  }
+  return h;
+}
+
+void SceneCache::save(const std::string& path, std::uint64_t key,
+                      const SceneRef& scene, float horizontalFov,
+                      const std::vector<Sphere>& spheres,
+                      const std::vector<Disc>& discs) {
+  ipu_utils::TraceScope traceScope("save_scene_cache");
+  Serialiser<16> sceneSerialiser(1024 * 1024);
+  serialiseSceneData(sceneSerialiser, scene);
+  const auto paramsOffset = sceneSerialiser.bytes.size();
+  serialiseRenderParams(sceneSerialiser, scene);
+
+  Serialiser<16> primSerialiser(1024);
+  primSerialiser << spheres << discs;
+
+  CacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+  header.version = cacheVersion;
+  header.headerSize = sizeof(CacheHeader);
+  header.triangleSize = sizeof(Triangle);
+  header.key = key;
+  header.sceneOffset = alignUp(sizeof(CacheHeader));
+  header.sceneSize = sceneSerialiser.bytes.size();
+  header.paramsOffset = paramsOffset;
+  header.primitivesOffset = alignUp(header.sceneOffset + header.sceneSize);
+  header.primitivesSize = primSerialiser.bytes.size();
+  header.horizontalFov = horizontalFov;
+
+  const auto tmpPath = path + ".tmp";
+  {
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!file) {
+      throw std::runtime_error("Could not open scene cache file for writing: '" + tmpPath + "'");
+    }
+    const char zeros[sectionAlign] = {};
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(zeros, header.sceneOffset - sizeof(header));
+    file.write(reinterpret_cast<const char*>(sceneSerialiser.bytes.data()), header.sceneSize);
+    file.write(zeros, header.primitivesOffset - (header.sceneOffset + header.sceneSize));
+    file.write(reinterpret_cast<const char*>(primSerialiser.bytes.data()), header.primitivesSize);
+    if (!file) {
+      throw std::runtime_error("Failed writing scene cache file: '" + tmpPath + "'");
+    }
+  }
+
+  if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+    std::remove(tmpPath.c_str());
+    throw std::runtime_error("Could not rename scene cache file to '" + path + "'");
+  }
+
+  ipu_utils::logger()->info("Saved scene cache '{}' ({} KiB)", path,
+                            (header.primitivesOffset + header.primitivesSize) / 1024.f);
+}
+
+std::unique_ptr<SceneCache> SceneCache::load(const std::string& path, std::uint64_t key) {
+  ipu_utils::TraceScope traceScope("load_scene_cache");
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    ipu_utils::logger()->debug("No scene cache found at '{}'", path);
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (std::size_t)st.st_size < sizeof(CacheHeader)) {
+    close(fd);
+    ipu_utils::logger()->warn("Ignoring invalid scene cache '{}'", path);
+    return nullptr;
+  }
+
+  // The mapping is private and writable so that render parameters can be
+  // updated without ever writing back to the file:
+  const std::size_t size = st.st_size;
+  void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    throw std::runtime_error("Could not memory map scene cache: '" + path + "'");
+  }
+
+  std::unique_ptr<SceneCache> cache(new SceneCache());
+  cache->bytes = static_cast<std::uint8_t*>(mapped);
+  cache->mappedSize = size;
+
+  CacheHeader header;
+  std::memcpy(&header, cache->bytes, sizeof(header));
+  if (std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 ||
+      header.version != cacheVersion || header.headerSize != sizeof(CacheHeader)) {
+    ipu_utils::logger()->warn("Ignoring scene cache '{}' written by a different version", path);
+    return nullptr;
+  }
+  if (header.triangleSize != sizeof(Triangle)) {
+    ipu_utils::logger()->warn("Ignoring scene cache '{}' written with a different triangle index width", path);
+    return nullptr;
+  }
+  if (header.key != key) {
+    ipu_utils::logger()->info("Scene cache '{}' is stale (key mismatch)", path);
+    return nullptr;
+  }
+  if (header.sceneOffset % sectionAlign || header.primitivesOffset % sectionAlign ||
+      header.paramsOffset > header.sceneSize ||
+      header.sceneOffset + header.sceneSize > size ||
+      header.primitivesOffset + header.primitivesSize > size) {
+    ipu_utils::logger()->warn("Ignoring corrupt scene cache '{}'", path);
+    return nullptr;
+  }
+
+  cache->sceneOffset = header.sceneOffset;
+  cache->sceneSize = header.sceneSize;
+  cache->paramsOffset = header.paramsOffset;
+  cache->horizontalFov = header.horizontalFov;
+
+  // The scene's arrays reference the mapped bytes directly:
+  Deserialiser<16> d(cache->bytes + header.sceneOffset, header.sceneSize);
+  d >> cache->scene;
+
+  // Primitives contain a vtable so they are reconstructed from their data:
+  Deserialiser<16> p(cache->bytes + header.primitivesOffset, header.primitivesSize);
+  std::uint32_t count;
+  p >> count;
+  cache->spheres.reserve(count);
+  for (auto i = 0u; i < count; ++i) {
+    float x, y, z, radius;
+    p >> x >> y >> z >> radius;
+    cache->spheres.emplace_back(embree_utils::Vec3fa(x, y, z), radius);
+  }
+  p >> count;
+  cache->discs.reserve(count);
+  for (auto i = 0u; i < count; ++i) {
+    float cx, cy, cz, r, nx, ny, nz;
+    p >> cx >> cy >> cz >> r >> nx >> ny >> nz;
+    cache->discs.emplace_back(embree_utils::Vec3fa(nx, ny, nz), embree_utils::Vec3fa(cx, cy, cz), r);
+  }
+
+  ipu_utils::logger()->info("Loaded scene cache '{}' ({} KiB)", path, size / 1024.f);
+  return cache;
+}
+
+SceneCache::~SceneCache() {
+  if (bytes) {
+    munmap(bytes, mappedSize);
+  }
+}
+
+void SceneCache::setRenderParams(const SceneRef& params) {
+  writeRenderParams<16>(bytes + sceneOffset, paramsOffset, sceneSize - paramsOffset, params);
+
+  // Keep the host side copy consistent with the stream:
+  scene.imageWidth = params.imageWidth;
+  scene.imageHeight = params.imageHeight;
+  scene.fovRadians = params.fovRadians;
+  scene.antiAliasScale = params.antiAliasScale;
+  scene.maxPathLength = params.maxPathLength;
+  scene.rouletteStartDepth = params.rouletteStartDepth;
+  scene.samplesPerPixel = params.samplesPerPixel;
+  scene.rngSeed = params.rngSeed;
+  scene.window = params.window;
+  scene.camera = params.camera;
+  scene.pathTrace = params.pathTrace;
+}
@@ -0,0 +1,275 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+#include <StreamingExr.hpp>
+#include <ipu_utils.hpp>
+
+#include <Eigen/Core>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+constexpr std::int32_t exrMagic = 20000630;
+constexpr std::int32_t exrVersion = 2;
+constexpr std::int32_t exrTiledFlag = 0x200; // Single part tiled file
+constexpr std::int32_t exrMultipartFlag = 0x1000;
+
+template <class T>
+void append(std::vector<char>& out, const T& value) {
+  const auto* bytes = reinterpret_cast<const char*>(&value);
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+void appendString(std::vector<char>& out, const std::string& s) {
+  out.insert(out.end(), s.begin(), s.end());
+  out.push_back('\0');
+}
+
+// Attributes are a name, a type name, the size of the value and then the value:
+void appendAttribute(std::vector<char>& out, const std::string& name, const std::string& type, const std::vector<char>& value) {
+  appendString(out, name);
+  appendString(out, type);
+  append(out, std::int32_t(value.size()));
+  out.insert(out.end(), value.begin(), value.end());
+}
+
+template <class... Ts>
+std::vector<char> pack(const Ts&... values) {
+  std::vector<char> out;
+  (append(out, values), ...);
+  return out;
+}
+
+// Channel names have to be in alphabetical order so RGB is stored as BGR:
+constexpr char channelNames[3] = {'B', 'G', 'R'};
+constexpr std::uint32_t channelIndex[3] = {2, 1, 0};
+
+std::vector<char> makeHeader(const std::string& partName, bool multipart, std::int32_t numChunks,
+                             std::uint32_t width, std::uint32_t height, std::uint32_t tileSize,
+                             StreamingExr::PixelType type) {
+  std::vector<char> channels;
+  for (auto c : channelNames) {
+    appendString(channels, std::string(1, c));
+    append(channels, std::int32_t(type));
+    append(channels, std::uint32_t(0)); // pLinear and reserved bytes
+    append(channels, std::int32_t(1)); // x and y sampling
+    append(channels, std::int32_t(1));
+  }
+  channels.push_back('\0');
+
+  const auto box = pack(std::int32_t(0), std::int32_t(0), std::int32_t(width - 1), std::int32_t(height - 1));
+  std::vector<char> header;
+  appendAttribute(header, "channels", "chlist", channels);
+  appendAttribute(header, "compression", "compression", {0}); // NO_COMPRESSION
+  appendAttribute(header, "dataWindow", "box2i", box);
+  appendAttribute(header, "displayWindow", "box2i", box);
+  appendAttribute(header, "lineOrder", "lineOrder", {2}); // RANDOM_Y (tiles are written in any order)
+  appendAttribute(header, "pixelAspectRatio", "float", pack(1.f));
+  appendAttribute(header, "screenWindowCenter", "v2f", pack(0.f, 0.f));
+  appendAttribute(header, "screenWindowWidth", "float", pack(1.f));
+  auto tiles = pack(tileSize, tileSize);
+  tiles.push_back(0); // ONE_LEVEL
+  appendAttribute(header, "tiles", "tiledesc", tiles);
+  if (multipart) {
+    appendAttribute(header, "name", "string", std::vector<char>(partName.begin(), partName.end()));
+    const std::string partType = "tiledimage";
+    appendAttribute(header, "type", "string", std::vector<char>(partType.begin(), partType.end()));
+    appendAttribute(header, "chunkCount", "int", pack(numChunks));
+  }
+  header.push_back('\0');
+  return header;
+}
+
+} // end anonymous namespace
+
+StreamingExr::StreamingExr(const std::string& _path, std::uint32_t _width, std::uint32_t _height, const CropWindow& window,
+                           std::vector<Part> _parts, PixelType _type, std::uint32_t _tileSize)
+  : path(_path),
+    width(_width),
+    height(_height),
+    parts(std::move(_parts)),
+    type(_type),
+    tileSize(_tileSize),
+    tilesX((_width + _tileSize - 1) / _tileSize),
+    tilesY((_height + _tileSize - 1) / _tileSize),
+    tileExpected(tilesX * tilesY, 0u),
+    tileReceived(tilesX * tilesY),
+    tileWritten(tilesX * tilesY),
+    tileDirty(tilesX * tilesY),
+    tileOffsets(parts.size(), std::vector<std::uint64_t>(tilesX * tilesY, 0u)),
+    tilesStreamed(0),
+    finished(false)
+{
+  if (parts.empty() || width == 0 || height == 0 || tileSize == 0) {
+    throw std::invalid_argument("Streamed EXR images need at least one part and a non-zero size.");
+  }
+
+  pixels.resize(parts.size());
+  for (auto& p : pixels) {
+    p.assign(std::size_t(width) * height * 3, 0.f);
+  }
+
+  // Count the window's pixels in each tile so that completed tiles can be detected:
+  const auto r0 = std::max(window.r, 0);
+  const auto c0 = std::max(window.c, 0);
+  const auto r1 = std::min<std::int32_t>(window.r + window.h, height);
+  const auto c1 = std::min<std::int32_t>(window.c + window.w, width);
+  for (auto r = r0; r < r1; ++r) {
+    for (auto c = c0; c < c1; ++c) {
+      tileExpected[(r / tileSize) * tilesX + c / tileSize] += 1;
+    }
+  }
+
+  file.open(path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    throw std::runtime_error("Could not open '" + path + "' for writing.");
+  }
+
+  const bool multipart = parts.size() > 1;
+  std::vector<char> start;
+  append(start, exrMagic);
+  append(start, exrVersion | (multipart ? exrMultipartFlag : exrTiledFlag));
+  for (const auto& p : parts) {
+    const auto header = makeHeader(p.name, multipart, getNumTiles(), width, height, tileSize, type);
+    start.insert(start.end(), header.begin(), header.end());
+  }
+  if (multipart) {
+    start.push_back('\0'); // An empty header ends the list
+  }
+  offsetTablePos = start.size();
+  // The offsets are written by finish():
+  start.resize(start.size() + parts.size() * getNumTiles() * sizeof(std::uint64_t), 0);
+  file.write(start.data(), start.size());
+  fileEnd = start.size();
+
+  // Tiles that are entirely outside the window are already complete:
+  for (auto t = 0u; t < getNumTiles(); ++t) {
+    if (tileExpected[t] == 0) {
+      writeTile(t);
+    }
+  }
+}
+
+StreamingExr::~StreamingExr() {
+  try {
+    finish();
+  } catch (const std::exception& e) {
+    ipu_utils::logger()->error("{}", e.what());
+  }
+}
+
+void StreamingExr::add(std::span<const embree_utils::TraceResult> batch) {
+  ipu_utils::TraceScope traceScope("stream_exr");
+  #pragma omp parallel for schedule(static)
+  for (std::size_t i = 0; i < batch.size(); ++i) {
+    const auto& r = batch[i];
+    if (!(r.p.u >= 0.f && r.p.u < height && r.p.v >= 0.f && r.p.v < width)) {
+      continue;
+    }
+    const std::uint32_t row = r.p.u;
+    const std::uint32_t col = r.p.v;
+    const auto pixel = 3 * (std::size_t(row) * width + col);
+    for (auto p = 0u; p < parts.size(); ++p) {
+      const auto v = parts[p].value(r);
+      for (auto c = 0u; c < 3; ++c) {
+        std::atomic_ref<float>(pixels[p][pixel + c]).store(v[c], std::memory_order_relaxed);
+      }
+    }
+
+    // The result that completes a tile writes it (the ordering makes every
+    // other pixel of the tile visible to that thread):
+    const auto tile = (row / tileSize) * tilesX + col / tileSize;
+    const auto received = tileReceived[tile].fetch_add(1, std::memory_order_acq_rel) + 1;
+    if (received == tileExpected[tile]) {
+      writeTile(tile);
+      tilesStreamed += 1;
+    } else if (received > tileExpected[tile]) {
+      tileDirty[tile].store(true, std::memory_order_relaxed);
+    }
+  }
+}
+
+void StreamingExr::finish() {
+  if (finished) {
+    return;
+  }
+  ipu_utils::TraceScope traceScope("write_image");
+  std::size_t remaining = 0;
+  for (auto t = 0u; t < getNumTiles(); ++t) {
+    if (!tileWritten[t] || tileDirty[t]) {
+      writeTile(t);
+      remaining += 1;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(fileMutex);
+  finished = true;
+  file.seekp(offsetTablePos);
+  for (const auto& offsets : tileOffsets) {
+    file.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(std::uint64_t));
+  }
+  file.close();
+  if (!file) {
+    throw std::runtime_error("Failed to write '" + path + "'.");
+  }
+  ipu_utils::logger()->info("Saved '{}': {} of {} tiles were written during the render ({} at the end)",
+                            path, tilesStreamed.load(), getNumTiles(), remaining);
+}
+
+void StreamingExr::writeTile(std::size_t tile) {
+  // Tiles at the right and bottom edges are cropped to the image:
+  const auto tx = std::uint32_t(tile % tilesX);
+  const auto ty = std::uint32_t(tile / tilesX);
+  const auto x0 = tx * tileSize;
+  const auto y0 = ty * tileSize;
+  const auto w = std::min(tileSize, width - x0);
+  const auto h = std::min(tileSize, height - y0);
+  const bool multipart = parts.size() > 1;
+  // Results received from now on mark the tile to be written again:
+  tileDirty[tile].store(false, std::memory_order_relaxed);
+  const std::size_t valueSize = type == PixelType::HALF ? sizeof(Eigen::half) : sizeof(float);
+
+  // Each part gets its own chunk: the tile's scanlines with the channels of each line in turn:
+  std::vector<std::vector<char>> chunks(parts.size());
+  for (auto p = 0u; p < parts.size(); ++p) {
+    auto& chunk = chunks[p];
+    const auto dataSize = std::int32_t(w * h * 3 * valueSize);
+    chunk.reserve(6 * sizeof(std::int32_t) + dataSize);
+    if (multipart) {
+      append(chunk, std::int32_t(p));
+    }
+    append(chunk, std::int32_t(tx));
+    append(chunk, std::int32_t(ty));
+    append(chunk, std::int32_t(0)); // Level
+    append(chunk, std::int32_t(0));
+    append(chunk, dataSize);
+    for (auto y = y0; y < y0 + h; ++y) {
+      for (auto c : channelIndex) {
+        for (auto x = x0; x < x0 + w; ++x) {
+          const float v = std::atomic_ref<float>(pixels[p][3 * (std::size_t(y) * width + x) + c]).load(std::memory_order_relaxed);
+          if (type == PixelType::HALF) {
+            append(chunk, Eigen::half(v));
+          } else {
+            append(chunk, v);
+          }
+        }
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(fileMutex);
+  if (finished) {
+    ipu_utils::logger()->warn("Ignoring results received after '{}' was saved", path);
+    return;
+  }
+  // A rewritten tile is appended and its offset replaces the old one:
+  file.seekp(fileEnd);
+  for (auto p = 0u; p < parts.size(); ++p) {
+    tileOffsets[p][tile] = fileEnd;
+    file.write(chunks[p].data(), chunks[p].size());
+    fileEnd += chunks[p].size();
+  }
+  tileWritten[tile] = true;
+}
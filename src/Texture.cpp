@@ -0,0 +1,143 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+#include <Texture.hpp>
+
+#include <limits>
+#include <stdexcept>
+
+namespace {
+
+std::uint16_t encodeRgb565(const embree_utils::Vec3fa& c) {
+  auto quantise = [](float v, std::uint32_t max) {
+    return std::uint32_t(std::min(std::max(v, 0.f), 1.f) * max + .5f);
+  };
+  return std::uint16_t(quantise(c.x, 31) << 11 | quantise(c.y, 63) << 5 | quantise(c.z, 31));
+}
+
+// Box filter a level to half its size (odd edges repeat their last texel):
+std::vector<float> downsample(const std::vector<float>& src, std::uint32_t w, std::uint32_t h) {
+  const auto dw = std::max(w / 2, 1u);
+  const auto dh = std::max(h / 2, 1u);
+  std::vector<float> dst(3 * dw * dh);
+  for (auto y = 0u; y < dh; ++y) {
+    for (auto x = 0u; x < dw; ++x) {
+      const std::uint32_t xs[2] = {std::min(2 * x, w - 1), std::min(2 * x + 1, w - 1)};
+      const std::uint32_t ys[2] = {std::min(2 * y, h - 1), std::min(2 * y + 1, h - 1)};
+      for (auto c = 0u; c < 3; ++c) {
+        float sum = 0.f;
+        for (auto sy : ys) {
+          for (auto sx : xs) {
+            sum += src[3 * (sy * w + sx) + c];
+          }
+        }
+        dst[3 * (y * dw + x) + c] = sum * .25f;
+      }
+    }
+  }
+  return dst;
+}
+
+} // end anonymous namespace
+
+Bc1Block encodeBc1Block(const embree_utils::Vec3fa (&texels)[16]) {
+  embree_utils::Vec3fa lo(1.f, 1.f, 1.f);
+  embree_utils::Vec3fa hi(0.f, 0.f, 0.f);
+  embree_utils::Vec3fa mean(0.f, 0.f, 0.f);
+  for (const auto& t : texels) {
+    for (auto c = 0u; c < 3; ++c) {
+      lo[c] = std::min(lo[c], t[c]);
+      hi[c] = std::max(hi[c], t[c]);
+    }
+    mean += t;
+  }
+  mean = mean * (1.f / 16.f);
+
+  // Use the diagonal of the bounding box that follows the texels: channels that
+  // vary against the one with the largest range have their extremes swapped:
+  const auto range = hi - lo;
+  const auto major = range.x >= range.y && range.x >= range.z ? 0u : (range.y >= range.z ? 1u : 2u);
+  for (auto c = 0u; c < 3; ++c) {
+    float covariance = 0.f;
+    for (const auto& t : texels) {
+      covariance += (t[major] - mean[major]) * (t[c] - mean[c]);
+    }
+    if (covariance < 0.f) {
+      std::swap(lo[c], hi[c]);
+    }
+  }
+
+  Bc1Block block;
+  block.c0 = encodeRgb565(hi);
+  block.c1 = encodeRgb565(lo);
+  block.indices = 0u;
+  if (block.c0 == block.c1) {
+    return block; // Every texel is the first end point
+  }
+  if (block.c0 < block.c1) {
+    std::swap(block.c0, block.c1); // Four colour mode
+  }
+
+  // Each texel picks the nearest of the colours the decoder produces:
+  embree_utils::Vec3fa palette[4];
+  for (auto i = 0u; i < 4; ++i) {
+    palette[i] = decodeBc1Texel(Bc1Block{block.c0, block.c1, i}, 0, 0);
+  }
+  for (auto i = 0u; i < 16; ++i) {
+    auto best = 0u;
+    auto bestDistance = std::numeric_limits<float>::infinity();
+    for (auto p = 0u; p < 4; ++p) {
+      const auto d = (texels[i] - palette[p]).squaredNorm();
+      if (d < bestDistance) {
+        bestDistance = d;
+        best = p;
+      }
+    }
+    block.indices |= best << (2 * i);
+  }
+  return block;
+}
+
+TextureInfo compressTexture(const std::vector<float>& rgb, std::uint32_t width, std::uint32_t height,
+                            std::vector<Bc1Block>& blocks, std::uint32_t maxSize) {
+  if (width == 0 || height == 0 || rgb.size() != 3 * std::size_t(width) * height) {
+    throw std::invalid_argument("Texture data must have three components for every texel.");
+  }
+
+  TextureInfo info{width, height, 0u, std::uint32_t(blocks.size())};
+  auto level = rgb;
+  for (;;) {
+    const auto w = mipSize(info.width, info.numLevels);
+    const auto h = mipSize(info.height, info.numLevels);
+    if (maxSize && (w > maxSize || h > maxSize)) {
+      // Levels that are too large are skipped (the texture starts at a smaller level):
+      level = downsample(level, w, h);
+      info.width = std::max(w / 2, 1u);
+      info.height = std::max(h / 2, 1u);
+      continue;
+    }
+
+    const auto bw = blocksAcross(w);
+    const auto bh = blocksAcross(h);
+    const auto first = blocks.size();
+    blocks.resize(first + bw * bh);
+    #pragma omp parallel for schedule(static)
+    for (auto b = 0u; b < bw * bh; ++b) {
+      // Blocks that overhang the level repeat its edge texels:
+      embree_utils::Vec3fa texels[16];
+      for (auto i = 0u; i < 16; ++i) {
+        const auto x = std::min(4 * (b % bw) + i % 4, w - 1);
+        const auto y = std::min(4 * (b / bw) + i / 4, h - 1);
+        const auto* t = &level[3 * (std::size_t(y) * w + x)];
+        texels[i] = embree_utils::Vec3fa(t[0], t[1], t[2]);
+      }
+      blocks[first + b] = encodeBc1Block(texels);
+    }
+
+    info.numLevels += 1;
+    if (w == 1 && h == 1) {
+      break;
+    }
+    level = downsample(level, w, h);
+  }
+  return info;
+}
@@ -6,59 +6,105 @@
 #include <Scene.hpp>
 #include <Mesh.hpp>
 #include <xoshiro.hpp>
+#include <SceneCache.hpp>
+#include <Denoiser.hpp>
+#include <geometric_sampling.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <regex>
 #include <optional>
 #include <cstdlib>
 #include <iostream>
+#include <iomanip>
+#include <sstream>
 #include <chrono>
 #include <functional>
 #include <vector>
 #include <random>
-
-void initPerspectiveRayStream(std::vector<embree_utils::TraceResult>& rayStream,
-                              const cv::Mat& image,
-                              const SceneRef& data,
-                              xoshiro::Generator* gen) {
-  const auto rayOrigin = embree_utils::Vec3fa(0, 0, 0);
+#include <limits>
+#include <unordered_map>
+
+// Initialise camera rays offset from their pixel coords by jitter(i, r, c, pu, pv):
+template <class Jitter>
+void initJitteredRays(RayStream& rayStream,
+                      const std::uint32_t* indices, std::size_t count,
+                      const cv::Mat& image,
+                      const SceneRef& data,
+                      Jitter&& jitter) {
+  const auto rayOrigin = data.camera.point(embree_utils::Vec3fa(0, 0, 0));
 
   // Do trig outside of loop:
   float s, c;
   sincos(data.fovRadians / 2.f, s, c);
   const auto fovTanTheta = s / c;
 
-  std::normal_distribution<float> d{0.f, data.antiAliasScale};
+  for (auto i = 0u; i < count; ++i) {
+    const auto index = indices ? indices[i] : i;
+    const std::uint32_t r = data.window.r + index / data.window.w;
+    const std::uint32_t c = data.window.c + index % data.window.w;
+    float pu = r;
+    float pv = c;
+    jitter(i, r, c, pu, pv);
+    const auto rayDir = pixelToRayDir(pv, pu, image.cols, image.rows, fovTanTheta);
+    rayStream[index].h = embree_utils::HitRecord(rayOrigin, data.camera.vector(rayDir));
+    rayStream[index].p = embree_utils::PixelCoord{r, c};
+  }
+}
 
-  auto i = 0u;
-  for (std::uint32_t r = data.window.r; r < data.window.r + data.window.h; ++r) {
-    for (std::uint32_t c = data.window.c; c < data.window.c + data.window.w; ++c) {
-      float pu = r;
-      float pv = c;
+void initPerspectiveRays(RayStream& rayStream,
+                         const std::uint32_t* indices, std::size_t count,
+                         const cv::Mat& image,
+                         const SceneRef& data,
+                         xoshiro::Generator* gen) {
+  std::normal_distribution<float> d{0.f, data.antiAliasScale};
+  initJitteredRays(rayStream, indices, count, image, data,
+    [&](std::size_t, std::uint32_t, std::uint32_t, float& pu, float& pv) {
       if (gen) {
         pu += d(*gen);
         pv += d(*gen);
       }
-      const auto rayDir = pixelToRayDir(pv, pu, image.cols, image.rows, fovTanTheta);
-      rayStream[i].h = embree_utils::HitRecord(rayOrigin, rayDir);
-      rayStream[i].p = embree_utils::PixelCoord{r, c};
-      i += 1;
-    }
-  }
+    });
+}
+
+void initPerspectiveRays(RayStream& rayStream,
+                         const std::uint32_t* indices, std::size_t count,
+                         const cv::Mat& image,
+                         const SceneRef& data,
+                         std::uint32_t sampleIndex, std::uint32_t seed,
+                         SobolSampler* samplers) {
+  initJitteredRays(rayStream, indices, count, image, data,
+    [&](std::size_t i, std::uint32_t r, std::uint32_t c, float& pu, float& pv) {
+      // Pixels are indexed in the same way as on the IPU:
+      samplers[i] = SobolSampler(r * std::uint32_t(image.cols) + c, sampleIndex, seed);
+      const float u1 = samplers[i].uniform_0_1();
+      const float u2 = samplers[i].uniform_0_1();
+      const auto [g1, g2] = sampleGaussian2d(u1, u2);
+      pu += data.antiAliasScale * g1;
+      pv += data.antiAliasScale * g2;
+    });
+}
+
+void initPerspectiveRayStream(RayStream& rayStream,
+                              const cv::Mat& image,
+                              const SceneRef& data,
+                              xoshiro::Generator* gen) {
+  initPerspectiveRays(rayStream, nullptr, rayStream.size(), image, data, gen);
 }
 
-void zeroRgb(std::vector<embree_utils::TraceResult>& rayStream) {
+void zeroRgb(RayStream& rayStream) {
   for (auto& r : rayStream) {
     r.rgb = embree_utils::Vec3fa(0, 0, 0);
   }
 }
 
-void scaleRgb(std::vector<embree_utils::TraceResult>& rayStream, float scale) {
+void scaleRgb(RayStream& rayStream, float scale) {
   for (auto& r : rayStream) {
     r.rgb *= scale;
   }
 }
 
-unsigned visualiseHits(const std::vector<embree_utils::TraceResult>& rayStream, const SceneRef& data, cv::Mat& image, VisualiseMode mode) {
+unsigned visualiseHits(const RayStream& rayStream, const SceneRef& data, cv::Mat& image, VisualiseMode mode) {
   // Note: Remember OpenCV is BGR by default when modifying these functions:
   auto rgbFunc = [&](const embree_utils::TraceResult& tr) {
     return cv::Vec3f(tr.rgb.z, tr.rgb.y, tr.rgb.x);
@@ -103,8 +149,29 @@ unsigned visualiseHits(const std::vector<embree_utils::TraceResult>& rayStream,
     return cv::Vec3f(hit.r.origin.z, hit.r.origin.y, hit.r.origin.x);
   };
 
+  // Traversal statistics are stored in the hit records by TraversalStats::store():
+  auto statFunc = [mode](const embree_utils::TraceResult& tr) {
+    switch (mode) {
+      case BVH_NODES: return tr.h.throughput.x;
+      case PRIM_TESTS: return tr.h.throughput.y;
+      case BOUNCES: return tr.h.throughput.z;
+      default: return tr.h.r.tMin;
+    }
+  };
+  float statMax = 0.f;
+  if (isTraversalStatsMode(mode)) {
+    for (const auto& tr : rayStream) {
+      statMax = std::max(statMax, statFunc(tr));
+    }
+  }
+  // Blue (least work) through green to red (most work in the image):
+  auto heatFunc = [&](const embree_utils::TraceResult& tr) {
+    const auto t = statMax > 0.f ? statFunc(tr) / statMax : 0.f;
+    return cv::Vec3f(std::clamp(1.f - 2.f * t, 0.f, 1.f), 1.f - std::abs(2.f * t - 1.f), std::clamp(2.f * t - 1.f, 0.f, 1.f));
+  };
+
   std::function<cv::Vec3f(const embree_utils::TraceResult&)> visFunc[] = {
-    rgbFunc, primFunc, normalFunc, tfarFunc, colFunc, hpFunc
+    rgbFunc, primFunc, normalFunc, tfarFunc, colFunc, hpFunc, heatFunc, heatFunc, heatFunc, heatFunc
   };
 
   ipu_utils::logger()->trace("Visualise start");
@@ -126,6 +193,30 @@ unsigned visualiseHits(const std::vector<embree_utils::TraceResult>& rayStream,
   return hitCount;
 }
 
+cv::Mat denoiseImage(const cv::Mat& image, const RayStream& rayStream) {
+  ipu_utils::TraceScope traceScope("denoise");
+  // Pixels outside the render window have zero AOVs (in OpenCV's BGR order like the image):
+  cv::Mat albedo = cv::Mat::zeros(image.rows, image.cols, CV_32FC3);
+  cv::Mat normal = cv::Mat::zeros(image.rows, image.cols, CV_32FC3);
+  for (const auto& r : rayStream) {
+    const auto& a = r.h.throughput;
+    const auto& n = r.h.normal;
+    albedo.at<cv::Vec3f>(r.p.u, r.p.v) = cv::Vec3f(a.z, a.y, a.x);
+    normal.at<cv::Vec3f>(r.p.u, r.p.v) = cv::Vec3f(n.z, n.y, n.x);
+  }
+
+  const cv::Mat rgb = image.isContinuous() ? image : image.clone();
+  cv::Mat denoised(image.rows, image.cols, CV_32FC3);
+  denoiseImage(rgb.ptr<float>(), albedo.ptr<float>(), normal.ptr<float>(), image.cols, image.rows,
+               denoised.ptr<float>());
+  return denoised;
+}
+
+void saveImage(const std::string& fileName, const cv::Mat& image) {
+  ipu_utils::TraceScope traceScope("write_image");
+  cv::imwrite(fileName, image);
+}
+
 const Primitive* getPrimitive(GeomRef geom, const SceneDescription& scene) {
   switch (geom.type) {
     case GeomType::Mesh:
@@ -137,53 +228,48 @@ const Primitive* getPrimitive(GeomRef geom, const SceneDescription& scene) {
     case GeomType::Disc:
       return &scene.discs[geom.index];
     break;
+    case GeomType::Instance:
+      return &scene.instancePrims[geom.index];
+    break;
   }
 
   throw std::logic_error("Invalid GeomRef.");
 }
 
-std::vector<RTCBuildPrimitive> makeBuildPrimitivesForEmbree(const SceneData& data, const SceneDescription& scene) {
-  // Make duplicates of primitives for Embree custom BVH build.
-  // Embree only needs to know the bounds and IDs:
-  embree_utils::Bounds3d extent;
-  std::vector<RTCBuildPrimitive> buildPrimitives;
+LeafBoundsFn makeLeafBoundsFn(const SceneData& data, const SceneDescription& scene) {
+  return [&data, &scene](std::uint32_t geomID, std::uint32_t firstPrim, std::uint32_t primCount) {
+    auto* p = getPrimitive(data.geometry.at(geomID), scene);
+    if (auto* tri = dynamic_cast<const HostTriangleMesh*>(p)) {
+      embree_utils::Bounds3d bounds;
+      for (auto pid = firstPrim; pid < firstPrim + primCount; ++pid) {
+        bounds += tri->getTriangleBoundingBox(pid);
+      }
+      return bounds;
+    }
+    return p->getBoundingBox();
+  };
+}
+
+std::vector<BuildPrimitive> makeBuildPrimitives(const SceneData& data, const SceneDescription& scene) {
+  // Make duplicates of primitives for the BVH build.
+  // The build only needs to know the bounds and IDs:
+  std::vector<BuildPrimitive> buildPrimitives;
   buildPrimitives.reserve(data.geometry.size());
-  bool separateTriangles = true;
   for (auto i = 0u; i < data.geometry.size(); ++i) {
-    RTCBuildPrimitive bp;
-    bp.geomID = i; // Note: Geometry creation ordering must match this indexing.
-
     auto* p = getPrimitive(data.geometry[i], scene);
-    const auto bbox = p->getBoundingBox();
-    extent += bbox;
 
-    const HostTriangleMesh* tri = nullptr;
-    if (separateTriangles && (tri = dynamic_cast<const HostTriangleMesh*>(p))) {
+    // Note: Geometry creation ordering must match this indexing.
+    if (auto* tri = dynamic_cast<const HostTriangleMesh*>(p)) {
       // Special handling for triangle meshes.
-      // Individual trianglea are recorded as separate primitives:
+      // Individual triangles are recorded as separate primitives:
       for (auto pid = 0u; pid < tri->triangles.size(); ++pid) {
-        const auto triBounds = tri->getTriangleBoundingBox(pid);
-        bp.lower_x = triBounds.min.x;
-        bp.lower_y = triBounds.min.y;
-        bp.lower_z = triBounds.min.z;
-        bp.upper_x = triBounds.max.x;
-        bp.upper_y = triBounds.max.y;
-        bp.upper_z = triBounds.max.z;
-        bp.primID = pid;
-        buildPrimitives.push_back(bp);
+        buildPrimitives.push_back(BuildPrimitive{tri->getTriangleBoundingBox(pid), i, pid});
       }
     } else {
-      bp.lower_x = bbox.min.x;
-      bp.lower_y = bbox.min.y;
-      bp.lower_z = bbox.min.z;
-      bp.upper_x = bbox.max.x;
-      bp.upper_y = bbox.max.y;
-      bp.upper_z = bbox.max.z;
-      bp.primID = 0;
-      buildPrimitives.push_back(bp);
+      buildPrimitives.push_back(BuildPrimitive{p->getBoundingBox(), i, 0});
     }
   }
-  
+
   return buildPrimitives;
 }
 
@@ -239,6 +325,7 @@ std::unique_ptr<PathTraceSettings> makePathTraceSettings(const boost::program_op
   settings->maxPathLength = args["max-path-length"].as<std::uint32_t>();
   settings->roulletteStartDepth = args["roulette-start-depth"].as<std::uint32_t>();
   settings->samplesPerPixel = args["samples"].as<std::uint32_t>();
+  settings->lowDiscrepancy = args["low-discrepancy"].as<bool>();
   if (args.at("visualise").as<std::string>() != "rgb") {
     throw std::runtime_error("Running path-tracing without visualise=rgb is not advised.");
   }
@@ -249,18 +336,28 @@ std::unique_ptr<PathTraceSettings> makePathTraceSettings(const boost::program_op
 // This is a high level description (i.e. in case of loading
 // from file the scne is imported into data structures that
 // mirror the file import format).
+// Mesh file used by the scene that args select (empty if the scene has no mesh file):
+std::string selectedMeshFile(const boost::program_options::variables_map& args) {
+  auto meshFile = args["mesh-file"].as<std::string>();
+  const auto sceneSelection = args["scene"].as<std::string>();
+  if (meshFile.empty() && (sceneSelection == "box-simple" || sceneSelection == "box")) {
+    // For the Cornell box scene we optionally need a meshfile that is
+    // rendered using one of the boxes as a plinth:
+    meshFile = "../assets/monkey_bust.glb";
+  }
+  return meshFile;
+}
+
 SceneDescription buildSceneDescription(const boost::program_options::variables_map& args) {
+  ipu_utils::TraceScope traceScope("import_scene");
   // Create the high level scene description:
-  auto meshFile = args["mesh-file"].as<std::string>();
+  const auto meshFile = selectedMeshFile(args);
 
   SceneDescription scene;
-  if (meshFile.empty()) {
+  if (args["mesh-file"].as<std::string>().empty()) {
     // If no meshfile is provided then we use one of the internal scenes.
     const auto sceneSelection = args["scene"].as<std::string>();
     if (sceneSelection == "box-simple" || sceneSelection == "box") {
-      // For the Cornell box scene we optionally need a meshfile that is
-      // rendered using one of the boxes as a plinth:
-      meshFile = "../assets/monkey_bust.glb";
       scene = makeCornellBoxScene(meshFile, sceneSelection == "box-simple");
     } else if (sceneSelection == "spheres") {
       scene = makePrimitiveScene();
@@ -269,7 +366,12 @@ SceneDescription buildSceneDescription(const boost::program_options::variables_m
     }
   } else {
     // Otherwise load only the specified scene:
-    scene = importScene(meshFile, args["load-normals"].as<bool>());
+    scene = importScene(meshFile, args["load-normals"].as<bool>(), args["max-texture-size"].as<std::uint32_t>());
+  }
+
+  if (args["instance-meshes"].as<bool>()) {
+    const auto count = instanceDuplicateMeshes(scene);
+    ipu_utils::logger()->info("Replaced {} duplicated meshes with {} instanced prototypes", count, scene.prototypes.size());
   }
 
   if (args["render-mode"].as<std::string>() == "path-trace") {
@@ -279,6 +381,352 @@ SceneDescription buildSceneDescription(const boost::program_options::variables_m
   return scene;
 }
 
+std::string sceneCachePath(const boost::program_options::variables_map& args, std::uint64_t& key) {
+  const auto cacheDir = args["scene-cache"].as<std::string>();
+  if (cacheDir.empty()) {
+    return cacheDir;
+  }
+
+  // Key on the mesh file's contents (not its name) and the options used to build the scene:
+  const auto meshFile = selectedMeshFile(args);
+  key = meshFile.empty() ? hashBytes(nullptr, 0) : hashFile(meshFile);
+  std::ostringstream options;
+  const bool builtIn = args["mesh-file"].as<std::string>().empty();
+  options << (builtIn ? args["scene"].as<std::string>() : std::string("file"))
+          << args["load-normals"].as<bool>() << args["max-texture-size"].as<std::uint32_t>() << args["instance-meshes"].as<bool>()
+          << args["precompute-triangles"].as<bool>() << args["compact-vertices"].as<bool>()
+          << sizeof(SceneBvhNode) << alignof(SceneBvhNode) << sizeof(InstanceInfo);
+  const auto optionStr = options.str();
+  key = hashBytes(optionStr.data(), optionStr.size(), key);
+
+  std::ostringstream path;
+  path << cacheDir << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".scene";
+  return path.str();
+}
+
+void reorderMeshTriangles(const BvhBuild& bvh, SceneData& data, SceneDescription& scene) {
+  // The build orders primitives so that each leaf's triangles become a
+  // contiguous run so the new triangle order is the build's order:
+  std::vector<std::vector<std::uint32_t>> newOrder(data.geometry.size());
+  for (const auto& p : bvh.prims) {
+    newOrder[p.geomID].push_back(p.primID);
+  }
+
+  for (auto g = 0u; g < data.geometry.size(); ++g) {
+    if (data.geometry[g].type != GeomType::Mesh) { continue; }
+    auto& mesh = scene.meshes[data.geometry[g].index];
+    const auto& order = newOrder[g];
+    if (order.size() != mesh.triangles.size()) {
+      throw std::logic_error("BVH leaves do not reference every mesh triangle.");
+    }
+
+    const auto& info = data.meshInfo[data.geometry[g].index];
+    for (auto t = 0u; t < order.size(); ++t) {
+      data.meshTris[info.firstIndex + t] = mesh.triangles[order[t]];
+    }
+    std::copy(data.meshTris.begin() + info.firstIndex,
+              data.meshTris.begin() + info.firstIndex + info.numTriangles,
+              mesh.triangles.begin());
+  }
+}
+
+// Build the bottom level BVH for a mesh that is referenced by instances. The
+// mesh's triangles are reordered so that every leaf references a contiguous run:
+std::vector<SceneBvhNode> buildMeshBvh(HostTriangleMesh& mesh, std::uint32_t& maxStackSize) {
+  std::vector<BuildPrimitive> buildPrimitives;
+  buildPrimitives.reserve(mesh.triangles.size());
+  for (auto pid = 0u; pid < mesh.triangles.size(); ++pid) {
+    buildPrimitives.push_back(BuildPrimitive{mesh.getTriangleBoundingBox(pid), 0, pid});
+  }
+
+  const auto bvh = buildSahBvh(std::move(buildPrimitives));
+
+  std::vector<Triangle> reordered;
+  reordered.reserve(mesh.triangles.size());
+  for (const auto& p : bvh.prims) {
+    reordered.push_back(mesh.triangles[p.primID]);
+  }
+  mesh.triangles = std::move(reordered);
+
+  return buildCompactBvh4<SceneBvhNode>(bvh.nodes, 0, maxStackSize);
+}
+
+std::vector<SceneShardData> buildSceneShards(const BvhBuild& bvh, const SceneData& data, std::uint32_t numShards) {
+  // Cut the tree by repeatedly splitting the largest sub-tree until there is one per shard:
+  std::vector<std::uint32_t> subtrees = {0};
+  while (subtrees.size() < numShards) {
+    std::int32_t largest = -1;
+    for (auto i = 0u; i < subtrees.size(); ++i) {
+      if (!bvh.nodes[subtrees[i]].isLeaf() &&
+          (largest < 0 || bvh.nodes[subtrees[i]].primCount > bvh.nodes[subtrees[largest]].primCount)) {
+        largest = i;
+      }
+    }
+    if (largest < 0) {
+      throw std::runtime_error("Scene has too few BVH leaves to split into " + std::to_string(numShards) + " shards.");
+    }
+    const auto inner = subtrees[largest];
+    subtrees[largest] = inner + 1;
+    subtrees.push_back(bvh.nodes[inner].secondChild);
+  }
+
+  // Position of every build primitive among the primitives of its own geometry:
+  std::vector<std::uint32_t> geomIndex(bvh.prims.size());
+  std::vector<std::uint32_t> geomCounts(data.geometry.size(), 0u);
+  for (auto p = 0u; p < bvh.prims.size(); ++p) {
+    geomIndex[p] = geomCounts[bvh.prims[p].geomID]++;
+  }
+
+  std::vector<SceneShardData> shards;
+  shards.reserve(subtrees.size());
+  const auto invalidPrim = std::numeric_limits<std::uint32_t>::max();
+  for (auto subtree : subtrees) {
+    shards.emplace_back();
+    auto& shard = shards.back();
+    shard.meshInfo.resize(data.meshInfo.size(), MeshInfo{0, 0, 0, 0});
+    shard.primIDOffsets.resize(data.geometry.size(), 0u);
+
+    // Triangles were reordered to match the build's primitive order and every
+    // sub-tree covers a contiguous range of it so each mesh's triangles in a
+    // sub-tree form a contiguous run:
+    std::vector<std::uint32_t> firstPrim(data.geometry.size(), invalidPrim);
+    std::vector<std::uint32_t> primCount(data.geometry.size(), 0u);
+    const auto& root = bvh.nodes[subtree];
+    for (auto p = root.firstPrim; p < root.firstPrim + root.primCount; ++p) {
+      const auto g = bvh.prims[p].geomID;
+      firstPrim[g] = std::min(firstPrim[g], geomIndex[p]);
+      primCount[g] += 1;
+    }
+
+    for (auto g = 0u; g < data.geometry.size(); ++g) {
+      if (data.geometry[g].type != GeomType::Mesh || primCount[g] == 0) { continue; }
+      const auto& info = data.meshInfo[data.geometry[g].index];
+      auto& localInfo = shard.meshInfo[data.geometry[g].index];
+      localInfo.firstIndex = shard.meshTris.size();
+      localInfo.firstVertex = shard.meshVerts.size();
+      localInfo.numTriangles = primCount[g];
+      shard.primIDOffsets[g] = firstPrim[g];
+
+      // Only copy the vertices the shard's triangles use (re-indexing the triangles to match):
+      std::unordered_map<std::uint32_t, std::uint32_t> localIndex;
+      auto addVertex = [&](std::uint32_t v) {
+        auto [itr, inserted] = localIndex.try_emplace(v, localIndex.size());
+        if (inserted) {
+          shard.meshVerts.push_back(data.meshVerts[info.firstVertex + v]);
+          if (!data.meshNormals.empty()) {
+            shard.meshNormals.push_back(data.meshNormals[info.firstVertex + v]);
+          }
+        }
+        return itr->second;
+      };
+      for (auto t = firstPrim[g]; t < firstPrim[g] + primCount[g]; ++t) {
+        const auto& tri = data.meshTris[info.firstIndex + t];
+        const auto v0 = addVertex(tri.v0);
+        const auto v1 = addVertex(tri.v1);
+        const auto v2 = addVertex(tri.v2);
+        shard.meshTris.emplace_back(v0, v1, v2);
+        if (!data.meshPrecomputed.empty()) {
+          shard.meshPrecomputed.push_back(data.meshPrecomputed[info.firstIndex + t]);
+        }
+      }
+      localInfo.numVertices = localIndex.size();
+    }
+
+    // Instances in the shard need a complete copy of their prototype mesh:
+    for (auto g = 0u; g < data.geometry.size(); ++g) {
+      if (data.geometry[g].type != GeomType::Instance || primCount[g] == 0) { continue; }
+      const auto meshIndex = data.instances[data.geometry[g].index].meshIndex;
+      auto& localInfo = shard.meshInfo[meshIndex];
+      if (localInfo.numTriangles) { continue; } // Already copied for another instance
+      const auto& info = data.meshInfo[meshIndex];
+      localInfo = MeshInfo{
+        (std::uint32_t)shard.meshTris.size(), (std::uint32_t)shard.meshVerts.size(),
+        info.numTriangles, info.numVertices
+      };
+      shard.meshTris.insert(shard.meshTris.end(), data.meshTris.begin() + info.firstIndex,
+                            data.meshTris.begin() + info.firstIndex + info.numTriangles);
+      if (!data.meshPrecomputed.empty()) {
+        shard.meshPrecomputed.insert(shard.meshPrecomputed.end(), data.meshPrecomputed.begin() + info.firstIndex,
+                                     data.meshPrecomputed.begin() + info.firstIndex + info.numTriangles);
+      }
+      shard.meshVerts.insert(shard.meshVerts.end(), data.meshVerts.begin() + info.firstVertex,
+                             data.meshVerts.begin() + info.firstVertex + info.numVertices);
+      if (!data.meshNormals.empty()) {
+        shard.meshNormals.insert(shard.meshNormals.end(), data.meshNormals.begin() + info.firstVertex,
+                                 data.meshNormals.begin() + info.firstVertex + info.numVertices);
+      }
+    }
+
+    // Convert the sub-tree and make its leaves reference the shard's own triangles:
+    shard.bvhNodes = buildCompactBvh4<SceneBvhNode>(bvh.nodes, subtree, shard.bvhMaxDepth);
+    for (auto& node : shard.bvhNodes) {
+      for (auto c = 0u; c < node.childCount; ++c) {
+        if (node.isLeaf(c)) {
+          const auto first = leafFirstPrim(node.child[c]) - shard.primIDOffsets[node.geomID[c]];
+          node.child[c] = packLeafPrims(first, leafPrimCount(node.child[c]));
+        }
+      }
+    }
+
+    ipu_utils::logger()->debug("Scene shard {}: {} BVH nodes, {} triangles, {} vertices",
+                               shards.size() - 1, shard.bvhNodes.size(), shard.meshTris.size(), shard.meshVerts.size());
+  }
+
+  return shards;
+}
+
+void precomputeMeshTriangles(SceneData& data, SceneDescription& scene) {
+  data.meshPrecomputed.clear();
+  data.meshPrecomputed.reserve(data.meshTris.size());
+  for (const auto& info : data.meshInfo) {
+    for (auto t = info.firstIndex; t < info.firstIndex + info.numTriangles; ++t) {
+      const auto& tri = data.meshTris[t];
+      data.meshPrecomputed.push_back(precomputeTriangle(
+        data.meshVerts[info.firstVertex + tri.v0],
+        data.meshVerts[info.firstVertex + tri.v1],
+        data.meshVerts[info.firstVertex + tri.v2]));
+    }
+  }
+
+  // The CPU renderer uses the scene description's meshes (which are stored
+  // in the same order as the mesh info: ordinary meshes then prototypes):
+  auto meshIdx = 0u;
+  auto copyToMesh = [&](HostTriangleMesh& m) {
+    const auto& info = data.meshInfo[meshIdx];
+    m.precomputed.assign(data.meshPrecomputed.begin() + info.firstIndex,
+                         data.meshPrecomputed.begin() + info.firstIndex + info.numTriangles);
+    meshIdx += 1;
+  };
+  for (auto& m : scene.meshes) { copyToMesh(m); }
+  for (auto& m : scene.prototypes) { copyToMesh(m); }
+}
+
+void quantiseMeshVertices(SceneData& data, SceneDescription& scene) {
+  data.meshQuantisation.clear();
+  auto quantise = [&](HostTriangleMesh& m) {
+    embree_utils::Bounds3d bounds;
+    for (const auto& v : m.vertices) {
+      bounds += v;
+    }
+    const auto q = VertexQuantisation::fromBounds(bounds);
+    for (auto& v : m.vertices) {
+      v = q.decode(q.encode(v));
+    }
+    for (auto& n : m.normals) {
+      n = decodeNormal(encodeNormal(n));
+    }
+    data.meshQuantisation.push_back(q);
+  };
+  for (auto& m : scene.meshes) { quantise(m); }
+  for (auto& m : scene.prototypes) { quantise(m); }
+}
+
+std::vector<AreaLight> buildAreaLights(const SceneData& data, const SceneDescription& scene) {
+  std::vector<AreaLight> lights;
+  float power = 0.f;
+  auto addLight = [&](AreaLight light, std::uint32_t geomID, float luminance) {
+    const float area = light.area();
+    if (!(area > 0.f)) {
+      return; // Degenerate lights can never be sampled
+    }
+    power += luminance * area;
+    light.cdf = power;
+    light.geomID = geomID;
+    lights.push_back(light);
+  };
+  auto addTriangles = [&](const HostTriangleMesh& m, const AffineTransform* objectToWorld,
+                          std::uint32_t geomID, float luminance) {
+    for (const auto& t : m.triangles) {
+      auto p0 = m.vertices[t.v0];
+      auto p1 = m.vertices[t.v1];
+      auto p2 = m.vertices[t.v2];
+      if (objectToWorld) {
+        p0 = objectToWorld->point(p0);
+        p1 = objectToWorld->point(p1);
+        p2 = objectToWorld->point(p2);
+      }
+      AreaLight light;
+      light.shape = AreaLight::Shape::Triangle;
+      light.p = p0;
+      light.u = p1 - p0;
+      light.v = p2 - p0;
+      light.radius = 0.f;
+      addLight(light, geomID, luminance);
+    }
+  };
+
+  for (auto geomID = 0u; geomID < data.geometry.size(); ++geomID) {
+    const auto& material = data.materials[data.matIDs[geomID]];
+    if (!material.emissive) {
+      continue;
+    }
+    const float luminance = lightLuminance(material.emission);
+    if (!(luminance > 0.f)) {
+      continue;
+    }
+
+    const auto& geom = data.geometry[geomID];
+    switch (geom.type) {
+      case GeomType::Mesh:
+        addTriangles(scene.meshes[geom.index], nullptr, geomID, luminance);
+        break;
+      case GeomType::Sphere: {
+        const auto& s = scene.spheres[geom.index];
+        AreaLight light;
+        light.shape = AreaLight::Shape::Sphere;
+        light.p = embree_utils::Vec3fa(s.x, s.y, s.z);
+        light.u = embree_utils::Vec3fa(0.f, 0.f, 0.f);
+        light.v = embree_utils::Vec3fa(0.f, 0.f, 0.f);
+        light.radius = s.radius;
+        addLight(light, geomID, luminance);
+      } break;
+      case GeomType::Disc: {
+        const auto& d = scene.discs[geom.index];
+        const auto [tangent, bitangent, normal] = embree_utils::Vec3fa(d.nx, d.ny, d.nz).normalized().orthonormalSystem();
+        AreaLight light;
+        light.shape = AreaLight::Shape::Disc;
+        light.p = embree_utils::Vec3fa(d.cx, d.cy, d.cz);
+        light.u = tangent * d.r;
+        light.v = bitangent * d.r;
+        light.radius = d.r;
+        addLight(light, geomID, luminance);
+      } break;
+      case GeomType::Instance:
+        addTriangles(scene.prototypes[scene.instances[geom.index].prototype],
+                     &data.instances[geom.index].objectToWorld, geomID, luminance);
+        break;
+      default:
+        throw std::logic_error("Invalid GeomRef.");
+    }
+  }
+
+  return lights;
+}
+
+namespace {
+
+// Pack previously quantised vertices (and normals) mesh by mesh then free the full precision arrays:
+void packMeshVertices(const std::vector<MeshInfo>& meshInfo, const std::vector<VertexQuantisation>& quantisation,
+                      std::vector<embree_utils::Vec3fa>& verts, std::vector<embree_utils::Vec3fa>& normals,
+                      std::vector<QuantisedVertex>& packedVerts, std::vector<OctahedralNormal>& packedNormals) {
+  packedVerts.resize(verts.size(), QuantisedVertex{0, 0, 0});
+  for (auto m = 0u; m < meshInfo.size(); ++m) {
+    const auto& info = meshInfo[m];
+    for (auto v = info.firstVertex; v < info.firstVertex + info.numVertices; ++v) {
+      packedVerts[v] = quantisation[m].encode(verts[v]);
+    }
+  }
+  packedNormals.clear();
+  packedNormals.reserve(normals.size());
+  for (const auto& n : normals) {
+    packedNormals.push_back(encodeNormal(n));
+  }
+  verts = std::vector<embree_utils::Vec3fa>();
+  normals = std::vector<embree_utils::Vec3fa>();
+}
+
+} // end anonymous namespace
+
 // Build efficient scene representations for both Embree and our custom CPU/IPU renderers/
 //
 // The scene description needs to be converted into a compact representation
@@ -288,77 +736,176 @@ SceneDescription buildSceneDescription(const boost::program_options::variables_m
 // Note: creation order is important in all cases because geomIDs
 // (Embree concept) are used to retrieve primitives during BVH traversal)
 // Mapping between materials and primitives also depends on a consistent order.
-std::pair<SceneData, embree_utils::EmbreeScene> buildSceneData(const SceneDescription& scene) {
+std::pair<SceneData, embree_utils::EmbreeScene> buildSceneData(SceneDescription& scene, std::uint32_t numShards,
+                                                               bool precomputeTriangles, bool compactVertices) {
+  ipu_utils::TraceScope traceScope("build_scene_data");
   SceneData data;
 
+  // Snap the meshes to their compact representation first so that every
+  // renderer (and the BVH build) sees exactly the same geometry:
+  if (compactVertices) {
+    quantiseMeshVertices(data, scene);
+  }
+
+  // Initialise Embree:
+  embree_utils::EmbreeScene embreeScene;
+
+  // Each instanced (prototype) mesh gets its own bottom level BVH which is
+  // shared by all its instances (building it reorders the mesh's triangles so
+  // this comes before the meshes are copied into the unified arrays):
+  std::vector<InstanceInfo> prototypeInfo;
+  for (auto p = 0u; p < scene.prototypes.size(); ++p) {
+    InstanceInfo info;
+    auto nodes = buildMeshBvh(scene.prototypes[p], info.stackSize);
+    info.meshIndex = scene.meshes.size() + p;
+    info.firstNode = data.blasNodes.size();
+    info.numNodes = nodes.size();
+    data.blasNodes.insert(data.blasNodes.end(), nodes.begin(), nodes.end());
+    prototypeInfo.push_back(info);
+  }
+
   // We need a compact representation for multiple meshes that we can transfer
-  // to the device easily. Append all the triangle buffer indices, vertices,
-  // and normals into unified arrays:
-  data.meshInfo.reserve(scene.meshes.size());
-  for (const auto& m : scene.meshes) {
-    data.meshInfo.emplace_back(
-      MeshInfo{
-        (std::uint32_t)data.meshTris.size(), (std::uint32_t)data.meshVerts.size(),
-        (std::uint32_t)m.triangles.size(), (std::uint32_t)m.vertices.size()
-      }
-    );
+  // to the device easily so all meshes are copied into unified arrays:
+  unifyMeshes(scene, data);
 
-    for (const auto& t : m.triangles) {
-      data.meshTris.push_back(t);
-    }
-    for (const auto& v : m.vertices) {
-      data.meshVerts.push_back(v);
-    }
-    for (const auto& n : m.normals) {
-      data.meshNormals.push_back(n);
+  data.instances.reserve(scene.instances.size());
+  for (const auto& inst : scene.instances) {
+    if (inst.prototype >= prototypeInfo.size()) {
+      throw std::runtime_error("Instance references an invalid prototype mesh.");
     }
+    auto info = prototypeInfo[inst.prototype];
+    info.objectToWorld = inst.objectToWorld;
+    info.worldToObject = inst.objectToWorld.inverse();
+    data.instances.push_back(info);
   }
 
-  // Initialise Embree:
-  embree_utils::EmbreeScene embreeScene;
+  // The CPU instance primitives point into the returned data (the SceneData
+  // is moved out of this function so the pointers stay valid):
+  scene.instancePrims.clear();
+  scene.instancePrims.reserve(scene.instances.size());
+  for (auto i = 0u; i < scene.instances.size(); ++i) {
+    const auto& info = data.instances[i];
+    scene.instancePrims.emplace_back(info, &scene.prototypes[scene.instances[i].prototype], &data.blasNodes[info.firstNode]);
+  }
 
-  // Create both the Embree and custom representations of all primitives:
+  // Create the custom representations of all primitives:
   for (auto i = 0u; i < scene.meshes.size(); ++i) {
-    auto& m = scene.meshes[i];
     data.geometry.emplace_back(i, GeomType::Mesh);
-    embreeScene.addTriMesh(
-      m.vertices,
-      ConstArrayRef<std::uint16_t>::reinterpret(m.triangles.data(), m.triangles.size()));
   }
 
   for (auto i = 0u; i < scene.spheres.size(); ++i) {
-    auto& s = scene.spheres[i];
     data.geometry.emplace_back(i, GeomType::Sphere);
-    embreeScene.addSphere(embree_utils::Vec3fa(s.x, s.y, s.z), s.radius);
   }
 
   for (auto i = 0u; i < scene.discs.size(); ++i) {
-    auto& d = scene.discs[i];
     data.geometry.emplace_back(i, GeomType::Disc);
-    embreeScene.addDisc(embree_utils::Vec3fa(d.cx, d.cy, d.cz), embree_utils::Vec3fa(d.nx, d.ny, d.nz), d.r);
+  }
+
+  for (auto i = 0u; i < scene.instances.size(); ++i) {
+    data.geometry.emplace_back(i, GeomType::Instance);
   }
 
   data.materials = scene.materials;
   data.matIDs = scene.matIDs;
+  for (const auto& m : data.materials) {
+    if (m.albedoTexture != Material::NoTexture && m.albedoTexture >= scene.textures.size()) {
+      throw std::runtime_error("Material references an invalid texture.");
+    }
+  }
+  data.textures = scene.textures;
+  data.texels = scene.texels;
 
   auto bvhStartTime = std::chrono::steady_clock::now();
+  pvti::Tracepoint::begin(ipu_utils::traceChannel(), "build_bvh");
+
+  // Build our own BVH:
+  const auto bvh = buildSahBvh(makeBuildPrimitives(data, scene));
 
-  auto buildPrimitives = makeBuildPrimitivesForEmbree(data, scene);
+  // Leaves hold runs of triangles so the meshes must be reordered to match:
+  reorderMeshTriangles(bvh, data, scene);
+  if (precomputeTriangles) {
+    precomputeMeshTriangles(data, scene);
+  }
 
-  // Build our own BVH (still using Embree to build it):
-  embree_utils::BvhBuilder builder(embreeScene.getDevice());
-  builder.build(buildPrimitives);
-  std::uint32_t maxDepth;
+  // Convert our custom BVH into a compact 4-wide form:
+  data.bvhNodes = buildCompactBvh4<SceneBvhNode>(bvh.nodes, 0, data.bvhMaxDepth);
 
-  // Convert our custom BVH into a compact form (i.e. convert the tree to a linear array):
-  data.bvhNodes = buildCompactBvh(builder.getRoot(), builder.nodeCount(), data.bvhMaxDepth);
-  buildPrimitives.clear(); // Embree is done with this now so free the space
+  // Emissive primitives are also sampled directly as lights:
+  data.lights = buildAreaLights(data, scene);
+
+  // Optionally split the scene so it can be distributed across groups of IPU tiles:
+  if (numShards) {
+    data.shards = buildSceneShards(bvh, data, numShards);
+  }
+
+  if (compactVertices) {
+    for (auto& shard : data.shards) {
+      packMeshVertices(shard.meshInfo, data.meshQuantisation, shard.meshVerts, shard.meshNormals,
+                       shard.meshPackedVerts, shard.meshPackedNormals);
+    }
+    packMeshVertices(data.meshInfo, data.meshQuantisation, data.meshVerts, data.meshNormals,
+                     data.meshPackedVerts, data.meshPackedNormals);
+  }
 
+  pvti::Tracepoint::end(ipu_utils::traceChannel(), "build_bvh");
   auto bvhEndTime = std::chrono::steady_clock::now();
   auto bvhSecs = std::chrono::duration<double>(bvhEndTime - bvhStartTime).count();
 
   ipu_utils::logger()->debug("Compact BVH build time: {} seconds", bvhSecs);
-  ipu_utils::logger()->debug("Max leaf depth in BVH: {}", data.bvhMaxDepth);
+  ipu_utils::logger()->debug("Binary BVH nodes: {} max depth: {}", bvh.nodes.size(), bvh.maxDepth);
+  ipu_utils::logger()->debug("Compact BVH nodes: {} ({} bytes)", data.bvhNodes.size(), data.bvhNodes.size() * sizeof(SceneBvhNode));
+  ipu_utils::logger()->debug("BVH traversal stack size: {}", data.bvhMaxDepth);
+  if (!data.meshPrecomputed.empty()) {
+    ipu_utils::logger()->debug("Precomputed triangles: {} ({} bytes)",
+                               data.meshPrecomputed.size(), data.meshPrecomputed.size() * sizeof(PrecomputedTriangle));
+  }
+  if (!data.meshPackedVerts.empty()) {
+    ipu_utils::logger()->debug("Compact vertices: {} ({} bytes) normals: {} ({} bytes)",
+                               data.meshPackedVerts.size(), data.meshPackedVerts.size() * sizeof(QuantisedVertex),
+                               data.meshPackedNormals.size(), data.meshPackedNormals.size() * sizeof(OctahedralNormal));
+  }
+  if (!data.lights.empty()) {
+    ipu_utils::logger()->debug("Area lights: {} ({} bytes)", data.lights.size(), data.lights.size() * sizeof(AreaLight));
+  }
+  if (!data.textures.empty()) {
+    ipu_utils::logger()->debug("Textures: {} ({} bytes of blocks) texture coordinates: {} ({} bytes)",
+                               data.textures.size(), data.texels.size() * sizeof(Bc1Block),
+                               data.meshUVs.size(), data.meshUVs.size() * sizeof(TexCoord));
+  }
+  if (!data.instances.empty()) {
+    ipu_utils::logger()->debug("Instances: {} of {} prototype meshes ({} bottom level BVH nodes)",
+                               data.instances.size(), scene.prototypes.size(), data.blasNodes.size());
+  }
+
+  // Create the Embree representation of all primitives (after the
+  // reordering so that Embree primIDs match the custom BVH):
+  static_assert(sizeof(Triangle) == 3 * sizeof(TriangleIndex), "Triangles are read as an array of indices.");
+  for (const auto& m : scene.meshes) {
+    embreeScene.addTriMesh(
+      m.vertices,
+      ConstArrayRef<TriangleIndex>::reinterpret(m.triangles.data(), m.triangles.size()));
+  }
+
+  for (const auto& s : scene.spheres) {
+    embreeScene.addSphere(embree_utils::Vec3fa(s.x, s.y, s.z), s.radius);
+  }
+
+  for (const auto& d : scene.discs) {
+    embreeScene.addDisc(embree_utils::Vec3fa(d.cx, d.cy, d.cz), embree_utils::Vec3fa(d.nx, d.ny, d.nz), d.r);
+  }
+
+  // Embree is only used as a reference so instances are simply flattened into transformed meshes:
+  for (const auto& inst : scene.instances) {
+    const auto& m = scene.prototypes[inst.prototype];
+    std::vector<embree_utils::Vec3fa> worldVerts;
+    worldVerts.reserve(m.vertices.size());
+    for (const auto& v : m.vertices) {
+      worldVerts.push_back(inst.objectToWorld.point(v));
+    }
+    embreeScene.addTriMesh(
+      worldVerts,
+      ConstArrayRef<TriangleIndex>::reinterpret(m.triangles.data(), m.triangles.size()));
+  }
 
-  return {data, embreeScene};
+  return {std::move(data), embreeScene};
 }
@@ -3,6 +3,9 @@
 #include <ipu_utils.hpp>
 #include <io_utils.hpp>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 Hdf5Model::~Hdf5Model() {}
 
 std::vector<Hdf5Model::JsonLayer> parseJsonModel(const std::string& s) {
@@ -68,20 +71,76 @@ Hdf5Model::Hdf5Model(const std::string& file)
   auto jsonModelConf = readStringAttribute("model_config");
   sequential = parseJsonModel(jsonModelConf);
 
+  readWeights(file);
+  ipu_utils::logger()->info("Finished reading model description");
+}
+
+/// Read every dataset into a single buffer. Datasets that are stored contiguously,
+/// unfiltered, and in native byte order (the default for Keras weights) are copied
+/// straight from the file in parallel. The HDF5 library is not (in general) thread
+/// safe so any other datasets are then read through it one by one:
+void Hdf5Model::readWeights(const std::string& file) {
+  struct Read {
+    H5::DataSet dataset;
+    Data* data;
+    haddr_t fileOffset;
+  };
+
+  std::vector<Read> reads;
+  std::size_t totalBytes = 0;
   for (auto& l : sequential) {
-    const auto wpath = "/model_weights/" + l.name + "/" + l.name + "/kernel:0";
+    const auto prefix = "/model_weights/" + l.name + "/" + l.name;
+    const auto wpath = prefix + "/kernel:0";
     ipu_utils::logger()->trace("Loading kernel data {}", wpath);
-    H5::DataSet ds = hdf.openDataSet(wpath);
-    l.kernelData = Data(ds);
+    reads.push_back({hdf.openDataSet(wpath), &l.kernelData, HADDR_UNDEF});
     if (l.useBias) {
-      const auto bpath = "/model_weights/" + l.name + "/" + l.name + "/bias:0";
+      const auto bpath = prefix + "/bias:0";
       ipu_utils::logger()->trace("Loading bias data {}", bpath);
-      H5::DataSet ds = hdf.openDataSet(bpath);
-      l.biasData = Data(ds);
+      reads.push_back({hdf.openDataSet(bpath), &l.biasData, HADDR_UNDEF});
     }
   }
 
-  ipu_utils::logger()->info("Finished reading model description");
+  for (auto& r : reads) {
+    *r.data = Data(r.dataset);
+    r.data->offset = totalBytes;
+    totalBytes += (r.data->bytes() + 63) & ~std::size_t(63); // Keep every dataset aligned
+    const auto createProps = r.dataset.getCreatePlist();
+    if (createProps.getLayout() == H5D_CONTIGUOUS && createProps.getNfilters() == 0 &&
+        r.dataset.getFloatType().getOrder() == H5T_ORDER_LE &&
+        r.dataset.getStorageSize() == r.data->bytes()) {
+      r.fileOffset = r.dataset.getOffset();
+    }
+  }
+  weights = std::make_shared<WeightBuffer>(totalBytes);
+
+  const int fd = open(file.c_str(), O_RDONLY);
+  std::size_t failed = 0;
+  #pragma omp parallel for schedule(dynamic) reduction(+:failed)
+  for (auto i = 0u; i < reads.size(); ++i) {
+    auto& r = reads[i];
+    if (fd < 0 || r.fileOffset == HADDR_UNDEF) {
+      continue;
+    }
+    const auto bytes = r.data->bytes();
+    if (pread(fd, weights->data() + r.data->offset, bytes, r.fileOffset) == ssize_t(bytes)) {
+      r.data = nullptr; // Done
+    } else {
+      failed += 1;
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  std::size_t slowReads = 0;
+  for (auto& r : reads) {
+    if (r.data) {
+      r.data->read(r.dataset, weights->data() + r.data->offset);
+      slowReads += 1;
+    }
+  }
+  ipu_utils::logger()->debug("Read {} bytes of weights from {} datasets ({} through the HDF5 library, {} failed direct reads)",
+                             totalBytes, reads.size(), slowReads, failed);
 }
 
 H5std_string Hdf5Model::readStringAttribute(const std::string& attrName) {
@@ -91,11 +150,12 @@ H5std_string Hdf5Model::readStringAttribute(const std::string& attrName) {
   return str;
 }
 
-Hdf5Model::Data::Data() : numElements(0) {}
+Hdf5Model::Data::Data() : offset(0), numElements(0), isHalfFloat(false) {}
 
 Hdf5Model::Data::Data(H5::DataSet& dset)
 : shape(dset.getSpace().getSimpleExtentNdims()),
-  numElements(dset.getStorageSize() / dset.getFloatType().getSize()),
+  offset(0),
+  numElements(dset.getSpace().getSimpleExtentNpoints()), // Not the storage size (which differs if compressed)
   isHalfFloat(false)
 {
   // NOTE: Convert everything from hsize_t to std::size_t (could be truncated):
@@ -116,9 +176,9 @@ Hdf5Model::Data::Data(H5::DataSet& dset)
     throw std::runtime_error("Only float32 and float16 weights are supported.");
   }
 
-  // Get the data values:
-  ipu_utils::logger()->trace("Data num elements: {}", numElements);
-  storage.resize(dset.getStorageSize());
+}
+
+void Hdf5Model::Data::read(H5::DataSet& dset, std::uint8_t* dst) const {
   if (isHalf()) {
     H5::FloatType halfType;
     halfType.copy(H5::PredType::IEEE_F32BE);
@@ -126,9 +186,8 @@ Hdf5Model::Data::Data(H5::DataSet& dset)
     halfType.setSize(2);
     halfType.setEbias(15);
     halfType.setOrder(H5T_ORDER_LE);
-    dset.read(storage.data(), halfType);
+    dset.read(dst, halfType);
   } else {
-    dset.read(storage.data(), H5::PredType::NATIVE_FLOAT);
+    dset.read(dst, H5::PredType::NATIVE_FLOAT);
   }
 }
-
@@ -2,24 +2,35 @@
 
 #include <H5Cpp.h>
 
+#include <boost/align/aligned_allocator.hpp>
+
 #include <vector>
 #include <map>
+#include <memory>
 
 using TensorShape = std::vector<std::size_t>;
 
+/// Storage for all the weights of a model in a single aligned allocation:
+using WeightBuffer = std::vector<std::uint8_t, boost::alignment::aligned_allocator<std::uint8_t, 64>>;
+
 // Very limited H5 model reading (Many hard coded aspects so
 // only useable for a known Keras model).
 struct Hdf5Model {
 
+  /// Description of a dataset whose values are stored in the model's weight buffer:
   struct Data {
     Data();
     Data(H5::DataSet& dset);
 
     std::size_t rank() const { return shape.size(); }
     std::size_t elements() const { return numElements; }
+    std::size_t bytes() const { return numElements * (isHalfFloat ? 2 : 4); }
     bool isHalf() const { return isHalfFloat; }
     std::vector<std::size_t> shape;
-    std::vector<std::uint8_t> storage;
+    std::size_t offset; // Byte offset of the values in the weight buffer
+
+    /// Read the values using the HDF5 library (converting to native byte order):
+    void read(H5::DataSet& dset, std::uint8_t* dst) const;
 
   private:
     std::size_t numElements;
@@ -43,7 +54,13 @@ struct Hdf5Model {
 
   const std::vector<JsonLayer>& get() const;
 
+  /// The values of every layer's datasets (at the offsets in their Data):
+  const std::shared_ptr<WeightBuffer>& getWeights() const { return weights; }
+
 private:
+  void readWeights(const std::string& file);
+
   H5::H5File hdf;
   std::vector<JsonLayer> sequential;
+  std::shared_ptr<WeightBuffer> weights;
 };
@@ -2,6 +2,9 @@
 
 #pragma once
 
+#include <span>
+
+/// The data of a host tensor is a view of its model's weight buffer:
 struct HostTensor {
   HostTensor(const std::vector<std::size_t>& shape, poplar::Type dtype, const std::string& name)
     : shape(shape), nameSuffix(name), type(dtype) {}
@@ -12,7 +15,7 @@ struct HostTensor {
   std::string nameSuffix;
   //ipu_utils::StreamableTensor tensor;
   poplar::Type type;
-  std::vector<std::uint8_t> data;
+  std::span<std::uint8_t> data;
 };
 
 struct DenseLayer {
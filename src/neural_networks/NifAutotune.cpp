@@ -0,0 +1,137 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+#include "NifAutotune.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+
+namespace {
+
+/// Builds and times a NIF with streamed IO for one candidate plan:
+struct NifBenchmark : ipu_utils::BuilderInterface {
+  NifBenchmark(std::shared_ptr<NifModel::Data>& data, poplar::Type type,
+               std::size_t batchSize, float memoryProportion)
+    : model(data, "nif_autotune", true, batchSize),
+      dtype(type), proportion(memoryProportion),
+      cycles(std::numeric_limits<std::uint64_t>::max()) {}
+
+  void build(poplar::Graph& graph, const poplar::Target&) override {
+    auto matmulOptions = NifModel::defaultMatmulOptions(proportion);
+    poplin::matmul::PlanningCache cache;
+    getPrograms().add("inference", model.buildInference(graph, matmulOptions, cache, true, poplar::Tensor(), dtype));
+    getPrograms().add("init", model.buildInit(graph, true));
+  }
+
+  void execute(poplar::Engine& engine, const poplar::Device&) override {
+    // The input values do not affect the timing so the (zeroed) input buffers
+    // are streamed as they are. The first run is a warm up:
+    model.connectStreams(engine);
+    getPrograms().run(engine, "init");
+    for (auto i = 0u; i < 4; ++i) {
+      getPrograms().run(engine, "inference");
+      if (i) {
+        cycles = std::min(cycles, model.getCycleCount());
+      }
+    }
+  }
+
+  NifModel model;
+  poplar::Type dtype;
+  float proportion;
+  std::uint64_t cycles;
+};
+
+std::string typeName(poplar::Type type) {
+  return type == poplar::HALF ? "half" : "float";
+}
+
+} // end anonymous namespace
+
+NifPlan autotuneNif(std::shared_ptr<NifModel::Data>& data, const NifAutotuneSettings& settings) {
+  auto config = settings.config;
+  config.numReplicas = 1;
+  config.loadExe = false;
+  config.saveExe = false;
+  config.compileOnly = false;
+
+  NifPlan best{0, 0.f, std::numeric_limits<std::uint64_t>::max()};
+  const auto fullBatchSize = settings.numTiles * settings.raysPerTile;
+  for (auto proportion : settings.memoryProportions) {
+    // Try batches from smallest to largest. If a batch does not fit then no
+    // larger batch will fit either:
+    for (auto factor = settings.raysPerTile; factor > 0; --factor) {
+      if (settings.raysPerTile % factor) {
+        continue;
+      }
+      const auto batchSize = fullBatchSize / factor;
+      ipu_utils::logger()->info("NIF autotune: trying batch-size {} memory-proportion {}", batchSize, proportion);
+      NifBenchmark benchmark(data, settings.dtype, batchSize, proportion);
+      benchmark.setRuntimeConfig(config);
+      ipu_utils::GraphManager manager;
+      if (manager.run(benchmark) != EXIT_SUCCESS) {
+        ipu_utils::logger()->info("NIF autotune: batch-size {} does not fit", batchSize);
+        break;
+      }
+
+      const auto cycles = benchmark.cycles * factor;
+      ipu_utils::logger()->info("NIF autotune: {} cycles per batch ({} per ray batch)", benchmark.cycles, cycles);
+      if (cycles < best.cycles) {
+        best = NifPlan{batchSize, proportion, cycles};
+      }
+    }
+  }
+
+  if (best.batchSize == 0) {
+    throw std::runtime_error("NIF autotune: none of the candidate plans could be compiled.");
+  }
+  ipu_utils::logger()->info("NIF autotune: best plan batch-size {} memory-proportion {} ({} cycles per ray batch)",
+                            best.batchSize, best.availableMemoryProportion, best.cycles);
+  return best;
+}
+
+std::optional<NifPlan> loadNifPlan(const std::string& path, const NifAutotuneSettings& settings) {
+  std::ifstream stream(path);
+  if (!stream) {
+    return std::nullopt;
+  }
+
+  boost::property_tree::ptree pt;
+  boost::property_tree::read_json(stream, pt);
+  if (pt.get<std::size_t>("num_ipus", 0) != settings.config.numIpus ||
+      pt.get<std::size_t>("num_tiles", 0) != settings.numTiles ||
+      pt.get<std::size_t>("rays_per_tile", 0) != settings.raysPerTile ||
+      pt.get<std::string>("dtype", "") != typeName(settings.dtype) ||
+      pt.get<std::string>("poplar_version", "") != poplar::versionString()) {
+    ipu_utils::logger()->info("NIF plan '{}' was tuned for different settings", path);
+    return std::nullopt;
+  }
+
+  NifPlan plan;
+  plan.batchSize = pt.get<std::size_t>("batch_size");
+  plan.availableMemoryProportion = pt.get<float>("available_memory_proportion");
+  plan.cycles = pt.get<std::uint64_t>("cycles");
+  ipu_utils::logger()->info("Loaded NIF plan '{}': batch-size {} memory-proportion {}",
+                            path, plan.batchSize, plan.availableMemoryProportion);
+  return plan;
+}
+
+void saveNifPlan(const std::string& path, const NifAutotuneSettings& settings, const NifPlan& plan) {
+  boost::property_tree::ptree pt;
+  pt.put("num_ipus", settings.config.numIpus);
+  pt.put("num_tiles", settings.numTiles);
+  pt.put("rays_per_tile", settings.raysPerTile);
+  pt.put("dtype", typeName(settings.dtype));
+  pt.put("poplar_version", poplar::versionString());
+  pt.put("batch_size", plan.batchSize);
+  pt.put("available_memory_proportion", plan.availableMemoryProportion);
+  pt.put("cycles", plan.cycles);
+
+  std::ofstream stream(path);
+  if (!stream) {
+    throw std::runtime_error("Could not open NIF plan file for writing: '" + path + "'");
+  }
+  boost::property_tree::write_json(stream, pt);
+  ipu_utils::logger()->info("Saved NIF plan '{}'", path);
+}
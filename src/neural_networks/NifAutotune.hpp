@@ -0,0 +1,38 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Autotuner for the batch serialisation and matmul memory proportion used to
+// evaluate the NIF environment light. Candidate plans are compiled and run in
+// isolation (using NifModel's streamed mode and its cycle count) and the plan
+// that evaluates a whole ray batch in the fewest cycles wins.
+
+#pragma once
+
+#include "NifModel.hpp"
+
+#include <optional>
+
+/// How the NIF is evaluated for one ray batch:
+struct NifPlan {
+  std::size_t batchSize; // Rays per serialised NIF batch
+  float availableMemoryProportion;
+  std::uint64_t cycles; // Measured cycles to evaluate every batch of a ray batch
+};
+
+struct NifAutotuneSettings {
+  ipu_utils::RuntimeConfig config; // Device for a single replica
+  std::size_t numTiles; // Compute tiles the NIF is distributed over
+  std::size_t raysPerTile; // Rays per tile in each ray batch
+  poplar::Type dtype;
+  std::vector<float> memoryProportions;
+};
+
+/// Compile and time the NIF for every batch size that evenly serialises a ray
+/// batch (batches are slices of the per-tile rays) and each memory proportion.
+/// Candidates that do not compile (e.g. because they run out of memory) are
+/// skipped. Throws if no candidate could be compiled.
+NifPlan autotuneNif(std::shared_ptr<NifModel::Data>& data, const NifAutotuneSettings& settings);
+
+/// Plans are saved as JSON alongside the settings they were tuned for. Loading
+/// returns nothing if there is no file or if it was tuned for other settings:
+std::optional<NifPlan> loadNifPlan(const std::string& path, const NifAutotuneSettings& settings);
+void saveNifPlan(const std::string& path, const NifAutotuneSettings& settings, const NifPlan& plan);
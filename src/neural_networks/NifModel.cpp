@@ -6,6 +6,7 @@
 
 #include <poplar/VariableMappingMethod.hpp>
 #include <poplar/CycleCount.hpp>
+#include <poplar/Target.hpp>
 #include <poputil/TileMapping.hpp>
 #include <popops/ElementWise.hpp>
 #include <popops/Cast.hpp>
@@ -15,6 +16,8 @@
 #include <popnn/codelets.hpp>
 
 #include <algorithm>
+#include <filesystem>
+#include <mutex>
 
 #include <io_utils.hpp>
 
@@ -36,6 +39,21 @@ std::size_t getFirstTile(poplar::Graph& g, poplar::Tensor t) {
   throw std::runtime_error("Tensor '" + t.getDebugStr() + "' has no tile mapping in this graph.");
 }
 
+/// Copy a tensor into the (sufficiently large) destination. Returns the
+/// number of bytes written which is halved if the tensor is converted:
+std::size_t copyTensorAsHalf(const poplar::Target& target, HostTensor& t, std::uint8_t* dst) {
+  const auto bytes = t.type == poplar::FLOAT ? t.data.size() / 2 : t.data.size();
+  if (t.type == poplar::FLOAT) {
+    poplar::copyFloatToDeviceHalf(target, reinterpret_cast<const float*>(t.data.data()),
+                                  dst, t.data.size() / sizeof(float));
+  } else {
+    std::copy(t.data.begin(), t.data.end(), dst);
+  }
+  t.data = std::span<std::uint8_t>(dst, bytes);
+  t.type = poplar::HALF;
+  return bytes;
+}
+
 } // end anonymous namespace
 
 NifModel::Data::Data(const std::string& h5File, const std::string& metaFile)
@@ -49,20 +67,38 @@ NifModel::Data::Data(const std::string& h5File, const std::string& metaFile)
   setupModel(h5File);
 }
 
+std::shared_ptr<NifModel::Data> NifModel::Data::load(const std::string& h5File, const std::string& metaFile) {
+  static std::mutex mutex;
+  static std::map<std::string, std::weak_ptr<Data>> loaded;
+
+  const auto key = std::filesystem::weakly_canonical(h5File).string() + "|" +
+                   std::filesystem::weakly_canonical(metaFile).string();
+  std::lock_guard<std::mutex> lock(mutex);
+  auto data = loaded[key].lock();
+  if (data) {
+    ipu_utils::logger()->info("Sharing already loaded NIF data from '{}'", h5File);
+  } else {
+    data = std::make_shared<Data>(h5File, metaFile);
+    loaded[key] = data;
+  }
+  return data;
+}
+
 void NifModel::Data::setupModel(const std::string& h5File) {
 
   // TODO: model loader is hard coded for sequential dense only layers:
   Hdf5Model h5model(h5File);
+  weights = h5model.getWeights();
 
   auto i = 0u;
   for (auto& l : h5model.get()) {
     auto dtype = l.dtype == "float16" ? poplar::HALF : poplar::FLOAT;
     layers.emplace_back(l.kernelData.shape, dtype, l.activation, l.name);
     auto& newLayer = layers.back();
-    newLayer.kernel.data = l.kernelData.storage;
+    newLayer.kernel.data = std::span<std::uint8_t>(weights->data() + l.kernelData.offset, l.kernelData.bytes());
     ipu_utils::logger()->debug("Added dense kernel: {} size: {}", newLayer.kernel.getName(), newLayer.kernel.data.size());
     if (l.useBias) {
-      newLayer.bias.data = l.biasData.storage;
+      newLayer.bias.data = std::span<std::uint8_t>(weights->data() + l.biasData.offset, l.biasData.bytes());
       ipu_utils::logger()->debug("Added bias: {} size: {}", newLayer.bias.getName(), newLayer.bias.data.size());
       ipu_utils::logger()->debug("Layer {}: weight tensors: {} ({}) {} ({})",
         i, newLayer.kernel.getName(), newLayer.kernel.shape, newLayer.bias.getName(), newLayer.bias.shape);
@@ -85,6 +121,79 @@ void NifModel::Data::setupModel(const std::string& h5File) {
   }
 }
 
+void NifModel::Data::convertToHalf(const poplar::Target& target) {
+  // Convert into a new buffer so that the weights stay in one allocation:
+  std::size_t halfBytes = 0;
+  bool anyFloat = false;
+  for (const auto& l : layers) {
+    for (const auto* t : {&l.kernel, &l.bias}) {
+      anyFloat |= t->type == poplar::FLOAT;
+      halfBytes += t->type == poplar::FLOAT ? t->data.size() / 2 : t->data.size();
+    }
+  }
+  if (!anyFloat) {
+    return;
+  }
+
+  auto converted = std::make_shared<WeightBuffer>(halfBytes);
+  std::size_t offset = 0;
+  for (auto& l : layers) {
+    offset += copyTensorAsHalf(target, l.kernel, converted->data() + offset);
+    offset += copyTensorAsHalf(target, l.bias, converted->data() + offset);
+  }
+  weights = converted;
+}
+
+NifMlpShape NifModel::Data::getMlpShape() const {
+  if (layers.size() < 2) {
+    throw std::runtime_error("NIF network must have at least two layers.");
+  }
+
+  NifMlpShape shape;
+  shape.embeddingDimension = metaData.embeddingDimension;
+  shape.hiddenSize = layers.front().kernel.shape.back();
+  shape.numLayers = layers.size();
+  shape.concatLayer = 0;
+  if (shape.hiddenSize < 3) {
+    throw std::runtime_error("NIF hidden size must be at least 3.");
+  }
+
+  for (auto l = 0u; l < layers.size(); ++l) {
+    const auto& kernelShape = layers[l].kernel.shape;
+    if (l > 0 && shape.concatLayer == 0 && kernelShape.front() == shape.hiddenSize + shape.numFeatures()) {
+      shape.concatLayer = l;
+    }
+    const bool last = l + 1 == layers.size();
+    const auto& activation = layers[l].activationFunction;
+    if (kernelShape.size() != 2 ||
+        kernelShape.front() != shape.layerInputs(l) ||
+        kernelShape.back() != shape.layerOutputs(l) ||
+        activation != (last ? "none" : "relu")) {
+      throw std::runtime_error("NIF layer '" + layers[l].kernel.getName() + "' has an unsupported shape or activation.");
+    }
+  }
+  return shape;
+}
+
+std::vector<std::uint8_t> NifModel::Data::packWeightsHalf(const poplar::Target& target) {
+  convertToHalf(target);
+  std::vector<std::uint8_t> packed;
+  packed.reserve(getMlpShape().numWeights() * sizeof(std::uint16_t));
+  for (const auto& l : layers) {
+    packed.insert(packed.end(), l.kernel.data.begin(), l.kernel.data.end());
+    if (l.hasBias()) {
+      packed.insert(packed.end(), l.bias.data.begin(), l.bias.data.end());
+    } else {
+      packed.resize(packed.size() + l.kernel.shape.back() * sizeof(std::uint16_t), 0); // fp16 zero
+    }
+  }
+  return packed;
+}
+
+NifDecodeParams NifModel::Data::getDecodeParams() const {
+  return NifDecodeParams{metaData.max, {metaData.mean[0], metaData.mean[1], metaData.mean[2]}, metaData.logToneMap};
+}
+
 NifModel::NifModel(std::shared_ptr<Data>& sharedData, const std::string& modelName)
 : data(sharedData),
   name(modelName),
@@ -119,6 +228,17 @@ NifModel::NifModel(std::shared_ptr<Data>& sharedData, const std::string& modelNa
   setupIoBuffers();
 }
 
+poplar::OptionFlags NifModel::defaultMatmulOptions(float availableMemoryProportion) {
+  ipu_utils::logger()->trace("NIF available memory proportion set to {}", availableMemoryProportion);
+  return poplar::OptionFlags {
+    {"partialsType", "half"},
+    {"availableMemoryProportion", std::to_string(availableMemoryProportion)},
+    {"fullyConnectedPass", "INFERENCE_FWD"},
+    {"use128BitConvUnitLoad", "true"},
+    {"enableFastReduce", "true"}
+  };
+}
+
 /// Calculate and log useful information about the model:
 void NifModel::analyseModel(std::size_t sampleCount) const {
   std::size_t flops = 0;
@@ -189,12 +309,12 @@ poplar::Tensor NifModel::buildEncodeInput(poplar::Graph& g, poplar::Type dtype,
   // Compute powers on host and upload as constant. This avoids using powf on
   // device which is slow and wastes memory with double emulation code:
   auto powers = makeCoefficients();
-  auto coeffs = g.addConstant(poplar::FLOAT, {data->getMetaData().embeddingDimension}, powers.data(), opPrefix + "/powers");
+  auto coeffs = g.addConstant(dtype, {data->getMetaData().embeddingDimension}, powers.data(), opPrefix + "/powers");
   auto firstInputTile = getFirstTile(g, uvCoords);
   g.setTileMapping(coeffs, firstInputTile);
 
-  auto one = g.addConstant(poplar::FLOAT, {}, 1.f, opPrefix + "/one");
-  auto two = g.addConstant(poplar::FLOAT, {}, 2.f, opPrefix + "/two");
+  auto one = g.addConstant(dtype, {}, 1.f, opPrefix + "/one");
+  auto two = g.addConstant(dtype, {}, 2.f, opPrefix + "/two");
   g.setTileMapping(one, firstInputTile);
   g.setTileMapping(two, firstInputTile);
 
@@ -208,7 +328,13 @@ poplar::Tensor NifModel::buildEncodeInput(poplar::Graph& g, poplar::Type dtype,
   auto posuv = popops::mul(g, uv, coeffs, prog, opPrefix + "/coeff_mul");
 
   // sin() and cos(). Do cosine first then the sine in place.
-  // Cast to fp16 because fp32 implementations are currently slow:
+  // Always at fp16 because fp32 implementations are currently slow:
+  if (dtype == poplar::HALF) {
+    auto cosuv = popops::cos(g, posuv, prog, opPrefix + "/cos_fp16");
+    popops::sinInPlace(g, posuv, prog, opPrefix + "/sin_fp16");
+    return poplar::concat({posuv[0], posuv[1], cosuv[0], cosuv[1]}, 1);
+  }
+
   auto posuv_fp16 = popops::cast(g, posuv, poplar::HALF, prog, opPrefix + "/to_fp16");
   auto cosuv_fp16 = popops::cos(g, posuv_fp16, prog, opPrefix + "/cos_fp16");
   popops::sinInPlace(g, posuv_fp16, prog, opPrefix + "/sin_fp16");
@@ -251,13 +377,19 @@ NifModel::buildInference(poplar::Graph& g,
       poplar::OptionFlags& matmulOptions,
       poplin::matmul::PlanningCache& cache,
       bool optimiseStreamMemory,
-      poplar::Tensor inputUV) {
+      poplar::Tensor inputUV,
+      poplar::Type dtype) {
   popops::addCodelets(g);
   poplin::addCodelets(g);
 
   poplar::program::Sequence progWithIO;
   poplar::program::Sequence execModel;
-  const auto dtype = poplar::FLOAT;
+
+  if (dtype == poplar::HALF) {
+    // Weights need to be the same type as the activations:
+    data->convertToHalf(g.getTarget());
+    ipu_utils::logger()->info("NifModel '{}': Building fp16 inference graph.", name);
+  }
 
   if (inputUV.valid()) {
     ipu_utils::logger()->debug("{}: UV input tensor was provided with shape: {}", name, inputUV.shape());
@@ -267,17 +399,22 @@ NifModel::buildInference(poplar::Graph& g,
     ipu_utils::logger()->debug("{}: Batch size set to: {}", name, batchSize);
     streamedIO = false;
   } else {
-    // No input tensor passed so create one and set it up for streaming:
+    // No input tensor passed so create one and set it up for streaming
+    // (host buffers are fp32 so the streams are always fp32):
     ipu_utils::logger()->debug("{}: No input tensor provided. Input will be allocated for stremaing.", name);
     constexpr auto linearMapping = poplar::VariableMappingMethod::LINEAR;
-    inputU = g.addVariable(dtype, {batchSize}, linearMapping, name + "/inputU");
-    inputV = g.addVariable(dtype, {batchSize}, linearMapping, name + "/inputV");
+    inputU = g.addVariable(poplar::FLOAT, {batchSize}, linearMapping, name + "/inputU");
+    inputV = g.addVariable(poplar::FLOAT, {batchSize}, linearMapping, name + "/inputV");
     progWithIO.add(inputU.buildWrite(g, optimiseStreamMemory));
     progWithIO.add(inputV.buildWrite(g, optimiseStreamMemory));
     inputUV = poplar::concat({inputU.get().expand({0}), inputV.get().expand({0})}, 0);
     streamedIO = true;
   }
 
+  if (inputUV.elementType() != dtype) {
+    inputUV = popops::cast(g, inputUV, dtype, execModel, name + "/cast_input");
+  }
+
   // Lay out input for first matmul:
   auto kernelShape = data->getLayers().front().kernel.shape;
   auto firstKernelType = data->getLayers().front().kernel.type;
@@ -327,7 +464,13 @@ NifModel::buildInference(poplar::Graph& g,
   }
 
   if (decodeOnDevice) {
-    output = buildDecodeOutput(g, x, execModel);
+    auto decoded = buildDecodeOutput(g, x, execModel);
+    if (!streamedIO && dtype == poplar::HALF) {
+      // Saturate rather than overflow to inf (e.g. when the sun is in the HDRI):
+      popops::minInPlace(g, decoded, 65504.f, execModel, name + "/saturate_fp16");
+      decoded = popops::cast(g, decoded, dtype, execModel, name + "/output_to_fp16");
+    }
+    output = decoded;
   } else {
     output = x;
   }
@@ -392,11 +535,11 @@ void NifModel::connectStreams(poplar::Engine& engine) {
   for (auto& l : data->getLayers()) {
     auto& kernelTensor = modelTensors.at(l.kernel.getName());
     ipu_utils::logger()->trace("NifModel '{}': Connecting weight stream: ({} bytes)", name, l.kernel.data.size());
-    kernelTensor.connectWriteStream(engine, l.kernel.data);
+    kernelTensor.connectWriteStream(engine, l.kernel.data.data());
     if (l.hasBias()) {
       auto& biasTensor = modelTensors.at(l.bias.getName());
       ipu_utils::logger()->trace("NifModel '{}': Connecting bias stream: ({} bytes)", name, l.bias.data.size());
-      biasTensor.connectWriteStream(engine, l.bias.data);
+      biasTensor.connectWriteStream(engine, l.bias.data.data());
     }
   }
 }
@@ -476,6 +619,10 @@ std::pair<std::vector<float>, std::vector<float>> NifModel::makeGridCoordsUV() {
   auto width = data->getMetaData().imageShape[1];
   auto height = data->getMetaData().imageShape[0];
   ipu_utils::logger()->debug("NifModel '{}': generating uv coords for image wxh: {} x {}", name, width, height);
+  return makeGridCoordsUV(width, height);
+}
+
+std::pair<std::vector<float>, std::vector<float>> NifModel::makeGridCoordsUV(std::size_t width, std::size_t height) {
   std::vector<float> u(width * height);
   std::vector<float> v(width * height);
   auto i = 0u;
@@ -486,7 +633,7 @@ std::pair<std::vector<float>, std::vector<float>> NifModel::makeGridCoordsUV() {
       i += 1;
     }
   }
-  ipu_utils::logger()->debug("NifModel '{}': {} UV coord pairs generated", name, i);
+  ipu_utils::logger()->debug("{} UV coord pairs generated", i);
   return std::make_pair(u, v);
 }
 
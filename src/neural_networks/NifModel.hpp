@@ -14,6 +14,8 @@
 #include "DenseLayer.hpp"
 #include "NifMetaData.hpp"
 
+#include <NifMlp.hpp>
+
 struct IoBuffer;
 
 struct NifModel {
@@ -22,15 +24,34 @@ struct NifModel {
   struct Data {
     Data(const std::string& h5File, const std::string& metaFile);
 
+    /// Return the data for the files, only loading it if no other model
+    /// still holds data loaded from the same files:
+    static std::shared_ptr<Data> load(const std::string& h5File, const std::string& metaFile);
+
     const NifMetaData& getMetaData() const { return metaData; }
     NifMetaData& getMetaData() { return metaData; }
     const std::vector<DenseLayer>& getLayers() const { return layers; }
     std::vector<DenseLayer>& getLayers() { return layers; }
 
+    /// Convert any fp32 weights to fp16 (for every model that shares
+    /// this data) so they can be streamed directly to a half precision model:
+    void convertToHalf(const poplar::Target& target);
+
+    /// Layer dimensions for evaluating the network with evaluateNif(). Throws
+    /// if the network does not have the structure that evaluateNif() supports:
+    NifMlpShape getMlpShape() const;
+
+    /// Pack every layer's kernel (then bias) into a single fp16 buffer in the
+    /// layout that evaluateNif() expects. Missing biases are packed as zeros:
+    std::vector<std::uint8_t> packWeightsHalf(const poplar::Target& target);
+
+    NifDecodeParams getDecodeParams() const;
+
   private:
     void setupModel(const std::string& h5File);
 
     NifMetaData metaData;
+    std::shared_ptr<WeightBuffer> weights; // The layers' tensors are views of this
     std::vector<DenseLayer> layers;
   };
 
@@ -42,6 +63,10 @@ struct NifModel {
   void analyseModel(std::size_t sampleCount) const;
 
   std::uint64_t getCycleCount() const { return cycleCountResult; }
+  std::shared_ptr<Data>& getData() { return data; }
+
+  /// Matmul options used for NIF inference:
+  static poplar::OptionFlags defaultMatmulOptions(float availableMemoryProportion);
   std::size_t getBatchSize() const { return batchSize; }
 
   /// Build the input encoding program (generate Fourier features from UV coords):
@@ -51,13 +76,16 @@ struct NifModel {
   /// Computed in-place if possible.
   poplar::Tensor buildDecodeOutput(poplar::Graph& g, poplar::Tensor bgr, poplar::program::Sequence& prog);
 
-  /// Build the main model inference program:
+  /// Build the main model inference program. The dtype is used for the input
+  /// encoding, activations, weights, and (unless IO is streamed) the output.
+  /// Output decoding is always computed at fp32:
   poplar::program::Sequence buildInference(
     poplar::Graph& g,
     poplar::OptionFlags& matmulOptions,
     poplin::matmul::PlanningCache& cache,
     bool optimiseStreamMemory,
-    poplar::Tensor uvInput = poplar::Tensor());
+    poplar::Tensor uvInput = poplar::Tensor(),
+    poplar::Type dtype = poplar::FLOAT);
 
   /// Build graph to initialise model weights.
   poplar::program::Sequence buildInit(poplar::Graph& g, bool optimiseStreamMemory);
@@ -76,6 +104,10 @@ struct NifModel {
 
   poplar::Tensor getOutput() { return output; }
 
+  /// Return separate vectors of u and v coordinates in range
+  /// [0, 1) for a grid of image coords:
+  static std::pair<std::vector<float>, std::vector<float>> makeGridCoordsUV(std::size_t width, std::size_t height);
+
 private:
   void setupStreamableTensors();
   void setupIoBuffers();
@@ -3,7 +3,15 @@
 #include <scene_utils.hpp>
 #include <ipu_utils.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <exception>
+#include <filesystem>
+#include <limits>
+#include <optional>
+#include <unordered_map>
+
+#include <opencv2/imgcodecs.hpp>
 
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
@@ -54,46 +62,100 @@ HostTriangleMesh makeGroundPlane(const embree_utils::Vec3fa& pos, float scale) {
   return mesh;
 }
 
-// Copy mesh data from aiScene data structure into ours:
-void getMeshes(const aiScene* aiFile, std::vector<HostTriangleMesh>& meshes, std::vector<std::uint32_t>& matIDs, bool loadNormals) {
-  // Get meshes:
-  meshes.reserve(meshes.size() + aiFile->mNumMeshes);
-  matIDs.reserve(matIDs.size() + aiFile->mNumMeshes);
+// Copy mesh data from aiScene data structure into ours. The meshes are converted
+// in parallel and each one is written straight into buffers of its final size.
+// If meshUVs is not null it gets the texture coordinates of every mesh (empty if it has none):
+void getMeshes(const aiScene* aiFile, std::vector<HostTriangleMesh>& meshes, std::vector<std::uint32_t>& matIDs, bool loadNormals,
+               std::vector<std::vector<TexCoord>>* meshUVs = nullptr) {
+  const auto numMeshes = aiFile->mNumMeshes;
   std::uint32_t faceCount = 0;
-
-  for (auto m = 0u; m < aiFile->mNumMeshes; ++m) {
-    auto& mesh = *aiFile->mMeshes[m];
-    auto& mat = *aiFile->mMaterials[mesh.mMaterialIndex];
-    matIDs.push_back(mesh.mMaterialIndex);
+  for (auto m = 0u; m < numMeshes; ++m) {
+    const auto& mesh = *aiFile->mMeshes[m];
+    const auto& mat = *aiFile->mMaterials[mesh.mMaterialIndex];
     ipu_utils::logger()->debug("Mesh {} '{}' has {} faces. Material: {} '{}'", m, mesh.mName.C_Str(), mesh.mNumFaces, mesh.mMaterialIndex, mat.GetName().C_Str());
+    ipu_utils::logger()->debug("{} normals for mesh {} '{}'", loadNormals && mesh.HasNormals() ? "Loading" : "No", m, mesh.mName.C_Str());
     faceCount += mesh.mNumFaces;
+  }
 
-    meshes.push_back(HostTriangleMesh());
-    auto& hostMesh = meshes.back();
+  // Each file mesh converts to one mesh unless it has too many vertices for the
+  // triangle index type, in which case it is split into several parts.
+  // (Exceptions can not leave the parallel loop so failures are checked after it):
+  const std::size_t maxVertices = std::size_t(Triangle::MaxIndex) + 1;
+  std::vector<std::vector<HostTriangleMesh>> converted(numMeshes);
+  std::vector<std::vector<std::vector<TexCoord>>> convertedUVs(numMeshes);
+  std::vector<std::uint8_t> nonTriangular(numMeshes, 0u);
+  #pragma omp parallel for schedule(dynamic)
+  for (auto m = 0u; m < numMeshes; ++m) {
+    const auto& mesh = *aiFile->mMeshes[m];
+    std::vector<WideTriangle> wideTriangles;
+    wideTriangles.reserve(mesh.mNumFaces);
     for (auto f = 0u; f < mesh.mNumFaces; ++f) {
       const auto& face = mesh.mFaces[f];
       if (face.mNumIndices != 3) {
-        throw std::runtime_error("Only triangle meshes are supported.");
+        nonTriangular[m] = 1u;
+        break;
       }
-      hostMesh.triangles.push_back(Triangle(face.mIndices[0], face.mIndices[1], face.mIndices[2]));
+      wideTriangles.push_back(WideTriangle{face.mIndices[0], face.mIndices[1], face.mIndices[2]});
     }
+    std::vector<embree_utils::Vec3fa> vertices(mesh.mNumVertices);
     for (auto v = 0u; v < mesh.mNumVertices; ++v) {
-      auto& vert = mesh.mVertices[v];
-      hostMesh.vertices.push_back(embree_utils::Vec3fa(vert[0], vert[1], vert[2]));
+      const auto& vert = mesh.mVertices[v];
+      vertices[v] = embree_utils::Vec3fa(vert[0], vert[1], vert[2]);
     }
+    std::vector<embree_utils::Vec3fa> normals;
     if (loadNormals && mesh.HasNormals()) {
-      ipu_utils::logger()->debug("Loading normals for mesh {} '{}'", m, mesh.mName.C_Str());
+      normals.resize(mesh.mNumVertices);
       for (auto v = 0u; v < mesh.mNumVertices; ++v) {
-        auto& n = mesh.mNormals[v];
-        hostMesh.normals.push_back(embree_utils::Vec3fa(n[0], n[1], n[2]));
+        const auto& n = mesh.mNormals[v];
+        normals[v] = embree_utils::Vec3fa(n[0], n[1], n[2]);
       }
+    }
+
+    std::vector<TexCoord> uvs;
+    if (meshUVs && mesh.HasTextureCoords(0)) {
+      uvs.resize(mesh.mNumVertices);
+      for (auto v = 0u; v < mesh.mNumVertices; ++v) {
+        const auto& uv = mesh.mTextureCoords[0][v];
+        uvs[v] = TexCoord{uv[0], uv[1]};
+      }
+    }
+
+    if (vertices.size() > maxVertices) {
+      converted[m] = splitMesh(wideTriangles, vertices, normals, maxVertices, uvs, &convertedUVs[m]);
     } else {
-      ipu_utils::logger()->debug("No normals loaded for mesh {} '{}'", m, mesh.mName.C_Str());
+      converted[m].resize(1);
+      auto& hostMesh = converted[m].front();
+      hostMesh.triangles.reserve(wideTriangles.size());
+      for (const auto& t : wideTriangles) {
+        hostMesh.triangles.push_back(Triangle(t.v0, t.v1, t.v2));
+      }
+      hostMesh.vertices = std::move(vertices);
+      hostMesh.normals = std::move(normals);
+      hostMesh.updateBoundingBox();
+      convertedUVs[m].push_back(std::move(uvs));
+    }
+  }
+  if (std::find(nonTriangular.begin(), nonTriangular.end(), 1u) != nonTriangular.end()) {
+    throw std::runtime_error("Only triangle meshes are supported.");
+  }
+
+  for (auto m = 0u; m < numMeshes; ++m) {
+    const auto& mesh = *aiFile->mMeshes[m];
+    if (converted[m].size() > 1) {
+      ipu_utils::logger()->info("Mesh {} '{}' has {} vertices: split into {} meshes of at most {} vertices",
+                                m, mesh.mName.C_Str(), mesh.mNumVertices, converted[m].size(), maxVertices);
+    }
+    for (auto p = 0u; p < converted[m].size(); ++p) {
+      auto& part = converted[m][p];
+      const auto& bounds = part.getBoundingBox();
+      ipu_utils::logger()->debug("Bounding box for mesh {}: {} {} {} -> {} {} {}", meshes.size(),
+        bounds.min.x, bounds.min.y, bounds.min.z, bounds.max.x, bounds.max.y, bounds.max.z);
+      meshes.push_back(std::move(part));
+      matIDs.push_back(mesh.mMaterialIndex);
+      if (meshUVs) {
+        meshUVs->push_back(p < convertedUVs[m].size() ? std::move(convertedUVs[m][p]) : std::vector<TexCoord>());
+      }
     }
-    hostMesh.updateBoundingBox();
-    ipu_utils::logger()->debug("Bounding box for mesh {}: {} {} {} -> {} {} {}", m,
-      hostMesh.getBoundingBox().min.x, hostMesh.getBoundingBox().min.y, hostMesh.getBoundingBox().min.z,
-      hostMesh.getBoundingBox().max.x, hostMesh.getBoundingBox().max.y, hostMesh.getBoundingBox().max.z);
   }
 
   ipu_utils::logger()->debug("Loaded {} faces.", faceCount);
@@ -118,6 +180,7 @@ void importMesh(std::string& filename, std::vector<HostTriangleMesh>& meshes) {
       std::vector<std::uint32_t> importedMatIds;
       const bool loadNormals = false;
       getMeshes(aiFile, importedMeshes, importedMatIds, loadNormals);
+      importer.FreeScene(); // Release assimp's copy before the meshes are transformed
 
       // Apply hardcoded transforms to position the monkey bust mesh and then append
       // the transformed meshes to existing meshes:
@@ -139,7 +202,7 @@ void importMesh(std::string& filename, std::vector<HostTriangleMesh>& meshes) {
           }
         );
 
-        meshes.push_back(hostMesh);
+        meshes.push_back(std::move(hostMesh));
       }
 
     } else  {
@@ -148,8 +211,48 @@ void importMesh(std::string& filename, std::vector<HostTriangleMesh>& meshes) {
   }
 }
 
+// Read a texture that is either embedded in the file ("*<index>") or an image
+// file (relative to the scene file's directory) as 8-bit BGR:
+cv::Mat readTextureImage(const aiScene* aiFile, const std::string& texturePath, const std::filesystem::path& sceneDir) {
+  if (const auto* embedded = aiFile->GetEmbeddedTexture(texturePath.c_str())) {
+    if (embedded->mHeight == 0) {
+      // Compressed image file data (e.g. PNG) of mWidth bytes:
+      const cv::Mat bytes(1, embedded->mWidth, CV_8UC1, (void*)embedded->pcData);
+      return cv::imdecode(bytes, cv::IMREAD_COLOR);
+    }
+    cv::Mat image(embedded->mHeight, embedded->mWidth, CV_8UC3);
+    for (auto i = 0u; i < embedded->mWidth * embedded->mHeight; ++i) {
+      const auto& t = embedded->pcData[i];
+      image.at<cv::Vec3b>(i / embedded->mWidth, i % embedded->mWidth) = cv::Vec3b(t.b, t.g, t.r);
+    }
+    return image;
+  }
+  auto path = std::filesystem::path(texturePath);
+  if (path.is_relative()) {
+    path = sceneDir / path;
+  }
+  return cv::imread(path.string(), cv::IMREAD_COLOR);
+}
+
+// Convert an 8-bit sRGB BGR image to linear RGB and compress it into the scene:
+std::uint32_t addTexture(SceneDescription& scene, const cv::Mat& image, std::uint32_t maxTextureSize) {
+  std::vector<float> rgb(std::size_t(image.rows) * image.cols * 3);
+  for (auto r = 0; r < image.rows; ++r) {
+    for (auto c = 0; c < image.cols; ++c) {
+      const auto& bgr = image.at<cv::Vec3b>(r, c);
+      for (auto i = 0u; i < 3; ++i) {
+        const float s = bgr[2 - i] * (1.f / 255.f);
+        rgb[3 * (std::size_t(r) * image.cols + c) + i] =
+          s <= .04045f ? s * (1.f / 12.92f) : std::pow((s + .055f) * (1.f / 1.055f), 2.4f);
+      }
+    }
+  }
+  scene.textures.push_back(compressTexture(rgb, image.cols, image.rows, scene.texels, maxTextureSize));
+  return scene.textures.size() - 1;
+}
+
 // Load a complete scene with camera attempting to reinterpret materials:
-SceneDescription importScene(std::string& filename, bool loadNormals) {
+SceneDescription importScene(std::string& filename, bool loadNormals, std::uint32_t maxTextureSize) {
   SceneDescription scene;
 
   Assimp::Importer importer;
@@ -171,7 +274,7 @@ SceneDescription importScene(std::string& filename, bool loadNormals) {
   ipu_utils::logger()->info("Found {} cameras", aiFile->mNumCameras);
   ipu_utils::logger()->info("Found {} materials", aiFile->mNumMaterials);
   ipu_utils::logger()->info("Found {} lights (ignored)", aiFile->mNumLights);
-  ipu_utils::logger()->info("Found {} textures: (ignored)", aiFile->mNumTextures);
+  ipu_utils::logger()->info("Found {} embedded textures", aiFile->mNumTextures);
 
   // Read cameras:
   if (aiFile->mNumCameras < 1) {
@@ -208,6 +311,8 @@ SceneDescription importScene(std::string& filename, bool loadNormals) {
 
   // Get materials:
   scene.materials.reserve(aiFile->mNumMaterials);
+  const auto sceneDir = std::filesystem::path(filename).parent_path();
+  std::unordered_map<std::string, std::uint32_t> texturesByPath; // Materials that share a texture share its blocks
 
   for (auto m = 0u; m < aiFile->mNumMaterials; ++m) {
     auto& mat = *aiFile->mMaterials[m];
@@ -225,6 +330,30 @@ SceneDescription importScene(std::string& filename, bool loadNormals) {
                                   matName, col.r, col.g, col.b);
     }
 
+    // The diffuse texture (if any) modulates the albedo:
+    aiString texturePath;
+    if (mat.GetTexture(aiTextureType_DIFFUSE, 0, &texturePath) == AI_SUCCESS) {
+      const std::string path = texturePath.C_Str();
+      auto found = texturesByPath.find(path);
+      if (found == texturesByPath.end()) {
+        const auto image = readTextureImage(aiFile, path, sceneDir);
+        if (image.empty()) {
+          ipu_utils::logger()->warn("Material '{}': could not read texture '{}' (ignored)", matName, path);
+        } else {
+          found = texturesByPath.emplace(path, addTexture(scene, image, maxTextureSize)).first;
+          const auto& info = scene.textures.back();
+          ipu_utils::logger()->debug("Texture '{}': {}x{} ({} levels)", path, info.width, info.height, info.numLevels);
+        }
+      }
+      if (found != texturesByPath.end()) {
+        newMaterial.albedoTexture = found->second;
+        if (err != AI_SUCCESS) {
+          newMaterial.albedo = embree_utils::Vec3fa(1.f, 1.f, 1.f);
+        }
+        ipu_utils::logger()->debug("Material '{}' albedo texture: '{}'", matName, path);
+      }
+    }
+
     mat.Get(AI_MATKEY_COLOR_EMISSIVE, col);
     if (err == AI_SUCCESS) {
       newMaterial.emission = embree_utils::Vec3fa(col.r, col.g, col.b);
@@ -281,7 +410,9 @@ SceneDescription importScene(std::string& filename, bool loadNormals) {
     }
   }
 
-  getMeshes(aiFile, scene.meshes, scene.matIDs, loadNormals);
+  getMeshes(aiFile, scene.meshes, scene.matIDs, loadNormals, scene.textures.empty() ? nullptr : &scene.meshUVs);
+  ipu_utils::logger()->info("Loaded {} textures ({} blocks)", scene.textures.size(), scene.texels.size());
+  importer.FreeScene(); // Release assimp's copy of the meshes now they are converted
 
   // Transform scene so camera is at origin looking straight down -z axis:
   aiMatrix4x4t<float> cm(
@@ -309,8 +440,9 @@ SceneDescription importScene(std::string& filename, bool loadNormals) {
     n = embree_utils::Vec3fa(-p.x, p.y, -p.z); // Swap handedness
   };
 
-  for (auto& m : scene.meshes) {
-    transform(m, tfv, tfn);
+  #pragma omp parallel for schedule(dynamic)
+  for (auto m = 0u; m < scene.meshes.size(); ++m) {
+    transform(scene.meshes[m], tfv, tfn);
   }
 
   return scene;
@@ -595,3 +727,207 @@ SceneDescription makePrimitiveScene() {
 
   return scene;
 }
+
+// Try to find the affine transform that maps the vertices of mesh a onto
+// the corresponding vertices of mesh b (the meshes must share topology):
+std::optional<AffineTransform> fitMeshTransform(const HostTriangleMesh& a, const HostTriangleMesh& b, float tolerance) {
+  // Solve the least squares problem [p 1] X = q in double precision:
+  const auto n = a.vertices.size();
+  Eigen::MatrixXd A(n, 4);
+  Eigen::MatrixXd B(n, 3);
+  for (auto v = 0u; v < n; ++v) {
+    const auto& p = a.vertices[v];
+    const auto& q = b.vertices[v];
+    A.row(v) << p.x, p.y, p.z, 1.0;
+    B.row(v) << q.x, q.y, q.z;
+  }
+  const auto qr = A.colPivHouseholderQr();
+  if (qr.rank() < 4) {
+    return {}; // Flat meshes do not define a unique transform
+  }
+  const Eigen::MatrixXd X = qr.solve(B);
+
+  AffineTransform tf;
+  for (auto r = 0u; r < 3; ++r) {
+    for (auto c = 0u; c < 4; ++c) {
+      tf.m[4 * r + c] = X(c, r);
+    }
+  }
+
+  // The fit is only accepted if every vertex (and normal) matches:
+  const auto extent = b.getBoundingBox().max - b.getBoundingBox().min;
+  const float maxError = tolerance * std::sqrt(extent.squaredNorm());
+  for (auto v = 0u; v < n; ++v) {
+    const auto d = tf.point(a.vertices[v]) - b.vertices[v];
+    if (d.squaredNorm() > maxError * maxError) {
+      return {};
+    }
+  }
+
+  try {
+    const auto worldToObject = tf.inverse();
+    for (auto v = 0u; v < a.normals.size(); ++v) {
+      const auto n = worldToObject.transposedVector(a.normals[v]).normalized();
+      if ((n - b.normals[v]).squaredNorm() > 1e-4f) {
+        return {};
+      }
+    }
+  } catch (const std::runtime_error&) {
+    return {};
+  }
+
+  return tf;
+}
+
+std::size_t instanceDuplicateMeshes(SceneDescription& scene, float tolerance) {
+  if (!scene.instancePrims.empty()) {
+    throw std::logic_error("Meshes must be instanced before the scene data is built.");
+  }
+
+  // Candidate duplicates must have identical triangles so group them by a hash of the topology:
+  auto topologyHash = [](const HostTriangleMesh& m) {
+    std::size_t h = std::hash<std::size_t>()(m.vertices.size()) ^ (m.normals.size() << 1);
+    for (const auto& t : m.triangles) {
+      h = h * 31 + ((std::size_t)t.v0 | (std::size_t)t.v1 << 16 | (std::size_t)t.v2 << 32);
+    }
+    return h;
+  };
+  auto sameTopology = [](const HostTriangleMesh& a, const HostTriangleMesh& b) {
+    return a.vertices.size() == b.vertices.size() && a.normals.size() == b.normals.size() &&
+           a.triangles.size() == b.triangles.size() &&
+           std::equal(a.triangles.begin(), a.triangles.end(), b.triangles.begin(),
+                      [](const Triangle& s, const Triangle& t) { return s.v0 == t.v0 && s.v1 == t.v1 && s.v2 == t.v2; });
+  };
+
+  // For each mesh find the first earlier mesh that it is a transformed copy of:
+  const auto numMeshes = scene.meshes.size();
+  const auto notInstanced = std::numeric_limits<std::size_t>::max();
+  std::vector<std::size_t> source(numMeshes, notInstanced);
+  std::vector<AffineTransform> transforms(numMeshes, AffineTransform::identity());
+  std::unordered_map<std::size_t, std::vector<std::size_t>> groups;
+  auto hasUVs = [&](std::size_t m) { return m < scene.meshUVs.size() && !scene.meshUVs[m].empty(); };
+  for (auto m = 0u; m < numMeshes; ++m) {
+    if (hasUVs(m)) {
+      continue; // Instances are not textured so textured meshes stay as they are
+    }
+    auto& candidates = groups[topologyHash(scene.meshes[m])];
+    for (auto c : candidates) {
+      if (!sameTopology(scene.meshes[c], scene.meshes[m])) { continue; }
+      if (auto tf = fitMeshTransform(scene.meshes[c], scene.meshes[m], tolerance)) {
+        source[m] = c;
+        source[c] = c; // The first mesh in a group is its own source
+        transforms[m] = *tf;
+        break;
+      }
+    }
+    if (source[m] == notInstanced) {
+      candidates.push_back(m);
+    }
+  }
+
+  // Meshes that were not duplicated stay as they are. The rest become
+  // prototypes (the source meshes) and instances (every member of a group):
+  std::vector<HostTriangleMesh> meshes;
+  std::vector<std::uint32_t> matIDs;
+  std::vector<std::vector<TexCoord>> meshUVs;
+  std::vector<std::uint32_t> instanceMatIDs;
+  std::unordered_map<std::size_t, std::uint32_t> prototypeIndex;
+  std::size_t count = 0;
+  for (auto m = 0u; m < numMeshes; ++m) {
+    if (source[m] == notInstanced) {
+      meshes.push_back(std::move(scene.meshes[m]));
+      matIDs.push_back(scene.matIDs[m]);
+      if (hasUVs(m)) {
+        meshUVs.resize(meshes.size());
+        meshUVs.back() = std::move(scene.meshUVs[m]);
+      }
+      continue;
+    }
+    if (source[m] == m) {
+      prototypeIndex[m] = scene.prototypes.size();
+      scene.prototypes.push_back(scene.meshes[m]);
+    }
+    scene.instances.push_back(InstanceDescription{prototypeIndex.at(source[m]), transforms[m]});
+    instanceMatIDs.push_back(scene.matIDs[m]);
+    count += 1;
+  }
+
+  // Material IDs of the other primitives keep their order and the new
+  // instances' IDs are appended after any instances that already existed:
+  matIDs.insert(matIDs.end(), scene.matIDs.begin() + numMeshes, scene.matIDs.end());
+  matIDs.insert(matIDs.end(), instanceMatIDs.begin(), instanceMatIDs.end());
+  scene.meshes = std::move(meshes);
+  scene.matIDs = std::move(matIDs);
+  scene.meshUVs = std::move(meshUVs);
+
+  return count;
+}
+
+void unifyMeshes(const SceneDescription& scene, SceneData& data) {
+  // The triangle buffer indices, vertices, and normals of every mesh (with the
+  // instanced prototypes after the others) go into unified arrays. Their offsets
+  // are found by a prefix sum so that the buffers are sized once and every mesh
+  // is copied straight to its place in parallel:
+  std::vector<const HostTriangleMesh*> unifiedMeshes;
+  unifiedMeshes.reserve(scene.meshes.size() + scene.prototypes.size());
+  for (const auto& m : scene.meshes) { unifiedMeshes.push_back(&m); }
+  for (const auto& m : scene.prototypes) { unifiedMeshes.push_back(&m); }
+
+  // Imported meshes are split to fit the triangle index type but meshes made any
+  // other way could still overflow it (or overflow the geometry references):
+  if (unifiedMeshes.size() > std::numeric_limits<decltype(GeomRef::index)>::max()) {
+    throw std::runtime_error("Too many meshes in scene: " + std::to_string(unifiedMeshes.size()));
+  }
+  for (auto m = 0u; m < unifiedMeshes.size(); ++m) {
+    if (unifiedMeshes[m]->numVertices() > std::size_t(Triangle::MaxIndex) + 1) {
+      throw std::runtime_error("Mesh " + std::to_string(m) + " has more vertices (" +
+                               std::to_string(unifiedMeshes[m]->numVertices()) + ") than triangles can index.");
+    }
+  }
+
+  std::vector<std::size_t> normalOffsets;
+  normalOffsets.reserve(unifiedMeshes.size());
+  data.meshInfo.clear();
+  data.meshInfo.reserve(unifiedMeshes.size());
+  std::size_t numTris = 0;
+  std::size_t numVerts = 0;
+  std::size_t numNormals = 0;
+  for (const auto* m : unifiedMeshes) {
+    data.meshInfo.emplace_back(
+      MeshInfo{
+        (std::uint32_t)numTris, (std::uint32_t)numVerts,
+        (std::uint32_t)m->triangles.size(), (std::uint32_t)m->vertices.size()
+      }
+    );
+    normalOffsets.push_back(numNormals);
+    numTris += m->triangles.size();
+    numVerts += m->vertices.size();
+    numNormals += m->normals.size();
+  }
+
+  data.meshTris.assign(numTris, Triangle(0, 0, 0));
+  data.meshVerts.resize(numVerts);
+  data.meshNormals.resize(numNormals);
+  #pragma omp parallel for schedule(dynamic)
+  for (auto i = 0u; i < unifiedMeshes.size(); ++i) {
+    const auto& m = *unifiedMeshes[i];
+    const auto& info = data.meshInfo[i];
+    std::copy(m.triangles.begin(), m.triangles.end(), data.meshTris.begin() + info.firstIndex);
+    std::copy(m.vertices.begin(), m.vertices.end(), data.meshVerts.begin() + info.firstVertex);
+    std::copy(m.normals.begin(), m.normals.end(), data.meshNormals.begin() + normalOffsets[i]);
+  }
+
+  // Texture coordinates are unified like the vertices (meshes without any get zeros):
+  data.meshUVs.clear();
+  const bool hasUVs = std::any_of(scene.meshUVs.begin(), scene.meshUVs.end(), [](const auto& uvs) { return !uvs.empty(); });
+  if (hasUVs) {
+    data.meshUVs.assign(numVerts, TexCoord{0.f, 0.f});
+    for (auto i = 0u; i < scene.meshUVs.size() && i < scene.meshes.size(); ++i) {
+      const auto& uvs = scene.meshUVs[i];
+      if (!uvs.empty() && uvs.size() != scene.meshes[i].vertices.size()) {
+        throw std::runtime_error("Mesh " + std::to_string(i) + " must have one texture coordinate per vertex.");
+      }
+      std::copy(uvs.begin(), uvs.end(), data.meshUVs.begin() + data.meshInfo[i].firstVertex);
+    }
+  }
+}
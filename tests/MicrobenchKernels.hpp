@@ -0,0 +1,128 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Kernels timed by the microbenchmarks. The host harness (microbench.cpp) and
+// the IPU codelets (microbench_codelets.cpp) both run these functions so that
+// they time identical code. Each kernel loops over a list of inputs and returns
+// a checksum of its results so that the work can not be optimised away.
+
+#pragma once
+
+#include <BxDF.hpp>
+#include <CompactBVH2Node.hpp>
+#include <Mesh.hpp>
+#include <Primitives.hpp>
+#include <math/sincos.hpp>
+
+enum MicrobenchKernel : std::uint32_t {
+  RAY_SLAB, // intersectRaySlab(): floats per item are inverse direction, origin, slab min, slab max
+  TRIANGLE, // TriangleMesh::intersectTriangle(): each item is a ray (Ray layout) tested against the item's triangle
+  SPHERE, // Sphere::intersect(): each item is a ray
+  DISC, // Disc::intersect(): each item is a ray
+  SAMPLE_DIFFUSE, // sampleDiffuse(): floats per item are the normal then two uniform samples
+  DIELECTRIC, // dielectric(): each item is a ray followed by the normal and a uniform sample
+  SINCOS, // sincos() from ext/math: each item is an angle
+  STD_SINCOS, // std::sin() and std::cos() for comparison with sincos()
+  MICROBENCH_KERNEL_COUNT
+};
+
+/// Number of floats per input item of a kernel:
+inline std::uint32_t microbenchItemFloats(MicrobenchKernel kernel) {
+  constexpr auto rayFloats = sizeof(embree_utils::Ray) / sizeof(float);
+  switch (kernel) {
+    case RAY_SLAB: return 4;
+    case TRIANGLE:
+    case SPHERE:
+    case DISC: return rayFloats;
+    case SAMPLE_DIFFUSE: return 5;
+    case DIELECTRIC: return rayFloats + 4;
+    default: return 1;
+  }
+}
+
+/// Inputs of a run of a kernel. The triangle kernel tests item i against triangle i % numTriangles:
+struct MicrobenchData {
+  const float* items;
+  std::uint32_t numItems;
+  const embree_utils::Vec3fa* vertices;
+  const Triangle* triangles;
+  std::uint32_t numTriangles;
+};
+
+// The sphere and disc that the ray kernels test against (centred on the rays' target):
+inline Sphere microbenchSphere() { return Sphere(embree_utils::Vec3fa(0.f, 0.f, -4.f), 1.f); }
+inline Disc microbenchDisc() { return Disc(embree_utils::Vec3fa(0.f, 0.f, 1.f), embree_utils::Vec3fa(0.f, 0.f, -4.f), 1.f); }
+
+/// Run a kernel over every input item and return the checksum of the results:
+inline float runMicrobench(MicrobenchKernel kernel, const MicrobenchData& in) {
+  using namespace embree_utils;
+  const auto stride = microbenchItemFloats(kernel);
+  const auto* rays = reinterpret_cast<const Ray*>(in.items);
+  float sum = 0.f;
+  switch (kernel) {
+    case RAY_SLAB:
+      for (auto i = 0u; i < in.numItems; ++i) {
+        const float* f = in.items + i * stride;
+        float t0 = 0.f;
+        float t1 = std::numeric_limits<float>::infinity();
+        if (intersectRaySlab(f[0], f[1], f[2], f[3], t0, t1)) {
+          sum += t0;
+        }
+      }
+      break;
+    case TRIANGLE: {
+      // The mesh only refers to the inputs (which it never modifies):
+      const CompiledTriangleMesh mesh(Bounds3d(), ArrayRef<Triangle>(const_cast<Triangle*>(in.triangles), in.numTriangles),
+                                      ArrayRef<Vec3fa>(const_cast<Vec3fa*>(in.vertices), 3 * in.numTriangles),
+                                      ArrayRef<Vec3fa>());
+      for (auto i = 0u; i < in.numItems; ++i) {
+        const auto result = mesh.intersectTriangle(i % in.numTriangles, RayShearParams(rays[i]), rays[i].tMax);
+        sum += result.t + result.b0;
+      }
+      break;
+    }
+    case SPHERE: {
+      const auto sphere = microbenchSphere();
+      for (auto i = 0u; i < in.numItems; ++i) {
+        sum += intersectPrimitive(sphere, 0, rays[i]).t;
+      }
+      break;
+    }
+    case DISC: {
+      const auto disc = microbenchDisc();
+      for (auto i = 0u; i < in.numItems; ++i) {
+        sum += intersectPrimitive(disc, 0, rays[i]).t;
+      }
+      break;
+    }
+    case SAMPLE_DIFFUSE:
+      for (auto i = 0u; i < in.numItems; ++i) {
+        const float* f = in.items + i * stride;
+        const auto dir = sampleDiffuse(Vec3fa(f[0], f[1], f[2]), f[3], f[4]);
+        sum += dir.x + dir.y + dir.z;
+      }
+      break;
+    case DIELECTRIC:
+      for (auto i = 0u; i < in.numItems; ++i) {
+        const float* f = in.items + i * stride;
+        const auto& ray = *reinterpret_cast<const Ray*>(f);
+        const auto [dir, refracted] = dielectric(ray, Vec3fa(f[stride - 4], f[stride - 3], f[stride - 2]), 1.5f, f[stride - 1]);
+        sum += dir.x + dir.y + dir.z + float(refracted);
+      }
+      break;
+    case SINCOS:
+      for (auto i = 0u; i < in.numItems; ++i) {
+        float s, c;
+        sincos(in.items[i], s, c);
+        sum += s + c;
+      }
+      break;
+    case STD_SINCOS:
+      for (auto i = 0u; i < in.numItems; ++i) {
+        sum += std::sin(in.items[i]) + std::cos(in.items[i]);
+      }
+      break;
+    default:
+      break;
+  }
+  return sum;
+}
@@ -0,0 +1,311 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// Microbenchmarks of the core ray tracing kernels (see MicrobenchKernels.hpp).
+// Every kernel is timed on the host and (with --ipu) counted in tile cycles on
+// a single IPU worker. The IPU runs use the codelets compiled without and with
+// the double precision fallback in the triangle test. The host runs use the
+// build's ALLOW_DOUBLE_FALLBACK setting.
+
+#include <app_utils.hpp>
+
+#include "MicrobenchKernels.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <random>
+
+namespace {
+
+const char* kernelName(MicrobenchKernel kernel) {
+  static const char* names[] = {"ray_slab", "triangle", "sphere", "disc", "sample_diffuse", "dielectric", "sincos", "std_sincos"};
+  return names[kernel];
+}
+
+// Codelets built with the double precision fallback disabled and enabled:
+const std::vector<std::pair<std::string, std::string>> ipuVariants = {
+  {"MicrobenchCodelets.gp", "fp32"},
+  {"MicrobenchCodeletsFp64.gp", "fp64_fallback"}
+};
+
+/// Host copy of a kernel's inputs:
+struct MicrobenchInputs {
+  std::vector<float> items;
+  std::vector<embree_utils::Vec3fa> vertices = {embree_utils::Vec3fa(0.f)};
+  std::vector<TriangleIndex> triangles = {0, 0, 0};
+  std::uint32_t numItems = 0;
+
+  MicrobenchData data() const {
+    const auto numTriangles = std::uint32_t(triangles.size() / 3);
+    return MicrobenchData{items.data(), numItems, vertices.data(), reinterpret_cast<const Triangle*>(triangles.data()), numTriangles};
+  }
+};
+
+void addFloats(std::vector<float>& items, const embree_utils::Vec3fa& v) {
+  items.insert(items.end(), {v.x, v.y, v.z});
+}
+
+void addRay(std::vector<float>& items, const embree_utils::Ray& ray) {
+  const auto* f = reinterpret_cast<const float*>(&ray);
+  items.insert(items.end(), f, f + sizeof(embree_utils::Ray) / sizeof(float));
+}
+
+/// Make random inputs for a kernel. The rays are aimed at the region around the
+/// sphere and disc so that some hit and some miss. A quarter of the triangle
+/// kernel's rays travel straight down onto one of their triangle's vertices
+/// (which have integer coordinates) so that the edge tests are exactly zero and
+/// take the double precision fallback (when it is enabled). Both sin/cos kernels
+/// get the same angles:
+MicrobenchInputs makeInputs(MicrobenchKernel kernel, std::uint32_t numItems, std::uint32_t seed) {
+  using namespace embree_utils;
+  std::mt19937 gen(seed + (kernel == STD_SINCOS ? SINCOS : kernel));
+  std::uniform_real_distribution<float> unit(0.f, 1.f);
+  auto uniform = [&](float lo, float hi) { return lo + (hi - lo) * unit(gen); };
+  auto unitVector = [&]() {
+    return Vec3fa(uniform(-1.f, 1.f), uniform(-1.f, 1.f), uniform(-1.f, 1.f) + 1e-3f).normalized();
+  };
+  auto aimedRay = [&](const Vec3fa& target) {
+    const Vec3fa origin(uniform(-.1f, .1f), uniform(-.1f, .1f), 0.f);
+    return Ray(origin, (target - origin).normalized());
+  };
+
+  MicrobenchInputs in;
+  in.numItems = numItems;
+  if (kernel == TRIANGLE) {
+    const auto numTriangles = std::min<std::uint32_t>(numItems, 256);
+    in.vertices.clear();
+    in.triangles.clear();
+    for (auto t = 0u; t < numTriangles; ++t) {
+      for (auto v = 0u; v < 3; ++v) {
+        in.vertices.push_back(Vec3fa(std::round(uniform(-8.f, 8.f)), std::round(uniform(-8.f, 8.f)), -4.f - t % 4));
+        in.triangles.push_back(3 * t + v);
+      }
+    }
+  }
+
+  for (auto i = 0u; i < numItems; ++i) {
+    switch (kernel) {
+      case RAY_SLAB: {
+        const auto slabMin = uniform(-1.f, 0.f);
+        const auto dir = uniform(.01f, 1.f) * (unit(gen) < .5f ? -1.f : 1.f);
+        in.items.insert(in.items.end(), {1.f / dir, uniform(-2.f, 2.f), slabMin, slabMin + uniform(0.f, 1.f)});
+        break;
+      }
+      case TRIANGLE: {
+        const auto t = i % (in.triangles.size() / 3);
+        const auto& v0 = in.vertices[3 * t];
+        if (i % 4 == 3) {
+          addRay(in.items, Ray(Vec3fa(v0.x, v0.y, 0.f), Vec3fa(0.f, 0.f, -1.f)));
+        } else {
+          const auto centroid = (v0 + in.vertices[3 * t + 1] + in.vertices[3 * t + 2]) * (1.f / 3.f);
+          addRay(in.items, aimedRay(centroid + Vec3fa(uniform(-1.f, 1.f), uniform(-1.f, 1.f), 0.f)));
+        }
+        break;
+      }
+      case SPHERE:
+      case DISC:
+        addRay(in.items, aimedRay(Vec3fa(uniform(-1.5f, 1.5f), uniform(-1.5f, 1.5f), -4.f)));
+        break;
+      case SAMPLE_DIFFUSE:
+        addFloats(in.items, unitVector());
+        in.items.insert(in.items.end(), {unit(gen), unit(gen)});
+        break;
+      case DIELECTRIC:
+        addRay(in.items, Ray(Vec3fa(0.f), unitVector()));
+        addFloats(in.items, unitVector());
+        in.items.push_back(unit(gen));
+        break;
+      default:
+        in.items.push_back(uniform(0.f, TwoPi));
+        break;
+    }
+  }
+  return in;
+}
+
+struct MicrobenchResult {
+  double hostNsPerItem = std::numeric_limits<double>::quiet_NaN();
+  float hostChecksum = 0.f;
+  std::vector<double> ipuCyclesPerItem; // One for each IPU variant (NaN if it was not run)
+  std::vector<float> ipuChecksums;
+};
+
+// Fastest of the repeated runs on the host:
+void runOnHost(const std::vector<MicrobenchInputs>& inputs, std::uint32_t repeats, std::vector<MicrobenchResult>& results) {
+  for (auto k = 0u; k < MICROBENCH_KERNEL_COUNT; ++k) {
+    const auto kernel = MicrobenchKernel(k);
+    const auto data = inputs[k].data();
+    double bestSecs = std::numeric_limits<double>::infinity();
+    for (auto r = 0u; r < repeats; ++r) {
+      const auto start = std::chrono::steady_clock::now();
+      volatile float checksum = runMicrobench(kernel, data);
+      const auto end = std::chrono::steady_clock::now();
+      bestSecs = std::min(bestSecs, std::chrono::duration<double>(end - start).count());
+      results[k].hostChecksum = checksum;
+    }
+    results[k].hostNsPerItem = 1e9 * bestSecs / data.numItems;
+  }
+}
+
+// Each kernel runs on its own tile (in one compute set) and counts its own cycles:
+bool runOnIpu(const std::string& codelets, const std::vector<MicrobenchInputs>& inputs,
+              std::vector<float>& checksums, std::vector<unsigned>& cycles) {
+  using namespace poplar;
+  ipu_utils::StreamableTensor checksumsVar("checksums");
+  ipu_utils::StreamableTensor cyclesVar("cycles");
+  checksums.assign(MICROBENCH_KERNEL_COUNT, 0.f);
+  cycles.assign(MICROBENCH_KERNEL_COUNT, 0u);
+
+  auto builder = ipu_utils::LambdaBuilder(
+    [&](Graph& graph, const Target& target, ipu_utils::ProgramManager& progs) {
+      graph.addCodelets(codelets);
+      checksumsVar.buildTensor(graph, FLOAT, {MICROBENCH_KERNEL_COUNT});
+      cyclesVar.buildTensor(graph, UNSIGNED_INT, {MICROBENCH_KERNEL_COUNT});
+      auto cs = graph.addComputeSet("microbench");
+      for (auto k = 0u; k < MICROBENCH_KERNEL_COUNT; ++k) {
+        const auto& in = inputs[k];
+        const auto tile = k;
+        const auto name = std::string(kernelName(MicrobenchKernel(k)));
+        auto items = graph.addVariable(FLOAT, {in.items.size()}, name + "_items");
+        auto vertices = graph.addVariable(FLOAT, {3 * in.vertices.size()}, name + "_vertices");
+        auto triangles = graph.addVariable(poplar::equivalent_device_type<TriangleIndex>().value, {in.triangles.size()}, name + "_triangles");
+        graph.setInitialValue(items, poplar::ArrayRef<float>(in.items));
+        graph.setInitialValue(vertices, poplar::ArrayRef<float>(reinterpret_cast<const float*>(in.vertices.data()), 3 * in.vertices.size()));
+        graph.setInitialValue(triangles, poplar::ArrayRef<TriangleIndex>(in.triangles));
+
+        auto v = graph.addVertex(cs, "Microbench");
+        graph.connect(v["items"], items);
+        graph.connect(v["vertices"], vertices);
+        graph.connect(v["triangles"], triangles);
+        graph.connect(v["checksum"], checksumsVar.get().slice(k, k + 1));
+        graph.connect(v["cycles"], cyclesVar.get().slice(k, k + 1));
+        graph.setInitialValue(v["kernel"], k);
+        for (auto t : {items, vertices, triangles, checksumsVar.get().slice(k, k + 1), cyclesVar.get().slice(k, k + 1)}) {
+          graph.setTileMapping(t, tile);
+        }
+        graph.setTileMapping(v, tile);
+      }
+      progs.add("microbench", program::Sequence({
+        program::Execute(cs),
+        checksumsVar.buildRead(graph, true),
+        cyclesVar.buildRead(graph, true)
+      }));
+    },
+    [&](Engine& engine, const Device& device, const ipu_utils::ProgramManager& progs) {
+      checksumsVar.connectReadStream(engine, checksums);
+      cyclesVar.connectReadStream(engine, cycles);
+      progs.run(engine, "microbench");
+    }
+  );
+
+  builder.setRuntimeConfig(ipu_utils::RuntimeConfig{
+    1, 1, // numIpus, numReplicas
+    "microbench", // exeName
+    false, false, false, // useIpuModel, saveExe, loadExe
+    false, true // compileOnly, deferredAttach
+  });
+  return ipu_utils::GraphManager().run(builder) == EXIT_SUCCESS;
+}
+
+std::string jsonNumber(double v) {
+  return std::isfinite(v) ? std::to_string(v) : "null";
+}
+
+} // end anonymous namespace
+
+int main(int argc, char** argv) {
+  namespace po = boost::program_options;
+  po::options_description desc;
+  desc.add_options()
+  ("help", "Show command help.")
+  ("items", po::value<std::uint32_t>()->default_value(1024), "Number of inputs each kernel processes per run.")
+  ("repeats", po::value<std::uint32_t>()->default_value(200), "Number of host runs of each kernel (the fastest is reported).")
+  ("seed", po::value<std::uint32_t>()->default_value(1442), "Seed for the random inputs.")
+  ("ipu", po::bool_switch()->default_value(false),
+   "Also count each kernel's tile cycles on IPU (with the codelets built without and with the double precision fallback).")
+  ("codelet-dir", po::value<std::string>()->default_value("."), "Directory that contains the microbenchmark codelets.")
+  ("output", po::value<std::string>()->default_value(""), "If set write the results to this file as JSON.")
+  ("log-level", po::value<std::string>()->default_value("info"),
+  "Set the log level to one of the following: 'trace', 'debug', 'info', 'warn', 'err', 'critical', 'off'.");
+
+  po::variables_map args;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), args);
+    if (args.count("help")) {
+      std::cout << desc << "\n";
+      return EXIT_FAILURE;
+    }
+    po::notify(args);
+    setupLogging(args);
+  } catch (const std::exception& e) {
+    ipu_utils::logger()->error("Exiting after: {}.", e.what());
+    return EXIT_FAILURE;
+  }
+
+  const auto numItems = args.at("items").as<std::uint32_t>();
+  std::vector<MicrobenchInputs> inputs;
+  std::vector<MicrobenchResult> results(MICROBENCH_KERNEL_COUNT);
+  for (auto k = 0u; k < MICROBENCH_KERNEL_COUNT; ++k) {
+    inputs.push_back(makeInputs(MicrobenchKernel(k), numItems, args.at("seed").as<std::uint32_t>()));
+    results[k].ipuCyclesPerItem.assign(ipuVariants.size(), std::numeric_limits<double>::quiet_NaN());
+    results[k].ipuChecksums.assign(ipuVariants.size(), 0.f);
+  }
+
+  runOnHost(inputs, args.at("repeats").as<std::uint32_t>(), results);
+
+  if (args.at("ipu").as<bool>()) {
+    for (auto v = 0u; v < ipuVariants.size(); ++v) {
+      const auto codelets = std::filesystem::path(args.at("codelet-dir").as<std::string>()) / ipuVariants[v].first;
+      if (!std::filesystem::exists(codelets)) {
+        ipu_utils::logger()->warn("Skipping IPU variant '{}': codelets not found: '{}'", ipuVariants[v].second, codelets.string());
+        continue;
+      }
+      std::vector<float> checksums;
+      std::vector<unsigned> cycles;
+      if (!runOnIpu(codelets.string(), inputs, checksums, cycles)) {
+        ipu_utils::logger()->error("IPU variant '{}' failed.", ipuVariants[v].second);
+        return EXIT_FAILURE;
+      }
+      for (auto k = 0u; k < MICROBENCH_KERNEL_COUNT; ++k) {
+        results[k].ipuCyclesPerItem[v] = double(cycles[k]) / numItems;
+        results[k].ipuChecksums[v] = checksums[k];
+      }
+    }
+  }
+
+  // The checksums are only expected to agree approximately (the devices' maths libraries differ):
+  ipu_utils::logger()->info("Host build ALLOW_DOUBLE_FALLBACK={}", ALLOW_DOUBLE_FALLBACK);
+  ipu_utils::logger()->info("{:<16} {:>12} {:>14} {:>14}", "kernel", "host ns/item",
+                            "cycles/item " + ipuVariants[0].second, "cycles/item " + ipuVariants[1].second);
+  for (auto k = 0u; k < MICROBENCH_KERNEL_COUNT; ++k) {
+    const auto& r = results[k];
+    ipu_utils::logger()->info("{:<16} {:>12.2f} {:>14.1f} {:>14.1f}", kernelName(MicrobenchKernel(k)),
+                              r.hostNsPerItem, r.ipuCyclesPerItem[0], r.ipuCyclesPerItem[1]);
+    for (auto v = 0u; v < ipuVariants.size(); ++v) {
+      const auto diff = std::abs(r.ipuChecksums[v] - r.hostChecksum);
+      if (std::isfinite(r.ipuCyclesPerItem[v]) && diff > 1e-3f * std::max(1.f, std::abs(r.hostChecksum))) {
+        ipu_utils::logger()->warn("{} checksum differs between host and IPU ({}): {} vs {}",
+                                  kernelName(MicrobenchKernel(k)), ipuVariants[v].second, r.hostChecksum, r.ipuChecksums[v]);
+      }
+    }
+  }
+
+  const auto outputFile = args.at("output").as<std::string>();
+  if (!outputFile.empty()) {
+    std::ofstream json(outputFile);
+    json << "{\n  \"items\": " << numItems << ",\n  \"host_double_fallback\": " << (ALLOW_DOUBLE_FALLBACK ? "true" : "false")
+         << ",\n  \"kernels\": [\n";
+    for (auto k = 0u; k < MICROBENCH_KERNEL_COUNT; ++k) {
+      const auto& r = results[k];
+      json << "    {\"kernel\": \"" << kernelName(MicrobenchKernel(k)) << "\", \"host_ns_per_item\": " << jsonNumber(r.hostNsPerItem);
+      for (auto v = 0u; v < ipuVariants.size(); ++v) {
+        json << ", \"ipu_cycles_per_item_" << ipuVariants[v].second << "\": " << jsonNumber(r.ipuCyclesPerItem[v]);
+      }
+      json << "}" << (k + 1 < MICROBENCH_KERNEL_COUNT ? "," : "") << "\n";
+    }
+    json << "  ]\n}\n";
+  }
+
+  return EXIT_SUCCESS;
+}
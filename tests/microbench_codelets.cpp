@@ -0,0 +1,38 @@
+// Copyright (c) 2023 Graphcore Ltd. All rights reserved.
+
+// This file contains the IPU codelets of the microbenchmark program (see microbench.cpp).
+
+#include <poplar/Vertex.hpp>
+
+#include "MicrobenchKernels.hpp"
+
+using namespace poplar;
+
+// Lower 32 bits of the tile's cycle counter (differences are correct across one wrap):
+inline unsigned tileCycleCount() {
+  return __builtin_ipu_get_scount_l();
+}
+
+/// Time one run of a kernel over its inputs on a single worker:
+class Microbench : public Vertex {
+public:
+  Input<Vector<float, poplar::VectorLayout::SPAN, 8>> items;
+  Input<Vector<float, poplar::VectorLayout::SPAN, 8>> vertices; // Only read by the triangle kernel
+  Input<Vector<TriangleIndex>> triangles;
+  Output<Vector<float>> checksum;
+  Output<Vector<unsigned>> cycles;
+  unsigned kernel;
+
+  bool compute() {
+    const auto kernelID = MicrobenchKernel(kernel);
+    const MicrobenchData data{
+      &items[0], unsigned(items.size() / microbenchItemFloats(kernelID)),
+      reinterpret_cast<const embree_utils::Vec3fa*>(&vertices[0]),
+      reinterpret_cast<const Triangle*>(&triangles[0]), unsigned(triangles.size() / 3)
+    };
+    const auto start = tileCycleCount();
+    checksum[0] = runMicrobench(kernelID, data);
+    cycles[0] = tileCycleCount() - start;
+    return true;
+  }
+};
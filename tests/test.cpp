@@ -6,12 +6,46 @@
 #define BOOST_TEST_DYN_LINK
 
 #include <boost/test/unit_test.hpp>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <numeric>
+#include <random>
+#include <thread>
 #include <iostream>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <CompactBVH2Node.hpp>
+#include <CompactBVH4Node.hpp>
+#include <CompactBVH4QNode.hpp>
+#include <CompactBvhBuild.hpp>
+#include <Instance.hpp>
+#include <Mesh.hpp>
+#include <RayBatchQueue.hpp>
+#include <RayBudget.hpp>
+#include <RayCallbackPool.hpp>
+#include <RayPacket.hpp>
+#include <RayStream.hpp>
+#include <RenderFarm.hpp>
+#include <RaySort.hpp>
+#include <SceneAnalysis.hpp>
+#include <SceneCache.hpp>
+#include <SlimRay.hpp>
+#include <StreamingExr.hpp>
+#include <Texture.hpp>
+#include <TileOrder.hpp>
+#include <AdaptiveSampling.hpp>
+#include <CameraPath.hpp>
+#include <Denoiser.hpp>
+#include <EnvMap.hpp>
+#include <Lights.hpp>
+#include <SobolSampler.hpp>
+#include <NifMlp.hpp>
+#include <ProgressiveImage.hpp>
 #include <Arrays.hpp>
+#include <scene_utils.hpp>
+#include <embree_utils/EmbreeScene.hpp>
 #include <serialisation/Serialiser.hpp>
 #include <serialisation/Deserialiser.hpp>
 #include <serialisation/serialisation.hpp>
@@ -153,6 +187,1440 @@ BOOST_AUTO_TEST_CASE(SerialiseBVHNode) {
   testCompactBvhNode<16>();
 }
 
+BOOST_AUTO_TEST_CASE(WideBVHNodeIntersect) {
+  // Three unit boxes in a row along the x-axis at x = 0, 2, 4:
+  CompactBVH4Node node;
+  node.min_x = 0.f; node.min_y = 0.f; node.min_z = 0.f;
+  node.childCount = 3;
+  for (auto c = 0u; c < CompactBVH4Node::Width; ++c) {
+    node.lo_x[c] = (half)(2.f * c);
+    node.hi_x[c] = (half)(2.f * c + 1.f);
+    node.lo_y[c] = node.lo_z[c] = (half)0.f;
+    node.hi_y[c] = node.hi_z[c] = (half)1.f;
+    node.child[c] = c;
+    node.geomID[c] = c;
+  }
+
+  float tEntry[CompactBVH4Node::Width];
+  const embree_utils::Vec3fa origin(-1.f, .5f, .5f);
+  const embree_utils::Vec3fa invDir(1.f, std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity());
+  const auto inf = std::numeric_limits<float>::infinity();
+  // The unused fourth slot must never be reported:
+  BOOST_CHECK_EQUAL(node.intersect(origin, invDir, 0.f, inf, tEntry), 0b111);
+  BOOST_CHECK_EQUAL(tEntry[0], 1.f);
+  BOOST_CHECK_EQUAL(tEntry[2], 5.f);
+  // Range limits should cull the far boxes:
+  BOOST_CHECK_EQUAL(node.intersect(origin, invDir, 0.f, 3.5f, tEntry), 0b011);
+  BOOST_CHECK_EQUAL(node.intersect(origin, invDir, 2.5f, inf, tEntry), 0b110);
+
+  // A ray along y through the middle box only:
+  const embree_utils::Vec3fa originY(2.5f, -1.f, .5f);
+  const embree_utils::Vec3fa invDirY(inf, 1.f, inf);
+  BOOST_CHECK_EQUAL(node.intersect(originY, invDirY, 0.f, inf, tEntry), 0b010);
+
+  BOOST_CHECK_EQUAL(node.toBounds().max.x, 5.f);
+}
+
+BOOST_AUTO_TEST_CASE(QuantisedBVHNodeIntersect) {
+  // Three boxes of width 100 in a row along the x-axis at x = 1000, 1200, 1400.
+  // The grid spacing on x is 2 so the boxes are 50 grid steps wide:
+  CompactBVH4QNode node;
+  node.min_x = 1000.f; node.min_y = 0.f; node.min_z = 0.f;
+  node.exp_x = 1; node.exp_y = -1; node.exp_z = -1;
+  node.childCount = 3;
+  for (auto c = 0u; c < node.childCount; ++c) {
+    node.lo_x[c] = 100 * c;
+    node.hi_x[c] = 100 * c + 50;
+    node.lo_y[c] = node.lo_z[c] = 0;
+    node.hi_y[c] = node.hi_z[c] = 2;
+    node.child[c] = c;
+    node.geomID[c] = c;
+  }
+
+  const auto inf = std::numeric_limits<float>::infinity();
+  float tEntry[CompactBVH4QNode::Width];
+  const embree_utils::Vec3fa origin(0.f, .5f, .5f);
+  const embree_utils::Vec3fa invDir(1.f, inf, inf);
+  BOOST_CHECK_EQUAL(node.intersect(origin, invDir, 0.f, inf, tEntry), 0b111);
+  BOOST_CHECK_EQUAL(node.intersect(origin, invDir, 0.f, 1250.f, tEntry), 0b011);
+  BOOST_CHECK_EQUAL(node.intersect(origin, invDir, 1150.f, inf, tEntry), 0b110);
+
+  // Just outside the boxes in y should miss everything:
+  const embree_utils::Vec3fa outside(0.f, 1.01f, .5f);
+  BOOST_CHECK_EQUAL(node.intersect(outside, invDir, 0.f, inf, tEntry), 0b000);
+
+  const auto b = node.childBounds(2);
+  BOOST_CHECK_EQUAL(b.min.x, 1400.f);
+  BOOST_CHECK_EQUAL(b.max.x, 1500.f);
+  BOOST_CHECK_EQUAL(b.max.y, 1.f);
+}
+
+BOOST_AUTO_TEST_CASE(LeafPrimPacking) {
+  for (auto count = 1u; count <= MaxLeafPrims; ++count) {
+    auto packed = packLeafPrims(LeafPrimMask, count);
+    BOOST_CHECK_EQUAL(leafFirstPrim(packed), LeafPrimMask);
+    BOOST_CHECK_EQUAL(leafPrimCount(packed), count);
+  }
+  BOOST_CHECK_EQUAL(packLeafPrims(123, 1), 123u);
+}
+
+BOOST_AUTO_TEST_CASE(SahBvhBuild) {
+  // Random boxes from two geometries (enough to exercise the parallel build):
+  std::mt19937 gen(7);
+  std::uniform_real_distribution<float> u(0.f, 100.f);
+  std::vector<BuildPrimitive> prims;
+  for (auto i = 0u; i < 20000; ++i) {
+    const embree_utils::Vec3fa lo(u(gen), u(gen), u(gen));
+    prims.push_back(BuildPrimitive{embree_utils::Bounds3d(lo, lo + 1.f), i % 2, i / 2});
+  }
+  // Many coincident primitives force splits that the SAH can not make:
+  for (auto i = 0u; i < 100; ++i) {
+    prims.push_back(BuildPrimitive{embree_utils::Bounds3d(embree_utils::Vec3fa(5.f), embree_utils::Vec3fa(6.f)), i % 2, 10000 + i / 2});
+  }
+  const auto count = prims.size();
+  const auto bvh = buildSahBvh(std::move(prims));
+  BOOST_CHECK_EQUAL(bvh.prims.size(), count);
+  BOOST_CHECK_EQUAL(bvh.nodes[0].primCount, count);
+
+  // Check leaves cover the primitives in order and respect the leaf constraints:
+  std::uint32_t nextPrim = 0;
+  std::uint32_t geomCounts[2] = {0, 0};
+  for (auto n = 0u; n < bvh.nodes.size(); ++n) {
+    const auto& node = bvh.nodes[n];
+    if (node.isLeaf()) {
+      BOOST_CHECK_EQUAL(node.firstPrim, nextPrim);
+      BOOST_CHECK(node.primCount > 0 && node.primCount <= 8);
+      BOOST_CHECK_EQUAL(node.geomFirst, geomCounts[node.geomID]);
+      for (auto p = node.firstPrim; p < node.firstPrim + node.primCount; ++p) {
+        BOOST_CHECK_EQUAL(bvh.prims[p].geomID, node.geomID);
+      }
+      nextPrim += node.primCount;
+      geomCounts[node.geomID] += node.primCount;
+    } else {
+      // Depth first order with children that partition the parent's range:
+      const auto& left = bvh.nodes[n + 1];
+      const auto& right = bvh.nodes[node.secondChild];
+      BOOST_CHECK_EQUAL(left.firstPrim, node.firstPrim);
+      BOOST_CHECK_EQUAL(right.firstPrim, node.firstPrim + left.primCount);
+      BOOST_CHECK_EQUAL(left.primCount + right.primCount, node.primCount);
+      BOOST_CHECK(left.bounds.min.x >= node.bounds.min.x && right.bounds.max.z <= node.bounds.max.z);
+    }
+  }
+  BOOST_CHECK_EQUAL(nextPrim, count);
+  BOOST_CHECK(bvh.maxDepth > 1 && bvh.maxDepth < 64);
+}
+
+BOOST_AUTO_TEST_CASE(InstanceIntersect) {
+  // Unit cube mesh:
+  HostTriangleMesh cube;
+  for (auto c = 0u; c < 8; ++c) {
+    cube.vertices.emplace_back(c & 1 ? 1.f : -1.f, c & 2 ? 1.f : -1.f, c & 4 ? 1.f : -1.f);
+  }
+  const std::uint16_t quads[6][4] = {
+    {0, 2, 3, 1}, {4, 5, 7, 6}, {0, 1, 5, 4}, {2, 6, 7, 3}, {0, 4, 6, 2}, {1, 3, 7, 5}
+  };
+  for (const auto& q : quads) {
+    cube.triangles.emplace_back(q[0], q[1], q[2]);
+    cube.triangles.emplace_back(q[0], q[2], q[3]);
+  }
+  cube.updateBoundingBox();
+
+  std::vector<BuildPrimitive> prims;
+  for (auto t = 0u; t < 12; ++t) {
+    prims.push_back(BuildPrimitive{cube.getTriangleBoundingBox(t), 0u, t});
+  }
+  const auto bvh = buildSahBvh(std::move(prims));
+  std::vector<Triangle> reordered;
+  for (const auto& p : bvh.prims) {
+    reordered.push_back(cube.triangles[p.primID]);
+  }
+  cube.triangles = reordered;
+  std::uint32_t stackSize = 0;
+  auto nodes = buildCompactBvh4<CompactBVH4QNode>(bvh.nodes, 0, stackSize);
+
+  // Rotate 90 degrees about z, scale non-uniformly, and translate:
+  InstanceInfo info;
+  info.objectToWorld = AffineTransform{{0.f, -2.f, 0.f, 10.f,
+                                        1.f,  0.f, 0.f, -5.f,
+                                        0.f,  0.f, 3.f, 2.f}};
+  info.worldToObject = info.objectToWorld.inverse();
+  info.meshIndex = 0;
+  info.firstNode = 0;
+  info.numNodes = nodes.size();
+  info.stackSize = stackSize;
+  Instance<CompactBVH4QNode, HostTriangleMesh> instance(info, &cube, nodes.data());
+
+  // Reference is the same mesh transformed into world space (normals are from the face winding):
+  HostTriangleMesh world = cube;
+  for (auto& v : world.vertices) {
+    v = info.objectToWorld.point(v);
+  }
+  world.updateBoundingBox();
+
+  const auto ib = instance.getBoundingBox();
+  BOOST_CHECK_CLOSE(ib.min.x, world.getBoundingBox().min.x, 1e-4f);
+  BOOST_CHECK_CLOSE(ib.max.z, world.getBoundingBox().max.z, 1e-4f);
+
+  const embree_utils::Vec3fa origin(20.f, 3.f, -4.f);
+  for (auto i = 0u; i < 64; ++i) {
+    const embree_utils::Vec3fa target(8.f + .1f * (i % 8), -5.9f + .2f * (i / 8), -.5f + .08f * i);
+    const embree_utils::Ray ray(origin, (target - origin).normalized());
+    const auto expected = world.intersect(ray);
+    const auto hit = instance.intersect(0, ray);
+    BOOST_CHECK_EQUAL((bool)hit, (bool)expected);
+    if (hit && expected) {
+      BOOST_CHECK(hit.prim == &instance);
+      BOOST_CHECK_EQUAL(hit.primID, expected.primID);
+      BOOST_CHECK_CLOSE(hit.t, expected.t, 1e-3f);
+      BOOST_CHECK_SMALL((hit.normal - expected.normal).squaredNorm(), 1e-8f);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(InstanceDuplicates) {
+  using embree_utils::Vec3fa;
+  HostTriangleMesh block;
+  for (auto c = 0u; c < 8; ++c) {
+    block.vertices.emplace_back(c & 1 ? 1.f : 0.f, c & 2 ? 2.f : 0.f, c & 4 ? 3.f : 0.f);
+  }
+  const std::uint16_t quads[6][4] = {
+    {0, 2, 3, 1}, {4, 5, 7, 6}, {0, 1, 5, 4}, {2, 6, 7, 3}, {0, 4, 6, 2}, {1, 3, 7, 5}
+  };
+  for (const auto& q : quads) {
+    block.triangles.emplace_back(q[0], q[1], q[2]);
+    block.triangles.emplace_back(q[0], q[2], q[3]);
+  }
+  block.updateBoundingBox();
+  HostTriangleMesh quad;
+  addQuad(quad, {{0.f, 0.f, 0.f}, {1.f, 0.f, 0.f}, {1.f, 1.f, 0.f}, {0.f, 1.f, 0.f}});
+  quad.updateBoundingBox();
+
+  // Rotate 90 degrees about y, scale by 2, and translate:
+  auto moved = block;
+  transform(moved, [](Vec3fa& v) { v = Vec3fa(2.f * v.z + 5.f, 2.f * v.y - 1.f, -2.f * v.x + 3.f); }, [](Vec3fa&) {});
+  auto movedQuad = quad;
+  transform(movedQuad, [](Vec3fa& v) { v = v + Vec3fa(0.f, 0.f, 4.f); }, [](Vec3fa&) {});
+
+  // A flat mesh does not define a transform and a textured copy can not be instanced:
+  SceneDescription scene;
+  scene.meshes = {block, quad, moved, movedQuad, moved};
+  scene.spheres.emplace_back(Vec3fa(0.f, 0.f, 0.f), 1.f);
+  scene.matIDs = {10, 11, 12, 13, 14, 15};
+  scene.meshUVs.resize(5);
+  scene.meshUVs[4].resize(moved.vertices.size(), TexCoord{.5f, .5f});
+
+  BOOST_CHECK_EQUAL(instanceDuplicateMeshes(scene), 2u);
+  BOOST_CHECK_EQUAL(scene.prototypes.size(), 1u);
+  BOOST_REQUIRE_EQUAL(scene.instances.size(), 2u);
+  BOOST_CHECK_EQUAL(scene.meshes.size(), 3u);
+  BOOST_CHECK_EQUAL(scene.prototypes[0].vertices.size(), block.vertices.size());
+  for (auto i = 0u; i < 2; ++i) {
+    BOOST_CHECK_EQUAL(scene.instances[i].prototype, 0u);
+    const auto& target = i == 0 ? block : moved;
+    float maxError = 0.f;
+    for (auto v = 0u; v < block.vertices.size(); ++v) {
+      const auto d = scene.instances[i].objectToWorld.point(block.vertices[v]) - target.vertices[v];
+      maxError = std::max(maxError, std::sqrt(d.squaredNorm()));
+    }
+    BOOST_CHECK_SMALL(maxError, 1e-4f);
+  }
+
+  // Remaining meshes keep their order, then the other primitives, then the instances:
+  BOOST_CHECK_EQUAL(scene.meshes[0].vertices[0].z, 0.f);
+  BOOST_CHECK_EQUAL(scene.meshes[1].vertices[0].z, 4.f);
+  const std::vector<std::uint32_t> expectedIDs = {11, 13, 14, 15, 10, 12};
+  BOOST_CHECK_EQUAL_COLLECTIONS(scene.matIDs.begin(), scene.matIDs.end(), expectedIDs.begin(), expectedIDs.end());
+  BOOST_REQUIRE_EQUAL(scene.meshUVs.size(), 3u);
+  BOOST_CHECK(scene.meshUVs[0].empty() && scene.meshUVs[1].empty());
+  BOOST_CHECK_EQUAL(scene.meshUVs[2].size(), moved.vertices.size());
+}
+
+BOOST_AUTO_TEST_CASE(UnifiedMeshBuffers) {
+  // Meshes of different sizes where only some have normals or texture coordinates:
+  using embree_utils::Vec3fa;
+  SceneDescription scene;
+  for (auto m = 0u; m < 40; ++m) {
+    HostTriangleMesh mesh;
+    const auto numQuads = 1 + (m * 7) % 13;
+    for (auto q = 0u; q < numQuads; ++q) {
+      const float x = m + 0.1f * q;
+      addQuad(mesh, {{x, 0.f, 0.f}, {x, 1.f, 0.f}, {x, 1.f, 1.f}, {x, 0.f, 1.f}});
+    }
+    if (m % 3 != 0) {
+      for (auto v = 0u; v < mesh.vertices.size(); ++v) {
+        mesh.normals.emplace_back(float(m), float(v), 1.f);
+      }
+    }
+    mesh.updateBoundingBox();
+    auto& uvs = scene.meshUVs.emplace_back();
+    if (m % 4 == 1) {
+      for (auto v = 0u; v < mesh.vertices.size(); ++v) {
+        uvs.push_back(TexCoord{float(m), float(v)});
+      }
+    }
+    (m < 36 ? scene.meshes : scene.prototypes).push_back(std::move(mesh));
+  }
+  scene.meshUVs.resize(scene.meshes.size());
+
+  // The serial equivalent of the unified buffers:
+  std::vector<const HostTriangleMesh*> order;
+  for (const auto& m : scene.meshes) { order.push_back(&m); }
+  for (const auto& m : scene.prototypes) { order.push_back(&m); }
+  std::vector<Triangle> tris;
+  std::vector<Vec3fa> verts;
+  std::vector<Vec3fa> normals;
+  std::vector<TexCoord> uvs;
+  for (auto i = 0u; i < order.size(); ++i) {
+    tris.insert(tris.end(), order[i]->triangles.begin(), order[i]->triangles.end());
+    verts.insert(verts.end(), order[i]->vertices.begin(), order[i]->vertices.end());
+    normals.insert(normals.end(), order[i]->normals.begin(), order[i]->normals.end());
+    if (i < scene.meshUVs.size() && !scene.meshUVs[i].empty()) {
+      uvs.insert(uvs.end(), scene.meshUVs[i].begin(), scene.meshUVs[i].end());
+    } else {
+      uvs.resize(verts.size(), TexCoord{0.f, 0.f});
+    }
+  }
+
+  SceneData data;
+  unifyMeshes(scene, data);
+  auto same = [](const Vec3fa& a, const Vec3fa& b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+  BOOST_REQUIRE_EQUAL(data.meshInfo.size(), order.size());
+  std::uint32_t firstIndex = 0;
+  std::uint32_t firstVertex = 0;
+  for (auto i = 0u; i < order.size(); ++i) {
+    const auto& info = data.meshInfo[i];
+    BOOST_CHECK_EQUAL(info.firstIndex, firstIndex);
+    BOOST_CHECK_EQUAL(info.firstVertex, firstVertex);
+    BOOST_CHECK_EQUAL(info.numTriangles, order[i]->triangles.size());
+    BOOST_CHECK_EQUAL(info.numVertices, order[i]->vertices.size());
+    firstIndex += info.numTriangles;
+    firstVertex += info.numVertices;
+  }
+
+  BOOST_REQUIRE_EQUAL(data.meshTris.size(), tris.size());
+  for (auto t = 0u; t < tris.size(); ++t) {
+    BOOST_CHECK(data.meshTris[t].v0 == tris[t].v0 && data.meshTris[t].v1 == tris[t].v1 && data.meshTris[t].v2 == tris[t].v2);
+  }
+  BOOST_REQUIRE_EQUAL(data.meshVerts.size(), verts.size());
+  for (auto v = 0u; v < verts.size(); ++v) {
+    BOOST_CHECK(same(data.meshVerts[v], verts[v]));
+  }
+  BOOST_REQUIRE_EQUAL(data.meshNormals.size(), normals.size());
+  for (auto n = 0u; n < normals.size(); ++n) {
+    BOOST_CHECK(same(data.meshNormals[n], normals[n]));
+  }
+  BOOST_REQUIRE_EQUAL(data.meshUVs.size(), uvs.size());
+  for (auto v = 0u; v < uvs.size(); ++v) {
+    BOOST_CHECK(data.meshUVs[v].u == uvs[v].u && data.meshUVs[v].v == uvs[v].v);
+  }
+
+  // Texture coordinates must match their mesh's vertices:
+  scene.meshUVs[1].pop_back();
+  BOOST_CHECK_THROW(unifyMeshes(scene, data), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(EmbreeWideTriangleIndices) {
+  // The only triangle uses vertices beyond the range of 16-bit indices:
+  using embree_utils::Vec3fa;
+  const std::uint32_t first = 70000;
+  std::vector<Vec3fa> vertices(first + 3, Vec3fa(100.f, 100.f, 100.f));
+  vertices[first] = Vec3fa(-1.f, -1.f, -5.f);
+  vertices[first + 1] = Vec3fa(1.f, -1.f, -5.f);
+  vertices[first + 2] = Vec3fa(0.f, 1.f, -5.f);
+  const std::vector<std::uint32_t> indices = {first, first + 1, first + 2};
+
+  // A copy further away uses the build's index type in the same way as buildSceneData():
+  HostTriangleMesh mesh;
+  for (auto v = first; v < first + 3; ++v) {
+    mesh.vertices.push_back(vertices[v] - Vec3fa(0.f, 0.f, 2.f));
+  }
+  mesh.triangles.push_back(Triangle(0, 1, 2));
+
+  embree_utils::EmbreeScene embreeScene;
+  embreeScene.addTriMesh(ConstArrayRef(vertices), ConstArrayRef(indices));
+  embreeScene.addTriMesh(ConstArrayRef(mesh.vertices),
+                         ConstArrayRef<TriangleIndex>::reinterpret(mesh.triangles.data(), mesh.triangles.size()));
+  embreeScene.commitScene();
+
+  // A ray from the front hits the first mesh and one from behind hits the copy:
+  std::vector<RTCRayHit> hits = {
+    convertHitRecord(embree_utils::HitRecord(Vec3fa(0.f, 0.f, 0.f), Vec3fa(0.f, 0.f, -1.f))),
+    convertHitRecord(embree_utils::HitRecord(Vec3fa(0.f, 0.f, -10.f), Vec3fa(0.f, 0.f, 1.f)))
+  };
+  embreeScene.intersect(hits, 1);
+  BOOST_CHECK_CLOSE(hits[0].ray.tfar, 5.f, 1e-3f);
+  BOOST_CHECK_EQUAL(hits[0].hit.geomID, 0u);
+  BOOST_CHECK_CLOSE(hits[1].ray.tfar, 3.f, 1e-3f);
+  BOOST_CHECK_EQUAL(hits[1].hit.geomID, 1u);
+  for (const auto& rh : hits) {
+    BOOST_CHECK_EQUAL(rh.hit.primID, 0u);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(PrecomputedTriangleIntersect) {
+  // Random triangle soup:
+  std::mt19937 gen(7);
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  HostTriangleMesh mesh;
+  for (auto t = 0u; t < 200; ++t) {
+    const embree_utils::Vec3fa c(dist(gen), dist(gen), dist(gen));
+    for (auto v = 0u; v < 3; ++v) {
+      mesh.vertices.push_back(c + embree_utils::Vec3fa(dist(gen), dist(gen), dist(gen)) * .2f);
+    }
+    mesh.triangles.emplace_back(3 * t, 3 * t + 1, 3 * t + 2);
+  }
+  mesh.updateBoundingBox();
+
+  HostTriangleMesh fast = mesh;
+  for (const auto& tri : mesh.triangles) {
+    fast.precomputed.push_back(precomputeTriangle(mesh.vertices[tri.v0], mesh.vertices[tri.v1], mesh.vertices[tri.v2]));
+  }
+
+  auto hitCount = 0u;
+  for (auto i = 0u; i < 500; ++i) {
+    const embree_utils::Vec3fa origin(dist(gen) * 3.f, dist(gen) * 3.f, 4.f);
+    const embree_utils::Vec3fa target(dist(gen), dist(gen), dist(gen));
+    const embree_utils::Ray ray(origin, (target - origin).normalized());
+    const auto expected = mesh.intersect(ray);
+    const auto hit = fast.intersect(ray);
+    BOOST_CHECK_EQUAL((bool)hit, (bool)expected);
+    if (hit && expected) {
+      hitCount += 1;
+      BOOST_CHECK_EQUAL(hit.primID, expected.primID);
+      BOOST_CHECK_CLOSE(hit.t, expected.t, 1e-3f);
+      BOOST_CHECK_SMALL((hit.normal - expected.normal).squaredNorm(), 1e-8f);
+
+      // Single triangle test must agree with the brute force one:
+      const auto single = fast.intersect(hit.primID, ray);
+      BOOST_CHECK_EQUAL(single.t, hit.t);
+    }
+  }
+  BOOST_CHECK(hitCount > 100);
+
+  // Degenerate triangles are never hit:
+  const embree_utils::Vec3fa p(0.f, 0.f, 0.f);
+  const auto degenerate = precomputeTriangle(p, p + embree_utils::Vec3fa(1.f, 0.f, 0.f), p + embree_utils::Vec3fa(2.f, 0.f, 0.f));
+  for (auto v : degenerate.m) {
+    BOOST_CHECK_EQUAL(v, 0.f);
+  }
+}
+
+// Lookup that passes primitives to traversal as their concrete types:
+struct StaticTestLookup {
+  const HostTriangleMesh& mesh;
+  const Sphere& sphere;
+  template <class F>
+  void visit(std::uint16_t geomID, F&& f) const {
+    if (geomID) { f(sphere); } else { f(mesh); }
+  }
+};
+
+BOOST_AUTO_TEST_CASE(RayPacketIntersect) {
+  // Random triangle soup (geomID 0) and a sphere (geomID 1):
+  std::mt19937 gen(11);
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  HostTriangleMesh mesh;
+  for (auto t = 0u; t < 400; ++t) {
+    const embree_utils::Vec3fa c(dist(gen), dist(gen), dist(gen));
+    for (auto v = 0u; v < 3; ++v) {
+      mesh.vertices.push_back(c + embree_utils::Vec3fa(dist(gen), dist(gen), dist(gen)) * .2f);
+    }
+    mesh.triangles.emplace_back(3 * t, 3 * t + 1, 3 * t + 2);
+  }
+  mesh.updateBoundingBox();
+  Sphere sphere(embree_utils::Vec3fa(.2f, -.1f, .3f), .4f);
+
+  std::vector<BuildPrimitive> prims;
+  for (auto t = 0u; t < mesh.triangles.size(); ++t) {
+    prims.push_back(BuildPrimitive{mesh.getTriangleBoundingBox(t), 0u, t});
+  }
+  prims.push_back(BuildPrimitive{sphere.getBoundingBox(), 1u, 0u});
+  const auto build = buildSahBvh(std::move(prims));
+  std::vector<Triangle> reordered;
+  for (const auto& p : build.prims) {
+    if (p.geomID == 0) { reordered.push_back(mesh.triangles[p.primID]); }
+  }
+  mesh.triangles = reordered;
+
+  auto binaryNodes = buildCompactBvh(build);
+  std::uint32_t wideStackSize = 0;
+  auto wideNodes = buildCompactBvh4<CompactBVH4QNode>(build.nodes, 0, wideStackSize);
+  auto binaryRef = ArrayRef(binaryNodes);
+  auto wideRef = ArrayRef(wideNodes);
+  CompactBvh binary(binaryRef, build.maxDepth + 1);
+  CompactBvh wide(wideRef, wideStackSize);
+
+  auto primLookup = [&](std::uint16_t geomID, std::uint32_t) -> const Primitive* {
+    return geomID ? (const Primitive*)&sphere : &mesh;
+  };
+  auto meshLookup = [&](std::uint16_t geomID) -> const HostTriangleMesh* {
+    return geomID ? nullptr : &mesh;
+  };
+  const StaticTestLookup staticLookup{mesh, sphere};
+
+  // Packets of rays through a grid of screen tiles (the last packet is partial):
+  const embree_utils::Vec3fa origin(.3f, .2f, 4.f);
+  std::vector<embree_utils::Ray> rays;
+  for (auto y = 0u; y < 40; ++y) {
+    for (auto x = 0u; x < 40; ++x) {
+      const embree_utils::Vec3fa target(-1.2f + x * .06f, -1.2f + y * .06f, 0.f);
+      rays.emplace_back(origin, (target - origin).normalized());
+    }
+  }
+  rays.resize(rays.size() - 3);
+
+  auto hitCount = 0u;
+  for (auto first = 0u; first < rays.size(); first += PacketWidth) {
+    const auto count = std::min<std::size_t>(PacketWidth, rays.size() - first);
+    const RayPacket<PacketWidth> packet(&rays[first], count);
+    Intersection binaryHits[PacketWidth];
+    Intersection wideHits[PacketWidth];
+    intersectPacket(binary, packet, primLookup, meshLookup, binaryHits);
+    intersectPacket(wide, packet, primLookup, meshLookup, wideHits);
+    for (auto l = 0u; l < count; ++l) {
+      const auto expected = binary.intersect(rays[first + l], primLookup);
+      BOOST_CHECK_EQUAL(wide.intersect(rays[first + l], primLookup).primID, expected.primID);
+
+      // Static dispatch must find the same hits as virtual dispatch:
+      const auto staticHit = wide.intersect(rays[first + l], staticLookup);
+      BOOST_CHECK(staticHit.prim == expected.prim);
+      BOOST_CHECK_EQUAL(staticHit.primID, expected.primID);
+      BOOST_CHECK_EQUAL(wide.occluded(rays[first + l], staticLookup), (bool)expected);
+
+      // Recording traversal statistics must not change the hits (for either kind of lookup):
+      TraversalStats wideStats, binaryStats;
+      const TraversalRecorder<const StaticTestLookup> wideRecorder{staticLookup, wideStats};
+      const TraversalRecorder<decltype(primLookup)> binaryRecorder{primLookup, binaryStats};
+      BOOST_CHECK(wide.intersect(rays[first + l], wideRecorder).prim == expected.prim);
+      BOOST_CHECK_EQUAL(binary.intersect(rays[first + l], binaryRecorder).primID, expected.primID);
+      BOOST_CHECK(wideStats.nodes >= 1 && wideStats.nodes < binaryStats.nodes);
+      if (expected) {
+        BOOST_CHECK(wideStats.prims > 0 && binaryStats.prims > 0);
+      }
+      if (expected) {
+        // Any hit tests must respect the extent of shadow rays:
+        auto shortRay = rays[first + l];
+        shortRay.tMax = expected.t * .99f;
+        BOOST_CHECK(!wide.occluded(shortRay, staticLookup));
+        BOOST_CHECK(!occludesPrimitives(mesh, 0u, mesh.triangles.size(), shortRay));
+        shortRay.tMax = expected.t * 1.01f;
+        BOOST_CHECK(wide.occluded(shortRay, staticLookup));
+        if (expected.geomID == 0) {
+          BOOST_CHECK(occludesPrimitives(mesh, 0u, mesh.triangles.size(), shortRay));
+        }
+      }
+      for (const auto& hit : {binaryHits[l], wideHits[l]}) {
+        BOOST_CHECK_EQUAL((bool)hit, (bool)expected);
+        if (hit && expected) {
+          BOOST_CHECK(hit.prim == expected.prim);
+          BOOST_CHECK_EQUAL(hit.geomID, expected.geomID);
+          BOOST_CHECK_EQUAL(hit.primID, expected.primID);
+          BOOST_CHECK_CLOSE(hit.t, expected.t, 1e-4f);
+          if (hit.geomID == 0) {
+            // (Other primitives compute their normals after traversal.)
+            BOOST_CHECK_SMALL((hit.normal - expected.normal).squaredNorm(), 1e-8f);
+          }
+        }
+      }
+      hitCount += expected ? 1 : 0;
+    }
+  }
+  BOOST_CHECK(hitCount > 400);
+}
+
+BOOST_AUTO_TEST_CASE(CompactVertexStorage) {
+  std::mt19937 gen(11);
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+
+  // Octahedral normals round trip closely over the whole sphere:
+  for (auto i = 0u; i < 1000; ++i) {
+    const auto n = embree_utils::Vec3fa(dist(gen), dist(gen), dist(gen)).normalized();
+    BOOST_CHECK_GT(decodeNormal(encodeNormal(n)).dot(n), 0.99999f);
+  }
+
+  // Random triangle soup with normals snapped to the compact representation:
+  HostTriangleMesh mesh;
+  for (auto t = 0u; t < 200; ++t) {
+    const embree_utils::Vec3fa c(dist(gen), dist(gen), dist(gen));
+    for (auto v = 0u; v < 3; ++v) {
+      mesh.vertices.push_back(c + embree_utils::Vec3fa(dist(gen), dist(gen), dist(gen)) * .2f);
+      mesh.normals.push_back(embree_utils::Vec3fa(dist(gen), dist(gen), dist(gen)).normalized());
+    }
+    mesh.triangles.emplace_back(3 * t, 3 * t + 1, 3 * t + 2);
+  }
+  mesh.updateBoundingBox();
+  const auto q = VertexQuantisation::fromBounds(mesh.getBoundingBox());
+  std::vector<QuantisedVertex> packedVerts;
+  std::vector<OctahedralNormal> packedNormals;
+  for (auto v = 0u; v < mesh.vertices.size(); ++v) {
+    const auto snapped = q.decode(q.encode(mesh.vertices[v]));
+    for (auto i = 0u; i < 3; ++i) {
+      BOOST_CHECK_LE(std::abs(snapped[i] - mesh.vertices[v][i]), q.scale[i]);
+    }
+    mesh.vertices[v] = snapped;
+    mesh.normals[v] = decodeNormal(encodeNormal(mesh.normals[v]));
+    packedVerts.push_back(q.encode(mesh.vertices[v]));
+    packedNormals.push_back(encodeNormal(mesh.normals[v]));
+  }
+
+  CompiledTriangleMesh compact(
+    mesh.getBoundingBox(), ArrayRef(mesh.triangles),
+    ArrayRef<embree_utils::Vec3fa>(), ArrayRef<embree_utils::Vec3fa>(), ArrayRef<PrecomputedTriangle>(),
+    q, ArrayRef(packedVerts), ArrayRef(packedNormals));
+  BOOST_CHECK(compact.hasNormals());
+  BOOST_CHECK_EQUAL(compact.numVertices(), mesh.vertices.size());
+
+  auto hitCount = 0u;
+  for (auto i = 0u; i < 500; ++i) {
+    const embree_utils::Vec3fa origin(dist(gen) * 3.f, dist(gen) * 3.f, 4.f);
+    const embree_utils::Vec3fa target(dist(gen), dist(gen), dist(gen));
+    const embree_utils::Ray ray(origin, (target - origin).normalized());
+    const auto expected = mesh.intersect(ray);
+    const auto hit = compact.intersect(ray);
+    BOOST_CHECK_EQUAL((bool)hit, (bool)expected);
+    if (hit && expected) {
+      hitCount += 1;
+      BOOST_CHECK_EQUAL(hit.primID, expected.primID);
+      BOOST_CHECK_CLOSE(hit.t, expected.t, 1e-4f);
+      BOOST_CHECK_SMALL((hit.normal - expected.normal).squaredNorm(), 1e-8f);
+    }
+  }
+  BOOST_CHECK(hitCount > 100);
+}
+
+BOOST_AUTO_TEST_CASE(MeshSplit) {
+  // Grid with shared vertices (and a normal per vertex):
+  const auto n = 40u;
+  std::vector<embree_utils::Vec3fa> vertices;
+  std::vector<embree_utils::Vec3fa> normals;
+  for (auto j = 0u; j < n; ++j) {
+    for (auto i = 0u; i < n; ++i) {
+      vertices.push_back(embree_utils::Vec3fa(i, j, 0.1f * i * j));
+      normals.push_back(embree_utils::Vec3fa(i, j, 1.f).normalized());
+    }
+  }
+  std::vector<WideTriangle> triangles;
+  for (auto j = 0u; j + 1 < n; ++j) {
+    for (auto i = 0u; i + 1 < n; ++i) {
+      const auto v = j * n + i;
+      triangles.push_back(WideTriangle{v, v + 1, v + n});
+      triangles.push_back(WideTriangle{v + 1, v + n + 1, v + n});
+    }
+  }
+
+  // Triangles as their vertex positions so that the parts can be compared to the input:
+  using Corners = std::array<float, 9>;
+  auto corners = [](const embree_utils::Vec3fa& a, const embree_utils::Vec3fa& b, const embree_utils::Vec3fa& c) {
+    return Corners{a.x, a.y, a.z, b.x, b.y, b.z, c.x, c.y, c.z};
+  };
+  std::vector<Corners> expected;
+  for (const auto& t : triangles) {
+    expected.push_back(corners(vertices[t.v0], vertices[t.v1], vertices[t.v2]));
+  }
+
+  const auto maxVertices = 100u;
+  const auto parts = splitMesh(triangles, vertices, normals, maxVertices);
+  BOOST_CHECK_GE(parts.size(), vertices.size() / maxVertices);
+  std::vector<Corners> found;
+  for (const auto& part : parts) {
+    BOOST_CHECK_LE(part.vertices.size(), maxVertices);
+    BOOST_CHECK_EQUAL(part.normals.size(), part.vertices.size());
+    for (const auto& t : part.triangles) {
+      found.push_back(corners(part.vertices[t.v0], part.vertices[t.v1], part.vertices[t.v2]));
+      BOOST_CHECK_SMALL((part.normals[t.v0] - embree_utils::Vec3fa(part.vertices[t.v0].x, part.vertices[t.v0].y, 1.f).normalized()).squaredNorm(), 1e-10f);
+    }
+  }
+  std::sort(expected.begin(), expected.end());
+  std::sort(found.begin(), found.end());
+  BOOST_CHECK((found == expected));
+
+  // A mesh that fits is left in one piece:
+  const auto whole = splitMesh(triangles, vertices, {});
+  BOOST_CHECK_EQUAL(whole.size(), 1u);
+  BOOST_CHECK_EQUAL(whole.front().triangles.size(), triangles.size());
+  BOOST_CHECK(whole.front().normals.empty());
+  BOOST_CHECK_THROW(splitMesh(triangles, vertices, normals, 2), std::invalid_argument);
+
+  // Texture coordinates stay with their vertices in every part (each is the vertex's grid position):
+  std::vector<TexCoord> uvs;
+  for (const auto& v : vertices) {
+    uvs.push_back(TexCoord{v.x / n, v.y / n});
+  }
+  std::vector<std::vector<TexCoord>> partUVs;
+  const auto texturedParts = splitMesh(triangles, vertices, normals, maxVertices, uvs, &partUVs);
+  BOOST_REQUIRE_EQUAL(partUVs.size(), texturedParts.size());
+  BOOST_CHECK_EQUAL(texturedParts.size(), parts.size());
+  float maxUVError = 0.f;
+  for (auto p = 0u; p < texturedParts.size(); ++p) {
+    const auto& part = texturedParts[p];
+    BOOST_REQUIRE_EQUAL(partUVs[p].size(), part.vertices.size());
+    for (auto v = 0u; v < part.vertices.size(); ++v) {
+      maxUVError = std::max(maxUVError, std::abs(partUVs[p][v].u - part.vertices[v].x / n));
+      maxUVError = std::max(maxUVError, std::abs(partUVs[p][v].v - part.vertices[v].y / n));
+    }
+  }
+  BOOST_CHECK_EQUAL(maxUVError, 0.f);
+
+  // A mesh without texture coordinates adds no parts' UVs (its parts get none when the scene is imported):
+  std::vector<std::vector<TexCoord>> noUVs;
+  splitMesh(triangles, vertices, normals, maxVertices, {}, &noUVs);
+  BOOST_CHECK(noUVs.empty());
+  uvs.pop_back();
+  BOOST_CHECK_THROW(splitMesh(triangles, vertices, normals, maxVertices, uvs, &partUVs), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(RgbeRoundTrip) {
+  BOOST_CHECK_EQUAL(encodeRgbe(embree_utils::Vec3fa(0.f, 0.f, 0.f)), 0u);
+  BOOST_CHECK_EQUAL(decodeRgbe(0u).x, 0.f);
+
+  // Channels are accurate relative to the largest one over a wide range of magnitudes:
+  std::mt19937 gen(3);
+  std::uniform_real_distribution<float> dist(0.f, 1.f);
+  for (float scale = 1e-6f; scale < 1e8f; scale *= 10.f) {
+    for (auto i = 0u; i < 100; ++i) {
+      const embree_utils::Vec3fa c(dist(gen) * scale, dist(gen) * scale, dist(gen) * scale);
+      const auto d = decodeRgbe(encodeRgbe(c));
+      const float m = std::max(c.x, std::max(c.y, c.z));
+      for (auto k = 0u; k < 3; ++k) {
+        BOOST_CHECK_SMALL(d[k] - c[k], m / 128.f);
+      }
+    }
+  }
+
+  // Zero channels stay zero:
+  const auto red = decodeRgbe(encodeRgbe(embree_utils::Vec3fa(5.f, 0.f, 0.f)));
+  BOOST_CHECK_CLOSE(red.x, 5.f, 1.f);
+  BOOST_CHECK_EQUAL(red.y, 0.f);
+  BOOST_CHECK_EQUAL(red.z, 0.f);
+}
+
+BOOST_AUTO_TEST_CASE(InterleavedRayOrder) {
+  // Three tiles with four rays each and a partial last batch:
+  const std::uint32_t raysPerBatch = 12;
+  const std::uint32_t raysPerTile = 4;
+  const std::uint32_t numRays = 30;
+  std::vector<std::uint32_t> indices;
+  for (auto i = 0u; i < numRays; ++i) {
+    const auto index = interleavedRayIndex(i, raysPerBatch, raysPerTile, numRays);
+    BOOST_CHECK_EQUAL(index / raysPerBatch, i / raysPerBatch);
+    indices.push_back(index);
+  }
+
+  // A tile's rays are spread through the batch:
+  BOOST_CHECK_EQUAL(indices[0], 0u);
+  BOOST_CHECK_EQUAL(indices[1], 3u);
+  BOOST_CHECK_EQUAL(indices[4], 1u);
+  BOOST_CHECK_EQUAL(indices[12 + 5], 12u + 4u);
+
+  // The partial batch is not reordered:
+  BOOST_CHECK_EQUAL(indices[25], 25u);
+
+  // Every ray is traced exactly once:
+  std::sort(indices.begin(), indices.end());
+  for (auto i = 0u; i < numRays; ++i) {
+    BOOST_CHECK_EQUAL(indices[i], i);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(MortonTileOrder) {
+  BOOST_CHECK_EQUAL(mortonCode2d(0, 0), 0u);
+  BOOST_CHECK_EQUAL(mortonCode2d(1, 0), 1u);
+  BOOST_CHECK_EQUAL(mortonCode2d(0, 1), 2u);
+  BOOST_CHECK_EQUAL(mortonCode2d(3, 5), 0b100111u);
+  BOOST_CHECK_EQUAL(mortonCode2d(0xffff, 0xffff), 0xffffffffu);
+
+  // Every tile is visited once and the first 2x2 block on the curve is visited first:
+  const std::uint32_t tilesX = 5;
+  const std::uint32_t tilesY = 3;
+  const auto order = mortonTileOrder(tilesX, tilesY);
+  BOOST_CHECK_EQUAL(order.size(), tilesX * tilesY);
+  auto sorted = order;
+  std::sort(sorted.begin(), sorted.end());
+  for (auto i = 0u; i < sorted.size(); ++i) {
+    BOOST_CHECK_EQUAL(sorted[i], i);
+  }
+  const std::uint32_t first[4] = {0, 1, tilesX, tilesX + 1};
+  for (auto i = 0u; i < 4; ++i) {
+    BOOST_CHECK_EQUAL(order[i], first[i]);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(BucketWindows) {
+  // A 300x130 window split into 128 pixel buckets (edge buckets are cropped):
+  const CropWindow window{300, 130, 20, 10};
+  const auto buckets = bucketWindows(window, 128);
+  BOOST_CHECK_EQUAL(buckets.size(), 6u);
+  BOOST_CHECK_EQUAL(buckets.front().w, 128);
+  BOOST_CHECK_EQUAL(buckets.front().h, 128);
+  BOOST_CHECK_EQUAL(buckets.front().c, 20);
+  BOOST_CHECK_EQUAL(buckets.front().r, 10);
+
+  // Every pixel of the window is in exactly one bucket:
+  std::vector<int> covered(window.w * window.h, 0);
+  for (const auto& b : buckets) {
+    BOOST_CHECK(b.w * b.h <= buckets.front().w * buckets.front().h);
+    for (auto r = b.r; r < b.r + b.h; ++r) {
+      for (auto c = b.c; c < b.c + b.w; ++c) {
+        covered.at((r - window.r) * window.w + (c - window.c)) += 1;
+      }
+    }
+  }
+  BOOST_CHECK(std::all_of(covered.begin(), covered.end(), [](int n) { return n == 1; }));
+  BOOST_CHECK_EQUAL(bucketWindows(window, 512).size(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(OctantSort) {
+  BOOST_CHECK_EQUAL(directionOctant(embree_utils::Vec3fa(1.f, 1.f, 1.f)), 0u);
+  BOOST_CHECK_EQUAL(directionOctant(embree_utils::Vec3fa(-1.f, 1.f, -1.f)), 5u);
+
+  // Sorting a subset of the rays gives the same indices grouped by octant:
+  std::mt19937 gen(7);
+  std::normal_distribution<float> dist;
+  std::vector<embree_utils::Vec3fa> dirs(500);
+  for (auto& d : dirs) {
+    d = embree_utils::Vec3fa(dist(gen), dist(gen), dist(gen));
+  }
+  std::vector<unsigned> live;
+  for (auto i = 0u; i < dirs.size(); i += 3) {
+    live.push_back(i);
+  }
+  auto sorted = live;
+  auto octant = [&](unsigned r) { return directionOctant(dirs[r]); };
+  sortByOctant(sorted.data(), sorted.size(), octant);
+  for (auto i = 1u; i < sorted.size(); ++i) {
+    BOOST_CHECK(octant(sorted[i - 1]) <= octant(sorted[i]));
+  }
+  std::sort(sorted.begin(), sorted.end());
+  BOOST_CHECK(sorted == live);
+}
+
+BOOST_AUTO_TEST_CASE(AutoRaysPerWorker) {
+  RayMemoryBudget budget;
+  budget.bytesPerTile = 300 * 1024;
+  budget.computeFixedBytes = 100 * 1024;
+  budget.computeBytesPerRay = 6 * 84;
+  budget.ioFixedBytes = 10 * 1024;
+  budget.ioBytesPerRay = 2 * 1280 * 6 * 84 / 64;
+
+  // The I/O tiles are the limit here and the buffers of the choice fit on both kinds of tile:
+  const auto rpw = fitRaysPerWorker(budget);
+  BOOST_CHECK_EQUAL(rpw, (budget.bytesPerTile - budget.ioFixedBytes) / budget.ioBytesPerRay);
+  BOOST_CHECK(budget.ioFixedBytes + rpw * budget.ioBytesPerRay <= budget.bytesPerTile);
+  BOOST_CHECK(budget.ioFixedBytes + (rpw + 1) * budget.ioBytesPerRay > budget.bytesPerTile);
+  BOOST_CHECK(budget.computeFixedBytes + rpw * budget.computeBytesPerRay <= budget.bytesPerTile);
+
+  // Nothing fits if the scene fills the tile:
+  budget.computeFixedBytes = budget.bytesPerTile;
+  BOOST_CHECK_EQUAL(fitRaysPerWorker(budget), 0u);
+
+  // Enough batches are left to fill the pipeline (and there is always at least one ray per worker):
+  const std::size_t workers = 1280 * 6;
+  BOOST_CHECK_EQUAL(raysPerWorkerForBatches(768 * 432, workers, 2), 21u);
+  BOOST_CHECK(768 * 432 / (21 * workers) >= 2);
+  BOOST_CHECK_EQUAL(raysPerWorkerForBatches(100, workers, 2), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(RayBatchPlanning) {
+  // Too few DRAM batches to overlap I/O falls back to one batch at a time:
+  BOOST_CHECK_EQUAL(pipelineDepthForBatches(1, 2), 1u);
+  BOOST_CHECK_EQUAL(pipelineDepthForBatches(2, 2), 2u);
+  BOOST_CHECK_EQUAL(pipelineDepthForBatches(9, 2), 2u);
+
+  // Exactly enough full batches to fill the pipeline of both replicas:
+  auto counts = countRayBatches(4 * 64, 64, 2, 2, 2);
+  BOOST_CHECK_EQUAL(counts.streamBatches, 4u);
+  BOOST_CHECK_EQUAL(counts.deviceBatches, 4u);
+  BOOST_CHECK_EQUAL(counts.paddingRays, 0u);
+
+  // A padded last batch plus a dummy batch so that both replicas get three:
+  counts = countRayBatches(4 * 64 + 10, 64, 2, 2, 3);
+  BOOST_CHECK_EQUAL(counts.streamBatches, 5u);
+  BOOST_CHECK_EQUAL(counts.deviceBatches, 6u);
+  BOOST_CHECK_EQUAL(counts.paddingRays, 54u);
+
+  // Small streams are padded with dummy batches up to the pipeline depth:
+  counts = countRayBatches(10, 64, 1, 2, 2);
+  BOOST_CHECK_EQUAL(counts.streamBatches, 1u);
+  BOOST_CHECK_EQUAL(counts.deviceBatches, 2u);
+
+  // More batches than the DRAM buffer holds:
+  BOOST_CHECK_THROW(countRayBatches(4 * 64 + 10, 64, 2, 2, 2), std::runtime_error);
+  BOOST_CHECK_THROW(countRayBatches(10, 64, 1, 2, 1), std::runtime_error);
+
+  // The DRAM buffer holds the batches of the largest stream (with dummy batches
+  // for replicas that the batches don't divide between):
+  BOOST_CHECK_EQUAL(dramRayBatchCapacity(4 * 64, 64, 1), 4u);
+  BOOST_CHECK_EQUAL(dramRayBatchCapacity(4 * 64, 64, 2), 2u);
+  BOOST_CHECK_EQUAL(dramRayBatchCapacity(4 * 64 + 10, 64, 2), 3u);
+  BOOST_CHECK_EQUAL(dramRayBatchCapacity(4 * 64 + 10, 64, 4), 2u);
+  BOOST_CHECK_EQUAL(dramRayBatchCapacity(10, 64, 3), 1u);
+  for (auto replicas = 1u; replicas <= 4; ++replicas) {
+    for (auto rays : {64u, 1000u, 4097u}) {
+      const auto capacity = dramRayBatchCapacity(rays, 64, replicas);
+      counts = countRayBatches(rays, 64, replicas, 1, capacity);
+      BOOST_CHECK_EQUAL(counts.deviceBatches, capacity * replicas);
+      BOOST_CHECK_THROW(countRayBatches(rays, 64, replicas, 1, capacity - 1), std::runtime_error);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(RayBatchQueueSplit) {
+  // A thread taking from the back waits for the frame to start:
+  RayBatchQueue queue;
+  std::vector<std::size_t> backBatches;
+  std::thread back([&]() {
+    while (auto batch = queue.takeBack()) {
+      backBatches.push_back(*batch);
+    }
+  });
+
+  const std::size_t numBatches = 103;
+  queue.start(numBatches, 64);
+  BOOST_CHECK_EQUAL(queue.getRaysPerBatch(), 64u);
+  std::vector<std::size_t> frontBatches;
+  for (auto run = queue.takeFront(4); run.count; run = queue.takeFront(4)) {
+    BOOST_CHECK(run.count <= 4);
+    for (auto i = 0u; i < run.count; ++i) {
+      frontBatches.push_back(run.first + i);
+    }
+  }
+  back.join();
+
+  // Every batch is handed out once (the front in ascending and the back in descending order):
+  BOOST_CHECK(std::is_sorted(frontBatches.begin(), frontBatches.end()));
+  BOOST_CHECK(std::is_sorted(backBatches.rbegin(), backBatches.rend()));
+  auto all = frontBatches;
+  all.insert(all.end(), backBatches.begin(), backBatches.end());
+  std::sort(all.begin(), all.end());
+  BOOST_CHECK_EQUAL(all.size(), numBatches);
+  for (auto i = 0u; i < all.size(); ++i) {
+    BOOST_CHECK_EQUAL(all[i], i);
+  }
+
+  // Closing releases threads waiting for a frame that never starts:
+  RayBatchQueue unused;
+  bool released = false;
+  std::thread waiting([&]() { released = !unused.takeBack(); });
+  unused.close();
+  waiting.join();
+  BOOST_CHECK(released);
+  BOOST_CHECK_EQUAL(unused.takeFront(1).count, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(RenderFarmQueue) {
+  // Two processes (simulated by two queues) share a frame of 10 batches in chunks of 3:
+  const auto dir = (std::filesystem::temp_directory_path() / "ipu_ray_lib_farm_test").string();
+  std::filesystem::remove_all(dir);
+  const std::size_t numRays = 38;
+  const std::size_t raysPerBatch = 4;
+  RayStream streams[2];
+  std::vector<std::unique_ptr<FarmBatchQueue>> queues;
+  for (auto r = 0u; r < 2; ++r) {
+    streams[r].resize(numRays);
+    queues.emplace_back(new FarmBatchQueue(dir, r, 2, streams[r]));
+    queues[r]->start(10, raysPerBatch);
+  }
+
+  // Process 1 renders one chunk, then process 0 renders everything else
+  // (stealing the rest of process 1's share). Each marks the rays it renders:
+  auto render = [&](std::uint32_t r) {
+    const auto run = queues[r]->takeFront(3);
+    for (auto i = run.first * raysPerBatch; i < std::min((run.first + run.count) * raysPerBatch, numRays); ++i) {
+      streams[r][i].rgb = embree_utils::Vec3fa(r + 1.f, i, 0.f);
+    }
+    return run.count;
+  };
+  BOOST_CHECK_EQUAL(render(1), 3u);
+  while (render(0)) {}
+  BOOST_CHECK_EQUAL(render(1), 0u);
+  BOOST_CHECK_EQUAL(queues[0]->getNumChunks(), 4u);
+  BOOST_CHECK_EQUAL(queues[0]->getChunksRendered(), 3u);
+  BOOST_CHECK_EQUAL(queues[0]->getChunksStolen(), 1u);
+  BOOST_CHECK_EQUAL(queues[1]->getChunksRendered(), 1u);
+  BOOST_CHECK_THROW(queues[1]->gather(), std::logic_error);
+
+  // The output process gathers every ray (process 1's first chunk is chunk 2):
+  queues[1]->finish();
+  queues[0]->gather(0.0);
+  for (auto i = 0u; i < numRays; ++i) {
+    const bool fromOne = i >= 24 && i < 36;
+    BOOST_CHECK_EQUAL(streams[0][i].rgb.x, fromOne ? 2.f : 1.f);
+    BOOST_CHECK_EQUAL(streams[0][i].rgb.y, float(i));
+  }
+
+  // A process that does not match the frame is rejected:
+  RayStream other(numRays + 1);
+  FarmBatchQueue mismatched(dir, 1, 2, other);
+  mismatched.start(10, raysPerBatch);
+  BOOST_CHECK_THROW(mismatched.takeFront(3), std::runtime_error);
+  BOOST_CHECK_THROW(FarmBatchQueue(dir, 2, 2, other), std::invalid_argument);
+  std::filesystem::remove_all(dir);
+}
+
+BOOST_AUTO_TEST_CASE(RayStreamMappedFile) {
+  const auto dir = (std::filesystem::temp_directory_path() / "ipu_ray_lib_ray_stream_test").string();
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  setRayStreamStorage(RayStreamStorage::MappedFile, dir);
+
+  const auto numRays = rayStreamMinMappedBytes / sizeof(embree_utils::TraceResult) + 100;
+  RayStream rays(numRays);
+  RayStream small(10); // Too small to map
+  for (auto i = 0u; i < rays.size(); ++i) {
+    rays[i].p = embree_utils::PixelCoord(i, i + 1);
+  }
+  // The file is unlinked as soon as it is mapped:
+  BOOST_CHECK(std::filesystem::is_empty(dir));
+  BOOST_CHECK_EQUAL(reinterpret_cast<std::uintptr_t>(rays.data()) % sysconf(_SC_PAGESIZE), 0u);
+
+  // Results that were written back are read from the file again:
+  writeBackRays(std::span(rays).subspan(7, 5000));
+  writeBackRays(std::span(small));
+  bool same = true;
+  for (auto i = 0u; i < rays.size(); ++i) {
+    same = same && rays[i].p.u == i && rays[i].p.v == i + 1;
+  }
+  BOOST_CHECK(same);
+
+  // Streams are freed from where they came from after the setting changes:
+  setRayStreamStorage(RayStreamStorage::Heap);
+  BOOST_CHECK(getRayStreamStorage() == RayStreamStorage::Heap);
+  RayStream copy = rays;
+  rays.clear();
+  rays.shrink_to_fit();
+  BOOST_CHECK_EQUAL(copy.size(), numRays);
+  BOOST_CHECK_EQUAL(copy.back().p.u, numRays - 1);
+  BOOST_CHECK_THROW(setRayStreamStorage(RayStreamStorage::MappedFile), std::invalid_argument);
+  std::filesystem::remove_all(dir);
+}
+
+BOOST_AUTO_TEST_CASE(RayCallbackWorkers) {
+  SpscQueue<int> queue(2);
+  int v = 0;
+  BOOST_CHECK(!queue.pop(v));
+  BOOST_CHECK(queue.push(1));
+  BOOST_CHECK(queue.push(2));
+  BOOST_CHECK(!queue.push(3));
+  BOOST_CHECK(queue.pop(v) && v == 1);
+  BOOST_CHECK(queue.push(3));
+  BOOST_CHECK(queue.pop(v) && v == 2);
+  BOOST_CHECK(queue.pop(v) && v == 3);
+  BOOST_CHECK(!queue.pop(v));
+
+  // Two producers (like the stream callbacks of two replicas) submit batches to three
+  // workers. Each batch is a buffer of its index which must arrive intact:
+  const std::size_t numBatches = 200;
+  const std::size_t words = 1000;
+  std::vector<std::atomic<std::uint32_t>> received(numBatches);
+  std::atomic<std::size_t> corrupt(0);
+  RayCallbackPool pool(2, 3, 2, words * sizeof(std::uint32_t), [&](std::size_t index, const void* data) {
+    const auto* values = static_cast<const std::uint32_t*>(data);
+    for (auto i = 0u; i < words; ++i) {
+      corrupt += values[i] != index;
+    }
+    received[index] += 1;
+    if (index == 7) {
+      throw std::runtime_error("Batch failed");
+    }
+  });
+  std::vector<std::thread> producers;
+  for (auto p = 0u; p < 2; ++p) {
+    producers.emplace_back([&, p]() {
+      std::vector<std::uint32_t> batch(words);
+      for (auto b = p; b < numBatches; b += 2) {
+        std::fill(batch.begin(), batch.end(), b);
+        pool.submit(p, b, batch.data()); // The batch can be reused as soon as this returns
+      }
+    });
+  }
+  for (auto& t : producers) {
+    t.join();
+  }
+  BOOST_CHECK_THROW(pool.drain(), std::runtime_error);
+  BOOST_CHECK_EQUAL(corrupt.load(), 0u);
+  for (const auto& r : received) {
+    BOOST_CHECK_EQUAL(r.load(), 1u);
+  }
+  pool.drain(); // The error is only reported once
+}
+
+BOOST_AUTO_TEST_CASE(ProgressiveAccumulation) {
+  // Two threads (like the workers of a ray callback pool) add the samples of a
+  // 4x3 image at the same time so every pixel is updated from both threads:
+  const std::uint32_t rows = 3;
+  const std::uint32_t cols = 4;
+  const std::uint32_t samples = 64;
+  cv::Mat image(rows, cols, CV_32FC3, cv::Scalar(1.f, 1.f, 1.f));
+  ProgressiveImage progressive(image, 1.f / samples);
+
+  // Sample colours are small multiples of powers of two so the sums are exact in any order:
+  auto sampleColour = [](std::uint32_t r, std::uint32_t c, std::uint32_t s) {
+    return embree_utils::Vec3fa(r, c, (s % 4) * .25f);
+  };
+  std::vector<std::thread> workers;
+  for (auto w = 0u; w < 2; ++w) {
+    workers.emplace_back([&, w]() {
+      RayStream batch(rows * cols);
+      for (auto s = w; s < samples; s += 2) {
+        for (auto i = 0u; i < batch.size(); ++i) {
+          batch[i].p = embree_utils::PixelCoord(i / cols, i % cols);
+          batch[i].rgb = sampleColour(i / cols, i % cols, s);
+        }
+        progressive.add(batch);
+      }
+    });
+  }
+  for (auto& t : workers) {
+    t.join();
+  }
+
+  BOOST_CHECK_EQUAL(progressive.getRayCount(), rows * cols * samples);
+  for (auto r = 0u; r < rows; ++r) {
+    for (auto c = 0u; c < cols; ++c) {
+      embree_utils::Vec3fa mean(0.f, 0.f, 0.f);
+      for (auto s = 0u; s < samples; ++s) {
+        mean += sampleColour(r, c, s);
+      }
+      mean = mean * (1.f / samples);
+      const auto& pixel = image.at<cv::Vec3f>(r, c); // (BGR)
+      BOOST_CHECK_EQUAL(pixel[0], mean.z);
+      BOOST_CHECK_EQUAL(pixel[1], mean.y);
+      BOOST_CHECK_EQUAL(pixel[2], mean.x);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(AdaptiveSamplingConvergence) {
+  // Constant (and black) pixels converge as soon as there are enough samples:
+  PixelSampleStats flat;
+  PixelSampleStats black;
+  BOOST_CHECK(!flat.converged(.01f));
+  for (auto i = 0u; i < 2; ++i) {
+    flat.add(embree_utils::Vec3fa(.5f, .5f, .5f));
+    black.add(embree_utils::Vec3fa(0.f, 0.f, 0.f));
+  }
+  BOOST_CHECK(flat.converged(.01f));
+  BOOST_CHECK(black.converged(.01f));
+  BOOST_CHECK_CLOSE(flat.sum / flat.count, .5f, 1e-4f);
+
+  // A noisy pixel needs roughly (stddev / (threshold * mean))^2 samples:
+  std::mt19937 gen(7);
+  std::uniform_real_distribution<float> dist(0.f, 2.f);
+  PixelSampleStats noisy;
+  while (!noisy.converged(.05f) && noisy.count < 100000) {
+    const float v = dist(gen);
+    noisy.add(embree_utils::Vec3fa(v, v, v));
+  }
+  BOOST_CHECK_GT(noisy.count, 100u);
+  BOOST_CHECK_LT(noisy.count, 300u);
+}
+
+BOOST_AUTO_TEST_CASE(EnvMapLookup) {
+  // 4x2 texture where the blue channel is the column and green is the row:
+  const unsigned width = 4;
+  const unsigned height = 2;
+  std::vector<float> texels;
+  for (auto r = 0u; r < height; ++r) {
+    for (auto c = 0u; c < width; ++c) {
+      texels.insert(texels.end(), {float(c), float(r), 1.f});
+    }
+  }
+  EnvMap<float> env{texels.data(), width, height, 0.f};
+
+  // Straight up is the first row and the +x axis is the first column:
+  float u, v;
+  equirectUV(embree_utils::Vec3fa(0.f, 1.f, 0.f), 0.f, u, v);
+  BOOST_CHECK_SMALL(u, 1e-6f);
+  auto c = env.lookup(embree_utils::Vec3fa(1.f, 1e-7f, 0.f).normalized());
+  BOOST_CHECK_CLOSE(c.x, 1.f, 1e-3f);
+  BOOST_CHECK_CLOSE(c.y, 1.f, 1e-3f); // Horizon is on the last row (clamped)
+  BOOST_CHECK_SMALL(c.z, 1e-4f);
+
+  // Halfway between columns 1 and 2 interpolates:
+  const float phi = embree_utils::TwoPi * 1.5f / width;
+  c = env.lookup(embree_utils::Vec3fa(std::cos(phi), 0.f, std::sin(phi)));
+  BOOST_CHECK_CLOSE(c.z, 1.5f, 1e-3f);
+
+  // The azimuth wraps from the last column back to the first:
+  const float wrapPhi = embree_utils::TwoPi * 3.5f / width;
+  c = env.lookup(embree_utils::Vec3fa(std::cos(wrapPhi), 0.f, std::sin(wrapPhi)));
+  BOOST_CHECK_CLOSE(c.z, 1.5f, 1e-3f);
+
+  // Rotating the map by a column shifts the lookup:
+  EnvMap<float> rotated{texels.data(), width, height, embree_utils::TwoPi / width};
+  c = rotated.lookup(embree_utils::Vec3fa(1.f, 0.f, 0.f));
+  BOOST_CHECK_CLOSE(c.z, 1.f, 1e-3f);
+}
+
+BOOST_AUTO_TEST_CASE(AreaLightSampling) {
+  using embree_utils::Vec3fa;
+  // A triangle (area 2), a sphere (area 4 Pi), and a disc (area Pi) with cumulative power:
+  std::vector<AreaLight> lights(3);
+  lights[0].shape = AreaLight::Shape::Triangle;
+  lights[0].p = Vec3fa(1.f, 0.f, 0.f);
+  lights[0].u = Vec3fa(2.f, 0.f, 0.f);
+  lights[0].v = Vec3fa(0.f, 2.f, 0.f);
+  lights[1].shape = AreaLight::Shape::Sphere;
+  lights[1].p = Vec3fa(0.f, 5.f, 0.f);
+  lights[1].radius = 1.f;
+  lights[2].shape = AreaLight::Shape::Disc;
+  lights[2].p = Vec3fa(0.f, 0.f, 3.f);
+  lights[2].u = Vec3fa(1.f, 0.f, 0.f);
+  lights[2].v = Vec3fa(0.f, 1.f, 0.f);
+  BOOST_CHECK_CLOSE(lights[0].area(), 2.f, 1e-4f);
+  BOOST_CHECK_CLOSE(lights[1].area(), 4.f * embree_utils::Pi, 1e-4f);
+  BOOST_CHECK_CLOSE(lights[2].area(), embree_utils::Pi, 1e-4f);
+  float power = 0.f;
+  for (auto& l : lights) {
+    power += l.area();
+    l.cdf = power;
+  }
+  ArrayRef<AreaLight> lightsRef(lights);
+
+  std::mt19937 gen(5);
+  std::uniform_real_distribution<float> uniform(0.f, 1.f);
+  std::vector<unsigned> counts(lights.size(), 0u);
+  const unsigned numSamples = 100000;
+  for (auto i = 0u; i < numSamples; ++i) {
+    const auto& light = chooseLight(lightsRef, uniform(gen));
+    const auto index = &light - lights.data();
+    counts[index] += 1;
+
+    // Samples lie on the light's surface:
+    Vec3fa p, n;
+    light.sample(uniform(gen), uniform(gen), p, n);
+    BOOST_CHECK_CLOSE(n.squaredNorm(), 1.f, 1e-3f);
+    if (index == 0) {
+      BOOST_CHECK_SMALL(p.z, 1e-6f);
+      BOOST_CHECK(p.x >= 1.f && p.y >= 0.f && (p.x - 1.f) + p.y <= 2.f + 1e-5f);
+    } else if (index == 1) {
+      BOOST_CHECK_CLOSE((p - light.p).squaredNorm(), 1.f, 1e-3f);
+    } else {
+      BOOST_CHECK_CLOSE(p.z, 3.f, 1e-4f);
+      BOOST_CHECK((p - light.p).squaredNorm() <= 1.f + 1e-5f);
+    }
+  }
+
+  // Lights are chosen in proportion to their power:
+  for (auto l = 0u; l < lights.size(); ++l) {
+    BOOST_CHECK_CLOSE(counts[l] / float(numSamples), lights[l].area() / power, 3.f);
+  }
+
+  // Every point on the lights has the same area pdf (all of them have the same emission):
+  BOOST_CHECK_CLOSE(lightAreaPdf(lightsRef, Vec3fa(1.f, 1.f, 1.f)), 1.f / power, 1e-4f);
+}
+
+BOOST_AUTO_TEST_CASE(SobolSampling) {
+  // The first 16 samples of each pair of dimensions should be a (0,4,2)-net:
+  // every 4x4, 16x1, and 1x16 box of the unit square contains exactly one point:
+  for (auto pixel : {0u, 7u, 1234u}) {
+    std::vector<unsigned> squares(2 * 16, 0u);
+    std::vector<unsigned> columns(2 * 16, 0u);
+    std::vector<unsigned> rows(2 * 16, 0u);
+    float sum = 0.f;
+    for (auto s = 0u; s < 16u; ++s) {
+      SobolSampler sampler(pixel, s, 42u);
+      for (auto pair = 0u; pair < 2u; ++pair) {
+        const float u1 = sampler.uniform_0_1();
+        const float u2 = sampler.uniform_0_1();
+        BOOST_CHECK(u1 >= 0.f && u1 < 1.f);
+        BOOST_CHECK(u2 >= 0.f && u2 < 1.f);
+        sum += u1 + u2;
+        squares[pair * 16 + unsigned(4.f * u1) * 4 + unsigned(4.f * u2)] += 1;
+        columns[pair * 16 + unsigned(16.f * u1)] += 1;
+        rows[pair * 16 + unsigned(16.f * u2)] += 1;
+      }
+    }
+    for (auto i = 0u; i < squares.size(); ++i) {
+      BOOST_CHECK_EQUAL(squares[i], 1u);
+      BOOST_CHECK_EQUAL(columns[i], 1u);
+      BOOST_CHECK_EQUAL(rows[i], 1u);
+    }
+    // The mean of stratified samples is close to one half:
+    BOOST_CHECK_CLOSE(sum / 64.f, .5f, 5.f);
+  }
+
+  // Pixels are decorrelated by their seeds:
+  SobolSampler a(0u, 0u, 42u);
+  SobolSampler b(1u, 0u, 42u);
+  BOOST_CHECK_NE(a.uniform_0_1(), b.uniform_0_1());
+}
+
+BOOST_AUTO_TEST_CASE(DenoiseImage) {
+  // Noisy constant illumination of two materials that meet at the image's centre line:
+  const unsigned width = 32;
+  const unsigned height = 32;
+  std::vector<float> rgb(3 * width * height);
+  std::vector<float> truth(rgb.size());
+  std::vector<float> albedo(rgb.size());
+  std::vector<float> normal(rgb.size(), 0.f);
+  std::mt19937 gen(11);
+  std::normal_distribution<float> noise(1.f, .3f);
+  for (auto y = 0u; y < height; ++y) {
+    for (auto x = 0u; x < width; ++x) {
+      const auto p = 3 * (y * width + x);
+      const bool left = x < width / 2;
+      albedo[p] = left ? .8f : .2f;
+      albedo[p + 1] = .2f;
+      albedo[p + 2] = left ? .2f : .8f;
+      normal[p + 2] = 1.f;
+      for (auto c = 0u; c < 3u; ++c) {
+        truth[p + c] = albedo[p + c];
+        rgb[p + c] = albedo[p + c] * noise(gen);
+      }
+    }
+  }
+
+  std::vector<float> denoised(rgb.size());
+  denoiseImage(rgb.data(), albedo.data(), normal.data(), width, height, denoised.data());
+
+  auto mse = [&](const std::vector<float>& image) {
+    float sum = 0.f;
+    for (auto i = 0u; i < image.size(); ++i) {
+      sum += (image[i] - truth[i]) * (image[i] - truth[i]);
+    }
+    return sum / image.size();
+  };
+  BOOST_CHECK_LT(mse(denoised), .1f * mse(rgb));
+
+  // The materials are not blurred across the edge:
+  const auto edge = 3 * (height / 2 * width + width / 2);
+  BOOST_CHECK_CLOSE(denoised[edge - 3], .8f, 10.f);
+  BOOST_CHECK_CLOSE(denoised[edge], .2f, 10.f);
+}
+
+BOOST_AUTO_TEST_CASE(CameraPathLoad) {
+  const std::string path = "test_camera_path.txt";
+  {
+    std::ofstream file(path);
+    file << "# eye target [up]\n"
+         << "0 0 5  0 0 0\n"
+         << "\n"
+         << "3 2 1  3 2 -9  1 0 0\n";
+  }
+  const auto cameras = loadCameraPath(path);
+  std::remove(path.c_str());
+  BOOST_REQUIRE_EQUAL(cameras.size(), 2u);
+
+  // Cameras are at the eye looking down their -z axis at the target:
+  const embree_utils::Vec3fa origin(0.f, 0.f, 0.f);
+  const embree_utils::Vec3fa forward(0.f, 0.f, -1.f);
+  auto p = cameras[0].point(origin);
+  BOOST_CHECK_SMALL(p.x, 1e-6f);
+  BOOST_CHECK_CLOSE(p.z, 5.f, 1e-4f);
+  auto d = cameras[0].vector(forward);
+  BOOST_CHECK_CLOSE(d.z, -1.f, 1e-4f);
+  BOOST_CHECK_CLOSE(cameras[0].vector(embree_utils::Vec3fa(0.f, 1.f, 0.f)).y, 1.f, 1e-4f);
+
+  p = cameras[1].point(origin);
+  BOOST_CHECK_CLOSE(p.x, 3.f, 1e-4f);
+  BOOST_CHECK_CLOSE(p.y, 2.f, 1e-4f);
+  d = cameras[1].vector(forward);
+  BOOST_CHECK_CLOSE(d.z, -1.f, 1e-4f);
+  // The camera's up axis follows the path's up vector:
+  BOOST_CHECK_CLOSE(cameras[1].vector(embree_utils::Vec3fa(0.f, 1.f, 0.f)).x, 1.f, 1e-4f);
+  BOOST_CHECK_CLOSE(cameras[1].determinant(), 1.f, 1e-4f);
+
+  // Transforms must be rigid and looking along the up vector is degenerate:
+  BOOST_CHECK_THROW(lookAtTransform(origin, embree_utils::Vec3fa(0.f, 2.f, 0.f)), std::runtime_error);
+  BOOST_CHECK_THROW(loadCameraPath("missing_camera_path.txt"), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(EnvMapSampling) {
+  // 16x8 texture that is dim everywhere except for a bright patch:
+  const unsigned width = 16;
+  const unsigned height = 8;
+  std::vector<float> texels(3 * width * height, .1f);
+  for (auto c : {5u, 6u}) {
+    for (auto i = 0u; i < 3; ++i) { texels[3 * (2 * width + c) + i] = 50.f; }
+  }
+  EnvMap<float> env{texels.data(), width, height, .3f};
+  std::vector<float> cdf(EnvMapSampler::cdfSize(width, height));
+  EnvMapSampler::build(env, cdf.data());
+  EnvMapSampler sampler{cdf.data(), width, height, env.azimuthRotation};
+  BOOST_CHECK_EQUAL(cdf[height], 1.f);
+
+  std::mt19937 gen(3);
+  std::uniform_real_distribution<float> uniform(0.f, 1.f);
+
+  // The pdf integrates to one over the sphere (checked with uniform samples)
+  // and the estimate of the total radiance agrees with uniform sampling:
+  const unsigned numSamples = 200000;
+  double pdfIntegral = 0.0;
+  double uniformEstimate = 0.0;
+  double importanceEstimate = 0.0;
+  for (auto i = 0u; i < numSamples; ++i) {
+    const float z = 1.f - 2.f * uniform(gen);
+    const float phi = embree_utils::TwoPi * uniform(gen);
+    const float r = std::sqrt(std::max(0.f, 1.f - z * z));
+    const embree_utils::Vec3fa dir(r * std::cos(phi), z, r * std::sin(phi));
+    pdfIntegral += sampler.pdf(dir) * 4.0 * embree_utils::Pi;
+    uniformEstimate += env.lookup(dir).x * 4.0 * embree_utils::Pi;
+
+    float pdf;
+    const auto sampled = sampler.sample(uniform(gen), uniform(gen), pdf);
+    BOOST_REQUIRE_CLOSE(sampled.squaredNorm(), 1.f, 1e-3f);
+    BOOST_REQUIRE_CLOSE(pdf, sampler.pdf(sampled), 0.5f);
+    importanceEstimate += env.lookup(sampled).x / pdf;
+  }
+  BOOST_CHECK_CLOSE(pdfIntegral / numSamples, 1.0, 1.0);
+  BOOST_CHECK_CLOSE(importanceEstimate / numSamples, uniformEstimate / numSamples, 2.0);
+
+  BOOST_CHECK_CLOSE(powerHeuristic(1.f, 1.f), .5f, 1e-4f);
+  BOOST_CHECK_EQUAL(powerHeuristic(1.f, 0.f), 1.f);
+}
+
+BOOST_AUTO_TEST_CASE(NifMlpEvaluation) {
+  // Small network with a skip connection into the third layer:
+  const NifMlpShape shape{2, 5, 4, 2};
+  BOOST_CHECK_EQUAL(shape.layerInputs(0), 8u);
+  BOOST_CHECK_EQUAL(shape.layerInputs(2), 13u);
+  BOOST_CHECK_EQUAL(shape.layerOutputs(3), 3u);
+
+  std::mt19937 gen(11);
+  std::uniform_real_distribution<float> dist(-.5f, .5f);
+  std::vector<float> weights(shape.numWeights());
+  for (auto& w : weights) { w = dist(gen); }
+  const NifDecodeParams decode{2.f, {.1f, .2f, .3f}, true};
+
+  // Reference evaluation of one layer at a time:
+  auto reference = [&](float u, float v) {
+    std::vector<float> features;
+    for (auto x : {std::sin(2.f * (u - 1.f)), std::sin(4.f * (u - 1.f)), std::sin(2.f * (v - 1.f)), std::sin(4.f * (v - 1.f)),
+                   std::cos(2.f * (u - 1.f)), std::cos(4.f * (u - 1.f)), std::cos(2.f * (v - 1.f)), std::cos(4.f * (v - 1.f))}) {
+      features.push_back(x);
+    }
+    std::vector<float> acts = features;
+    auto w = weights.data();
+    for (auto l = 0u; l < shape.numLayers; ++l) {
+      if (l == shape.concatLayer) {
+        acts.insert(acts.end(), features.begin(), features.end());
+      }
+      const auto numOut = shape.layerOutputs(l);
+      std::vector<float> out(numOut);
+      for (auto j = 0u; j < numOut; ++j) {
+        out[j] = w[acts.size() * numOut + j];
+        for (auto i = 0u; i < acts.size(); ++i) {
+          out[j] += acts[i] * w[i * numOut + j];
+        }
+        if (l + 1 < shape.numLayers) { out[j] = std::max(out[j], 0.f); }
+      }
+      w += (acts.size() + 1) * numOut;
+      acts = out;
+    }
+    return embree_utils::Vec3fa(std::exp(acts[2] * 2.f + .3f), std::exp(acts[1] * 2.f + .2f), std::exp(acts[0] * 2.f + .1f));
+  };
+
+  std::vector<float> scratch(shape.scratchSize());
+  for (auto uv : {std::make_pair(0.f, 0.f), std::make_pair(.3f, .7f), std::make_pair(.9f, .25f)}) {
+    auto c = evaluateNif(shape, weights.data(), decode, uv.first, uv.second, scratch.data());
+    auto expected = reference(uv.first, uv.second);
+    BOOST_CHECK_CLOSE(c.x, expected.x, 1e-3f);
+    BOOST_CHECK_CLOSE(c.y, expected.y, 1e-3f);
+    BOOST_CHECK_CLOSE(c.z, expected.z, 1e-3f);
+  }
+}
+
 BOOST_AUTO_TEST_CASE(SerialiseVector) {
   std::vector<std::uint32_t> v(999);
   std::iota(v.begin(), v.end(), 0);
@@ -236,6 +1704,321 @@ BOOST_AUTO_TEST_CASE(SerialiseAlignedArray) {
   BOOST_CHECK_EQUAL(uu, 5u);
 }
 
+BOOST_AUTO_TEST_CASE(SceneFeatureDetection) {
+  std::vector<GeomRef> geometry = {GeomRef(0, GeomType::Mesh), GeomRef(0, GeomType::Disc)};
+  std::vector<Material> materials(2);
+  SceneRef scene{};
+  scene.geometry = ArrayRef(geometry);
+  scene.materials = ArrayRef(materials);
+
+  auto features = getSceneFeatures(scene);
+  BOOST_CHECK(!features.spheres);
+  BOOST_CHECK(features.discs);
+  BOOST_CHECK(!features.instances);
+  BOOST_CHECK(!features.refractive);
+
+  // A renderer specialised for these features can not render a refractive material:
+  materials[1].type = Material::Type::Refractive;
+  const auto glass = getSceneFeatures(scene);
+  BOOST_CHECK(glass.refractive);
+  BOOST_CHECK(glass.supports(features));
+  BOOST_CHECK(!features.supports(glass));
+  BOOST_CHECK((SceneFeatures{true, true, true, true}.supports(glass)));
+}
+
+BOOST_AUTO_TEST_CASE(SceneCacheRoundTrip) {
+  std::vector<GeomRef> geometry = {GeomRef(0, GeomType::Mesh), GeomRef(0, GeomType::Sphere)};
+  std::vector<MeshInfo> meshInfo(1);
+  std::vector<Triangle> tris = {Triangle(0, 1, 2), Triangle(2, 1, 3)};
+  std::vector<embree_utils::Vec3fa> verts = {{0.f, 0.f, 0.f}, {1.f, 0.f, 0.f}, {0.f, 1.f, 0.f}, {1.f, 1.f, 0.f}};
+  std::vector<embree_utils::Vec3fa> normals;
+  std::vector<PrecomputedTriangle> precomputed;
+  std::vector<VertexQuantisation> quantisation;
+  std::vector<QuantisedVertex> packedVerts;
+  std::vector<OctahedralNormal> packedNormals;
+  std::vector<std::uint32_t> matIDs = {1, 0};
+  std::vector<Material> materials(2);
+  std::vector<SceneBvhNode> nodes(3);
+  std::vector<InstanceInfo> instances;
+  std::vector<SceneBvhNode> blasNodes;
+  std::vector<AreaLight> lights;
+  SceneRef scene {
+    ArrayRef(geometry), ArrayRef(meshInfo), ArrayRef(tris), ArrayRef(verts), ArrayRef(normals), ArrayRef(precomputed),
+    ArrayRef(quantisation), ArrayRef(packedVerts), ArrayRef(packedNormals),
+    ArrayRef(matIDs), ArrayRef(materials), ArrayRef(nodes), ArrayRef(instances), ArrayRef(blasNodes), ArrayRef(lights),
+    5u // maxLeafDepth
+  };
+  scene.imageWidth = 64.f;
+  scene.samplesPerPixel = 4u;
+  std::vector<Sphere> spheres = {Sphere(embree_utils::Vec3fa(1.f, 2.f, 3.f), 4.f)};
+  std::vector<Disc> discs = {Disc(embree_utils::Vec3fa(0.f, 1.f, 0.f), embree_utils::Vec3fa(5.f, 6.f, 7.f), 8.f)};
+
+  const std::string path = "test_scene_cache.scene";
+  SceneCache::save(path, 42u, scene, 0.5f, spheres, discs);
+  BOOST_CHECK(SceneCache::load(path, 43u) == nullptr);
+
+  auto cache = SceneCache::load(path, 42u);
+  BOOST_REQUIRE(cache != nullptr);
+  auto& cached = cache->getSceneRef();
+  BOOST_REQUIRE_EQUAL(cached.meshVerts.size(), verts.size());
+  BOOST_CHECK_EQUAL(cached.meshVerts[3].y, 1.f);
+  BOOST_CHECK_EQUAL(cached.meshTris[1].v2, tris[1].v2);
+  BOOST_CHECK_EQUAL(cached.maxLeafDepth, 5u);
+  BOOST_CHECK_EQUAL(cached.samplesPerPixel, 4u);
+  BOOST_CHECK_EQUAL(cache->getHorizontalFov(), 0.5f);
+  BOOST_CHECK_EQUAL(cache->getSpheres().at(0).radius, 4.f);
+  BOOST_CHECK_EQUAL(cache->getDiscs().at(0).ny, 1.f);
+  BOOST_CHECK_EQUAL(cache->getDiscs().at(0).cz, 7.f);
+
+  // Updating the render parameters must give the same stream as serialising from scratch:
+  scene.imageWidth = 640.f;
+  scene.samplesPerPixel = 1000u;
+  cache->setRenderParams(scene);
+  Serialiser<16> s(1024);
+  s << scene;
+  BOOST_REQUIRE_EQUAL(s.bytes.size(), cache->getSerialisedSceneSize());
+  BOOST_CHECK(std::equal(s.bytes.begin(), s.bytes.end(), cache->getSerialisedScene()));
+
+  // The mapping is private so the file still holds the original parameters:
+  cache.reset();
+  BOOST_CHECK_EQUAL(SceneCache::load(path, 42u)->getSceneRef().samplesPerPixel, 4u);
+  std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(StreamingExrWrite) {
+  // 5x3 image of 2x2 tiles with a window that leaves the first column and last row black:
+  const std::uint32_t width = 5;
+  const std::uint32_t height = 3;
+  const CropWindow window{4, 2, 1, 0};
+  std::vector<StreamingExr::Part> parts = {
+    {"rgb", [](const embree_utils::TraceResult& r) { return r.rgb; }},
+    {"normal", [](const embree_utils::TraceResult& r) { return r.h.normal; }}
+  };
+  RayStream results;
+  for (auto r = 0u; r < 2; ++r) {
+    for (auto c = 1u; c < 5; ++c) {
+      embree_utils::TraceResult t;
+      t.p = embree_utils::PixelCoord(r, c);
+      t.rgb = embree_utils::Vec3fa(r, c, 0.5f);
+      t.h.normal = embree_utils::Vec3fa(0.f, 0.f, r + c);
+      results.push_back(t);
+    }
+  }
+
+  const std::string path = "test_streaming.exr";
+  {
+    StreamingExr exr(path, width, height, window, parts, StreamingExr::PixelType::FLOAT, 2);
+    BOOST_CHECK_EQUAL(exr.getNumTiles(), 6u);
+    // The first two columns only complete the top left tile:
+    exr.add(std::span(results).subspan(0, 2));
+    BOOST_CHECK_EQUAL(exr.getTilesStreamed(), 0u);
+    exr.add(std::span(results).subspan(4, 2));
+    BOOST_CHECK_EQUAL(exr.getTilesStreamed(), 1u);
+    // The rest complete both other tiles in the window (the bottom row of tiles is outside it):
+    exr.add(std::span(results).subspan(2, 2));
+    exr.add(std::span(results).subspan(6, 2));
+    BOOST_CHECK_EQUAL(exr.getTilesStreamed(), 3u);
+    exr.finish();
+  }
+
+  std::ifstream in(path, std::ios::binary);
+  const std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  auto read = [&](std::size_t& pos, auto value) {
+    std::memcpy(&value, bytes.data() + pos, sizeof(value));
+    pos += sizeof(value);
+    return value;
+  };
+  std::size_t pos = 0;
+  BOOST_CHECK_EQUAL(read(pos, std::int32_t()), 20000630);
+  BOOST_CHECK_EQUAL(read(pos, std::int32_t()), 0x1002); // Multi-part
+  // Skip both headers (and the empty header that ends them):
+  for (auto h = 0u; h < 3; ++h) {
+    while (bytes[pos] != 0) {
+      pos += std::strlen(&bytes[pos]) + 1;
+      pos += std::strlen(&bytes[pos]) + 1;
+      pos += read(pos, std::int32_t());
+    }
+    pos += 1;
+  }
+
+  // Check the pixels of the tile which holds (row 1, column 3) in each part:
+  std::vector<std::uint64_t> offsets(12);
+  for (auto& o : offsets) { o = read(pos, std::uint64_t()); }
+  for (auto p = 0u; p < 2; ++p) {
+    std::size_t chunk = offsets[6 * p + 1];
+    BOOST_CHECK_EQUAL(read(chunk, std::int32_t()), p);
+    BOOST_CHECK_EQUAL(read(chunk, std::int32_t()), 1); // Tile x
+    BOOST_CHECK_EQUAL(read(chunk, std::int32_t()), 0); // Tile y
+    chunk += 2 * sizeof(std::int32_t);
+    BOOST_CHECK_EQUAL(read(chunk, std::int32_t()), 2 * 2 * 3 * sizeof(float));
+    // Second scanline then channels B, G, R then the second pixel:
+    chunk += (3 * 2 + 1) * sizeof(float);
+    const float b = read(chunk, float());
+    chunk += sizeof(float);
+    const float g = read(chunk, float());
+    chunk += sizeof(float);
+    const float r = read(chunk, float());
+    BOOST_CHECK_EQUAL(b, p == 0 ? .5f : 4.f);
+    BOOST_CHECK_EQUAL(g, p == 0 ? 3.f : 0.f);
+    BOOST_CHECK_EQUAL(r, p == 0 ? 1.f : 0.f);
+  }
+  in.close();
+  std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(TextureCompression) {
+  // Smooth gradient with sizes that are not multiples of the block size:
+  const std::uint32_t w = 37;
+  const std::uint32_t h = 20;
+  std::vector<float> rgb(3 * w * h);
+  for (auto y = 0u; y < h; ++y) {
+    for (auto x = 0u; x < w; ++x) {
+      rgb[3 * (y * w + x) + 0] = x / float(w - 1);
+      rgb[3 * (y * w + x) + 1] = y / float(h - 1);
+      rgb[3 * (y * w + x) + 2] = .3f;
+    }
+  }
+
+  std::vector<Bc1Block> blocks;
+  const auto full = compressTexture(rgb, w, h, blocks);
+  BOOST_CHECK_EQUAL(full.width, w);
+  BOOST_CHECK_EQUAL(full.height, h);
+  BOOST_CHECK_EQUAL(full.numLevels, 6u); // 37x20 down to 1x1
+  BOOST_CHECK_EQUAL(full.firstBlock, 0u);
+  BOOST_CHECK_EQUAL(blocks.size(), 74u); // 10x5 + 5x3 + 3x2 + 1 + 1 + 1
+
+  // Sampling the centre of each texel at level 0 returns it to within the BC1 error.
+  // The image's top row is at v = 1:
+  float maxError = 0.f;
+  for (auto y = 0u; y < h; ++y) {
+    for (auto x = 0u; x < w; ++x) {
+      const TexCoord uv{(x + .5f) / w, 1.f - (y + .5f) / h};
+      const auto c = sampleTexture(full, blocks, uv, 0);
+      for (auto i = 0u; i < 3; ++i) {
+        maxError = std::max(maxError, std::abs(c[i] - rgb[3 * (y * w + x) + i]));
+      }
+    }
+  }
+  BOOST_CHECK_LT(maxError, .1f);
+
+  // The last level is the mean colour and coordinates wrap:
+  const auto mean = sampleTexture(full, blocks, TexCoord{.3f, .6f}, full.numLevels - 1);
+  BOOST_CHECK_CLOSE(mean.z, .3f, 5.f);
+  const auto a = sampleTexture(full, blocks, TexCoord{.25f, .5f}, 0);
+  const auto b = sampleTexture(full, blocks, TexCoord{-.75f, 2.5f}, 0);
+  BOOST_CHECK_EQUAL(a.x, b.x);
+  BOOST_CHECK_EQUAL(a.y, b.y);
+
+  // Limiting the size drops the large levels and appends after the existing blocks:
+  const auto small = compressTexture(rgb, w, h, blocks, 8);
+  BOOST_CHECK_EQUAL(small.width, 4u);
+  BOOST_CHECK_EQUAL(small.height, 2u);
+  BOOST_CHECK_EQUAL(small.numLevels, 3u);
+  BOOST_CHECK_EQUAL(small.firstBlock, 74u);
+  BOOST_CHECK_EQUAL(blocks.size(), 77u);
+
+  // Level selection: about one texel per footprint (clamped to the chain):
+  BOOST_CHECK_EQUAL(textureLevel(full, 1.f, 1.f), 0u);
+  BOOST_CHECK_EQUAL(textureLevel(full, 16.f, 1.f), 2u);
+  BOOST_CHECK_EQUAL(textureLevel(full, 1e9f, 1.f), full.numLevels - 1);
+
+  BOOST_CHECK_THROW(compressTexture(rgb, w + 1, h, blocks), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(SceneAnalysis) {
+  // Random triangle soup (geomID 0) and a sphere (geomID 1):
+  std::mt19937 gen(5);
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  HostTriangleMesh mesh;
+  for (auto t = 0u; t < 300; ++t) {
+    const embree_utils::Vec3fa c(dist(gen), dist(gen), dist(gen));
+    for (auto v = 0u; v < 3; ++v) {
+      mesh.vertices.push_back(c + embree_utils::Vec3fa(dist(gen), dist(gen), dist(gen)) * .1f);
+    }
+    mesh.triangles.emplace_back(3 * t, 3 * t + 1, 3 * t + 2);
+  }
+  Sphere sphere(embree_utils::Vec3fa(.5f, .5f, .5f), .25f);
+
+  std::vector<BuildPrimitive> prims;
+  for (auto t = 0u; t < mesh.triangles.size(); ++t) {
+    prims.push_back(BuildPrimitive{mesh.getTriangleBoundingBox(t), 0u, t});
+  }
+  prims.push_back(BuildPrimitive{sphere.getBoundingBox(), 1u, 0u});
+  const auto build = buildSahBvh(std::move(prims));
+  std::vector<Triangle> reordered;
+  for (const auto& p : build.prims) {
+    if (p.geomID == 0) { reordered.push_back(mesh.triangles[p.primID]); }
+  }
+  mesh.triangles = reordered;
+
+  auto leafBounds = [&](std::uint32_t geomID, std::uint32_t first, std::uint32_t count) {
+    if (geomID == 1) {
+      return sphere.getBoundingBox();
+    }
+    embree_utils::Bounds3d b;
+    for (auto t = first; t < first + count; ++t) { b += mesh.getTriangleBoundingBox(t); }
+    return b;
+  };
+  std::uint32_t stackSize = 0;
+  const auto nodes = buildCompactBvh4<CompactBVH4QNode>(build.nodes, 0, stackSize);
+  const auto q = analyseBvh<CompactBVH4QNode>(nodes, leafBounds);
+  BOOST_CHECK_EQUAL(q.nodes, nodes.size());
+  BOOST_CHECK_EQUAL(q.prims, build.prims.size());
+  BOOST_CHECK_EQUAL(std::accumulate(q.leafSizes.begin(), q.leafSizes.end(), std::size_t(0)), q.leaves);
+  BOOST_CHECK_EQUAL(std::accumulate(q.leafDepths.begin(), q.leafDepths.end(), std::size_t(0)), q.leaves);
+  BOOST_CHECK_EQUAL(q.leafDepths.at(0), 0u); // The root has depth 1
+  BOOST_CHECK_GE(q.sahCost, 1.0); // The root is always visited
+  // Quantised boxes are conservative but only a little larger:
+  BOOST_CHECK_GT(q.maxBoundsError, 0.0);
+  BOOST_CHECK_LT(q.meanBoundsError, 0.25);
+
+  // The tile memory items account for every serialised byte:
+  std::vector<GeomRef> geometry = {GeomRef(0, GeomType::Mesh), GeomRef(0, GeomType::Sphere)};
+  std::vector<MeshInfo> meshInfo(1);
+  std::vector<embree_utils::Vec3fa> normals;
+  std::vector<PrecomputedTriangle> precomputed;
+  std::vector<VertexQuantisation> quantisation;
+  std::vector<QuantisedVertex> packedVerts;
+  std::vector<OctahedralNormal> packedNormals;
+  std::vector<std::uint32_t> matIDs = {0, 0};
+  std::vector<Material> materials(1);
+  std::vector<SceneBvhNode> sceneNodes(nodes.begin(), nodes.end());
+  std::vector<InstanceInfo> instances;
+  std::vector<SceneBvhNode> blasNodes;
+  std::vector<AreaLight> lights;
+  SceneRef scene {
+    ArrayRef(geometry), ArrayRef(meshInfo), ArrayRef(mesh.triangles), ArrayRef(mesh.vertices), ArrayRef(normals),
+    ArrayRef(precomputed), ArrayRef(quantisation), ArrayRef(packedVerts), ArrayRef(packedNormals),
+    ArrayRef(matIDs), ArrayRef(materials), ArrayRef(sceneNodes), ArrayRef(instances), ArrayRef(blasNodes), ArrayRef(lights),
+    stackSize
+  };
+  const auto items = sceneTileMemory(scene, 1, 0);
+  Serialiser<16> s(1024);
+  s << scene;
+  std::size_t serialisedBytes = 0;
+  for (const auto& item : items) {
+    if (item.name == "BVH nodes") {
+      BOOST_CHECK_GE(item.bytes, nodes.size() * sizeof(CompactBVH4QNode));
+    }
+    if (item.name != "Spheres" && item.name != "Discs") {
+      serialisedBytes += item.bytes;
+    }
+  }
+  BOOST_CHECK_EQUAL(serialisedBytes, s.bytes.size());
+  BOOST_CHECK_EQUAL(items.at(items.size() - 2).bytes, sizeof(Sphere));
+
+  // A graph with spare capacity stores the padded primitives and scene on every tile:
+  const auto padded = sceneTileMemory(scene, 4, 2, s.bytes.size() + 100);
+  const auto layout = sceneUploadLayout(4, 2);
+  BOOST_CHECK_GE(layout.discsOffset, 4 * sizeof(Sphere));
+  BOOST_CHECK_GE(layout.sceneOffset, layout.discsOffset + 2 * sizeof(Disc));
+  BOOST_CHECK_EQUAL(layout.sceneOffset % 16, 0u);
+  BOOST_REQUIRE_EQUAL(padded.size(), items.size() + 1);
+  BOOST_CHECK_EQUAL(padded.at(padded.size() - 3).bytes, 100u);
+  BOOST_CHECK_EQUAL(padded.at(padded.size() - 2).bytes, layout.discsOffset);
+  BOOST_CHECK_EQUAL(padded.back().bytes, layout.sceneOffset - layout.discsOffset);
+}
+
 ipu_utils::RuntimeConfig testConfig {
   1, 1, // numIpus, numReplicas
   "ipu_test", // exeName
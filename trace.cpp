@@ -3,16 +3,37 @@
 // Main ray/path tracing programs for IPU, CPU, and Embree.
 
 #include <app_utils.hpp>
-
-std::vector<embree_utils::TraceResult> renderEmbree(const SceneRef& data, embree_utils::EmbreeScene& embreeScene, cv::Mat& image) {
-  std::vector<embree_utils::TraceResult> rayStream(data.window.w * data.window.h);
+#include <CameraPath.hpp>
+#include <SceneCache.hpp>
+#include <ProgressiveImage.hpp>
+#include <StreamingExr.hpp>
+#include <RayPacket.hpp>
+#include <RayBatchQueue.hpp>
+#include <RenderFarm.hpp>
+#include <TileOrder.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <numeric>
+#include <thread>
+#include <iomanip>
+#include <sstream>
+
+// Embree's copies of the ray stream are stored in the same way as the ray stream:
+using RayHitStream = std::vector<RTCRayHit, RayStreamAllocator<RTCRayHit>>;
+
+RayStream renderEmbree(const SceneRef& data, embree_utils::EmbreeScene& embreeScene, cv::Mat& image) {
+  RayStream rayStream(data.window.w * data.window.h);
   initPerspectiveRayStream(rayStream, image, data);
   zeroRgb(rayStream);
 
   embreeScene.commitScene();
 
   // Convert stream:
-  std::vector<RTCRayHit> hitStream;
+  RayHitStream hitStream;
   hitStream.reserve(rayStream.size());
   for (const auto& r : rayStream) {
     hitStream.push_back(convertHitRecord(r.h));
@@ -112,62 +133,88 @@ std::vector<embree_utils::TraceResult> renderEmbree(const SceneRef& data, embree
   return rayStream;
 }
 
-template <class T>
+// Add a hit's emission (scaled by its MIS weight) to the path's colour and choose
+// the direction in which the path continues. This is shared by the CPU and Embree
+// path tracers. The hit record must already hold the hit point and the shading normal.
+// The albedo is the material's albedo at the hit (see surfaceAlbedo()):
+template <class Sampler>
+inline void scatter(const Material& material,
+                    const embree_utils::Vec3fa& albedo,
+                    embree_utils::TraceResult& result,
+                    embree_utils::Vec3fa& color,
+                    Sampler& sampler,
+                    float emissionWeight = 1.f) {
+  using namespace embree_utils;
+  auto& hit = result.h;
+
+  if (material.emissive) {
+    color += hit.throughput * material.emission * emissionWeight;
+  }
+
+  if (material.type == Material::Type::Diffuse) {
+    const float u1 = sampler.uniform_0_1();
+    const float u2 = sampler.uniform_0_1();
+    hit.r.direction = sampleDiffuse(hit.normal, u1, u2);
+    // Update throughput
+    //const float w = std::abs(wiWorld.dot(normal));
+    //const float pdf = cosineHemispherePdf(wiTangent);
+    // The terms w / (Pi * pdf) all cancel for diffuse throughput:
+    hit.throughput *= albedo; // * (w / (Pi * pdf)); // PDF terms cancel for cosine weighted samples
+    //throughput *= albedo * (wiTangent.z * 2.f); // Apply PDF for hemisphere samples (sampleDir is in tangent space so cos(theta) == z-coord).
+  } else if (material.type == Material::Type::Specular) {
+    hit.r.direction = reflect(hit.r.direction, hit.normal);
+    hit.throughput *= albedo;
+  } else if (material.type == Material::Type::Refractive) {
+    const float u1 = sampler.uniform_0_1();
+    const auto [dir, refracted] = dielectric(hit.r, hit.normal, material.ior, u1);
+    hit.r.direction = dir;
+    if (refracted) { hit.throughput *= albedo; }
+  } else {
+    // Mark an error:
+    result.rgb *= std::numeric_limits<float>::quiet_NaN();
+    hit.flags |= HitRecord::ERROR;
+  }
+}
+
+template <class Bvh, class T, class Sampler>
 void pathTrace(const SceneRef& sceneRef,
                SceneDescription& scene,
-               const CompactBvh& bvh,
+               const Bvh& bvh,
                embree_utils::TraceResult& result,
-               T& primLookupFunc) {
+               T& primLookupFunc,
+               Sampler& sampler,
+               const Intersection* primaryHit = nullptr) {
   using namespace embree_utils;
   auto& hit = result.h;
   hit.throughput = Vec3fa(1.f, 1.f, 1.f);
   Vec3fa color(0.f, 0.f, 0.f);
+  float bxdfPdf = 0.f; // Zero unless the last bounce was sampled from a diffuse BxDF
+  const float pixelSpread = pixelSpreadAngle(std::tan(sceneRef.fovRadians / 2.f), sceneRef.imageHeight);
 
   for (auto i = 0u; i < scene.pathTrace->maxPathLength; ++i) {
     offsetRay(hit.r, hit.normal); // offset rays to avoid self intersection.
     // Reset ray limits for next bounce:
     hit.r.tMin = 0.f;
     hit.r.tMax = std::numeric_limits<float>::infinity();
-    auto intersected = bvh.intersect(hit.r, primLookupFunc);
+    // The camera ray's intersection can be found beforehand (e.g. with ray packets):
+    auto intersected = i == 0 && primaryHit ? *primaryHit : bvh.intersect(hit.r, primLookupFunc);
 
     if (intersected) {
-      updateHit(intersected, hit);
+      updateHit(intersected, hit, primLookupFunc);
       const auto& material = sceneRef.materials[sceneRef.matIDs[hit.geomID]];
-
-      if (material.emissive) {
-        color += hit.throughput * material.emission;
-      }
-
-      if (material.type == Material::Type::Diffuse) {
-        // CPU Generator not thread safe:
-        float u1, u2;
-        #pragma omp critical(sample)
-        {
-          u1 = scene.pathTrace->sampler.uniform_0_1();
-          u2 = scene.pathTrace->sampler.uniform_0_1();
-        }
-        hit.r.direction = sampleDiffuse(hit.normal, u1, u2);
-        // Update throughput
-        //const float w = std::abs(wiWorld.dot(normal));
-        //const float pdf = cosineHemispherePdf(wiTangent);
-        // The terms w / (Pi * pdf) all cancel for diffuse throughput:
-        hit.throughput *= material.albedo; // * (w / (Pi * pdf)); // PDF terms cancel for cosine weighted samples
-        //throughput *= material.albedo * (wiTangent.z * 2.f); // Apply PDF for hemisphere samples (sampleDir is in tangent space so cos(theta) == z-coord).
-      } else if (material.type == Material::Type::Specular) {
-        hit.r.direction = reflect(hit.r.direction, hit.normal);
-        hit.throughput *= material.albedo;
-      } else if (material.type == Material::Type::Refractive) {
-        float u1;
-        #pragma omp critical(sample)
-        { u1 = scene.pathTrace->sampler.uniform_0_1(); }
-        const auto [dir, refracted] = dielectric(hit.r, hit.normal, material.ior, u1);
-        hit.r.direction = dir;
-        if (refracted) { hit.throughput *= material.albedo; }
-      } else {
-        // Mark an error:
-        result.rgb *= std::numeric_limits<float>::quiet_NaN();
-        hit.flags |= HitRecord::ERROR;
+      const bool diffuse = material.type == Material::Type::Diffuse;
+      const auto albedo = surfaceAlbedo(sceneRef, material, hit, pixelSpread);
+      const float emissionWeight = emissionMisWeight(sceneRef.lights, material, hit, bxdfPdf);
+      if (sceneRef.lights.size() && diffuse) {
+        // Next event estimation (this must be before the hit is shaded):
+        const float u1 = sampler.uniform_0_1();
+        const float u2 = sampler.uniform_0_1();
+        const float u3 = sampler.uniform_0_1();
+        color += sampleAreaLights(bvh, sceneRef.lights, sceneRef.matIDs, sceneRef.materials,
+                                  hit, albedo, u1, u2, u3, primLookupFunc);
       }
+      scatter(material, albedo, result, color, sampler, emissionWeight);
+      bxdfPdf = diffuse ? std::max(hit.normal.dot(hit.r.direction), 0.f) * InvPi : 0.f;
     } else {
       hit.flags |= HitRecord::ESCAPED;
       break;
@@ -175,11 +222,7 @@ void pathTrace(const SceneRef& sceneRef,
 
     // Random stopping:
     if (i > scene.pathTrace->roulletteStartDepth) {
-      float u1;
-      #pragma omp critical(sample)
-      {
-        u1 = scene.pathTrace->sampler.uniform_0_1();
-      }
+      const float u1 = sampler.uniform_0_1();
       if (evaluateRoulette(u1, hit.throughput)) { break; }
     }
   }
@@ -187,46 +230,358 @@ void pathTrace(const SceneRef& sceneRef,
   result.rgb += color;
 }
 
-std::vector<embree_utils::TraceResult> renderCPU(
-  SceneRef& sceneRef, cv::Mat& image, SceneDescription& scene
-) {
-  // Use the compiled variant of a mesh (to match IPU implementation
-  // as closely as possible). A compiled mesh's internal storage
-  // is setup to reference the correct parts of the unified arrays
-  // in the scene description:
-  std::vector<CompiledTriangleMesh> meshes;
-  meshes.reserve(sceneRef.meshInfo.size());
+// Shading normal of an Embree hit. The normal is computed from the scene's own
+// primitives in the same way as the custom intersectors so that the Embree
+// path tracer shades exactly like the CPU path tracer:
+embree_utils::Vec3fa embreeShadingNormal(const SceneRef& data, const SceneDescription& scene,
+                                         const RTCRayHit& rh, const embree_utils::Vec3fa& hitPoint) {
+  const auto& geom = data.geometry[rh.hit.geomID];
+  const Intersection intersection(rh.hit.geomID, rh.hit.primID, rh.ray.tfar);
+  // Embree's barycentric coords weight vertices 1 and 2:
+  const TriangleIntersection bary{rh.ray.tfar, 1.f - rh.hit.u - rh.hit.v, rh.hit.u, rh.hit.v};
+  if (geom.type == GeomType::Mesh) {
+    return scene.meshes[geom.index].computeNormal(bary, intersection);
+  }
+  if (geom.type == GeomType::Instance) {
+    // Instances are flattened in the Embree scene so the primID indexes the prototype:
+    const auto& instance = scene.instancePrims[geom.index];
+    const auto& prototype = scene.prototypes[scene.instances[geom.index].prototype];
+    const auto n = prototype.computeNormal(bary, intersection);
+    return instance.worldToObject.transposedVector(n).normalized() * instance.normalSign;
+  }
+  return getPrimitive(geom, scene)->normal(intersection, hitPoint);
+}
 
-  #pragma omp parallel for schedule(auto)
-  for (auto s = 0u; s < sceneRef.meshInfo.size(); ++s) {
-    const auto& info = sceneRef.meshInfo[s];
+// Path trace the scene with Embree. The paths are traced wavefront style: every
+// bounce intersects the whole ray stream with Embree's stream API and is then
+// shaded in parallel using the same materials and sampling as pathTrace():
+RayStream renderEmbreePathTrace(const SceneRef& data, SceneDescription& scene,
+                               embree_utils::EmbreeScene& embreeScene, cv::Mat& image) {
+  using namespace embree_utils;
+  RayStream rayStream(data.window.w * data.window.h);
+  initPerspectiveRayStream(rayStream, image, data);
+  zeroRgb(rayStream);
+
+  embreeScene.commitScene();
+
+  // Contiguous blocks of the stream have their own RNG streams (in the same
+  // way as the CPU renderer's tiles) so that the result does not depend on the
+  // number of threads:
+  constexpr std::uint32_t raysPerBlock = 64;
+  const auto numRays = rayStream.size();
+  const auto numBlocks = (numRays + raysPerBlock - 1) / raysPerBlock;
+  std::vector<xoshiro::Generator> blockSamplers;
+  blockSamplers.reserve(numBlocks);
+  auto streamStart = scene.pathTrace->sampler;
+  for (auto b = 0u; b < numBlocks; ++b) {
+    streamStart.jump();
+    blockSamplers.push_back(streamStart);
+  }
+
+  RayHitStream hitStream(numRays);
+  std::vector<Vec3fa> colors(numRays);
+  std::vector<std::uint8_t> active(numRays);
+  const auto& settings = *scene.pathTrace;
+  const float pixelSpread = pixelSpreadAngle(std::tan(data.fovRadians / 2.f), data.imageHeight);
+
+  ipu_utils::logger()->info("Embree path tracing started.");
+  auto startTime = std::chrono::steady_clock::now();
+
+  for (auto s = 0u; s < settings.samplesPerPixel; ++s) {
+    // New (jittered) camera rays for every sample:
+    #pragma omp parallel for schedule(auto)
+    for (auto b = 0u; b < numBlocks; ++b) {
+      const std::uint32_t first = b * raysPerBlock;
+      const std::uint32_t count = std::min<std::size_t>(raysPerBlock, numRays - first);
+      std::uint32_t indices[raysPerBlock];
+      std::iota(indices, indices + count, first);
+      initPerspectiveRays(rayStream, indices, count, image, data, &blockSamplers[b]);
+      for (auto r = first; r < first + count; ++r) {
+        rayStream[r].h.throughput = Vec3fa(1.f, 1.f, 1.f);
+        colors[r] = Vec3fa(0.f, 0.f, 0.f);
+        active[r] = 1;
+      }
+    }
+
+    for (auto i = 0u; i < settings.maxPathLength; ++i) {
+      // Rays get the same offset and limits as in pathTrace(). Finished paths
+      // stay in the stream with an empty interval which Embree skips:
+      #pragma omp parallel for schedule(auto)
+      for (auto r = 0u; r < numRays; ++r) {
+        auto& rh = hitStream[r];
+        if (active[r]) {
+          auto& hit = rayStream[r].h;
+          offsetRay(hit.r, hit.normal);
+          hit.r.tMin = 0.f;
+          hit.r.tMax = std::numeric_limits<float>::infinity();
+          rh = convertHitRecord(hit);
+        } else {
+          rh.ray.tnear = 0.f;
+          rh.ray.tfar = -std::numeric_limits<float>::infinity();
+        }
+        rh.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+      }
+
+      embreeScene.intersect(hitStream, data.window.h);
+
+      #pragma omp parallel for schedule(dynamic)
+      for (auto b = 0u; b < numBlocks; ++b) {
+        const auto first = b * raysPerBlock;
+        const auto end = std::min<std::size_t>(first + raysPerBlock, numRays);
+        auto& sampler = blockSamplers[b];
+        for (auto r = first; r < end; ++r) {
+          if (!active[r]) {
+            continue;
+          }
+          const auto& rh = hitStream[r];
+          auto& result = rayStream[r];
+          auto& hit = result.h;
+          if (rh.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
+            hit.flags |= HitRecord::ESCAPED;
+            active[r] = 0;
+            continue;
+          }
+
+          hit.geomID = rh.hit.geomID;
+          hit.primID = rh.hit.primID;
+          hit.r.tMax = rh.ray.tfar;
+          hit.r.origin += hit.r.direction * rh.ray.tfar;
+          hit.normal = embreeShadingNormal(data, scene, rh, hit.r.origin);
+          const auto& material = data.materials[data.matIDs[hit.geomID]];
+          scatter(material, surfaceAlbedo(data, material, hit, pixelSpread), result, colors[r], sampler);
+
+          // Random stopping:
+          if (i > settings.roulletteStartDepth) {
+            const float u1 = sampler.uniform_0_1();
+            if (evaluateRoulette(u1, hit.throughput)) { active[r] = 0; }
+          }
+        }
+      }
+    }
+
+    #pragma omp parallel for schedule(auto)
+    for (auto r = 0u; r < numRays; ++r) {
+      rayStream[r].rgb += colors[r];
+    }
+  }
+  scaleRgb(rayStream, 1.f / settings.samplesPerPixel);
+
+  auto endTime = std::chrono::steady_clock::now();
+  ipu_utils::logger()->info("Embree path tracing ended.");
+
+  auto secs = std::chrono::duration<double>(endTime - startTime).count();
+  auto pathRate = numRays * settings.samplesPerPixel * settings.maxPathLength / secs;
+  ipu_utils::logger()->info("Embree time: {}", secs);
+  ipu_utils::logger()->info("Embree paths per second: {} ", pathRate);
+
+  return rayStream;
+}
+
+// The CPU renderer is parallelised over square screen tiles of this size. The
+// camera rays of each sub-tile of a screen tile are traced as one ray packet:
+constexpr std::uint32_t cpuTileSize = 8;
+constexpr std::uint32_t packetTileWidth = 4;
+constexpr std::uint32_t packetTileHeight = PacketWidth / packetTileWidth;
+
+// Traces packets of rays from the ray stream for the CPU renderers using our
+// custom built BVH and custom intersection routines:
+class CpuTracer {
+public:
+  CpuTracer(SceneRef& _sceneRef, SceneDescription& _scene, bool _rayPackets)
+    : sceneRef(_sceneRef), scene(_scene),
+      // Make a CompactBvh object for our custom CPU ray-tracer.
+      // A CompactBvh wraps the scene ref BVH nodes:
+      bvh(sceneRef.bvhNodes, sceneRef.maxLeafDepth),
+      rayPackets(_rayPackets)
+  {
+    // Use the compiled variant of a mesh (to match IPU implementation
+    // as closely as possible). A compiled mesh's internal storage
+    // is setup to reference the correct parts of the unified arrays
+    // in the scene description. (The vector is sized first so that the
+    // threads only write to their own elements):
+    meshes.resize(sceneRef.meshInfo.size());
+
+    #pragma omp parallel for schedule(auto)
+    for (auto s = 0u; s < sceneRef.meshInfo.size(); ++s) {
+      const auto& info = sceneRef.meshInfo[s];
+
+      auto firstNormalIndex = 0u;
+      auto numNormals = 0u;
+      if (sceneRef.meshNormals.size() || sceneRef.meshPackedNormals.size()) {
+        // If scene has normals assume every mesh has normals:
+        firstNormalIndex = info.firstVertex;
+        numNormals = info.numVertices;
+      }
+      auto firstPrecomputed = 0u;
+      auto numPrecomputed = 0u;
+      if (sceneRef.meshPrecomputed.size()) {
+        firstPrecomputed = info.firstIndex;
+        numPrecomputed = info.numTriangles;
+      }
+      // Compact vertices replace the full precision arrays (which are then empty):
+      const bool packed = sceneRef.meshPackedVerts.size();
+      const auto quantisation = packed ? sceneRef.meshQuantisation[s] : VertexQuantisation();
+      meshes[s] = CompiledTriangleMesh(
+        embree_utils::Bounds3d(), // Don't actually need this bound box for rendering...
+        ArrayRef(&sceneRef.meshTris[info.firstIndex], info.numTriangles),
+        ArrayRef(&sceneRef.meshVerts[info.firstVertex], packed ? 0u : info.numVertices),
+        ArrayRef(&sceneRef.meshNormals[firstNormalIndex], packed ? 0u : numNormals),
+        ArrayRef(&sceneRef.meshPrecomputed[firstPrecomputed], numPrecomputed),
+        quantisation,
+        ArrayRef(&sceneRef.meshPackedVerts[info.firstVertex], packed ? info.numVertices : 0u),
+        ArrayRef(&sceneRef.meshPackedNormals[firstNormalIndex], packed ? numNormals : 0u)
+      );
+    }
+  }
+
+  /// Path trace one sample for each of the packet's pixels. The camera rays
+  /// are generated (jittered by the sampler) and intersected together. In low
+  /// discrepancy mode every ray instead has a Sobol sampler for its pixel and
+  /// sample index (which counts the pixel's samples from zero):
+  void pathTracePacket(RayStream& rayStream,
+                       const std::uint32_t* indices, std::uint32_t count,
+                       const cv::Mat& image, xoshiro::Generator& sampler,
+                       std::uint32_t sampleIndex) const {
+    SobolSampler sobolSamplers[PacketWidth];
+    const bool lowDiscrepancy = scene.pathTrace->lowDiscrepancy;
+    if (lowDiscrepancy) {
+      const auto seed = std::uint32_t(sceneRef.rngSeed ^ (sceneRef.rngSeed >> 32));
+      initPerspectiveRays(rayStream, indices, count, image, sceneRef, sampleIndex, seed, sobolSamplers);
+    } else {
+      initPerspectiveRays(rayStream, indices, count, image, sceneRef, &sampler);
+    }
+
+    // Camera rays get the same offset and limits as the first bounce in pathTrace():
+    embree_utils::Ray rays[PacketWidth];
+    Intersection hits[PacketWidth];
+    for (auto i = 0u; i < count; ++i) {
+      const auto& hit = rayStream[indices[i]].h;
+      rays[i] = hit.r;
+      offsetRay(rays[i], hit.normal);
+      rays[i].tMin = 0.f;
+      rays[i].tMax = std::numeric_limits<float>::infinity();
+    }
+    intersectRays(rays, count, hits);
+    PrimLookup primLookup{*this};
+    for (auto i = 0u; i < count; ++i) {
+      if (lowDiscrepancy) {
+        pathTrace(sceneRef, scene, bvh, rayStream[indices[i]], primLookup, sobolSamplers[i], &hits[i]);
+      } else {
+        pathTrace(sceneRef, scene, bvh, rayStream[indices[i]], primLookup, sampler, &hits[i]);
+      }
+    }
+  }
+
+  /// Shade the packet's rays with a shadow ray to a point light:
+  void shadowTracePacket(RayStream& rayStream,
+                         const std::uint32_t* indices, std::uint32_t count) const {
+    const embree_utils::Vec3fa lightPos(18, 257, -1060); // hard coded light position for testing
+    embree_utils::Ray rays[PacketWidth];
+    Intersection hits[PacketWidth];
+    for (auto i = 0u; i < count; ++i) {
+      rays[i] = rayStream[indices[i]].h.r;
+    }
+    intersectRays(rays, count, hits);
+    PrimLookup primLookup{*this};
+    for (auto i = 0u; i < count; ++i) {
+      shadeShadowRay(
+        bvh,
+        sceneRef.matIDs, sceneRef.materials,
+        .05f, // ambient light factor
+        hits[i], rayStream[indices[i]], primLookup, lightPos);
+    }
+  }
+
+private:
+  SceneRef& sceneRef;
+  SceneDescription& scene;
+  std::vector<CompiledTriangleMesh> meshes;
+  CompactBvh<SceneBvhNode> bvh;
+  const bool rayPackets;
+
+  // Maps geomIDs to the primitives that rays are intersected with. Primitives
+  // are visited as their concrete types so that traversal makes no virtual calls:
+  struct PrimLookup {
+    const CpuTracer& tracer;
+    template <class F>
+    void visit(std::uint16_t geomID, F&& f) const {
+      const auto& geom = tracer.sceneRef.geometry[geomID];
+      switch (geom.type) {
+        case GeomType::Mesh:
+          f(tracer.meshes[geom.index]);
+          break;
+        case GeomType::Sphere:
+          f(tracer.scene.spheres[geom.index]);
+          break;
+        case GeomType::Disc:
+          f(tracer.scene.discs[geom.index]);
+          break;
+        case GeomType::Instance:
+          f(tracer.scene.instancePrims[geom.index]);
+          break;
+        default:
+          throw std::logic_error("Invalid GeomRef.");
+      }
+    }
+  };
 
-    auto firstNormalIndex = 0u;
-    auto numNormals = 0u;
-    if (sceneRef.meshNormals.size()) {
-      // If scene has normals assume every mesh has normals:
-      firstNormalIndex = info.firstVertex;
-      numNormals = info.numVertices;
+  // Find the nearest hits for the rays of one packet:
+  void intersectRays(const embree_utils::Ray* rays, std::uint32_t count, Intersection* hits) const {
+    PrimLookup primLookup{*this};
+    if (rayPackets) {
+      // Ray packets use their own triangle test for meshes:
+      auto meshLookup = [this](std::uint16_t geomID) -> const CompiledTriangleMesh* {
+        const auto& geom = sceneRef.geometry[geomID];
+        return geom.type == GeomType::Mesh ? &meshes[geom.index] : nullptr;
+      };
+      intersectPacket(bvh, RayPacket<PacketWidth>(rays, count), primLookup, meshLookup, hits);
+    } else {
+      for (auto i = 0u; i < count; ++i) {
+        hits[i] = bvh.intersect(rays[i], primLookup);
+      }
     }
-    meshes.emplace_back(
-      embree_utils::Bounds3d(), // Don't actually need this bound box for rendering...
-      ArrayRef(&sceneRef.meshTris[info.firstIndex], info.numTriangles),
-      ArrayRef(&sceneRef.meshVerts[info.firstVertex], info.numVertices),
-      ArrayRef(&sceneRef.meshNormals[firstNormalIndex], numNormals)
-    );
   }
+};
+
+RayStream renderCPU(
+  SceneRef& sceneRef, cv::Mat& image, SceneDescription& scene, bool rayPackets
+) {
+  CpuTracer tracer(sceneRef, scene, rayPackets);
 
-  std::vector<embree_utils::TraceResult> rayStream(sceneRef.window.w * sceneRef.window.h);
+  RayStream rayStream(sceneRef.window.w * sceneRef.window.h);
   initPerspectiveRayStream(rayStream, image, sceneRef);
   zeroRgb(rayStream);
 
-  // Make a CompactBvh object for our custom CPU ray-tracer.
-  // A CompactBvh wraps the scene ref BVH nodes:
-  CompactBvh bvh(sceneRef.bvhNodes, sceneRef.maxLeafDepth);
-
-  auto primLookup = [&](std::uint16_t geomID, std::uint32_t primID) {
-    const auto& geom = sceneRef.geometry[geomID];
-    return getPrimitive(geom, scene);
+  const std::uint32_t width = sceneRef.window.w;
+  const std::uint32_t height = sceneRef.window.h;
+  const auto tilesX = (width + cpuTileSize - 1) / cpuTileSize;
+  const auto tilesY = (height + cpuTileSize - 1) / cpuTileSize;
+  const auto numTiles = tilesX * tilesY;
+
+  // Threads take tiles in Morton order so that the tiles being traced at any
+  // time are close together on screen (and need the same parts of the BVH).
+  // Tiles are handed out dynamically so threads that finish early (e.g. on
+  // tiles of sky with short paths) take more of them:
+  const auto tileOrder = mortonTileOrder(tilesX, tilesY);
+
+  // Call f(indices, count) with the ray stream indices of each packet in a screen tile:
+  auto forEachPacket = [&](std::uint32_t tile, auto&& f) {
+    const auto x0 = (tile % tilesX) * cpuTileSize;
+    const auto y0 = (tile / tilesX) * cpuTileSize;
+    const auto x1 = std::min(x0 + cpuTileSize, width);
+    const auto y1 = std::min(y0 + cpuTileSize, height);
+    for (auto py = y0; py < y1; py += packetTileHeight) {
+      for (auto px = x0; px < x1; px += packetTileWidth) {
+        std::uint32_t indices[PacketWidth];
+        std::uint32_t count = 0;
+        for (auto y = py; y < std::min(py + packetTileHeight, y1); ++y) {
+          for (auto x = px; x < std::min(px + packetTileWidth, x1); ++x) {
+            indices[count++] = y * width + x;
+          }
+        }
+        f(indices, count);
+      }
+    }
   };
 
   // Time just the intersections with the compact BVH:
@@ -234,24 +589,35 @@ std::vector<embree_utils::TraceResult> renderCPU(
   ipu_utils::logger()->info("CPU Rendering started.");
 
   if (scene.pathTrace) {
-    for (auto s = 0u; s < scene.pathTrace->samplesPerPixel; ++s) {
-      // Regenerate new camera rays at each sample step:
-      initPerspectiveRayStream(rayStream, image, sceneRef, &scene.pathTrace->sampler);
-      #pragma omp parallel for schedule(auto)
-      for (auto itr = rayStream.begin(); itr != rayStream.end(); ++itr) {
-        pathTrace(sceneRef, scene, bvh, *itr, primLookup);
+    // Every screen tile has its own RNG stream (the streams are 2^64 numbers
+    // apart) so that threads never share a generator and the result does not
+    // depend on the number of threads. The stream also jitters the tile's camera rays:
+    std::vector<xoshiro::Generator> tileSamplers;
+    tileSamplers.reserve(numTiles);
+    auto streamStart = scene.pathTrace->sampler;
+    for (auto t = 0u; t < numTiles; ++t) {
+      streamStart.jump();
+      tileSamplers.push_back(streamStart);
+    }
+
+    // Each thread generates the camera rays for its tile and traces all of the
+    // tile's samples while the BVH nodes it needs are in cache:
+    #pragma omp parallel for schedule(dynamic)
+    for (auto k = 0u; k < numTiles; ++k) {
+      const auto t = tileOrder[k];
+      for (auto s = 0u; s < scene.pathTrace->samplesPerPixel; ++s) {
+        forEachPacket(t, [&](const std::uint32_t* indices, std::uint32_t count) {
+          tracer.pathTracePacket(rayStream, indices, count, image, tileSamplers[t], s);
+        });
       }
     }
     scaleRgb(rayStream, 1.f / scene.pathTrace->samplesPerPixel);
   } else {
-    embree_utils::Vec3fa lightPos(18, 257, -1060); // hard coded light position for testing
-    #pragma omp parallel for schedule(auto)
-    for (auto itr = rayStream.begin(); itr != rayStream.end(); ++itr) {
-      traceShadowRay(
-        bvh,
-        sceneRef.matIDs, sceneRef.materials,
-        .05f, // ambient light factor
-        *itr, primLookup, lightPos);
+    #pragma omp parallel for schedule(dynamic)
+    for (auto k = 0u; k < numTiles; ++k) {
+      forEachPacket(tileOrder[k], [&](const std::uint32_t* indices, std::uint32_t count) {
+        tracer.shadowTracePacket(rayStream, indices, count);
+      });
     }
   }
 
@@ -267,24 +633,306 @@ std::vector<embree_utils::TraceResult> renderCPU(
   return rayStream;
 }
 
-std::vector<embree_utils::TraceResult> renderIPU(
+// Render ray batches taken from the back of the queue on the CPU (while the
+// IPU takes batches from the front). A batch's rays are traced in packets of
+// consecutive rays which are shared out between the threads. Path traced
+// results are sums over the samples (the same as the IPU's) and completed
+// batches are passed to the batch callback if there is one (the same one that
+// receives the IPU's batches). Returns the number of batches rendered:
+std::size_t renderCpuBatches(SceneRef& sceneRef, SceneDescription& scene,
+                             RayStream& rayStream, const cv::Mat& image,
+                             RayBatchQueue& queue, bool rayPackets,
+                             const IpuScene::RayCallbackFn* batchCallback) {
+  CpuTracer tracer(sceneRef, scene, rayPackets);
+
+  // Every packet of the frame has its own RNG stream derived in the same way as
+  // the CPU renderer's tiles (the streams are 2^64 numbers apart so they never
+  // overlap). The streams are made up front as the batches come in any order:
+  const auto packetsPerBatch = (queue.getRaysPerBatch() + PacketWidth - 1) / PacketWidth;
+  std::vector<xoshiro::Generator> packetSamplers;
+  if (scene.pathTrace) {
+    const auto streamBatches = (rayStream.size() + queue.getRaysPerBatch() - 1) / queue.getRaysPerBatch();
+    packetSamplers.reserve(streamBatches * packetsPerBatch);
+    auto streamStart = scene.pathTrace->sampler;
+    for (auto p = 0u; p < streamBatches * packetsPerBatch; ++p) {
+      streamStart.jump();
+      packetSamplers.push_back(streamStart);
+    }
+  }
+
+  std::size_t numBatches = 0;
+  while (auto batch = queue.takeBack()) {
+    const std::size_t first = *batch * queue.getRaysPerBatch();
+    const auto count = std::min(queue.getRaysPerBatch(), rayStream.size() - first);
+    const auto numPackets = (count + PacketWidth - 1) / PacketWidth;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (auto p = 0u; p < numPackets; ++p) {
+      std::uint32_t indices[PacketWidth];
+      const std::uint32_t packetStart = first + p * PacketWidth;
+      const std::uint32_t packetSize = std::min<std::size_t>(PacketWidth, first + count - packetStart);
+      std::iota(indices, indices + packetSize, packetStart);
+      if (scene.pathTrace) {
+        auto& sampler = packetSamplers[*batch * packetsPerBatch + p];
+        for (auto s = 0u; s < scene.pathTrace->samplesPerPixel; ++s) {
+          tracer.pathTracePacket(rayStream, indices, packetSize, image, sampler, s);
+        }
+      } else {
+        tracer.shadowTracePacket(rayStream, indices, packetSize);
+      }
+    }
+
+    if (batchCallback) {
+      (*batchCallback)(*batch, std::span(rayStream).subspan(first, count));
+    }
+    numBatches += 1;
+  }
+  return numBatches;
+}
+
+// True if the IPU image is accumulated as ray batches are received:
+bool accumulateOnHost(const boost::program_options::variables_map& args) {
+  return args.at("progressive").as<bool>() || args.at("stream-exr").as<bool>();
+}
+
+std::map<std::string, VisualiseMode> visStrMap = {
+  {"rgb", RGB},
+  {"normal", NORMAL},
+  {"hitpoint", HIT_POINT},
+  {"tfar", RAY_TFAR},
+  {"color", MAT_COLOR},
+  {"id", GEOM_AND_PRIM_ID},
+  {"nodes", BVH_NODES},
+  {"prims", PRIM_TESTS},
+  {"bounces", BOUNCES},
+  {"cycles", CYCLES}
+};
+
+// Return the camera of each frame in the camera path (or just the identity camera if there is no path):
+std::vector<AffineTransform> loadCameras(const boost::program_options::variables_map& args) {
+  const auto path = args.at("camera-path").as<std::string>();
+  return path.empty() ? std::vector<AffineTransform>{AffineTransform::identity()} : loadCameraPath(path);
+}
+
+// Write a machine readable summary of the IPU render's configuration and throughput to a JSON
+// file (this is what the bench program collects). Measurements that are not available are null:
+void writeThroughputReport(const std::string& fileName, const boost::program_options::variables_map& args,
+                           const SceneRef& sceneRef, const RayStream& rayStream,
+                           const TraceStats& stats, const ipu_utils::GraphTimings& timings, bool exeCacheHit,
+                           std::size_t raysPerWorker) {
+  auto jsonNumber = [](double v) {
+    std::ostringstream s;
+    if (std::isfinite(v)) { s << std::setprecision(10) << v; } else { s << "null"; }
+    return s.str();
+  };
+  auto jsonString = [](const std::string& v) {
+    std::string s = "\"";
+    for (const auto c : v) {
+      if (c == '"' || c == '\\') { s += '\\'; }
+      s += c;
+    }
+    return s + "\"";
+  };
+
+  // Every path casts a primary (camera) ray. A shadow trace casts a shadow ray for each primary hit:
+  const double rays = rayStream.size();
+  double primaryCasts = rays;
+  double secondaryCasts = std::numeric_limits<double>::quiet_NaN();
+  if (sceneRef.pathTrace) {
+    primaryCasts = stats.castsCounted ? stats.paths : rays * sceneRef.samplesPerPixel;
+    if (stats.castsCounted) { secondaryCasts = stats.secondaryCasts; }
+  } else {
+    secondaryCasts = std::count_if(rayStream.begin(), rayStream.end(), [](const embree_utils::TraceResult& r) {
+      return r.h.geomID != embree_utils::HitRecord::InvalidGeomID;
+    });
+  }
+  const auto secs = stats.traceSecs;
+  const auto meshFile = args.at("mesh-file").as<std::string>();
+
+  std::ofstream json(fileName);
+  json << "{\n"
+       << "  \"scene\": " << jsonString(meshFile.empty() ? args.at("scene").as<std::string>() : meshFile) << ",\n"
+       << "  \"render_mode\": " << jsonString(args.at("render-mode").as<std::string>()) << ",\n"
+       << "  \"wavefront\": " << (args.at("wavefront").as<bool>() ? "true" : "false") << ",\n"
+       << "  \"width\": " << sceneRef.window.w << ",\n"
+       << "  \"height\": " << sceneRef.window.h << ",\n"
+       << "  \"samples\": " << (sceneRef.pathTrace ? sceneRef.samplesPerPixel : 1u) << ",\n"
+       << "  \"max_path_length\": " << (sceneRef.pathTrace ? sceneRef.maxPathLength : 1u) << ",\n"
+       << "  \"rays_per_worker\": " << raysPerWorker << ",\n"
+       << "  \"ipus\": " << args.at("ipus").as<std::uint32_t>() << ",\n"
+       << "  \"nif\": " << jsonString(args.at("nif-hdri").as<std::string>()) << ",\n"
+       << "  \"bake_nif_hdri\": " << args.at("bake-nif-hdri").as<std::uint32_t>() << ",\n"
+       << "  \"nif_on_tile\": " << (args.at("nif-on-tile").as<bool>() ? "true" : "false") << ",\n"
+       << "  \"exe_cache_hit\": " << (exeCacheHit ? "true" : "false") << ",\n"
+       << "  \"build_secs\": " << jsonNumber(timings.buildSecs) << ",\n"
+       << "  \"compile_secs\": " << jsonNumber(timings.compileSecs) << ",\n"
+       << "  \"load_exe_secs\": " << jsonNumber(timings.loadExeSecs) << ",\n"
+       << "  \"init_secs\": " << jsonNumber(timings.engineLoadSecs + stats.sceneUploadSecs) << ",\n"
+       << "  \"trace_secs\": " << jsonNumber(secs) << ",\n"
+       << "  \"rays\": " << jsonNumber(rays) << ",\n"
+       << "  \"primary_casts\": " << jsonNumber(primaryCasts) << ",\n"
+       << "  \"secondary_casts\": " << jsonNumber(secondaryCasts) << ",\n"
+       << "  \"rays_per_sec\": " << jsonNumber((primaryCasts + secondaryCasts) / secs) << ",\n"
+       << "  \"paths_per_sec\": " << jsonNumber(sceneRef.pathTrace ? primaryCasts / secs : std::nan("")) << ",\n"
+       << "  \"primary_casts_per_sec\": " << jsonNumber(primaryCasts / secs) << ",\n"
+       << "  \"secondary_casts_per_sec\": " << jsonNumber(secondaryCasts / secs) << ",\n"
+       << "  \"host_to_dram_gbps\": " << jsonNumber(stats.hostToDramGBps()) << ",\n"
+       << "  \"dram_to_host_gbps\": " << jsonNumber(stats.dramToHostGBps()) << "\n"
+       << "}\n";
+  if (!json) {
+    throw std::runtime_error("Could not write throughput report: '" + fileName + "'");
+  }
+  ipu_utils::logger()->info("Wrote throughput report: '{}'", fileName);
+}
+
+// Log a histogram of the compute tiles' path trace cycles (to expose load imbalance between
+// tiles) and save the cycles of every tile to a CSV file for further analysis:
+void reportTileCycles(const TraceStats& stats, std::size_t tilesPerReplica, const std::string& csvFileName) {
+  const auto& cycles = stats.tileCycles;
+  if (cycles.empty()) {
+    return;
+  }
+  const auto [minItr, maxItr] = std::minmax_element(cycles.begin(), cycles.end());
+  const auto mean = std::accumulate(cycles.begin(), cycles.end(), 0.0) / cycles.size();
+  constexpr std::size_t numBins = 16;
+  std::vector<std::size_t> bins(numBins, 0);
+  const auto binWidth = std::max<std::uint64_t>((*maxItr - *minItr + numBins) / numBins, 1u);
+  for (const auto c : cycles) {
+    bins[std::min<std::size_t>((c - *minItr) / binWidth, numBins - 1)] += 1;
+  }
+  const auto maxCount = *std::max_element(bins.begin(), bins.end());
+  ipu_utils::logger()->info("Tile cycles: min {} mean {} max {} (max/mean: {})", *minItr, mean, *maxItr, *maxItr / mean);
+  for (auto b = 0u; b < numBins; ++b) {
+    ipu_utils::logger()->info("  {:>12} {:>6} {}", *minItr + b * binWidth, bins[b], std::string(50 * bins[b] / maxCount, '#'));
+  }
+
+  std::ofstream csv(csvFileName);
+  if (!csv) {
+    throw std::runtime_error("Could not write tile cycles: '" + csvFileName + "'");
+  }
+  csv << "replica,tile,cycles\n";
+  for (auto i = 0u; i < cycles.size(); ++i) {
+    csv << i / tilesPerReplica << "," << i % tilesPerReplica << "," << cycles[i] << "\n";
+  }
+  ipu_utils::logger()->info("Saved tile cycles to '{}'", csvFileName);
+}
+
+// Log the quality of the scene's BVH: SAH cost, node overlap, the error that compressing the node
+// bounds introduces, and histograms of the leaves' sizes and depths:
+void reportBvhQuality(const SceneData& data, const SceneDescription& scene) {
+  const auto q = analyseBvh<SceneBvhNode>(data.bvhNodes, makeLeafBoundsFn(data, scene));
+  ipu_utils::logger()->info("BVH nodes: {} leaves: {} primitives: {} max depth: {}", q.nodes, q.leaves, q.prims,
+                            q.leafDepths.empty() ? 0 : q.leafDepths.size() - 1);
+  ipu_utils::logger()->info("BVH SAH cost: {} mean child overlap: {}", q.sahCost, q.meanOverlap);
+  ipu_utils::logger()->info("BVH compressed bounds area error: mean {} max {}", q.meanBoundsError, q.maxBoundsError);
+  auto logHistogram = [](const std::string& title, const std::vector<std::size_t>& histogram) {
+    if (histogram.empty()) {
+      return;
+    }
+    ipu_utils::logger()->info("{}:", title);
+    const auto maxCount = *std::max_element(histogram.begin(), histogram.end());
+    for (auto b = 0u; b < histogram.size(); ++b) {
+      if (histogram[b]) {
+        ipu_utils::logger()->info("  {:>4} {:>8} {}", b, histogram[b], std::string(50 * histogram[b] / maxCount, '#'));
+      }
+    }
+  };
+  logHistogram("Primitives per leaf", q.leafSizes);
+  logHistogram("Leaf depths", q.leafDepths);
+  logHistogram("Children per node", q.childCounts);
+}
+
+// Log the exact bytes of each part of the scene that is stored on every tile (sized for the
+// graph's capacity options in the same way as the upload). Returns false if they exceed the
+// budget (zero means no budget):
+bool reportTileMemory(const SceneRef& sceneRef, std::size_t numSpheres, std::size_t numDiscs,
+                      const boost::program_options::variables_map& args, std::size_t budget) {
+  const auto maxSpheres = std::max(numSpheres, args.at("capacity-spheres").as<std::size_t>());
+  const auto maxDiscs = std::max(numDiscs, args.at("capacity-discs").as<std::size_t>());
+  const auto maxSceneBytes = args.at("scene-shards").as<std::uint32_t>() ? 0 : args.at("capacity-scene-bytes").as<std::size_t>();
+  const auto items = sceneTileMemory(sceneRef, maxSpheres, maxDiscs, maxSceneBytes);
+  std::size_t total = 0;
+  for (const auto& item : items) {
+    total += item.bytes;
+  }
+  ipu_utils::logger()->info("Scene memory per tile:");
+  for (const auto& item : items) {
+    if (item.bytes) {
+      ipu_utils::logger()->info("  {:<24} {:>10} bytes ({:.1f}%)", item.name, item.bytes, 100.0 * item.bytes / total);
+    }
+  }
+  ipu_utils::logger()->info("  {:<24} {:>10} bytes ({:.1f} KiB)", "Total", total, total / 1024.0);
+  if (budget && total > budget) {
+    ipu_utils::logger()->error("Scene needs {} bytes per tile which exceeds the budget of {} bytes", total, budget);
+    return false;
+  }
+  return true;
+}
+
+RayStream renderIPU(
   SceneRef& sceneRef, cv::Mat& image,
   const std::vector<Sphere>& spheres,
   const std::vector<Disc>& discs,
-  const boost::program_options::variables_map& args)
+  std::vector<SceneShardData>& shards,
+  const boost::program_options::variables_map& args,
+  const SceneCache* cache = nullptr,
+  SceneDescription* coRenderScene = nullptr)
 {
-  std::vector<embree_utils::TraceResult> rayStream(sceneRef.window.w * sceneRef.window.h);
-  initPerspectiveRayStream(rayStream, image, sceneRef);
+  // A large window can be rendered in buckets that are rendered one after the
+  // other by the same graph so the ray stream only holds one bucket's rays:
+  const auto frameWindow = sceneRef.window;
+  const auto bucketSize = args["bucket-size"].as<std::uint32_t>();
+  const auto buckets = bucketSize ? bucketWindows(frameWindow, bucketSize) : std::vector<CropWindow>{frameWindow};
+  sceneRef.window = buckets.front();
+  if (buckets.size() > 1) {
+    ipu_utils::logger()->info("Rendering {} buckets of up to {}x{} pixels", buckets.size(), bucketSize, bucketSize);
+  }
+
+  // If rays are generated on device the ray stream only receives the results:
+  const bool deviceRays = args["device-ray-generation"].as<bool>();
+  RayStream rayStream(sceneRef.window.w * sceneRef.window.h);
+  if (!deviceRays) {
+    initPerspectiveRayStream(rayStream, image, sceneRef);
+  }
   zeroRgb(rayStream);
 
+  // Results can be accumulated into the image as they are received from the IPU:
+  std::unique_ptr<ProgressiveImage> progressive;
+  if (accumulateOnHost(args)) {
+    const float weight = sceneRef.pathTrace ? 1.f / sceneRef.samplesPerPixel : 1.f;
+    const auto previewPath = args.at("outprefix").as<std::string>() + "_rgb_ipu_preview.exr";
+    progressive = std::make_unique<ProgressiveImage>(image, weight, previewPath, args["preview-interval"].as<double>());
+  }
+
+  // The output file can also be written as the results are received (the AOVs
+  // are extra parts of the same file):
+  std::unique_ptr<StreamingExr> streamedExr;
+  if (args["stream-exr"].as<bool>()) {
+    const float weight = sceneRef.pathTrace ? 1.f / sceneRef.samplesPerPixel : 1.f;
+    std::vector<StreamingExr::Part> parts = {
+      {"rgb", [weight](const embree_utils::TraceResult& r) { return r.rgb * weight; }}
+    };
+    if (args.at("denoise").as<bool>()) {
+      parts.push_back({"albedo", [](const embree_utils::TraceResult& r) { return r.h.throughput; }});
+      parts.push_back({"normal", [](const embree_utils::TraceResult& r) { return r.h.normal; }});
+    }
+    const auto type = args["exr-half"].as<bool>() ? StreamingExr::PixelType::HALF : StreamingExr::PixelType::FLOAT;
+    streamedExr = std::make_unique<StreamingExr>(args.at("outprefix").as<std::string>() + "_rgb_ipu.exr",
+                                                 image.cols, image.rows, frameWindow, std::move(parts), type);
+  }
+
   // This will be called as partial results are received from the IPU:
   IpuScene::RayCallbackFn rayCallback;
   IpuScene::RayCallbackFn* rayCallbackPtr = nullptr; // nullptr builds a renderer with no callback
-  if (args["ipu-ray-callback"].as<bool>()) {
-    rayCallback = [](std::size_t idx, const std::vector<embree_utils::TraceResult>& batch) {
-      // here we just log but we could process the batch of results
-      // e.g. to asynchronously update a render preview image.
+  if (args["ipu-ray-callback"].as<bool>() || progressive) {
+    rayCallback = [&progressive, &streamedExr](std::size_t idx, std::span<const embree_utils::TraceResult> batch) {
       ipu_utils::logger()->debug("Application callback received batch {}", idx);
+      if (progressive) {
+        progressive->add(batch);
+      }
+      if (streamedExr) {
+        streamedExr->add(batch);
+      }
     };
     rayCallbackPtr = &rayCallback;
   }
@@ -293,18 +941,17 @@ std::vector<embree_utils::TraceResult> renderIPU(
   auto rpw = args["rays-per-worker"].as<std::size_t>();
   ipu_utils::logger()->debug("IPU samples: {} rays-per-worker: {}", sceneRef.samplesPerPixel, rpw);
   IpuScene ipuScene(spheres, discs, sceneRef, rayStream, rpw, rayCallbackPtr);
-  ipuScene.setRuntimeConfig(
-    ipu_utils::RuntimeConfig {
-      ipus, // numIpus;
-      ipus, // numReplicas;
-      "ipu_ray_trace", // exeName;
-      false, // useIpuModel;
-      false, // saveExe;
-      false, // loadExe;
-      false, // compileOnly;
-      true   // deferredAttach;
-    }
-  );
+  ipu_utils::RuntimeConfig config {
+    ipus, // numIpus;
+    ipus, // numReplicas;
+    "ipu_ray_trace", // exeName;
+    false, // useIpuModel;
+    false, // saveExe;
+    false, // loadExe;
+    false, // compileOnly;
+    true   // deferredAttach;
+  };
+  ipuScene.setRuntimeConfig(config);
 
   auto nifPath = args["nif-hdri"].as<std::string>();
   if (!nifPath.empty()) {
@@ -312,25 +959,237 @@ std::vector<embree_utils::TraceResult> renderIPU(
   }
   ipuScene.setHdriRotation(args.at("hdri-rotation").as<float>());
   ipuScene.setAvailableMemoryProportion(args.at("available-memory-proportion").as<float>());
+  ipuScene.setAutoRaysMemoryProportion(args.at("auto-rays-memory-proportion").as<float>());
   ipuScene.setMaxNifBatchSize(args.at("max-nif-batch-size").as<std::size_t>());
+  ipuScene.setNifHalfPrecision(args.at("nif-fp16").as<bool>());
+  ipuScene.setBakedHdriWidth(args.at("bake-nif-hdri").as<std::uint32_t>());
+  ipuScene.setNifOnTile(args.at("nif-on-tile").as<bool>());
+  ipuScene.setEnvLightSampling(args.at("env-light-sampling").as<bool>());
+  ipuScene.setSlimRayStream(args.at("slim-ray-stream").as<bool>());
+  ipuScene.setDeviceRayGeneration(deviceRays);
+  ipuScene.setIoPipelineDepth(args.at("io-pipeline-depth").as<std::uint32_t>());
+  ipuScene.setRayCallbackThreads(args.at("ray-callback-threads").as<std::size_t>());
+  ipuScene.setWavefront(args.at("wavefront").as<bool>());
+  ipuScene.setOctantSort(args.at("octant-sort").as<bool>());
+  ipuScene.setCoherentRayOrder(args.at("coherent-rays").as<bool>());
+  ipuScene.setAdaptiveSampling(args.at("adaptive-threshold").as<float>(), args.at("adaptive-min-samples").as<std::uint32_t>());
+  ipuScene.setLowDiscrepancySampling(args.at("low-discrepancy").as<bool>());
+  const bool denoise = args.at("denoise").as<bool>();
+  ipuScene.setDenoiseAovs(denoise);
+  const auto visModeStr = args.at("visualise").as<std::string>();
+  const auto visMode = visStrMap.at(visModeStr);
+  ipuScene.setTraversalStats(isTraversalStatsMode(visMode));
+  if (!shards.empty()) {
+    ipuScene.setSceneShards(shards);
+  }
+  if (cache) {
+    // Stream the memory mapped scene instead of serialising it again:
+    ipuScene.setSerialisedScene(cache->getSerialisedScene(), cache->getSerialisedSceneSize());
+  }
+  ipuScene.setGraphCapacity(GraphCapacity {
+    args.at("capacity-scene-bytes").as<std::size_t>(),
+    args.at("capacity-spheres").as<std::size_t>(),
+    args.at("capacity-discs").as<std::size_t>(),
+    args.at("capacity-meshes").as<std::size_t>(),
+    args.at("capacity-instances").as<std::size_t>(),
+    args.at("capacity-rays").as<std::size_t>()
+  });
+  if (args.at("nif-autotune").as<bool>()) {
+    if (nifPath.empty()) {
+      ipu_utils::logger()->warn("There is no NIF to autotune.");
+    } else {
+      // Plans are stored with the model (per IPU count):
+      ipuScene.autotuneNif(nifPath + "/nif_plan_" + std::to_string(ipus) + "ipu.json");
+    }
+  }
+
+  // Load the compiled graph from the cache if there is one for these
+  // options otherwise compile it and save it for next time:
+  const auto exeCacheDir = args.at("exe-cache").as<std::string>();
+  if (!exeCacheDir.empty() && !nifPath.empty()) {
+    ipu_utils::logger()->warn("The executable cache is not used with a NIF environment light.");
+  } else if (!exeCacheDir.empty()) {
+    std::filesystem::create_directories(exeCacheDir);
+    std::ostringstream exeName;
+    exeName << exeCacheDir << "/" << std::hex << std::setw(16) << std::setfill('0') << ipuScene.getGraphKey();
+    config.exeName = exeName.str();
+    config.loadExe = std::filesystem::exists(ipu_utils::makeExeFileName(config.exeName)) &&
+                     std::filesystem::exists(ipu_utils::makeProgramsFileName(config.exeName));
+    config.saveExe = !config.loadExe;
+    ipu_utils::logger()->info("Executable cache {}: '{}'", config.loadExe ? "hit" : "miss", config.exeName);
+    ipuScene.setRuntimeConfig(config);
+  }
+
+  // Further frames move the camera along the camera path and/or rotate the HDRI (e.g.
+  // for a fly-through or look-dev turntable) and are rendered without re-attaching the
+  // device or uploading the scene again. All but the last frame are saved here (the
+  // last is returned as normal):
+  const auto cameras = loadCameras(args);
+  const auto numFrames = args.at("camera-path").as<std::string>().empty() ?
+                           args.at("frames").as<std::uint32_t>() : cameras.size();
+  auto hdriRotation = args.at("hdri-rotation").as<float>();
+  // Each frame is saved (and denoised) on the host while the IPU renders the next one:
+  std::future<void> frameOutput;
+  IpuScene::FrameCallbackFn frameCallback = [&](std::size_t frame) {
+    if (frame + 1 >= numFrames) {
+      return false;
+    }
+    if (frameOutput.valid()) {
+      frameOutput.get();
+    }
+    const auto framePrefix = args.at("outprefix").as<std::string>() + "_" + visModeStr + "_ipu_frame_" + std::to_string(frame);
+    frameOutput = std::async(std::launch::async,
+                             [framePrefix, denoise, visMode, frameRef = sceneRef, rows = image.rows, cols = image.cols,
+                              frameRays = rayStream]() mutable {
+      if (frameRef.pathTrace) {
+        scaleRgb(frameRays, 1.f / frameRef.samplesPerPixel);
+      }
+      cv::Mat frameImage = cv::Mat::zeros(rows, cols, CV_32FC3);
+      visualiseHits(frameRays, frameRef, frameImage, visMode);
+      saveImage(framePrefix + ".exr", frameImage);
+      if (denoise) {
+        saveImage(framePrefix + "_denoised.exr", denoiseImage(frameImage, frameRays));
+      }
+    });
+
+    sceneRef.camera = cameras[std::min(frame + 1, cameras.size() - 1)];
+    ipuScene.setCameraTransform(sceneRef.camera);
+    if (!sceneRef.pathTrace) {
+      // Shadow trace results overwrite the rays so they must be generated again:
+      initPerspectiveRayStream(rayStream, image, sceneRef);
+    }
+    hdriRotation += args.at("frame-hdri-rotation").as<float>();
+    ipuScene.setHdriRotation(hdriRotation);
+    ipuScene.setRngSeed(sceneRef.rngSeed + frame + 1);
+    return true;
+  };
+  if (numFrames > 1) {
+    ipuScene.setFrameCallback(&frameCallback);
+  }
+
+  // Buckets are the frames of one session. While the IPU traces a bucket a host
+  // thread saves the previous bucket's results into the image and then generates
+  // the rays of the bucket after the next in the same buffer:
+  RayStream bucketRays;
+  std::future<void> bucketOutput;
+  double bucketSecs = 0.0;
+  auto prepareBucket = [&, bucketRef = sceneRef](std::size_t b) mutable {
+    bucketRef.window = buckets[b];
+    bucketRays.resize(bucketRef.window.w * bucketRef.window.h);
+    if (!deviceRays) {
+      initPerspectiveRayStream(bucketRays, image, bucketRef);
+    }
+    zeroRgb(bucketRays);
+  };
+  IpuScene::FrameCallbackFn bucketCallback = [&](std::size_t bucket) {
+    bucketSecs += ipuScene.getTraceTimeSecs();
+    if (bucket + 1 >= buckets.size()) {
+      return false;
+    }
+    bucketOutput.get(); // The next bucket's rays are ready
+    std::swap(rayStream, bucketRays);
+    bucketOutput = std::async(std::launch::async, [&, bucket, bucketRef = sceneRef]() {
+      if (!accumulateOnHost(args)) {
+        if (bucketRef.pathTrace) {
+          scaleRgb(bucketRays, 1.f / bucketRef.samplesPerPixel);
+        }
+        visualiseHits(bucketRays, bucketRef, image, visMode);
+      }
+      if (bucket + 2 < buckets.size()) {
+        prepareBucket(bucket + 2);
+      }
+    });
+    sceneRef.window = buckets[bucket + 1];
+    ipuScene.setRenderWindow(sceneRef.window);
+    ipuScene.setRngSeed(sceneRef.rngSeed + bucket + 1);
+    return true;
+  };
+  if (buckets.size() > 1) {
+    ipuScene.setFrameCallback(&bucketCallback);
+    bucketOutput = std::async(std::launch::async, [&]() { prepareBucket(1); });
+  }
+
+  // In a render farm the batches are shared with the other processes:
+  std::unique_ptr<FarmBatchQueue> farmQueue;
+  const auto farmDir = args["farm-dir"].as<std::string>();
+  if (!farmDir.empty()) {
+    farmQueue = std::make_unique<FarmBatchQueue>(farmDir, args["farm-rank"].as<std::uint32_t>(),
+                                                 args["farm-size"].as<std::uint32_t>(), rayStream);
+    ipuScene.setRayBatchQueue(farmQueue.get());
+  }
+
+  // When co-rendering a host thread renders batches from the back of the
+  // same queue of ray batches that the IPU takes from the front:
+  RayBatchQueue batchQueue;
+  std::thread cpuThread;
+  std::size_t cpuBatches = 0;
+  if (coRenderScene) {
+    ipuScene.setRayBatchQueue(&batchQueue);
+    cpuThread = std::thread([&]() {
+      cpuBatches = renderCpuBatches(sceneRef, *coRenderScene, rayStream, image, batchQueue,
+                                    !args["cpu-scalar"].as<bool>(), rayCallbackPtr);
+    });
+  }
 
   // Hard code a large timeout. There is a
   // sync with the host ofter each ray batch but
   // a single batch could take a long time when a
   // large number of samples are used.
-  ipu_utils::GraphManager().run(ipuScene,
-                                {{"target.hostSyncTimeout", "10000"}});
+  ipu_utils::GraphManager graphManager;
+  const auto exitCode = graphManager.run(ipuScene, {{"target.hostSyncTimeout", "10000"}});
+  if (frameOutput.valid()) {
+    frameOutput.get();
+  }
+  if (bucketOutput.valid()) {
+    bucketOutput.get();
+  }
+  // (The last bucket's results are left in the ray stream):
+  sceneRef.window = frameWindow;
+
+  if (cpuThread.joinable()) {
+    // (Closing the queue releases the thread if the IPU never started the frame):
+    batchQueue.close();
+    cpuThread.join();
+    ipu_utils::logger()->info("CPU rendered {} ray batches", cpuBatches);
+  }
+  if (streamedExr) {
+    streamedExr->finish();
+  }
+  if (farmQueue && exitCode == EXIT_SUCCESS) {
+    farmQueue->finish();
+    ipu_utils::logger()->info("Farm process rendered {} of {} chunks ({} stolen)", farmQueue->getChunksRendered(),
+                              farmQueue->getNumChunks(), farmQueue->getChunksStolen());
+    if (farmQueue->isOutputProcess()) {
+      farmQueue->gather();
+    }
+  }
 
-  if (sceneRef.pathTrace) {
+  // A progressive image is already complete (and the ray stream is not normalised):
+  if (sceneRef.pathTrace && !progressive) {
     scaleRgb(rayStream, 1.f / sceneRef.samplesPerPixel);
   }
 
-  auto secs = ipuScene.getTraceTimeSecs();
+  auto secs = buckets.size() > 1 ? bucketSecs : ipuScene.getTraceTimeSecs();
   auto castsPerRay = sceneRef.pathTrace ? sceneRef.samplesPerPixel : 1;
   auto rateString = sceneRef.pathTrace ? "paths" : "rays";
-  auto rate = rayStream.size() * castsPerRay / secs;
+  auto rate = double(frameWindow.w) * frameWindow.h * castsPerRay / secs;
   ipu_utils::logger()->info("IPU time: {}", secs);
   ipu_utils::logger()->info("IPU {} per second: {} ", rateString, rate);
+  const auto& stats = ipuScene.getTraceStats();
+  if (stats.castsCounted) {
+    // Paths vary in length so count every ray that was cast:
+    ipu_utils::logger()->info("IPU ray casts per second: {} (primary: {} secondary: {})",
+                              (stats.paths + stats.secondaryCasts) / stats.traceSecs, stats.paths, stats.secondaryCasts);
+  }
+  if (isTraversalStatsMode(visMode) && exitCode == EXIT_SUCCESS) {
+    reportTileCycles(stats, stats.tileCycles.size() / ipus, args.at("outprefix").as<std::string>() + "_tile_cycles.csv");
+  }
+
+  const auto reportFile = args.at("report-json").as<std::string>();
+  if (!reportFile.empty() && exitCode == EXIT_SUCCESS) {
+    writeThroughputReport(reportFile, args, sceneRef, rayStream, stats, graphManager.getTimings(), config.loadExe,
+                          ipuScene.getRaysPerWorker());
+  }
 
   return rayStream;
 }
@@ -341,7 +1200,10 @@ void addOptions(boost::program_options::options_description& desc) {
   ("help", "Show command help.")
   ("outprefix,o", po::value<std::string>()->default_value("out"), "Set the output filename prefix.")
   ("ipus", po::value<std::uint32_t>()->default_value(4), "Select number of IPUs (each IPU will be a replica).")
-  ("rays-per-worker", po::value<std::size_t>()->default_value(1), "Set the number of rays processed by each thread in each iteration. Lower values relieve I/O tile memory pressure.")
+  ("rays-per-worker", po::value<std::size_t>()->default_value(0), "Set the number of rays processed by each thread in each iteration. Lower values relieve I/O tile memory pressure. "
+   "0 means \"auto\": the largest value whose ray buffers fit in tile memory alongside the scene.")
+  ("auto-rays-memory-proportion", po::value<float>()->default_value(0.5),
+   "Proportion of each tile's memory that the scene and ray buffers may use when rays-per-worker is chosen automatically.")
   ("width,w", po::value<std::int32_t>()->default_value(768), "Set rendered image width.")
   ("height,h", po::value<std::int32_t>()->default_value(432), "Set rendered image height.")
   ("crop", po::value<std::string>()->default_value(""),
@@ -357,8 +1219,19 @@ void addOptions(boost::program_options::options_description& desc) {
     "Path to the 'assets.extra' directory of a saved keras NIF model.")
   ("hdri-rotation", po::value<float>()->default_value(0.f), "Azimuthal rotation for HDRI environment map (degrees).")
   ("load-normals", po::bool_switch()->default_value(false), "When loading a mesh file normals are ignored by default (to save on-chip memory). If you use this flag they will be loaded (and interpolated).")
+  ("max-texture-size", po::value<std::uint32_t>()->default_value(0),
+    "When loading a mesh file drop the mip levels of diffuse textures that are wider or taller than this (0 keeps every level). "
+    "Textures are stored on every tile so this limits their tile memory.")
+  ("instance-meshes", po::bool_switch()->default_value(false), "Replace meshes that are transformed copies of another mesh with instances that share one mesh and BVH.")
+  ("precompute-triangles", po::bool_switch()->default_value(false),
+    "Store a precomputed transform for every triangle so that intersection tests need fewer loads and flops. "
+    "Costs 48 bytes of tile memory per triangle and the test is not watertight.")
+  ("compact-vertices", po::bool_switch()->default_value(false),
+    "Store mesh vertices quantised to 16 bits per component and normals octahedral encoded in 32 bits (saves tile memory). "
+    "The geometry used by every renderer is snapped to the quantised values.")
   ("scene", po::value<std::string>()->default_value("box"), "Choose one of the built in scenes from [box-simple, box, spheres] (only valid when not specifying 'mesh-file').")
-  ("visualise", po::value<std::string>()->default_value("rgb"), "Choose the render output values to test/visualise. One of [rgb, normal, hitpoint, tfar, color, id]")
+  ("visualise", po::value<std::string>()->default_value("rgb"), "Choose the render output values to test/visualise. One of [rgb, normal, hitpoint, tfar, color, id, nodes, prims, bounces, cycles]. "
+    "The last four are heat maps of the IPU's BVH nodes visited, primitives tested, bounces, and tile cycles per pixel (requires 'ipu-only').")
   ("render-mode", po::value<std::string>()->default_value("path-trace"), "Choose type of render from [shadow-trace, path-trace]. To see result set visualise=rgb")
   ("max-path-length", po::value<std::uint32_t>()->default_value(10), "Max path length for path tracing.")
   ("roulette-start-depth", po::value<std::uint32_t>()->default_value(3), "Path length after which rays can be randomly terminated with prob. inversely proportional to their throughput.")
@@ -368,24 +1241,137 @@ void addOptions(boost::program_options::options_description& desc) {
     "Proportion of on-chip memory that is allowed for matrix multiplies.")
   ("max-nif-batch-size", po::value<std::size_t>()->default_value(0),
     "Maximum batch-size for the NIF neural network. If the required batch is larger than this "
-    "the batch will be serialised so that this value is not exceeded. 0 means \"auto\": i.e. batch "
-    "will be chosen so that it matches the size of a single ray-batch streamed from DRAM.")
+    "the batch will be serialised so that this value is not exceeded. 0 means \"auto\": i.e. one "
+    "batch per worker's share of a ray-batch. Escaped rays are compacted before the NIF runs so "
+    "batches that contain no escaped rays are skipped.")
+  ("nif-autotune", po::bool_switch()->default_value(false),
+    "Choose the NIF batch-size and available-memory-proportion by compiling and timing candidate plans on the "
+    "device (overrides --max-nif-batch-size and --available-memory-proportion). The winning plan is saved in the "
+    "NIF model directory and reused by later runs with the same IPU count, rays-per-worker, and precision.")
+  ("bake-nif-hdri", po::value<std::uint32_t>()->default_value(0),
+    "Evaluate the NIF once at start up to bake an fp16 environment map of this width (the height is half the width) "
+    "which is stored on every tile. Much faster than evaluating the NIF for every escaped ray but uses more tile "
+    "memory (6 bytes per texel). 0 means evaluate the NIF exactly per ray.")
+  ("env-light-sampling", po::bool_switch()->default_value(false),
+    "Importance sample the baked NIF environment light at every diffuse hit (requires --bake-nif-hdri). Shadow rays "
+    "are cast towards bright parts of the environment and combined with BxDF sampling using multiple importance "
+    "sampling, which greatly reduces noise for outdoor scenes lit by the sun.")
+  ("nif-on-tile", po::bool_switch()->default_value(false),
+    "Evaluate the NIF inside a vertex on every tile for that tile's own escaped rays (with fp16 weights stored on "
+    "every tile) instead of with matmuls spread over all tiles. This removes all exchange from the environment "
+    "lookup but only suits small networks. Ignored if --bake-nif-hdri is set.")
+  ("nif-fp16", po::bool_switch()->default_value(false),
+    "Run the NIF environment light at fp16 end to end (including its UV inputs and lighting outputs). "
+    "Weights are converted to fp16 if the model was trained at fp32.")
+  ("scene-shards", po::value<std::uint32_t>()->default_value(0),
+    "Split the scene into this many shards that are distributed across groups of IPU tiles instead of "
+    "replicating the whole scene on every tile. 0 disables sharding. Only supported for render-mode=shadow-trace.")
+  ("scene-cache", po::value<std::string>()->default_value(""),
+    "Directory in which to cache the imported and built scene. Later runs with the same scene and "
+    "build options memory map the cache instead of importing the scene and building the BVH. "
+    "The cache is only loaded for 'ipu-only' renders of unsharded scenes. Empty disables caching.")
+  ("frames", po::value<std::uint32_t>()->default_value(1),
+    "Number of frames to render on the IPU in one session (the device stays attached and the scene is only uploaded once). "
+    "Every frame except the last is saved with its frame number.")
+  ("frame-hdri-rotation", po::value<float>()->default_value(0.f), "HDRI azimuthal rotation added for each frame after the first (degrees).")
+  ("camera-path", po::value<std::string>()->default_value(""),
+    "File with one camera per line ('ex ey ez tx ty tz [ux uy uz]': the eye position, the point it looks at, and "
+    "optionally the up direction). The IPU renders a frame for each camera in one session and the CPU and Embree "
+    "references use the first camera. Not valid with 'frames'.")
+  ("exe-cache", po::value<std::string>()->default_value(""),
+    "Directory in which to cache the compiled IPU graph. The graph only depends on the IPU target, the "
+    "capacity options, and the render options that change the program (not on the scene or e.g. image size "
+    "and samples) so later runs with the same key load it instead of compiling. Empty disables caching.")
+  ("capacity-scene-bytes", po::value<std::size_t>()->default_value(0),
+    "Build the IPU graph for serialised scenes of up to this many bytes so it can be reused (cached) for other scenes. "
+    "0 sizes the graph for the scene being rendered. Likewise for the other capacity options.")
+  ("capacity-spheres", po::value<std::size_t>()->default_value(0), "Maximum number of spheres the IPU graph can hold.")
+  ("capacity-discs", po::value<std::size_t>()->default_value(0), "Maximum number of discs the IPU graph can hold.")
+  ("capacity-meshes", po::value<std::size_t>()->default_value(0), "Maximum number of meshes the IPU graph can hold.")
+  ("capacity-instances", po::value<std::size_t>()->default_value(0), "Maximum number of mesh instances the IPU graph can hold.")
+  ("capacity-rays", po::value<std::size_t>()->default_value(0), "Maximum number of rays (pixels in the render window) the IPU graph can trace.")
+  ("analyse-scene", po::bool_switch()->default_value(false),
+    "Log the quality of the scene's BVH and the scene's memory on every tile then exit without rendering. "
+    "Exits with failure if the scene exceeds 'tile-scene-budget'.")
+  ("tile-scene-budget", po::value<std::size_t>()->default_value(0),
+    "Reject scenes (before the graph is built) that need more bytes than this on every tile. Zero disables the check. "
+    "Not checked for sharded scenes.")
   ("ipu-only", po::bool_switch()->default_value(false), "Only render on IPU (e.g. if you don't want to wait for slow CPU path tracing).")
+  ("report-json", po::value<std::string>()->default_value(""),
+    "Write the IPU render's configuration, timings (compile, initialisation, and trace), ray cast rates, "
+    "and host/DRAM bandwidths to this JSON file (used by the bench program).")
+  ("cpu-scalar", po::bool_switch()->default_value(false),
+    "Trace the CPU reference's camera rays one at a time instead of as SIMD ray packets (the images are the same).")
+  ("co-render", po::bool_switch()->default_value(false),
+    "Render the IPU image on the IPU and the host CPU together: host threads render ray batches from the "
+    "back of the frame's batch queue while the IPU takes them from the front.")
+  ("bucket-size", po::value<std::uint32_t>()->default_value(0),
+    "Render the IPU image in square buckets of this many pixels (0 renders the whole window at once). The buckets "
+    "reuse the same graph one after the other so host ray memory is bounded by the bucket size. Use a multiple of "
+    "64 with 'stream-exr' so that each bucket's tiles are written as soon as it is finished.")
+  ("farm-dir", po::value<std::string>()->default_value(""),
+    "Render one frame with several processes (e.g. one per IPU-POD partition) that share this directory (use a new "
+    "directory for each frame). Processes claim chunks of the frame's ray batches from the directory and steal "
+    "chunks from each other when their own share is done. Process 0 gathers the results and saves the image.")
+  ("farm-size", po::value<std::uint32_t>()->default_value(1), "Number of processes that render the frame with 'farm-dir'.")
+  ("farm-rank", po::value<std::uint32_t>()->default_value(0), "Index of this process in [0, farm-size) when rendering with 'farm-dir'.")
+  ("ray-stream-dir", po::value<std::string>()->default_value(""),
+    "Map the host's ray streams from (unlinked) files in this directory instead of allocating them on the heap. "
+    "Pages are then backed by the file rather than swap and the results of each batch are written back as soon as "
+    "they arrive so that only the batches in flight need to stay in memory on hosts that are short of it.")
+  ("ray-stream-huge-pages", po::bool_switch()->default_value(false),
+    "Allocate the host's ray streams in huge pages (reserved huge pages if there are any, otherwise transparent huge pages).")
   ("ipu-ray-callback", po::bool_switch()->default_value(false), "Retrieve partial results directly from the IPU during renderering via callback mechanism. "
                                                                 "By default the results are read from DRAM on one go at the end of renderering.")
+  ("ray-callback-threads", po::value<std::size_t>()->default_value(0),
+    "Process the ray batches received via the IPU ray callback (e.g. for progressive or streamed output) on this many "
+    "host threads so that the work does not stall the stream from the IPU. 0 processes each batch on Poplar's "
+    "stream callback threads.")
+  ("progressive", po::bool_switch()->default_value(false),
+    "Accumulate the IPU image on the host as ray batches are received (implies ipu-ray-callback) "
+    "so the image is ready as soon as the render finishes. Only valid with visualise=rgb.")
+  ("stream-exr", po::bool_switch()->default_value(false),
+    "Write the IPU image to a tiled EXR file while rendering: each tile is written as soon as its pixels have been "
+    "received so little is left to write at the end (implies progressive). With denoise the albedo and normal AOVs "
+    "are extra parts of the same file. Only valid with visualise=rgb.")
+  ("exr-half", po::bool_switch()->default_value(false),
+    "Store the pixels of streamed EXR files as half precision floats.")
+  ("preview-interval", po::value<double>()->default_value(0.0),
+    "When rendering progressively, save a preview of the partial IPU image at most this often (in seconds). 0 disables previews.")
+  ("slim-ray-stream", po::bool_switch()->default_value(false),
+    "Stream compact ray records (pixel coordinate in, RGBE radiance out) to and from DRAM instead of full trace results. "
+    "Only supported for render-mode=path-trace and only the rgb output of the IPU render is valid.")
+  ("device-ray-generation", po::bool_switch()->default_value(false),
+    "Generate the rays of every batch on the IPU so no ray stream is uploaded (only results leave the chip). "
+    "Implies slim-ray-stream.")
+  ("adaptive-threshold", po::value<float>()->default_value(0.f),
+    "Stop path tracing a pixel on the IPU once the standard error of its mean luminance is less than this "
+    "fraction of the mean (--samples becomes the maximum). 0 disables adaptive sampling.")
+  ("adaptive-min-samples", po::value<std::uint32_t>()->default_value(16),
+    "Minimum number of samples taken of each pixel when adaptive sampling.")
+  ("denoise", po::bool_switch()->default_value(false),
+    "Return first hit albedo and normal AOVs from the IPU and save a denoised copy of each IPU image "
+    "(denoised on the host, overlapped with rendering the next frame). Not valid with slim ray streams, wavefront mode, "
+    "co-rendering, or a NIF evaluated per ray.")
+  ("low-discrepancy", po::bool_switch()->default_value(false),
+    "Path trace with scrambled Sobol points instead of pseudo-random numbers (on the IPU and CPU, "
+    "but not in wavefront mode, for the Embree reference, or with a NIF evaluated per ray).")
+  ("wavefront", po::bool_switch()->default_value(false),
+    "Path trace on the IPU one bounce at a time (separate extend and shade steps with compaction of live paths) "
+    "instead of tracing whole paths in a single vertex. Only supported for render-mode=path-trace.")
+  ("octant-sort", po::bool_switch()->default_value(false),
+    "In wavefront mode group each tile's live rays by the octant of their direction between bounces so each "
+    "IPU worker traces rays that take similar paths through the BVH.")
+  ("coherent-rays", po::bool_switch()->default_value(false),
+    "Sort the IPU's ray stream along a Morton curve through the pixels before it is split into batches so "
+    "that every tile traces a compact region of the screen (rays of a slim stream are no longer interleaved between tiles).")
+  ("io-pipeline-depth", po::value<std::uint32_t>()->default_value(2),
+    "Number of stages in the IPU's ray batch pipeline: 1 processes one batch at a time, 2 overlaps DRAM I/O with compute. "
+    "Renders with too few batches to fill the pipeline fall back to 1.")
   ("log-level", po::value<std::string>()->default_value("info"),
   "Set the log level to one of the following: 'trace', 'debug', 'info', 'warn', 'err', 'critical', 'off'.");
 }
 
-std::map<std::string, VisualiseMode> visStrMap = {
-  {"rgb", RGB},
-  {"normal", NORMAL},
-  {"hitpoint", HIT_POINT},
-  {"tfar", RAY_TFAR},
-  {"color", MAT_COLOR},
-  {"id", GEOM_AND_PRIM_ID}
-};
-
 std::map<std::string, RenderMode> renderStrMap = {
   {"shadow-trace", SHADOW_TRACE},
   {"path-trace", PATH_TRACE}
@@ -419,10 +1405,170 @@ boost::program_options::variables_map parseOptions(int argc, char** argv, boost:
     throw std::runtime_error("Option 'load-normals' is not valid without the 'mesh-file' option");
   }
 
+  if (vm.at("scene-shards").as<std::uint32_t>() && vm.at("render-mode").as<std::string>() != "shadow-trace") {
+    throw std::runtime_error("Option 'scene-shards' is only valid with 'render-mode=shadow-trace'");
+  }
+
+  for (const auto option : {"progressive", "stream-exr"}) {
+    if (vm.at(option).as<bool>() && vm.at("visualise").as<std::string>() != "rgb") {
+      throw std::runtime_error("Option '" + std::string(option) + "' is only valid with 'visualise=rgb'");
+    }
+  }
+
+  const bool cameraPath = !vm.at("camera-path").as<std::string>().empty();
+  if (cameraPath && vm.at("frames").as<std::uint32_t>() > 1) {
+    throw std::runtime_error("Option 'camera-path' sets the number of frames so is not valid with 'frames'");
+  }
+
+  for (const auto option : {"progressive", "stream-exr"}) {
+    if (vm.at(option).as<bool>() && (vm.at("frames").as<std::uint32_t>() > 1 || cameraPath)) {
+      throw std::runtime_error("Option '" + std::string(option) + "' is not valid when rendering more than one frame");
+    }
+  }
+
+  if (isTraversalStatsMode(visStrMap.at(vm.at("visualise").as<std::string>()))) {
+    // Only the IPU's trace vertices are instrumented (and not in every configuration):
+    if (!vm.at("ipu-only").as<bool>()) {
+      throw std::runtime_error("Traversal statistics visualisations are only valid with 'ipu-only'");
+    }
+    for (const auto option : {"wavefront", "slim-ray-stream", "device-ray-generation", "denoise"}) {
+      if (vm.at(option).as<bool>()) {
+        throw std::runtime_error("Traversal statistics visualisations are not valid with '" + std::string(option) + "'");
+      }
+    }
+    if (vm.at("scene-shards").as<std::uint32_t>()) {
+      throw std::runtime_error("Traversal statistics visualisations are not valid with 'scene-shards'");
+    }
+  }
+
+  if (vm.at("octant-sort").as<bool>() && !vm.at("wavefront").as<bool>()) {
+    throw std::runtime_error("Option 'octant-sort' is only valid with 'wavefront'");
+  }
+
+  if (vm.at("coherent-rays").as<bool>() && vm.at("device-ray-generation").as<bool>()) {
+    throw std::runtime_error("Option 'coherent-rays' is not valid with 'device-ray-generation'");
+  }
+
+  if (vm.at("denoise").as<bool>() && vm.at("render-mode").as<std::string>() != "path-trace") {
+    throw std::runtime_error("Option 'denoise' is only valid with 'render-mode=path-trace'");
+  }
+
+  if (vm.at("co-render").as<bool>()) {
+    if (vm.at("denoise").as<bool>()) {
+      // Batches rendered on the CPU do not return AOVs:
+      throw std::runtime_error("Option 'co-render' is not valid with 'denoise'");
+    }
+    if (vm.at("coherent-rays").as<bool>()) {
+      // The CPU regenerates camera rays from their position in the stream:
+      throw std::runtime_error("Option 'co-render' is not valid with 'coherent-rays'");
+    }
+    if (vm.at("device-ray-generation").as<bool>()) {
+      throw std::runtime_error("Option 'co-render' is not valid with 'device-ray-generation'");
+    }
+    if (vm.at("frames").as<std::uint32_t>() > 1 || cameraPath) {
+      throw std::runtime_error("Option 'co-render' is not valid when rendering more than one frame");
+    }
+    if (!vm.at("nif-hdri").as<std::string>().empty()) {
+      throw std::runtime_error("Option 'co-render' is not valid with a NIF environment light (the CPU renderer has no environment light)");
+    }
+  }
+
+  if (vm.at("bucket-size").as<std::uint32_t>()) {
+    // Buckets are rendered as the frames of one session and the results of each are dropped once it is saved:
+    if (vm.at("frames").as<std::uint32_t>() > 1 || cameraPath) {
+      throw std::runtime_error("Option 'bucket-size' is not valid when rendering more than one frame");
+    }
+    for (const auto option : {"co-render", "denoise"}) {
+      if (vm.at(option).as<bool>()) {
+        throw std::runtime_error("Option 'bucket-size' is not valid with '" + std::string(option) + "'");
+      }
+    }
+    for (const auto option : {"farm-dir", "report-json"}) {
+      if (!vm.at(option).as<std::string>().empty()) {
+        throw std::runtime_error("Option 'bucket-size' is not valid with '" + std::string(option) + "'");
+      }
+    }
+  }
+
+  const auto rayStreamDir = vm.at("ray-stream-dir").as<std::string>();
+  if (!rayStreamDir.empty()) {
+    if (vm.at("ray-stream-huge-pages").as<bool>()) {
+      throw std::runtime_error("Option 'ray-stream-dir' is not valid with 'ray-stream-huge-pages'");
+    }
+    if (!std::filesystem::is_directory(rayStreamDir)) {
+      throw std::runtime_error("Ray stream directory '" + rayStreamDir + "' does not exist");
+    }
+  }
+
+  if (!vm.at("farm-dir").as<std::string>().empty()) {
+    if (vm.at("farm-rank").as<std::uint32_t>() >= vm.at("farm-size").as<std::uint32_t>()) {
+      throw std::runtime_error("Option 'farm-rank' must be less than 'farm-size'");
+    }
+    if (!vm.at("ipu-only").as<bool>()) {
+      throw std::runtime_error("Option 'farm-dir' is only valid with 'ipu-only'");
+    }
+    // Every process must generate the same ray stream and results are only gathered at the end:
+    for (const auto option : {"co-render", "progressive", "stream-exr", "device-ray-generation"}) {
+      if (vm.at(option).as<bool>()) {
+        throw std::runtime_error("Option 'farm-dir' is not valid with '" + std::string(option) + "'");
+      }
+    }
+    if (vm.at("frames").as<std::uint32_t>() > 1 || cameraPath) {
+      throw std::runtime_error("Option 'farm-dir' is not valid when rendering more than one frame");
+    }
+  }
+
   po::notify(vm);
   return vm;
 }
 
+// Set the SceneRef members that come from the command line rather than from the scene:
+void setRenderParams(SceneRef& sceneRef, float horizontalFov, const CropWindow& window,
+                     const boost::program_options::variables_map& args) {
+  sceneRef.imageWidth = args["width"].as<std::int32_t>();
+  sceneRef.imageHeight = args["height"].as<std::int32_t>();
+  sceneRef.fovRadians = horizontalFov;
+  sceneRef.antiAliasScale = args["anti-alias"].as<float>();
+  sceneRef.maxPathLength = args["max-path-length"].as<std::uint32_t>();
+  sceneRef.rouletteStartDepth = args["roulette-start-depth"].as<std::uint32_t>();
+  sceneRef.samplesPerPixel = args["samples"].as<std::uint32_t>();
+  sceneRef.rngSeed = args["seed"].as<std::uint64_t>();
+  sceneRef.window = window;
+  sceneRef.camera = loadCameras(args).front();
+  sceneRef.pathTrace = args["render-mode"].as<std::string>() == "path-trace";
+}
+
+cv::Mat renderAndSaveIPU(SceneRef& sceneRef,
+                         const std::vector<Sphere>& spheres,
+                         const std::vector<Disc>& discs,
+                         std::vector<SceneShardData>& shards,
+                         const boost::program_options::variables_map& args,
+                         const SceneCache* cache = nullptr,
+                         SceneDescription* coRenderScene = nullptr) {
+  const auto visModeStr = args.at("visualise").as<std::string>();
+  const auto visMode = visStrMap.at(visModeStr);
+  const std::string outPrefix = args.at("outprefix").as<std::string>() + "_" + visModeStr + "_";
+
+  cv::Mat ipuImage(sceneRef.imageHeight, sceneRef.imageWidth, CV_32FC3);
+  auto rayStream = renderIPU(sceneRef, ipuImage, spheres, discs, shards, args, cache, coRenderScene);
+  // Only the farm's output process has the whole frame:
+  if (!args.at("farm-dir").as<std::string>().empty() && args.at("farm-rank").as<std::uint32_t>() != 0) {
+    return ipuImage;
+  }
+  if (!accumulateOnHost(args)) {
+    auto hitCount = visualiseHits(rayStream, sceneRef, ipuImage, visMode);
+    ipu_utils::logger()->debug("IPU hit count: {}", hitCount);
+  }
+  // A streamed image has already been saved:
+  if (!args.at("stream-exr").as<bool>()) {
+    saveImage(outPrefix + "ipu.exr", ipuImage);
+  }
+  if (args.at("denoise").as<bool>()) {
+    saveImage(outPrefix + "ipu_denoised.exr", denoiseImage(ipuImage, rayStream));
+  }
+  return ipuImage;
+}
+
 int main(int argc, char** argv) {
   boost::program_options::options_description desc;
   addOptions(desc);
@@ -435,6 +1581,15 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
+  // Ray streams must be placed before any of them are allocated:
+  if (!args["ray-stream-dir"].as<std::string>().empty()) {
+    setRayStreamStorage(RayStreamStorage::MappedFile, args["ray-stream-dir"].as<std::string>());
+    ipu_utils::logger()->info("Ray streams are mapped from files in '{}'", args["ray-stream-dir"].as<std::string>());
+  } else if (args["ray-stream-huge-pages"].as<bool>()) {
+    setRayStreamStorage(RayStreamStorage::HugePages);
+    ipu_utils::logger()->info("Ray streams are allocated in huge pages");
+  }
+
   // Log size info for various types, useful during memory optimisation:
   ipu_utils::logger()->trace("HitRecord size: {}", sizeof(embree_utils::HitRecord));
   ipu_utils::logger()->trace("HitRecord align: {}", alignof(embree_utils::HitRecord));
@@ -442,6 +1597,10 @@ int main(int argc, char** argv) {
   ipu_utils::logger()->trace("TraceResult align: {}", alignof(embree_utils::TraceResult));
   ipu_utils::logger()->trace("CompactBVH2Node size: {}", sizeof(CompactBVH2Node));
   ipu_utils::logger()->trace("CompactBVH2Node align: {}", alignof(CompactBVH2Node));
+  ipu_utils::logger()->trace("CompactBVH4Node size: {}", sizeof(CompactBVH4Node));
+  ipu_utils::logger()->trace("CompactBVH4Node align: {}", alignof(CompactBVH4Node));
+  ipu_utils::logger()->trace("CompactBVH4QNode size: {}", sizeof(CompactBVH4QNode));
+  ipu_utils::logger()->trace("CompactBVH4QNode align: {}", alignof(CompactBVH4QNode));
   ipu_utils::logger()->trace("Ray size: {}", sizeof(embree_utils::Ray));
   ipu_utils::logger()->trace("Ray align: {}", alignof(embree_utils::Ray));
   ipu_utils::logger()->trace("RayShearParams size: {}", sizeof(RayShearParams));
@@ -449,12 +1608,6 @@ int main(int argc, char** argv) {
 
   // ===== Scene setup: ======
 
-  // Load or build a scene:
-  auto scene = buildSceneDescription(args);
-
-  // Convert scene into efficient representations for rendering:
-  auto [customScene, embreeScene] = buildSceneData(scene);
-
   // Get cropped window size:
   const auto imageWidth = args["width"].as<std::int32_t>();
   const auto imageHeight = args["height"].as<std::int32_t>();
@@ -462,6 +1615,40 @@ int main(int argc, char** argv) {
   auto window = crop.value_or(CropWindow{imageWidth, imageHeight, 0, 0}); // (Set window to whole image if crop wasn't specified)
   ipu_utils::logger()->info("Rendering window: width: {}, height: {}, start col: {}, start row: {}", window.w, window.h, window.c, window.r);
 
+  const bool ipuOnly = args["ipu-only"].as<bool>();
+  const auto numShards = args["scene-shards"].as<std::uint32_t>();
+  std::uint64_t cacheKey = 0;
+  const auto cachePath = sceneCachePath(args, cacheKey);
+  const bool useCache = !cachePath.empty() && numShards == 0;
+
+  // The CPU and Embree renderers need the full scene description
+  // so a cached scene can only be used for IPU only renders:
+  const bool coRender = args["co-render"].as<bool>();
+  const bool analyse = args["analyse-scene"].as<bool>();
+  const auto tileBudget = args["tile-scene-budget"].as<std::size_t>();
+  if (useCache && ipuOnly && !coRender && !analyse) {
+    auto cache = SceneCache::load(cachePath, cacheKey);
+    if (cache) {
+      auto& sceneRef = cache->getSceneRef();
+      setRenderParams(sceneRef, cache->getHorizontalFov(), window, args);
+      cache->setRenderParams(sceneRef);
+      if (tileBudget && !reportTileMemory(sceneRef, cache->getSpheres().size(), cache->getDiscs().size(), args, tileBudget)) {
+        return EXIT_FAILURE;
+      }
+      std::vector<SceneShardData> noShards;
+      renderAndSaveIPU(sceneRef, cache->getSpheres(), cache->getDiscs(), noShards, args, cache.get());
+      ipu_utils::logger()->info("Done.");
+      return EXIT_SUCCESS;
+    }
+  }
+
+  // Load or build a scene:
+  auto scene = buildSceneDescription(args);
+
+  // Convert scene into efficient representations for rendering:
+  auto [customScene, embreeScene] = buildSceneData(scene, numShards, args["precompute-triangles"].as<bool>(),
+                                                      args["compact-vertices"].as<bool>());
+
   // The SceneRef wraps the dynamic arrays from the custom scene represenation in data structures that
   // can be backed by either dynamic (for CPU) or static (for IPU) arrays. This allows the CPU code to
   // be almost identical to IPU code which makes development and debugging quicker:
@@ -471,21 +1658,45 @@ int main(int argc, char** argv) {
     ArrayRef(customScene.meshTris),
     ArrayRef(customScene.meshVerts),
     ArrayRef(customScene.meshNormals),
+    ArrayRef(customScene.meshPrecomputed),
+    ArrayRef(customScene.meshQuantisation),
+    ArrayRef(customScene.meshPackedVerts),
+    ArrayRef(customScene.meshPackedNormals),
     ArrayRef(customScene.matIDs),
     ArrayRef(customScene.materials),
     ArrayRef(customScene.bvhNodes),
+    ArrayRef(customScene.instances),
+    ArrayRef(customScene.blasNodes),
+    ArrayRef(customScene.lights),
     customScene.bvhMaxDepth,
-    (float)imageWidth,
-    (float)imageHeight,
-    scene.camera.horizontalFov,
-    args["anti-alias"].as<float>(),
-    args["max-path-length"].as<std::uint32_t>(),
-    args["roulette-start-depth"].as<std::uint32_t>(),
-    args["samples"].as<std::uint32_t>(),
-    args["seed"].as<std::uint64_t>(),
-    window,
-    scene.pathTrace != nullptr
+    ArrayRef(customScene.meshUVs),
+    ArrayRef(customScene.textures),
+    ArrayRef(customScene.texels)
   };
+  setRenderParams(sceneRef, scene.camera.horizontalFov, window, args);
+
+  // Check the scene before spending time compiling a graph for it:
+  if (analyse) {
+    reportBvhQuality(customScene, scene);
+    if (numShards) {
+      ipu_utils::logger()->info("The scene is sharded: each tile stores one shard instead of the scene below.");
+    }
+  }
+  if (analyse || tileBudget) {
+    const bool fits = reportTileMemory(sceneRef, scene.spheres.size(), scene.discs.size(), args, numShards ? 0 : tileBudget);
+    if (analyse || !fits) {
+      return fits ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (useCache) {
+    // Failing to write the cache is not fatal (the scene is still rendered):
+    try {
+      SceneCache::save(cachePath, cacheKey, sceneRef, scene.camera.horizontalFov, scene.spheres, scene.discs);
+    } catch (const std::exception& e) {
+      ipu_utils::logger()->warn("Scene cache was not saved: {}", e.what());
+    }
+  }
 
   // ===== Rendering: ======
 
@@ -496,32 +1707,28 @@ int main(int argc, char** argv) {
   cv::Mat embreeImage(imageHeight, imageWidth, CV_32FC3);
   cv::Mat cpuImage(imageHeight, imageWidth, CV_32FC3);
 
-  const bool ipuOnly = args["ipu-only"].as<bool>();
   if (!ipuOnly) {
     // First create the same image using our custom built BVH and
     // custom intersection routines:
-    auto rayStream = renderCPU(sceneRef, cpuImage, scene);
+    auto rayStream = renderCPU(sceneRef, cpuImage, scene, !args["cpu-scalar"].as<bool>());
     auto hitCount = visualiseHits(rayStream, sceneRef, cpuImage, visMode);
-    cv::imwrite(outPrefix + "cpu.exr", cpuImage);
+    saveImage(outPrefix + "cpu.exr", cpuImage);
     ipu_utils::logger()->debug("CPU reference hit count: {}", hitCount);
 
     // Now create reference image using Embree:
     if (sceneRef.pathTrace) {
-      ipu_utils::logger()->warn("Embree path trace not yet implemented.");
+      rayStream = renderEmbreePathTrace(sceneRef, scene, embreeScene, embreeImage);
     } else {
       rayStream = renderEmbree(sceneRef, embreeScene, embreeImage);
-      hitCount = visualiseHits(rayStream, sceneRef, embreeImage, visMode);
-      cv::imwrite(outPrefix + "embree.exr", embreeImage);
-      ipu_utils::logger()->debug("Embree hit count: {}", hitCount);
     }
+    hitCount = visualiseHits(rayStream, sceneRef, embreeImage, visMode);
+    saveImage(outPrefix + "embree.exr", embreeImage);
+    ipu_utils::logger()->debug("Embree hit count: {}", hitCount);
   }
 
   // Now render on IPU:
-  cv::Mat ipuImage(imageHeight, imageWidth, CV_32FC3);
-  auto rayStream = renderIPU(sceneRef, ipuImage, scene.spheres, scene.discs, args);
-  auto hitCount = visualiseHits(rayStream, sceneRef, ipuImage, visMode);
-  cv::imwrite(outPrefix + "ipu.exr", ipuImage);
-  ipu_utils::logger()->debug("IPU hit count: {}", hitCount);
+  auto ipuImage = renderAndSaveIPU(sceneRef, scene.spheres, scene.discs, customScene.shards, args,
+                                   nullptr, coRender ? &scene : nullptr);
 
   // ===== Testing: ======
 